@@ -0,0 +1,6 @@
+// The smallest possible host program. Built twice: zusage_bench_app links
+// the zusage object, so its constructor runs before main; zusage_bench_baseline
+// does not, and gives the cost of starting a process at all.
+int main() {
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zusage_internal.h"
+
+// Measurement helper for zusage_bench. It links the zusage object but is
+// started with ZUSAGE_DISABLE set, so its own constructor does nothing and
+// the library's steps can be timed one by one. Times are printed in
+// microseconds, whitespace separated.
+//
+//   zusage_bench_probe phases
+//       One send, split into its phases: host profile, executable lookup,
+//       app version, payload, connect, request and response.
+//   zusage_bench_probe fork <rss MB> <count>
+//       Touch <rss MB> of memory, then time spawn_usage_sender() in the
+//       parent <count> times. This is the fork cost a host process pays.
+
+static long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int run_phases() {
+  long long t0 = now_us();
+  const struct host_profile *host = host_profile_get();
+  long long t1 = now_us();
+  const struct program_info *info = get_program_info();
+  long long t2 = now_us();
+  char *app_version = get_app_version();
+  long long t3 = now_us();
+
+  char payload[MAX_POST_DATA_SIZE];
+  int payload_len = build_usage_payload_from_prefix(payload, sizeof(payload), host->payload_prefix,
+                                                    host->payload_prefix_len, info ? info->name : "unknown",
+                                                    app_version ? app_version : "unknown");
+  char request[MAX_POST_DATA_SIZE * 2];
+  int request_len = payload_len < 0 ? -1 : build_usage_request(request, sizeof(request), payload, payload_len, 0);
+  free(app_version);
+  long long t4 = now_us();
+  if (request_len < 0) {
+    fprintf(stderr, "zusage_bench_probe: payload does not fit\n");
+    return 1;
+  }
+
+  int sockfd = connect_to_collector();
+  long long t5 = now_us();
+  if (sockfd < 0) {
+    fprintf(stderr, "zusage_bench_probe: cannot connect to the collector\n");
+    return 1;
+  }
+  int ok = send_all(sockfd, request, request_len) && read_response_ok(sockfd);
+  close(sockfd);
+  long long t6 = now_us();
+  if (!ok) {
+    fprintf(stderr, "zusage_bench_probe: request not acknowledged\n");
+    return 1;
+  }
+
+  printf("%lld %lld %lld %lld %lld %lld\n", t1 - t0, t2 - t1, t3 - t2, t4 - t3, t5 - t4, t6 - t5);
+  return 0;
+}
+
+static int run_fork(long rss_mb, int count) {
+  size_t size = (size_t)rss_mb * 1024 * 1024;
+  char *ballast = NULL;
+  if (size > 0) {
+    ballast = malloc(size);
+    if (!ballast) {
+      fprintf(stderr, "zusage_bench_probe: cannot allocate %ld MB\n", rss_mb);
+      return 1;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < size; i += page) {
+      ballast[i] = (char)i;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    long long start = now_us();
+    spawn_usage_sender(0);
+    long long elapsed = now_us() - start;
+    printf("%lld\n", elapsed);
+    fflush(stdout);
+    // Reap the sender before the next sample so they do not overlap
+    while (wait(NULL) > 0) {
+    }
+  }
+  free(ballast);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "phases") == 0) {
+    return run_phases();
+  }
+  if (argc == 4 && strcmp(argv[1], "fork") == 0) {
+    return run_fork(atol(argv[2]), atoi(argv[3]));
+  }
+  fprintf(stderr, "usage: %s phases | fork <rss MB> <count>\n", argv[0]);
+  return 2;
+}
@@ -0,0 +1,545 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+
+// zusage_bench: what does linking libzusage cost a program?
+//
+// Runs the programs built next to it against a stand-in collector on
+// loopback, with HOME pointing at a scratch directory so the ~/.cache files
+// can be removed (cold) or kept (warm) between runs:
+//
+//   startup   wall time from fork to exit of zusage_bench_baseline (no
+//             library) and zusage_bench_app (library constructor), cold and
+//             warm; startup_added is the difference of their percentiles
+//   fork      spawn_usage_sender() in a parent holding 0..N MB of touched
+//             memory (zusage_bench_probe fork)
+//   spawn     the same with ZUSAGE_SPAWN, starting the zusage-send helper
+//   send      one send split into phases, cold and warm (zusage_bench_probe
+//             phases)
+//
+// After each run the bench waits until the stand-in has answered the run's
+// requests, so senders never overlap with the next sample. Results are
+// printed as JSON: one entry per scenario and variant with the sample count
+// and p50/p90/p99/max in microseconds.
+//
+//   zusage_bench [-n samples] [-r rss_mb,...] [-e NAME=VALUE]... [-o file]
+//
+// -e sets a variable for the measured programs, e.g. -e ZUSAGE_FAST_INIT=1 to
+// measure another constructor path.
+
+#define BENCH_DEFAULT_SAMPLES 50
+#define BENCH_DEFAULT_RSS "0,64,256"
+#define BENCH_MAX_ENV 16
+#define BENCH_MAX_RSS 8
+#define BENCH_MAX_RESULTS 64
+#define BENCH_REQUEST_TIMEOUT_MS 5000
+#define BENCH_PHASE_COUNT 6
+#define BENCH_OUTPUT_SIZE 65536
+
+static const char *phase_names[BENCH_PHASE_COUNT] = {
+  "host_profile", "program_info", "app_version", "payload", "connect", "request"
+};
+
+struct result {
+  char name[32];
+  char variant[32];
+  int n;
+  long long p50, p90, p99, max;
+};
+
+static struct result results[BENCH_MAX_RESULTS];
+static int result_count = 0;
+
+static char bin_dir[PATH_MAX];
+static char home_dir[PATH_MAX];
+static char cache_dir[PATH_MAX];
+static const char *extra_env[BENCH_MAX_ENV];
+static int extra_env_count = 0;
+
+static pid_t stand_in_pid = -1;
+static unsigned long *requests_answered; // shared with the stand-in
+static unsigned long requests_expected = 0;
+
+static long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void die(const char *message) {
+  fprintf(stderr, "zusage_bench: %s\n", message);
+  if (stand_in_pid > 0) {
+    kill(stand_in_pid, SIGTERM);
+  }
+  exit(1);
+}
+
+// --- Stand-in collector ---
+// Answers every POST with 201 after reading its body, one connection at a
+// time, and counts the answered requests.
+
+static const char *find_bytes(const char *buf, size_t len, const char *needle) {
+  size_t needle_len = strlen(needle);
+  for (size_t i = 0; i + needle_len <= len; i++) {
+    if (memcmp(buf + i, needle, needle_len) == 0) {
+      return buf + i;
+    }
+  }
+  return NULL;
+}
+
+static int read_request(int fd) {
+  char buf[65536];
+  size_t len = 0;
+  for (;;) {
+    if (len == sizeof(buf)) {
+      return 0;
+    }
+    ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+    if (n <= 0) {
+      return 0;
+    }
+    len += n;
+    const char *end = find_bytes(buf, len, "\r\n\r\n");
+    if (!end) {
+      continue;
+    }
+    const char *cl = find_bytes(buf, end - buf, "Content-Length:");
+    size_t body = cl ? strtoul(cl + 15, NULL, 10) : 0;
+    size_t want = (end - buf) + 4 + body;
+    while (len < want) {
+      // Bodies larger than the buffer are read and dropped
+      n = read(fd, buf, sizeof(buf) < want - len ? sizeof(buf) : want - len);
+      if (n <= 0) {
+        return 0;
+      }
+      len += n;
+    }
+    return 1;
+  }
+}
+
+static void stand_in_loop(int listen_fd) {
+  static const char response[] =
+      "HTTP/1.1 201 Created\r\n"
+      "Content-Type: application/json\r\n"
+      "Content-Length: 16\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "{\"success\":true}";
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      _exit(1);
+    }
+    if (read_request(fd) && write(fd, response, sizeof(response) - 1) == sizeof(response) - 1) {
+      __atomic_fetch_add(requests_answered, 1, __ATOMIC_RELEASE);
+    }
+    close(fd);
+  }
+}
+
+static int start_stand_in() {
+  requests_answered = mmap(NULL, sizeof(*requests_answered), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (requests_answered == MAP_FAILED) {
+    die("mmap failed");
+  }
+  *requests_answered = 0;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addr_len = sizeof(addr);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    die("cannot listen on loopback");
+  }
+
+  stand_in_pid = fork();
+  if (stand_in_pid == -1) {
+    die("fork failed");
+  }
+  if (stand_in_pid == 0) {
+    stand_in_loop(fd);
+  }
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+// Wait until the stand-in has answered every request sent so far.
+static void wait_for_requests() {
+  long long deadline = now_us() + (long long)BENCH_REQUEST_TIMEOUT_MS * 1000;
+  while (__atomic_load_n(requests_answered, __ATOMIC_ACQUIRE) < requests_expected) {
+    if (now_us() > deadline) {
+      die("the library did not reach the stand-in collector");
+    }
+    struct timespec pause = { 0, 100000 };
+    nanosleep(&pause, NULL);
+  }
+}
+
+// --- Scratch HOME ---
+
+// Remove the library's cache files. The startup scenarios also remove the
+// directory, which the constructor creates; the probe does not create it.
+static void clear_cache(int remove_dir) {
+  DIR *dir = opendir(cache_dir);
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      char path[PATH_MAX];
+      int len = snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+      if (len > 0 && (size_t)len < sizeof(path)) {
+        unlink(path);
+      }
+    }
+    closedir(dir);
+  }
+  if (remove_dir) {
+    rmdir(cache_dir);
+  } else {
+    mkdir(cache_dir, 0700);
+  }
+}
+
+// --- Running the measured programs ---
+
+// Run a program from bin_dir and wait for it. Returns its wall time in
+// microseconds; its standard output is stored in out if given.
+static long long run_program(char *const argv[], int disable, char *out, size_t out_size) {
+  char path[PATH_MAX];
+  int path_len = snprintf(path, sizeof(path), "%s/%s", bin_dir, argv[0]);
+  if (path_len < 0 || (size_t)path_len >= sizeof(path)) {
+    die("program path too long");
+  }
+
+  int pipe_fds[2] = { -1, -1 };
+  if (out && pipe(pipe_fds) != 0) {
+    die("pipe failed");
+  }
+
+  long long start = now_us();
+  pid_t pid = fork();
+  if (pid == -1) {
+    die("fork failed");
+  }
+  if (pid == 0) {
+    if (out) {
+      dup2(pipe_fds[1], STDOUT_FILENO);
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+    }
+    if (disable) {
+      setenv("ZUSAGE_DISABLE", "1", 1);
+    }
+    execv(path, argv);
+    _exit(127);
+  }
+
+  size_t len = 0;
+  if (out) {
+    close(pipe_fds[1]);
+    ssize_t n;
+    while (len < out_size - 1 && (n = read(pipe_fds[0], out + len, out_size - 1 - len)) > 0) {
+      len += n;
+    }
+    out[len] = '\0';
+    close(pipe_fds[0]);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      die("waitpid failed");
+    }
+  }
+  long long elapsed = now_us() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "zusage_bench: %s failed\n", path);
+    die("measured program failed");
+  }
+  return elapsed;
+}
+
+// --- Results ---
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static long long percentile(const long long *sorted, int n, int p) {
+  int rank = (p * n + 99) / 100; // nearest rank
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static struct result *add_result(const char *name, const char *variant, long long *samples, int n) {
+  if (result_count == BENCH_MAX_RESULTS || n == 0) {
+    return NULL;
+  }
+  qsort(samples, n, sizeof(*samples), compare_ll);
+  struct result *r = &results[result_count++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  snprintf(r->variant, sizeof(r->variant), "%s", variant);
+  r->n = n;
+  r->p50 = percentile(samples, n, 50);
+  r->p90 = percentile(samples, n, 90);
+  r->p99 = percentile(samples, n, 99);
+  r->max = samples[n - 1];
+  return r;
+}
+
+static void add_difference(const char *name, const char *variant, const struct result *a,
+                           const struct result *b) {
+  if (!a || !b || result_count == BENCH_MAX_RESULTS) {
+    return;
+  }
+  struct result *r = &results[result_count++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  snprintf(r->variant, sizeof(r->variant), "%s", variant);
+  r->n = a->n;
+  r->p50 = a->p50 - b->p50;
+  r->p90 = a->p90 - b->p90;
+  r->p99 = a->p99 - b->p99;
+  r->max = a->max - b->max;
+}
+
+static void write_results(FILE *f, int samples) {
+  fprintf(f, "{\n  \"benchmark\": \"zusage_startup\",\n  \"samples\": %d,\n  \"unit\": \"us\",\n  \"env\": [", samples);
+  for (int i = 0; i < extra_env_count; i++) {
+    fprintf(f, "%s\"%s\"", i ? ", " : "", extra_env[i]);
+  }
+  fprintf(f, "],\n  \"results\": [\n");
+  for (int i = 0; i < result_count; i++) {
+    const struct result *r = &results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"variant\": \"%s\", \"n\": %d, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld}%s\n",
+            r->name, r->variant, r->n, r->p50, r->p90, r->p99, r->max, i + 1 < result_count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+// --- Scenarios ---
+
+static struct result *bench_startup(const char *program, const char *variant, int samples, int cold,
+                                    int sends) {
+  long long *times = calloc(samples, sizeof(*times));
+  char *argv[] = { (char *)program, NULL };
+  if (!cold) {
+    run_program(argv, 0, NULL, 0); // warm the caches
+    requests_expected += sends;
+    wait_for_requests();
+  }
+  for (int i = 0; i < samples; i++) {
+    if (cold) {
+      clear_cache(1);
+    }
+    times[i] = run_program(argv, 0, NULL, 0);
+    requests_expected += sends;
+    wait_for_requests();
+  }
+  struct result *r = add_result("startup", variant, times, samples);
+  free(times);
+  return r;
+}
+
+// name is "fork", or "spawn" to start the sender with ZUSAGE_SPAWN
+static void bench_fork(const char *name, long rss_mb, int samples) {
+  char rss[32], count[32], variant[32];
+  snprintf(rss, sizeof(rss), "%ld", rss_mb);
+  snprintf(count, sizeof(count), "%d", samples);
+  snprintf(variant, sizeof(variant), "rss_%ldmb", rss_mb);
+  char *argv[] = { "zusage_bench_probe", "fork", rss, count, NULL };
+
+  static char out[BENCH_OUTPUT_SIZE];
+  if (strcmp(name, "spawn") == 0) {
+    setenv("ZUSAGE_SPAWN", ZUSAGE_SEND_PATH, 1);
+  }
+  run_program(argv, 1, out, sizeof(out));
+  unsetenv("ZUSAGE_SPAWN");
+  requests_expected += samples;
+  wait_for_requests();
+
+  long long *times = calloc(samples, sizeof(*times));
+  int n = 0;
+  char *p = out;
+  char *end;
+  while (n < samples) {
+    long long value = strtoll(p, &end, 10);
+    if (end == p) {
+      break;
+    }
+    times[n++] = value;
+    p = end;
+  }
+  add_result(name, variant, times, n);
+  free(times);
+}
+
+static void bench_send(const char *variant, int samples, int cold) {
+  long long *times[BENCH_PHASE_COUNT + 1];
+  for (int i = 0; i <= BENCH_PHASE_COUNT; i++) {
+    times[i] = calloc(samples, sizeof(long long));
+  }
+  char *argv[] = { "zusage_bench_probe", "phases", NULL };
+  char out[256];
+
+  clear_cache(0);
+  if (!cold) {
+    run_program(argv, 1, out, sizeof(out));
+    requests_expected++;
+  }
+  for (int s = 0; s < samples; s++) {
+    if (cold) {
+      clear_cache(0);
+    }
+    run_program(argv, 1, out, sizeof(out));
+    requests_expected++;
+    long long total = 0;
+    char *p = out;
+    for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+      times[i][s] = strtoll(p, &p, 10);
+      total += times[i][s];
+    }
+    times[BENCH_PHASE_COUNT][s] = total;
+  }
+  wait_for_requests();
+
+  char name[32];
+  for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+    snprintf(name, sizeof(name), "send_%s", phase_names[i]);
+    add_result(name, variant, times[i], samples);
+  }
+  add_result("send_total", variant, times[BENCH_PHASE_COUNT], samples);
+  for (int i = 0; i <= BENCH_PHASE_COUNT; i++) {
+    free(times[i]);
+  }
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-n samples] [-r rss_mb,...] [-e NAME=VALUE]... [-o file]\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int samples = BENCH_DEFAULT_SAMPLES;
+  const char *rss_list = BENCH_DEFAULT_RSS;
+  const char *output = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:e:o:")) != -1) {
+    switch (opt) {
+      case 'n':
+        samples = atoi(optarg);
+        if (samples <= 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'r':
+        rss_list = optarg;
+        break;
+      case 'e':
+        if (extra_env_count == BENCH_MAX_ENV || !strchr(optarg, '=')) {
+          usage(argv[0]);
+        }
+        extra_env[extra_env_count++] = optarg;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  char self[PATH_MAX];
+  if (realpath(argv[0], self) == NULL) {
+    die("cannot locate the benchmark programs");
+  }
+  snprintf(bin_dir, sizeof(bin_dir), "%s", dirname(self));
+
+  snprintf(home_dir, sizeof(home_dir), "/tmp/zusage_bench.XXXXXX");
+  if (mkdtemp(home_dir) == NULL) {
+    die("mkdtemp failed");
+  }
+  int cache_dir_len = snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home_dir);
+  if (cache_dir_len < 0 || (size_t)cache_dir_len >= sizeof(cache_dir)) {
+    die("cache directory path too long");
+  }
+
+  int port = start_stand_in();
+  char collector[64];
+  snprintf(collector, sizeof(collector), "127.0.0.1:%d", port);
+
+  // Environment of the measured programs
+  setenv("HOME", home_dir, 1);
+  setenv("ZUSAGE_COLLECTOR", collector, 1);
+  unsetenv("ZUSAGE_DISABLE");
+  unsetenv("ZUSAGE_DEBUG");
+  for (int i = 0; i < extra_env_count; i++) {
+    putenv((char *)extra_env[i]);
+  }
+
+  // Only the default constructor path sends one request per process
+  int sends = getenv("ZUSAGE_AGGREGATE") == NULL && getenv("ZUSAGE_SPOOLER") == NULL;
+
+  struct result *baseline = bench_startup("zusage_bench_baseline", "baseline", samples, 0, 0);
+  struct result *cold = bench_startup("zusage_bench_app", "cold", samples, 1, sends);
+  struct result *warm = bench_startup("zusage_bench_app", "warm", samples, 0, sends);
+  add_difference("startup_added", "cold", cold, baseline);
+  add_difference("startup_added", "warm", warm, baseline);
+
+  char rss_copy[256];
+  snprintf(rss_copy, sizeof(rss_copy), "%s", rss_list);
+  int rss_count = 0;
+  for (char *tok = strtok(rss_copy, ","); tok && rss_count < BENCH_MAX_RSS; tok = strtok(NULL, ","), rss_count++) {
+    bench_fork("fork", atol(tok), samples);
+  }
+  snprintf(rss_copy, sizeof(rss_copy), "%s", rss_list);
+  rss_count = 0;
+  for (char *tok = strtok(rss_copy, ","); tok && rss_count < BENCH_MAX_RSS; tok = strtok(NULL, ","), rss_count++) {
+    bench_fork("spawn", atol(tok), samples);
+  }
+
+  bench_send("cold", samples, 1);
+  bench_send("warm", samples, 0);
+
+  kill(stand_in_pid, SIGTERM);
+  waitpid(stand_in_pid, NULL, 0);
+  clear_cache(1);
+  rmdir(home_dir);
+
+  FILE *f = output ? fopen(output, "w") : stdout;
+  if (!f) {
+    die("cannot open the output file");
+  }
+  write_results(f, samples);
+  if (output) {
+    fclose(f);
+  }
+  return 0;
+}
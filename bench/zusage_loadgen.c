@@ -0,0 +1,584 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef LOADGEN_TLS
+#include <openssl/ssl.h>
+#endif
+
+#include "zusage_internal.h"
+
+// zusage_loadgen: how many events per second can the collector take?
+//
+// Workers POST usage events to the collector's /usage endpoint with the
+// payload and request the client library builds (zusage_payload.c), for a
+// mix of apps, versions, hosts and users: app popularity follows a Zipf
+// distribution, as tool usage does. With a target rate the load is open
+// loop: each event has a scheduled send time and its latency is measured
+// from then, so a stalled server shows up in the percentiles instead of
+// slowing the generator down. Without one, every worker sends as fast as its
+// responses come back.
+//
+// Readers can run at the same time against the dashboard's HTTPS port (-s,
+// 3443 by default): -D fetches /api/dashboard and -Q a custom query, each in
+// a loop with -i milliseconds between requests. Those routes need a login, so
+// -C passes the session cookie of a signed-in browser (connect.sid=...).
+// Readers are only built in when OpenSSL is found; the server's certificate
+// is not checked, as the target is loopback.
+//
+// Only loopback targets are accepted. Results are printed as JSON, latencies
+// in microseconds.
+//
+//   zusage_loadgen [-p port] [-r events/s] [-c workers] [-d seconds] [-k]
+//                  [-a apps] [-H hosts] [-s https_port] [-C cookie]
+//                  [-D readers] [-Q sql] [-i ms] [-o file]
+
+#define LOADGEN_DEFAULT_RATE 1000
+#define LOADGEN_DEFAULT_WORKERS 8
+#define LOADGEN_DEFAULT_SECONDS 10
+#define LOADGEN_DEFAULT_APPS 50
+#define LOADGEN_DEFAULT_HOSTS 200
+#define LOADGEN_DEFAULT_READER_INTERVAL_MS 1000
+#define LOADGEN_DEFAULT_HTTPS_PORT 3443
+#define LOADGEN_VERSIONS_PER_APP 3
+#define LOADGEN_USERS_PER_HOST 4
+#define LOADGEN_MAX_READERS 16
+#define LOADGEN_IO_TIMEOUT_S 10
+#define LOADGEN_RESPONSE_BUFFER 16384
+
+struct samples {
+  long long *values;
+  size_t count;
+  size_t capacity;
+};
+
+struct worker {
+  pthread_t thread;
+  int index;
+  unsigned long long rng;
+  struct samples latency;
+  unsigned long long ok;
+  unsigned long long errors;
+};
+
+struct reader {
+  pthread_t thread;
+  const char *name;
+  char path[2048];
+  struct samples latency;
+  unsigned long long ok;
+  unsigned long long errors;
+};
+
+static struct sockaddr_in target;
+static int ingest_port = USAGE_ANALYTICS_PORT;
+static int https_port = LOADGEN_DEFAULT_HTTPS_PORT;
+static const char *session_cookie = NULL;
+static double rate = LOADGEN_DEFAULT_RATE;
+static int worker_count = LOADGEN_DEFAULT_WORKERS;
+static int seconds = LOADGEN_DEFAULT_SECONDS;
+static int keep_alive = 0;
+static int app_count = LOADGEN_DEFAULT_APPS;
+static int host_count = LOADGEN_DEFAULT_HOSTS;
+static int reader_interval_ms = LOADGEN_DEFAULT_READER_INTERVAL_MS;
+
+static double *zipf_cdf;
+static long long start_ns;
+static long long end_ns;
+static volatile int readers_stop = 0;
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(long long when_ns) {
+  long long delta = when_ns - now_ns();
+  if (delta <= 0) {
+    return;
+  }
+  struct timespec ts = { (time_t)(delta / 1000000000LL), (long)(delta % 1000000000LL) };
+  nanosleep(&ts, NULL);
+}
+
+static void samples_add(struct samples *s, long long value) {
+  if (s->count == s->capacity) {
+    size_t capacity = s->capacity ? s->capacity * 2 : 4096;
+    long long *grown = realloc(s->values, capacity * sizeof(*grown));
+    if (!grown) {
+      return;
+    }
+    s->values = grown;
+    s->capacity = capacity;
+  }
+  s->values[s->count++] = value;
+}
+
+// xorshift64*, one state per thread
+static unsigned long long next_random(unsigned long long *state) {
+  unsigned long long x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ULL;
+}
+
+static double next_uniform(unsigned long long *state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Index of a Zipf(s=1) distributed app
+static int pick_app(unsigned long long *state) {
+  double u = next_uniform(state);
+  int lo = 0;
+  int hi = app_count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// --- HTTP ---
+
+static int open_connection(int port) {
+  struct sockaddr_in addr = target;
+  addr.sin_port = htons(port);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct timeval timeout = { LOADGEN_IO_TIMEOUT_S, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static const char *find_header_end(const char *buf, size_t len) {
+  for (size_t i = 0; i + 4 <= len; i++) {
+    if (memcmp(buf + i, "\r\n\r\n", 4) == 0) {
+      return buf + i;
+    }
+  }
+  return NULL;
+}
+
+// Read one response. With a Content-Length the connection can be reused;
+// without one the body runs to the end of the stream. Returns the status
+// code, or 0 on a read error. *reusable is cleared if the connection cannot
+// take another request.
+static int read_response(int fd, int *reusable) {
+  char buf[LOADGEN_RESPONSE_BUFFER];
+  size_t len = 0;
+  const char *header_end = NULL;
+  while (!header_end) {
+    if (len == sizeof(buf)) {
+      return 0;
+    }
+    ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+    if (n <= 0) {
+      return 0;
+    }
+    len += n;
+    header_end = find_header_end(buf, len);
+  }
+  if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0) {
+    return 0;
+  }
+  int status = atoi(buf + 9);
+
+  long long body_len = -1;
+  for (const char *line = buf; line < header_end; line = strstr(line, "\r\n") + 2) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      body_len = atoll(line + 15);
+    } else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close") &&
+               strstr(line, "close") < strstr(line, "\r\n")) {
+      *reusable = 0;
+    }
+  }
+
+  long long have = (long long)(len - (header_end + 4 - buf));
+  if (body_len < 0) {
+    *reusable = 0;
+    for (;;) {
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      if (n == 0) {
+        return status;
+      }
+      if (n < 0) {
+        return 0;
+      }
+    }
+  }
+  while (have < body_len) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      return 0;
+    }
+    have += n;
+  }
+  return status;
+}
+
+static int send_request(int fd, const char *request, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, request, len, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    request += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// --- Ingest workers ---
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+  int fd = -1;
+  char payload[MAX_POST_DATA_SIZE];
+  char request[MAX_POST_DATA_SIZE * 2];
+  double interval_ns = rate > 0 ? 1e9 * worker_count / rate : 0;
+
+  for (unsigned long long k = 0;; k++) {
+    long long scheduled = start_ns;
+    if (interval_ns > 0) {
+      // Workers are staggered so the combined load is evenly spaced
+      scheduled += (long long)(interval_ns * k + interval_ns * w->index / worker_count);
+      if (scheduled >= end_ns) {
+        break;
+      }
+      sleep_until(scheduled);
+    } else {
+      scheduled = now_ns();
+      if (scheduled >= end_ns) {
+        break;
+      }
+    }
+
+    int app = pick_app(&w->rng);
+    int version = (int)(next_random(&w->rng) % LOADGEN_VERSIONS_PER_APP);
+    int host = (int)(next_random(&w->rng) % host_count);
+    int user = (int)(next_random(&w->rng) % LOADGEN_USERS_PER_HOST);
+    char app_name[32], app_version[32], fqdn[64], local_ip[INET_ADDRSTRLEN], username[32];
+    snprintf(app_name, sizeof(app_name), "loadgen-app-%03d", app);
+    snprintf(app_version, sizeof(app_version), "1.%d.%d", app % 7, version);
+    snprintf(fqdn, sizeof(fqdn), "host-%04d.loadgen.example.com", host);
+    snprintf(local_ip, sizeof(local_ip), "10.%d.%d.%d", (host >> 16) & 0xff, (host >> 8) & 0xff, host & 0xff);
+    snprintf(username, sizeof(username), "user%d", user);
+
+    int payload_len = build_usage_payload(payload, sizeof(payload), app_name, fqdn, local_ip,
+                                          host % 3 ? "3.1" : "2.5", host % 5 ? "s390x" : "x86_64",
+                                          app_version, username);
+    int request_len = payload_len < 0 ? -1
+                      : build_usage_request(request, sizeof(request), payload, payload_len, keep_alive);
+    if (request_len < 0) {
+      w->errors++;
+      continue;
+    }
+
+    int status = 0;
+    for (int attempt = 0; attempt < 2 && status == 0; attempt++) {
+      int fresh = fd < 0;
+      if (fd < 0 && (fd = open_connection(ingest_port)) < 0) {
+        break;
+      }
+      int reusable = keep_alive;
+      if (send_request(fd, request, request_len)) {
+        status = read_response(fd, &reusable);
+      }
+      if (!reusable || status == 0) {
+        close(fd);
+        fd = -1;
+      }
+      if (fresh) {
+        break; // only a reused connection may have been closed by the server
+      }
+    }
+
+    if (status >= 200 && status < 300) {
+      w->ok++;
+      samples_add(&w->latency, (now_ns() - scheduled) / 1000);
+    } else {
+      w->errors++;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return NULL;
+}
+
+// --- Readers ---
+
+#ifdef LOADGEN_TLS
+static SSL_CTX *tls_context;
+
+// One GET over a fresh TLS connection. Returns the HTTP status code, or 0 if
+// the request failed. The request asks the server to close the connection,
+// so the response is read to the end.
+static int tls_get(const char *request, int request_len) {
+  int fd = open_connection(https_port);
+  if (fd < 0) {
+    return 0;
+  }
+  int status = 0;
+  SSL *ssl = SSL_new(tls_context);
+  if (ssl && SSL_set_fd(ssl, fd) == 1 && SSL_connect(ssl) == 1 && SSL_write(ssl, request, request_len) == request_len) {
+    // Only the status line matters; the rest is read and dropped
+    char buf[LOADGEN_RESPONSE_BUFFER];
+    int len = 0;
+    int n;
+    while ((n = SSL_read(ssl, buf + len, (int)sizeof(buf) - 1 - len)) > 0) {
+      len += n;
+      if (!status && len >= 12) {
+        status = strncmp(buf, "HTTP/1.", 7) == 0 ? atoi(buf + 9) : -1;
+      }
+      if (status) {
+        len = 0;
+      }
+    }
+    if (status < 0) {
+      status = 0;
+    }
+  }
+  if (ssl) {
+    SSL_free(ssl);
+  }
+  close(fd);
+  return status;
+}
+
+static void *reader_main(void *arg) {
+  struct reader *r = arg;
+  char request[4096];
+  int request_len = snprintf(request, sizeof(request),
+                             "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\nCookie: %s\r\nConnection: close\r\n\r\n",
+                             r->path, session_cookie);
+  if (request_len < 0 || (size_t)request_len >= sizeof(request)) {
+    return NULL;
+  }
+  while (!readers_stop && now_ns() < end_ns) {
+    long long started = now_ns();
+    int status = tls_get(request, request_len);
+    if (status >= 200 && status < 300) {
+      r->ok++;
+      samples_add(&r->latency, (now_ns() - started) / 1000);
+    } else {
+      r->errors++;
+    }
+    sleep_until(started + (long long)reader_interval_ms * 1000000);
+  }
+  return NULL;
+}
+#endif
+
+static void url_encode(char *out, size_t size, const char *in) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t len = 0;
+  for (; *in && len + 4 < size; in++) {
+    unsigned char c = (unsigned char)*in;
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || strchr("-_.~", c)) {
+      out[len++] = c;
+    } else {
+      out[len++] = '%';
+      out[len++] = hex[c >> 4];
+      out[len++] = hex[c & 0xf];
+    }
+  }
+  out[len] = '\0';
+}
+
+// --- Report ---
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static long long percentile(const struct samples *s, double p) {
+  if (s->count == 0) {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100.0 * s->count + 0.999999);
+  return s->values[rank > 0 ? rank - 1 : 0];
+}
+
+static void write_latency(FILE *f, const struct samples *s) {
+  qsort(s->values, s->count, sizeof(*s->values), compare_ll);
+  fprintf(f, "{\"n\": %lu, \"p50\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}",
+          (unsigned long)s->count, percentile(s, 50), percentile(s, 99), percentile(s, 99.9),
+          s->count ? s->values[s->count - 1] : 0);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-t 127.0.0.1] [-p port] [-r events/s, 0 = unpaced] [-c workers] [-d seconds] [-k]\n"
+          "          [-a apps] [-H hosts] [-s https_port] [-C session cookie] [-D dashboard readers]\n"
+          "          [-Q sql] [-i reader ms] [-o file]\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *target_host = "127.0.0.1";
+  const char *output = NULL;
+  const char *sql = NULL;
+  int dashboard_readers = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:p:r:c:d:ka:H:s:C:D:Q:i:o:")) != -1) {
+    switch (opt) {
+      case 't': target_host = optarg; break;
+      case 'p': ingest_port = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'c': worker_count = atoi(optarg); break;
+      case 'd': seconds = atoi(optarg); break;
+      case 'k': keep_alive = 1; break;
+      case 'a': app_count = atoi(optarg); break;
+      case 'H': host_count = atoi(optarg); break;
+      case 's': https_port = atoi(optarg); break;
+      case 'C': session_cookie = optarg; break;
+      case 'D': dashboard_readers = atoi(optarg); break;
+      case 'Q': sql = optarg; break;
+      case 'i': reader_interval_ms = atoi(optarg); break;
+      case 'o': output = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (ingest_port <= 0 || https_port <= 0 || rate < 0 || worker_count <= 0 || seconds <= 0 || app_count <= 0 || host_count <= 0 ||
+      dashboard_readers < 0 || reader_interval_ms < 0 || (sql && dashboard_readers + 1 > LOADGEN_MAX_READERS) ||
+      dashboard_readers > LOADGEN_MAX_READERS) {
+    usage(argv[0]);
+  }
+  if (dashboard_readers > 0 || sql) {
+#ifdef LOADGEN_TLS
+    if (!session_cookie || strpbrk(session_cookie, "\r\n")) {
+      fprintf(stderr, "zusage_loadgen: readers need the session cookie of a signed-in browser (-C)\n");
+      return 2;
+    }
+    tls_context = SSL_CTX_new(TLS_client_method());
+    if (!tls_context) {
+      fprintf(stderr, "zusage_loadgen: cannot set up TLS\n");
+      return 1;
+    }
+#else
+    fprintf(stderr, "zusage_loadgen: readers need a build with OpenSSL\n");
+    return 2;
+#endif
+  }
+
+  memset(&target, 0, sizeof(target));
+  target.sin_family = AF_INET;
+  if (inet_pton(AF_INET, target_host, &target.sin_addr) != 1 || (ntohl(target.sin_addr.s_addr) >> 24) != 127) {
+    fprintf(stderr, "zusage_loadgen: %s is not a loopback address\n", target_host);
+    return 2;
+  }
+
+  zipf_cdf = malloc(app_count * sizeof(*zipf_cdf));
+  double total = 0;
+  for (int i = 0; i < app_count; i++) {
+    total += 1.0 / (i + 1);
+    zipf_cdf[i] = total;
+  }
+  for (int i = 0; i < app_count; i++) {
+    zipf_cdf[i] /= total;
+  }
+
+  struct worker *workers = calloc(worker_count, sizeof(*workers));
+  struct reader readers[LOADGEN_MAX_READERS];
+  int reader_count = 0;
+  memset(readers, 0, sizeof(readers));
+  for (int i = 0; i < dashboard_readers; i++) {
+    readers[reader_count].name = "dashboard";
+    snprintf(readers[reader_count].path, sizeof(readers[reader_count].path), "/api/dashboard");
+    reader_count++;
+  }
+  if (sql) {
+    char encoded[1900];
+    url_encode(encoded, sizeof(encoded), sql);
+    readers[reader_count].name = "custom_query";
+    snprintf(readers[reader_count].path, sizeof(readers[reader_count].path), "/usage/custom-query?sql=%s", encoded);
+    reader_count++;
+  }
+
+  start_ns = now_ns() + 10000000LL; // let every thread start first
+  end_ns = start_ns + (long long)seconds * 1000000000LL;
+  for (int i = 0; i < worker_count; i++) {
+    workers[i].index = i;
+    workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+  }
+#ifdef LOADGEN_TLS
+  for (int i = 0; i < reader_count; i++) {
+    pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]);
+  }
+#endif
+
+  struct samples ingest = { NULL, 0, 0 };
+  unsigned long long ok = 0;
+  unsigned long long errors = 0;
+  for (int i = 0; i < worker_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    ok += workers[i].ok;
+    errors += workers[i].errors;
+    for (size_t j = 0; j < workers[i].latency.count; j++) {
+      samples_add(&ingest, workers[i].latency.values[j]);
+    }
+  }
+  double elapsed = (now_ns() - start_ns) / 1e9;
+  readers_stop = 1;
+#ifdef LOADGEN_TLS
+  for (int i = 0; i < reader_count; i++) {
+    pthread_join(readers[i].thread, NULL);
+  }
+#endif
+
+  FILE *f = output ? fopen(output, "w") : stdout;
+  if (!f) {
+    fprintf(stderr, "zusage_loadgen: cannot open %s\n", output);
+    return 1;
+  }
+  fprintf(f, "{\n  \"benchmark\": \"zusage_loadgen\",\n  \"unit\": \"us\",\n");
+  fprintf(f, "  \"target_rate\": %.0f,\n  \"workers\": %d,\n  \"keep_alive\": %s,\n  \"seconds\": %.3f,\n",
+          rate, worker_count, keep_alive ? "true" : "false", elapsed);
+  fprintf(f, "  \"ok\": %llu,\n  \"errors\": %llu,\n  \"throughput\": %.1f,\n  \"ingest\": ",
+          ok, errors, elapsed > 0 ? ok / elapsed : 0);
+  write_latency(f, &ingest);
+  fprintf(f, ",\n  \"readers\": [");
+  for (int i = 0; i < reader_count; i++) {
+    fprintf(f, "%s\n    {\"name\": \"%s\", \"ok\": %llu, \"errors\": %llu, \"latency\": ", i ? "," : "",
+            readers[i].name, readers[i].ok, readers[i].errors);
+    write_latency(f, &readers[i].latency);
+    fprintf(f, "}");
+  }
+  fprintf(f, "%s]\n}\n", reader_count ? "\n  " : "");
+  if (output) {
+    fclose(f);
+  }
+  return errors > 0 && ok == 0;
+}
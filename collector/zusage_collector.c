@@ -0,0 +1,1450 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+
+#include <sqlite3.h>
+
+#include "zusage_internal.h"
+#include "zusage_wire.h"
+
+// zusage-collector: native replacement for the Node server's HTTP ingest
+// listener. It accepts the same POST /usage and POST /usage/batch requests
+// the client library sends, on keep-alive connections multiplexed with
+// epoll, and writes the events into the server's SQLite database in group
+// commits through one prepared insert. Requests are parsed in place: event
+// fields point into the connection's input buffer until their group has
+// been committed. The Node server keeps serving the dashboard and sees the
+// rows like any others; its rollup triggers fire on these inserts too.
+//
+// With a UDP port it also takes the binary datagrams of ZUSAGE_TRANSPORT=udp
+// clients (zusage_wire.h). Datagrams are received into an arena that lives
+// until the next commit, so their fields are used in place as well.
+
+#define COLLECTOR_DEFAULT_DATABASE "usage_data.db"
+#define COLLECTOR_LISTEN_BACKLOG 1024
+#define COLLECTOR_EPOLL_EVENTS 256
+#define COLLECTOR_READ_CHUNK 16384
+#define COLLECTOR_MAX_HEADER_SIZE 8192
+#define COLLECTOR_MAX_EVENT_BODY_SIZE (100 * 1024)       // body-parser's default limit
+#define COLLECTOR_MAX_BATCH_BODY_SIZE (5 * 1024 * 1024)  // the server's /usage/batch limit
+#define COLLECTOR_MAX_BATCH_EVENTS 10000
+#define COLLECTOR_MAX_JSON_DEPTH 32
+#define COLLECTOR_FLUSH_ROWS 500
+#define COLLECTOR_FLUSH_INTERVAL_MS 5
+#define COLLECTOR_KEEPALIVE_TIMEOUT_MS 5000
+#define COLLECTOR_BUSY_TIMEOUT_MS 5000
+#define COLLECTOR_MAX_RESPONSE_SIZE 512
+#define COLLECTOR_UDP_RCVBUF (4 * 1024 * 1024)
+// Aggregated events (count, last_seen), as validated by the Node server
+#define COLLECTOR_MAX_EVENT_COUNT 100000LL // COUNTER_MAX_EVENT_COUNT in the library
+#define COLLECTOR_AGGREGATE_MAX_AGE_MS (24LL * 60 * 60 * 1000)
+
+struct json_str {
+  const char *ptr;
+  int len;
+};
+
+enum event_field {
+  FIELD_APP_NAME,
+  FIELD_FQDN,
+  FIELD_LOCAL_IP,
+  FIELD_OS_RELEASE,
+  FIELD_CPU_ARCH,
+  FIELD_APP_VERSION,
+  FIELD_USERNAME,
+  FIELD_COUNT
+};
+
+static const char *field_names[FIELD_COUNT] = {
+  "app_name", "fqdn", "local_ip", "os_release", "cpu_arch", "app_version", "username"
+};
+
+struct usage_event {
+  struct json_str fields[FIELD_COUNT];
+  long long count;        // 0 for a plain event
+  long long last_seen;    // epoch ms, 0 if absent
+};
+
+struct http_request {
+  int is_post;
+  int is_batch;          // POST /usage/batch rather than /usage
+  int known_path;
+  int keep_alive;
+  int ndjson;
+  int expect_continue;
+  int chunked;
+  size_t header_len;
+  long long content_length;
+};
+
+struct connection {
+  int fd;
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+  size_t scan_from;       // where to resume looking for the end of the headers
+  size_t request_len;     // bytes of the request in flight, consumed once answered
+  int continue_sent;
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+  int keep_alive;
+  int closing;            // close once the output has been written
+  int waiting;            // request queued for the next group commit
+  int peer_closed;
+  int epoll_events;
+  int is_batch;
+  int inserted;
+  int rejected;
+  long long first_id;
+  long long last_active_ms;
+  struct connection *prev;
+  struct connection *next;
+};
+
+struct pending_row {
+  struct connection *conn;
+  struct usage_event event;
+  long long ts;
+  char timestamp[MAX_TIMESTAMP_LENGTH];
+};
+
+struct collector_stats {
+  unsigned long long connections;
+  unsigned long long requests;
+  unsigned long long rows;
+  unsigned long long rejected;
+  unsigned long long commits;
+  unsigned long long failed_commits;
+  unsigned long long datagrams;
+  unsigned long long bad_datagrams;
+};
+
+static int verbose = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static int epoll_fd = -1;
+static struct connection *connections = NULL;
+static struct pending_row *pending = NULL;
+static int pending_count = 0;
+static int pending_cap = 0;
+static long long pending_deadline_ms = 0;
+static sqlite3 *db = NULL;
+static sqlite3_stmt *insert_stmt = NULL;
+static sqlite3_stmt *last_id_stmt = NULL; // set when `usage` is a view
+static struct collector_stats stats;
+// Datagrams waiting for the next commit; at most one per pending row
+static unsigned char datagram_arena[COLLECTOR_FLUSH_ROWS * ZUSAGE_WIRE_MAX_DATAGRAM];
+static size_t datagram_arena_used = 0;
+static char udp_listener_tag; // epoll data for the UDP socket
+
+static void log_msg(const char *format, ...) {
+  char timestamp[32];
+  time_t now = time(NULL);
+  struct tm tm_info;
+  localtime_r(&now, &tm_info);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "%s zusage-collector: ", timestamp);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+#define log_debug(...)     \
+  do {                     \
+    if (verbose) {         \
+      log_msg(__VA_ARGS__); \
+    }                      \
+  } while (0)
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// --- Database ---
+
+static int db_exec(const char *sql) {
+  char *errmsg = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+    log_msg("SQL error: %s (%s)", errmsg ? errmsg : "unknown", sql);
+    sqlite3_free(errmsg);
+    return 0;
+  }
+  return 1;
+}
+
+// Open the server's database. A missing `usage` table is created with the
+// server's schema; everything else (migrations, rollups, normalized storage)
+// stays the server's job. In normalized storage `usage` is a view whose
+// INSTEAD OF trigger does the dictionary encoding.
+static int open_database(const char *path) {
+  if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+    log_msg("Failed to open %s: %s", path, sqlite3_errmsg(db));
+    return 0;
+  }
+  sqlite3_busy_timeout(db, COLLECTOR_BUSY_TIMEOUT_MS);
+  if (!db_exec("PRAGMA journal_mode = WAL") || !db_exec("PRAGMA synchronous = NORMAL")) {
+    return 0;
+  }
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT type FROM sqlite_master WHERE name = 'usage'", -1, &stmt, NULL) != SQLITE_OK) {
+    log_msg("Failed to read schema: %s", sqlite3_errmsg(db));
+    return 0;
+  }
+  int is_view = 0;
+  int exists = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    exists = 1;
+    is_view = strcmp((const char *)sqlite3_column_text(stmt, 0), "view") == 0;
+  }
+  sqlite3_finalize(stmt);
+
+  // Databases from before weighted rows get the column the server would add
+  if (exists && !is_view) {
+    sqlite3_exec(db, "ALTER TABLE usage ADD COLUMN weight INTEGER NOT NULL DEFAULT 1", NULL, NULL, NULL);
+  }
+  if (!exists && !db_exec("CREATE TABLE IF NOT EXISTS usage ("
+                          "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                          "app_name TEXT NOT NULL, "
+                          "fqdn TEXT NOT NULL, "
+                          "local_ip TEXT NOT NULL, "
+                          "os_release TEXT NOT NULL, "
+                          "cpu_arch TEXT NOT NULL, "
+                          "app_version TEXT NOT NULL, "
+                          "timestamp TEXT NOT NULL, "
+                          "username TEXT NOT NULL, "
+                          "ts INTEGER, "
+                          "weight INTEGER NOT NULL DEFAULT 1)")) {
+    return 0;
+  }
+
+  const char *insert_sql =
+      "INSERT INTO usage (app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username, ts, weight) "
+      "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10)";
+  if (sqlite3_prepare_v3(db, insert_sql, -1, SQLITE_PREPARE_PERSISTENT, &insert_stmt, NULL) != SQLITE_OK) {
+    log_msg("Failed to prepare insert (has the server migrated this database?): %s", sqlite3_errmsg(db));
+    return 0;
+  }
+  // Rows inserted through the view's trigger do not update last_insert_rowid
+  if (is_view &&
+      sqlite3_prepare_v3(db, "SELECT seq FROM sqlite_sequence WHERE name = 'usage_facts'", -1,
+                         SQLITE_PREPARE_PERSISTENT, &last_id_stmt, NULL) != SQLITE_OK) {
+    log_msg("Failed to prepare id lookup: %s", sqlite3_errmsg(db));
+    return 0;
+  }
+  log_msg("Writing to %s (%s storage)", path, is_view ? "normalized" : "legacy");
+  return 1;
+}
+
+static long long last_insert_id() {
+  if (!last_id_stmt) {
+    return sqlite3_last_insert_rowid(db);
+  }
+  long long id = 0;
+  if (sqlite3_step(last_id_stmt) == SQLITE_ROW) {
+    id = sqlite3_column_int64(last_id_stmt, 0);
+  }
+  sqlite3_reset(last_id_stmt);
+  return id;
+}
+
+static int insert_row(const struct pending_row *row) {
+  static const struct json_str unknown_user = { "unknown", 7 };
+  const struct usage_event *ev = &row->event;
+  const struct json_str *username = ev->fields[FIELD_USERNAME].len > 0 ? &ev->fields[FIELD_USERNAME] : &unknown_user;
+
+  sqlite3_bind_text(insert_stmt, 1, ev->fields[FIELD_APP_NAME].ptr, ev->fields[FIELD_APP_NAME].len, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 2, ev->fields[FIELD_FQDN].ptr, ev->fields[FIELD_FQDN].len, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 3, ev->fields[FIELD_LOCAL_IP].ptr, ev->fields[FIELD_LOCAL_IP].len, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 4, ev->fields[FIELD_OS_RELEASE].ptr, ev->fields[FIELD_OS_RELEASE].len, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 5, ev->fields[FIELD_CPU_ARCH].ptr, ev->fields[FIELD_CPU_ARCH].len, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 6, ev->fields[FIELD_APP_VERSION].ptr, ev->fields[FIELD_APP_VERSION].len, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 7, row->timestamp, -1, SQLITE_STATIC);
+  sqlite3_bind_text(insert_stmt, 8, username->ptr, username->len, SQLITE_STATIC);
+  sqlite3_bind_int64(insert_stmt, 9, row->ts);
+  sqlite3_bind_int64(insert_stmt, 10, ev->count > 0 ? ev->count : 1);
+
+  int rc = sqlite3_step(insert_stmt);
+  sqlite3_reset(insert_stmt);
+  if (rc != SQLITE_DONE) {
+    log_msg("Insert failed: %s", sqlite3_errmsg(db));
+    return 0;
+  }
+  return 1;
+}
+
+// --- JSON ---
+// Just enough JSON for usage events: objects whose interesting members are
+// strings. Strings are unescaped in place, which never makes them longer.
+
+struct json_parser {
+  char *p;
+  char *end;
+};
+
+static void json_skip_ws(struct json_parser *jp) {
+  while (jp->p < jp->end && (*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r')) {
+    jp->p++;
+  }
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static int json_read_hex4(const char *p) {
+  int value = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = hex_value(p[i]);
+    if (digit < 0) {
+      return -1;
+    }
+    value = value * 16 + digit;
+  }
+  return value;
+}
+
+static char *utf8_encode(char *out, unsigned int cp) {
+  if (cp < 0x80) {
+    *out++ = (char)cp;
+  } else if (cp < 0x800) {
+    *out++ = (char)(0xc0 | (cp >> 6));
+    *out++ = (char)(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    *out++ = (char)(0xe0 | (cp >> 12));
+    *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+    *out++ = (char)(0x80 | (cp & 0x3f));
+  } else {
+    *out++ = (char)(0xf0 | (cp >> 18));
+    *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+    *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+    *out++ = (char)(0x80 | (cp & 0x3f));
+  }
+  return out;
+}
+
+// Parse a string at jp->p (which must be '"'). Returns 1 on success.
+static int json_parse_string(struct json_parser *jp, struct json_str *out) {
+  char *p = jp->p + 1;
+  char *start = p;
+  // Fast path: no escapes, the string is used where it lies
+  while (p < jp->end && *p != '"' && *p != '\\') {
+    if ((unsigned char)*p < 0x20) {
+      return 0;
+    }
+    p++;
+  }
+  if (p >= jp->end) {
+    return 0;
+  }
+  if (*p == '"') {
+    out->ptr = start;
+    out->len = (int)(p - start);
+    jp->p = p + 1;
+    return 1;
+  }
+
+  char *w = p;
+  while (p < jp->end && *p != '"') {
+    if ((unsigned char)*p < 0x20) {
+      return 0;
+    }
+    if (*p != '\\') {
+      *w++ = *p++;
+      continue;
+    }
+    if (p + 1 >= jp->end) {
+      return 0;
+    }
+    char esc = p[1];
+    p += 2;
+    switch (esc) {
+      case '"': *w++ = '"'; break;
+      case '\\': *w++ = '\\'; break;
+      case '/': *w++ = '/'; break;
+      case 'b': *w++ = '\b'; break;
+      case 'f': *w++ = '\f'; break;
+      case 'n': *w++ = '\n'; break;
+      case 'r': *w++ = '\r'; break;
+      case 't': *w++ = '\t'; break;
+      case 'u': {
+        if (p + 4 > jp->end) {
+          return 0;
+        }
+        int cp = json_read_hex4(p);
+        if (cp < 0) {
+          return 0;
+        }
+        p += 4;
+        if (cp >= 0xd800 && cp <= 0xdbff && p + 6 <= jp->end && p[0] == '\\' && p[1] == 'u') {
+          int low = json_read_hex4(p + 2);
+          if (low >= 0xdc00 && low <= 0xdfff) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            p += 6;
+          }
+        }
+        if (cp >= 0xd800 && cp <= 0xdfff) {
+          cp = 0xfffd; // lone surrogate, as JSON.parse + UTF-8 encoding would produce
+        }
+        w = utf8_encode(w, (unsigned int)cp);
+        break;
+      }
+      default:
+        return 0;
+    }
+  }
+  if (p >= jp->end) {
+    return 0;
+  }
+  out->ptr = start;
+  out->len = (int)(w - start);
+  jp->p = p + 1;
+  return 1;
+}
+
+static int json_skip_value(struct json_parser *jp, int depth);
+
+static int json_skip_container(struct json_parser *jp, char close, int depth) {
+  if (depth > COLLECTOR_MAX_JSON_DEPTH) {
+    return 0;
+  }
+  jp->p++;
+  json_skip_ws(jp);
+  if (jp->p < jp->end && *jp->p == close) {
+    jp->p++;
+    return 1;
+  }
+  for (;;) {
+    if (close == '}') {
+      struct json_str key;
+      json_skip_ws(jp);
+      if (jp->p >= jp->end || *jp->p != '"' || !json_parse_string(jp, &key)) {
+        return 0;
+      }
+      json_skip_ws(jp);
+      if (jp->p >= jp->end || *jp->p != ':') {
+        return 0;
+      }
+      jp->p++;
+    }
+    if (!json_skip_value(jp, depth + 1)) {
+      return 0;
+    }
+    json_skip_ws(jp);
+    if (jp->p >= jp->end) {
+      return 0;
+    }
+    if (*jp->p == close) {
+      jp->p++;
+      return 1;
+    }
+    if (*jp->p != ',') {
+      return 0;
+    }
+    jp->p++;
+  }
+}
+
+static int json_skip_literal(struct json_parser *jp, const char *literal) {
+  size_t len = strlen(literal);
+  if ((size_t)(jp->end - jp->p) < len || memcmp(jp->p, literal, len) != 0) {
+    return 0;
+  }
+  jp->p += len;
+  return 1;
+}
+
+static int json_skip_value(struct json_parser *jp, int depth) {
+  json_skip_ws(jp);
+  if (jp->p >= jp->end) {
+    return 0;
+  }
+  struct json_str ignored;
+  switch (*jp->p) {
+    case '"': return json_parse_string(jp, &ignored);
+    case '{': return json_skip_container(jp, '}', depth);
+    case '[': return json_skip_container(jp, ']', depth);
+    case 't': return json_skip_literal(jp, "true");
+    case 'f': return json_skip_literal(jp, "false");
+    case 'n': return json_skip_literal(jp, "null");
+    default: {
+      char *start = jp->p;
+      while (jp->p < jp->end && strchr("+-0123456789.eE", *jp->p)) {
+        jp->p++;
+      }
+      return jp->p > start;
+    }
+  }
+}
+
+// Parse a value that should be a non-negative integer (digits only).
+// Returns 1 and stores it if it is one, 0 if it is some other value, and -1
+// if the JSON is malformed.
+static int json_parse_integer(struct json_parser *jp, long long *value) {
+  char *start = jp->p;
+  if (!json_skip_value(jp, 1)) {
+    return -1;
+  }
+  long long n = 0;
+  for (char *d = start; d < jp->p; d++) {
+    if (*d < '0' || *d > '9' || n > (LLONG_MAX - 9) / 10) {
+      return 0;
+    }
+    n = n * 10 + (*d - '0');
+  }
+  *value = n;
+  return jp->p > start;
+}
+
+// Parse one event object. Returns 1 if it is a valid event, 0 if it is well
+// formed but not a valid event (rejected, as validateData() would), and -1
+// if the JSON is malformed.
+static int json_parse_event(struct json_parser *jp, struct usage_event *ev) {
+  memset(ev, 0, sizeof(*ev));
+  json_skip_ws(jp);
+  if (jp->p >= jp->end) {
+    return -1;
+  }
+  if (*jp->p != '{') {
+    return json_skip_value(jp, 0) ? 0 : -1;
+  }
+
+  int valid = 1;
+  jp->p++;
+  json_skip_ws(jp);
+  if (jp->p < jp->end && *jp->p == '}') {
+    jp->p++;
+    return 0;
+  }
+  for (;;) {
+    struct json_str key;
+    json_skip_ws(jp);
+    if (jp->p >= jp->end || *jp->p != '"' || !json_parse_string(jp, &key)) {
+      return -1;
+    }
+    json_skip_ws(jp);
+    if (jp->p >= jp->end || *jp->p != ':') {
+      return -1;
+    }
+    jp->p++;
+    json_skip_ws(jp);
+
+    int field = -1;
+    for (int i = 0; i < FIELD_COUNT; i++) {
+      if ((int)strlen(field_names[i]) == key.len && memcmp(field_names[i], key.ptr, key.len) == 0) {
+        field = i;
+        break;
+      }
+    }
+    if (field >= 0 && jp->p < jp->end && *jp->p == '"') {
+      if (!json_parse_string(jp, &ev->fields[field])) {
+        return -1;
+      }
+    } else if (field < 0 && key.len == 5 && memcmp(key.ptr, "count", 5) == 0) {
+      int rc = json_parse_integer(jp, &ev->count);
+      if (rc < 0) {
+        return -1;
+      }
+      if (rc == 0 || ev->count < 1 || ev->count > COLLECTOR_MAX_EVENT_COUNT) {
+        valid = 0;
+      }
+    } else if (field < 0 && key.len == 9 && memcmp(key.ptr, "last_seen", 9) == 0) {
+      // Only a hint for the row time; anything else is ignored
+      if (json_parse_integer(jp, &ev->last_seen) < 0) {
+        return -1;
+      }
+    } else {
+      if (field >= 0) {
+        ev->fields[field].ptr = NULL; // later duplicates win, as in JSON.parse
+        ev->fields[field].len = 0;
+        if (field != FIELD_USERNAME) {
+          valid = 0;
+        }
+      }
+      if (!json_skip_value(jp, 1)) {
+        return -1;
+      }
+    }
+
+    json_skip_ws(jp);
+    if (jp->p >= jp->end) {
+      return -1;
+    }
+    if (*jp->p == '}') {
+      jp->p++;
+      break;
+    }
+    if (*jp->p != ',') {
+      return -1;
+    }
+    jp->p++;
+  }
+
+  for (int i = 0; i < FIELD_COUNT; i++) {
+    if (i != FIELD_USERNAME && ev->fields[i].len == 0) {
+      valid = 0;
+    }
+  }
+  return valid;
+}
+
+// --- Connections ---
+
+static void update_epoll(struct connection *conn, int events) {
+  if (conn->epoll_events == events) {
+    return;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+  conn->epoll_events = events;
+}
+
+static void close_connection(struct connection *conn) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+static int ensure_capacity(char **buf, size_t *cap, size_t needed) {
+  if (needed <= *cap) {
+    return 1;
+  }
+  size_t new_cap = *cap ? *cap : COLLECTOR_READ_CHUNK;
+  while (new_cap < needed) {
+    new_cap *= 2;
+  }
+  char *grown = realloc(*buf, new_cap);
+  if (!grown) {
+    return 0;
+  }
+  *buf = grown;
+  *cap = new_cap;
+  return 1;
+}
+
+static void append_output(struct connection *conn, const char *data, size_t len) {
+  if (!ensure_capacity(&conn->out, &conn->out_cap, conn->out_len + len)) {
+    conn->closing = 1;
+    return;
+  }
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+}
+
+static const char *status_text(int status) {
+  switch (status) {
+    case 201: return "Created";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    default: return "OK";
+  }
+}
+
+static void queue_response(struct connection *conn, int status, const char *body) {
+  char header[COLLECTOR_MAX_RESPONSE_SIZE];
+  size_t body_len = strlen(body);
+  int len = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: application/json; charset=utf-8\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     status, status_text(status), body_len, conn->keep_alive ? "keep-alive" : "close");
+  append_output(conn, header, len);
+  append_output(conn, body, body_len);
+  if (!conn->keep_alive) {
+    conn->closing = 1;
+  }
+}
+
+static void queue_error(struct connection *conn, int status, const char *message) {
+  char body[COLLECTOR_MAX_RESPONSE_SIZE];
+  snprintf(body, sizeof(body), "{\"error\":\"%s\"}", message);
+  queue_response(conn, status, body);
+}
+
+// Write as much pending output as the socket takes. Returns 0 if the
+// connection was closed.
+static int flush_output(struct connection *conn) {
+  while (conn->out_sent < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        update_epoll(conn, EPOLLOUT);
+        return 1;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      close_connection(conn);
+      return 0;
+    }
+    conn->out_sent += n;
+  }
+  conn->out_len = 0;
+  conn->out_sent = 0;
+  if (conn->closing || conn->peer_closed) {
+    close_connection(conn);
+    return 0;
+  }
+  update_epoll(conn, conn->waiting ? 0 : EPOLLIN);
+  return 1;
+}
+
+static void consume_request(struct connection *conn) {
+  memmove(conn->in, conn->in + conn->request_len, conn->in_len - conn->request_len);
+  conn->in_len -= conn->request_len;
+  conn->request_len = 0;
+  conn->scan_from = 0;
+  conn->continue_sent = 0;
+}
+
+static int header_is(const char *name, size_t name_len, const char *expected) {
+  return name_len == strlen(expected) && strncasecmp(name, expected, name_len) == 0;
+}
+
+static int value_has_token(const char *value, size_t len, const char *token) {
+  size_t token_len = strlen(token);
+  for (size_t i = 0; i + token_len <= len; i++) {
+    if (strncasecmp(value + i, token, token_len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Parse the request line and headers. Returns 1 when they are complete,
+// 0 if more input is needed, or an HTTP status code for a bad request.
+static int parse_request_head(struct connection *conn, struct http_request *req) {
+  size_t from = conn->scan_from > 3 ? conn->scan_from - 3 : 0;
+  char *head_end = memmem(conn->in + from, conn->in_len - from, "\r\n\r\n", 4);
+  if (!head_end) {
+    conn->scan_from = conn->in_len;
+    return conn->in_len > COLLECTOR_MAX_HEADER_SIZE ? 431 : 0;
+  }
+
+  memset(req, 0, sizeof(*req));
+  req->content_length = -1;
+  req->header_len = (size_t)(head_end - conn->in) + 4;
+
+  char *line = conn->in;
+  char *line_end = memmem(line, head_end + 2 - line, "\r\n", 2);
+  char *method_end = memchr(line, ' ', line_end - line);
+  if (!method_end) {
+    return 400;
+  }
+  char *path = method_end + 1;
+  char *path_end = memchr(path, ' ', line_end - path);
+  if (!path_end || line_end - path_end < 9 || memcmp(path_end + 1, "HTTP/1.", 7) != 0) {
+    return 400;
+  }
+  int http10 = path_end[8] == '0';
+  req->keep_alive = !http10;
+  req->is_post = method_end - line == 4 && memcmp(line, "POST", 4) == 0;
+
+  char *query = memchr(path, '?', path_end - path);
+  size_t path_len = (query ? query : path_end) - path;
+  size_t usage_len = strlen(USAGE_ANALYTICS_PATH);
+  size_t batch_len = strlen(USAGE_ANALYTICS_BATCH_PATH);
+  if (path_len == usage_len && memcmp(path, USAGE_ANALYTICS_PATH, usage_len) == 0) {
+    req->known_path = 1;
+  } else if (path_len == batch_len && memcmp(path, USAGE_ANALYTICS_BATCH_PATH, batch_len) == 0) {
+    req->known_path = 1;
+    req->is_batch = 1;
+  }
+
+  for (line = line_end + 2; line < head_end + 2; line = line_end + 2) {
+    line_end = memmem(line, head_end + 2 - line, "\r\n", 2);
+    char *colon = memchr(line, ':', line_end - line);
+    if (!colon) {
+      return 400;
+    }
+    size_t name_len = colon - line;
+    char *value = colon + 1;
+    while (value < line_end && (*value == ' ' || *value == '\t')) {
+      value++;
+    }
+    size_t value_len = line_end - value;
+
+    if (header_is(line, name_len, "Content-Length")) {
+      char *num_end;
+      errno = 0;
+      long long length = strtoll(value, &num_end, 10);
+      if (errno || num_end == value || length < 0) {
+        return 400;
+      }
+      req->content_length = length;
+    } else if (header_is(line, name_len, "Connection")) {
+      if (value_has_token(value, value_len, "close")) {
+        req->keep_alive = 0;
+      } else if (value_has_token(value, value_len, "keep-alive")) {
+        req->keep_alive = 1;
+      }
+    } else if (header_is(line, name_len, "Content-Type")) {
+      req->ndjson = value_has_token(value, value_len, "application/x-ndjson");
+    } else if (header_is(line, name_len, "Transfer-Encoding")) {
+      req->chunked = 1;
+    } else if (header_is(line, name_len, "Expect")) {
+      req->expect_continue = value_has_token(value, value_len, "100-continue");
+    }
+  }
+  return 1;
+}
+
+// Format epoch milliseconds like Date.toISOString()
+static void format_timestamp_ms(char *buf, size_t size, long long ts_ms) {
+  time_t seconds = (time_t)(ts_ms / 1000);
+  struct tm tm_info;
+  gmtime_r(&seconds, &tm_info);
+  size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm_info);
+  snprintf(buf + len, size - len, ".%03dZ", (int)(ts_ms % 1000));
+}
+
+static void format_timestamp(char *buf, size_t size, long long *ts_ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  *ts_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  format_timestamp_ms(buf, size, *ts_ms);
+}
+
+static int add_pending_row(struct connection *conn, const struct usage_event *ev, long long ts, const char *timestamp) {
+  if (pending_count == pending_cap) {
+    int new_cap = pending_cap ? pending_cap * 2 : COLLECTOR_FLUSH_ROWS * 2;
+    struct pending_row *grown = realloc(pending, new_cap * sizeof(*pending));
+    if (!grown) {
+      return 0;
+    }
+    pending = grown;
+    pending_cap = new_cap;
+  }
+  struct pending_row *row = &pending[pending_count++];
+  row->conn = conn;
+  row->event = *ev;
+  // An aggregated event is dated at its last_seen, like eventTime() in the
+  // server, if that is within the last day
+  if (ev->count > 0 && ev->last_seen > 0 && ev->last_seen <= ts &&
+      ev->last_seen >= ts - COLLECTOR_AGGREGATE_MAX_AGE_MS) {
+    row->ts = ev->last_seen;
+    format_timestamp_ms(row->timestamp, sizeof(row->timestamp), row->ts);
+  } else {
+    row->ts = ts;
+    strcpy(row->timestamp, timestamp);
+  }
+
+  // fqdn is stored lower-cased (ASCII, like the hostnames clients report)
+  char *fqdn = (char *)ev->fields[FIELD_FQDN].ptr;
+  for (int i = 0; i < ev->fields[FIELD_FQDN].len; i++) {
+    if (fqdn[i] >= 'A' && fqdn[i] <= 'Z') {
+      fqdn[i] += 'a' - 'A';
+    }
+  }
+  return 1;
+}
+
+// Parse the body of a complete request and queue its events. Returns 0 if
+// the request was queued for the next commit, or an HTTP status to answer
+// with right away (the body of the error is set in *message).
+static int handle_body(struct connection *conn, const struct http_request *req, const char **message) {
+  struct json_parser jp;
+  jp.p = conn->in + req->header_len;
+  jp.end = jp.p + req->content_length;
+
+  char timestamp[MAX_TIMESTAMP_LENGTH];
+  long long ts;
+  format_timestamp(timestamp, sizeof(timestamp), &ts);
+
+  int first_row = pending_count;
+  conn->inserted = 0;
+  conn->rejected = 0;
+  *message = "Invalid data format.";
+
+  if (!req->is_batch) {
+    struct usage_event ev;
+    int rc = json_parse_event(&jp, &ev);
+    json_skip_ws(&jp);
+    if (rc != 1 || jp.p != jp.end) {
+      return 400;
+    }
+    if (!add_pending_row(conn, &ev, ts, timestamp)) {
+      *message = "Failed to save data.";
+      return 500;
+    }
+    conn->inserted = 1;
+    return 0;
+  }
+
+  int events = 0;
+  json_skip_ws(&jp);
+  int array = !req->ndjson && jp.p < jp.end && *jp.p == '[';
+  if (array) {
+    jp.p++;
+    json_skip_ws(&jp);
+    if (jp.p < jp.end && *jp.p == ']') {
+      jp.p++;
+      array = 0;
+    }
+  } else if (!req->ndjson) {
+    *message = "Expected a JSON array or NDJSON body.";
+    return 400;
+  }
+
+  while (array || (req->ndjson && jp.p < jp.end)) {
+    struct usage_event ev;
+    int rc = json_parse_event(&jp, &ev);
+    if (rc < 0) {
+      pending_count = first_row;
+      *message = "Expected a JSON array or NDJSON body.";
+      return 400;
+    }
+    if (++events > COLLECTOR_MAX_BATCH_EVENTS) {
+      pending_count = first_row;
+      *message = "Batch exceeds 10000 events.";
+      return 413;
+    }
+    if (rc == 1) {
+      if (!add_pending_row(conn, &ev, ts, timestamp)) {
+        pending_count = first_row;
+        *message = "Failed to save data.";
+        return 500;
+      }
+      conn->inserted++;
+    } else {
+      conn->rejected++;
+    }
+
+    json_skip_ws(&jp);
+    if (array) {
+      if (jp.p < jp.end && *jp.p == ',') {
+        jp.p++;
+        continue;
+      }
+      if (jp.p < jp.end && *jp.p == ']') {
+        jp.p++;
+        break;
+      }
+      pending_count = first_row;
+      *message = "Expected a JSON array or NDJSON body.";
+      return 400;
+    }
+  }
+  json_skip_ws(&jp);
+  if (jp.p != jp.end) {
+    pending_count = first_row;
+    *message = "Expected a JSON array or NDJSON body.";
+    return 400;
+  }
+  if (conn->inserted == 0) {
+    return 400;
+  }
+  return 0;
+}
+
+static void wait_for_commit(struct connection *conn) {
+  conn->waiting = 1;
+  update_epoll(conn, 0);
+  if (pending_deadline_ms == 0) {
+    pending_deadline_ms = now_ms() + COLLECTOR_FLUSH_INTERVAL_MS;
+  }
+}
+
+// Handle every complete request in the input buffer, one at a time.
+// Returns 0 if the connection was closed.
+static int process_input(struct connection *conn) {
+  while (!conn->waiting && !conn->closing) {
+    struct http_request req;
+    int rc = parse_request_head(conn, &req);
+    if (rc == 0) {
+      break;
+    }
+    if (rc != 1) {
+      conn->keep_alive = 0;
+      queue_error(conn, rc, status_text(rc));
+      break;
+    }
+    conn->keep_alive = req.keep_alive;
+
+    if (!req.known_path || !req.is_post) {
+      conn->keep_alive = 0; // the body, if any, is not read
+      queue_error(conn, 404, "Not found.");
+      break;
+    }
+    if (req.chunked) {
+      conn->keep_alive = 0;
+      queue_error(conn, 501, "Chunked request bodies are not supported.");
+      break;
+    }
+    if (req.content_length < 0) {
+      conn->keep_alive = 0;
+      queue_error(conn, 411, "Content-Length is required.");
+      break;
+    }
+    long long limit = req.is_batch ? COLLECTOR_MAX_BATCH_BODY_SIZE : COLLECTOR_MAX_EVENT_BODY_SIZE;
+    if (req.content_length > limit) {
+      conn->keep_alive = 0;
+      queue_error(conn, 413, "Request body too large.");
+      break;
+    }
+
+    conn->request_len = req.header_len + (size_t)req.content_length;
+    if (conn->in_len < conn->request_len) {
+      if (req.expect_continue && !conn->continue_sent) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        append_output(conn, cont, sizeof(cont) - 1);
+        conn->continue_sent = 1;
+      }
+      break;
+    }
+
+    stats.requests++;
+    conn->is_batch = req.is_batch;
+    const char *message;
+    int status = handle_body(conn, &req, &message);
+    if (status == 0) {
+      wait_for_commit(conn);
+      break;
+    }
+    if (status == 400 && req.is_batch && conn->inserted == 0 && strcmp(message, "Invalid data format.") == 0) {
+      char body[COLLECTOR_MAX_RESPONSE_SIZE];
+      snprintf(body, sizeof(body), "{\"error\":\"%s\",\"rejected\":%d}", message, conn->rejected);
+      queue_response(conn, status, body);
+    } else {
+      queue_error(conn, status, message);
+    }
+    stats.rejected += conn->rejected;
+    consume_request(conn);
+  }
+
+  if (conn->out_len > conn->out_sent) {
+    return flush_output(conn);
+  }
+  return 1;
+}
+
+static void handle_readable(struct connection *conn) {
+  for (;;) {
+    if (!ensure_capacity(&conn->in, &conn->in_cap, conn->in_len + COLLECTOR_READ_CHUNK)) {
+      close_connection(conn);
+      return;
+    }
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+    if (n > 0) {
+      conn->in_len += n;
+      conn->last_active_ms = now_ms();
+      if (conn->in_len > COLLECTOR_MAX_HEADER_SIZE + COLLECTOR_MAX_BATCH_BODY_SIZE) {
+        break; // process_input rejects it
+      }
+      continue;
+    }
+    if (n == 0) {
+      // A half-closed client may still be waiting for its answer
+      conn->peer_closed = 1;
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      conn->peer_closed = 1;
+    }
+    break;
+  }
+
+  if (!process_input(conn)) {
+    return;
+  }
+  if (conn->peer_closed && !conn->waiting && conn->out_len == 0) {
+    close_connection(conn);
+  }
+}
+
+static void accept_connections(int listen_fd) {
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_msg("accept failed, errno: %d", errno);
+      }
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->last_active_ms = now_ms();
+    conn->epoll_events = EPOLLIN;
+    conn->next = connections;
+    if (connections) {
+      connections->prev = conn;
+    }
+    connections = conn;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close_connection(conn);
+      continue;
+    }
+    stats.connections++;
+  }
+}
+
+// --- Group commit ---
+
+// Write every queued event in one transaction, then answer the requests
+// they came from.
+static void flush_pending() {
+  if (pending_count == 0) {
+    pending_deadline_ms = 0;
+    return;
+  }
+
+  int ok = db_exec("BEGIN IMMEDIATE");
+  struct connection *current = NULL;
+  for (int i = 0; ok && i < pending_count; i++) {
+    ok = insert_row(&pending[i]);
+    if (ok && pending[i].conn && pending[i].conn != current) {
+      current = pending[i].conn;
+      current->first_id = last_insert_id();
+    }
+  }
+  if (ok) {
+    ok = db_exec("COMMIT");
+  }
+  if (!ok) {
+    db_exec("ROLLBACK");
+    stats.failed_commits++;
+  } else {
+    stats.commits++;
+    stats.rows += pending_count;
+  }
+  log_debug("Committed %d rows: %s", pending_count, ok ? "ok" : "failed");
+
+  // Answer each waiting connection once; its rows are contiguous.
+  // Rows from datagrams have no connection and get no answer.
+  int count = pending_count;
+  pending_count = 0;
+  pending_deadline_ms = 0;
+  datagram_arena_used = 0;
+  for (int i = 0; i < count; i++) {
+    struct connection *conn = pending[i].conn;
+    if (!conn || (i + 1 < count && pending[i + 1].conn == conn)) {
+      continue;
+    }
+    char body[COLLECTOR_MAX_RESPONSE_SIZE];
+    if (!ok) {
+      queue_error(conn, 500, "Failed to save data.");
+    } else if (conn->is_batch) {
+      snprintf(body, sizeof(body), "{\"success\":true,\"inserted\":%d,\"rejected\":%d}", conn->inserted, conn->rejected);
+      queue_response(conn, 201, body);
+      stats.rejected += conn->rejected;
+    } else {
+      snprintf(body, sizeof(body), "{\"success\":true,\"id\":%lld}", conn->first_id);
+      queue_response(conn, 201, body);
+    }
+    conn->waiting = 0;
+    consume_request(conn);
+    if (conn->peer_closed) {
+      conn->closing = 1;
+    }
+    // Pipelined requests already in the buffer are handled now
+    process_input(conn);
+  }
+}
+
+// --- Datagrams ---
+
+static int datagram_arena_full() {
+  return sizeof(datagram_arena) - datagram_arena_used < ZUSAGE_WIRE_MAX_DATAGRAM;
+}
+
+// Reads until the socket is empty or the arena is full. A full arena is not
+// flushed from here: flushing answers and may close connections that still
+// have entries in the current epoll batch. The flush after the batch empties
+// it, and the socket, being level-triggered, is read again on the next wait.
+static void read_datagrams(int udp_fd) {
+  for (;;) {
+    if (datagram_arena_full()) {
+      return;
+    }
+    unsigned char *buf = datagram_arena + datagram_arena_used;
+    ssize_t n = recv(udp_fd, buf, ZUSAGE_WIRE_MAX_DATAGRAM, MSG_TRUNC);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    stats.datagrams++;
+
+    struct usage_event ev;
+    memset(&ev, 0, sizeof(ev));
+    int lens[ZUSAGE_WIRE_FIELD_COUNT];
+    const char *fields[ZUSAGE_WIRE_FIELD_COUNT];
+    int valid = n <= ZUSAGE_WIRE_MAX_DATAGRAM && zusage_wire_decode(buf, n, fields, lens);
+    for (int i = 0; valid && i < FIELD_COUNT; i++) {
+      ev.fields[i].ptr = fields[i];
+      ev.fields[i].len = lens[i];
+      if (i != FIELD_USERNAME && lens[i] == 0) {
+        valid = 0;
+      }
+    }
+    if (!valid) {
+      stats.bad_datagrams++;
+      continue;
+    }
+
+    char timestamp[MAX_TIMESTAMP_LENGTH];
+    long long ts;
+    format_timestamp(timestamp, sizeof(timestamp), &ts);
+    if (!add_pending_row(NULL, &ev, ts, timestamp)) {
+      stats.bad_datagrams++;
+      continue;
+    }
+    datagram_arena_used += n;
+    if (pending_deadline_ms == 0) {
+      pending_deadline_ms = now_ms() + COLLECTOR_FLUSH_INTERVAL_MS;
+    }
+  }
+}
+
+static int open_udp_listener(const char *address, int port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    log_msg("socket failed, errno: %d", errno);
+    return -1;
+  }
+  int rcvbuf = COLLECTOR_UDP_RCVBUF;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    log_msg("Failed to bind UDP %s:%d, errno: %d", address, port, errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void close_idle_connections() {
+  long long now = now_ms();
+  struct connection *conn = connections;
+  while (conn) {
+    struct connection *next = conn->next;
+    if (!conn->waiting && conn->out_len == 0 && now - conn->last_active_ms > COLLECTOR_KEEPALIVE_TIMEOUT_MS) {
+      close_connection(conn);
+    }
+    conn = next;
+  }
+}
+
+// --- Main loop ---
+
+static void request_stop(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static int open_listener(const char *address, int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    log_msg("socket failed, errno: %d", errno);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+    log_msg("Invalid listen address: %s", address);
+    close(fd);
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, COLLECTOR_LISTEN_BACKLOG) == -1) {
+    log_msg("Failed to listen on %s:%d, errno: %d", address, port, errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-u port] [-b address] [-d database] [-v]\n"
+          "  -p port      TCP port to listen on (default %d)\n"
+          "  -u port      UDP port for binary datagrams, 0 to disable (default %d)\n"
+          "  -b address   IPv4 address to bind (default 0.0.0.0)\n"
+          "  -d database  SQLite database shared with the server (default %s)\n"
+          "  -v           log every commit\n",
+          prog, USAGE_ANALYTICS_PORT, USAGE_ANALYTICS_UDP_PORT, COLLECTOR_DEFAULT_DATABASE);
+}
+
+int main(int argc, char **argv) {
+  int port = USAGE_ANALYTICS_PORT;
+  int udp_port = USAGE_ANALYTICS_UDP_PORT;
+  const char *address = "0.0.0.0";
+  const char *database = COLLECTOR_DEFAULT_DATABASE;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:u:b:d:vh")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 'u': udp_port = atoi(optarg); break;
+      case 'b': address = optarg; break;
+      case 'd': database = optarg; break;
+      case 'v': verbose = 1; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (!open_database(database)) {
+    return EXIT_FAILURE;
+  }
+  int listen_fd = open_listener(address, port);
+  if (listen_fd < 0) {
+    return EXIT_FAILURE;
+  }
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event lev;
+  memset(&lev, 0, sizeof(lev));
+  lev.events = EPOLLIN;
+  lev.data.ptr = NULL; // the listener
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &lev);
+
+  int udp_fd = -1;
+  if (udp_port > 0) {
+    udp_fd = open_udp_listener(address, udp_port);
+    if (udp_fd < 0) {
+      return EXIT_FAILURE;
+    }
+    lev.data.ptr = &udp_listener_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &lev);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (udp_fd >= 0) {
+    log_msg("Listening on %s:%d (UDP %d)", address, port, udp_port);
+  } else {
+    log_msg("Listening on %s:%d", address, port);
+  }
+  long long last_sweep = now_ms();
+  struct epoll_event events[COLLECTOR_EPOLL_EVENTS];
+
+  while (!stop_requested) {
+    int timeout = 1000;
+    if (pending_count > 0) {
+      long long due = pending_deadline_ms - now_ms();
+      timeout = due > 0 ? (int)due : 0;
+    }
+    int n = epoll_wait(epoll_fd, events, COLLECTOR_EPOLL_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_msg("epoll_wait failed, errno: %d", errno);
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      struct connection *conn = events[i].data.ptr;
+      if (!conn) {
+        accept_connections(listen_fd);
+      } else if (events[i].data.ptr == &udp_listener_tag) {
+        read_datagrams(udp_fd);
+      } else if (events[i].events & EPOLLOUT) {
+        flush_output(conn);
+      } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        handle_readable(conn);
+      }
+    }
+
+    long long now = now_ms();
+    if (pending_count >= COLLECTOR_FLUSH_ROWS || datagram_arena_full() ||
+        (pending_count > 0 && now >= pending_deadline_ms)) {
+      flush_pending();
+    }
+    if (now - last_sweep >= 1000) {
+      close_idle_connections();
+      last_sweep = now;
+    }
+  }
+
+  flush_pending();
+  log_msg("Stopping: %llu connections, %llu requests, %llu datagrams (%llu bad), %llu rows in %llu commits (%llu failed), "
+          "%llu rejected",
+          stats.connections, stats.requests, stats.datagrams, stats.bad_datagrams, stats.rows, stats.commits,
+          stats.failed_commits, stats.rejected);
+  while (connections) {
+    close_connection(connections);
+  }
+  close(listen_fd);
+  if (udp_fd >= 0) {
+    close(udp_fd);
+  }
+  sqlite3_finalize(insert_stmt);
+  sqlite3_finalize(last_id_stmt);
+  sqlite3_close(db);
+  free(pending);
+  return EXIT_SUCCESS;
+}
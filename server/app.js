@@ -1,4 +1,9 @@
 require('dotenv').config(); // Load environment variables from .env file
+// A running ad-hoc query occupies a libuv threadpool thread, so size the pool
+// to leave the default four free for ingestion and the dashboard. This must
+// happen before anything uses the threadpool.
+const QUERY_WORKERS = Number(process.env.QUERY_WORKERS) || 2;
+process.env.UV_THREADPOOL_SIZE = process.env.UV_THREADPOOL_SIZE || String(4 + QUERY_WORKERS);
 const express = require('express');
 const bodyParser = require('body-parser');
 const sqlite3 = require('sqlite3').verbose();
@@ -10,10 +15,27 @@ const OAuth2Strategy = require('passport-oauth2'); // Import OAuth2 strategy
 const session = require('express-session'); // Import express-session
 const https = require('https');
 const http = require('http');
+const dgram = require('dgram');
+const { Worker } = require('worker_threads');
+const crypto = require('crypto');
+const zlib = require('zlib');
+const {
+    usageColumns,
+    partitionMonth,
+    partitionSchema,
+    partitionFileName,
+    partitionFileMonth,
+    quoteLiteral,
+    syncReadConnection
+} = require('./partitions');
+const { createSketch, addToSketch, mergeSketch, estimateSketch, encodeSketch, decodeSketch } = require('./hll');
 
 // Initialize the app and database
 const app = express();
 const httpApp = express(); // Separate Express app for HTTP /usage route
+// The ingest endpoints (/usage, /usage/batch), shared by httpApp and the
+// loopback bench listener
+const ingestRouter = express.Router();
 const dbFilePath = path.join(__dirname, 'usage_data.db');
 const backupFilePath = `${dbFilePath}.bak`;
 const weeklyBackupDir = path.join(__dirname, 'weekly_backups');
@@ -24,6 +46,13 @@ if (!fs.existsSync(weeklyBackupDir)) {
 }
 
 const db = new sqlite3.Database(dbFilePath);
+// The native collector (collector/) may write to the same database; wait for
+// its commits instead of failing with SQLITE_BUSY.
+db.configure('busyTimeout', 5000);
+// Separate read-only connection for dashboard and ad-hoc queries. With the
+// database in WAL mode, long reads here never block ingestion on `db`.
+const readDb = new sqlite3.Database(dbFilePath);
+readDb.run('PRAGMA query_only = ON');
 
 // --- HTTPS Configuration using self-signed certificate ---
 const privateKey = fs.readFileSync(path.join(__dirname, 'zusage1fyreibmcom.key'), 'utf8'); 
@@ -51,14 +80,568 @@ app.use(passport.initialize());
 app.use(passport.session());
 
 app.use(bodyParser.json());
-httpApp.use(bodyParser.json()); // Need body-parser for the httpApp too
+// Batches can be far larger than a single event; give /usage/batch its own parsers
+// (registered first so the default 100kb JSON parser below skips these requests)
+ingestRouter.use('/usage/batch', bodyParser.json({ limit: '5mb' }), bodyParser.text({ type: 'application/x-ndjson', limit: '5mb' }));
+ingestRouter.use(bodyParser.json());
+httpApp.use(ingestRouter);
 
 app.use(express.static(path.join(__dirname, 'public')));
 httpApp.use(express.static(path.join(__dirname, 'public'))); // Serve static files for httpApp as well (though mainly for /usage)
 
 
-// Create or migrate the database schema
-db.serialize(() => {
+// Storage layout. `legacy` keeps every string in the `usage` table. In
+// `normalized` mode the repeated strings live in small dim_* tables and rows
+// in usage_facts hold their integer ids; `usage` becomes a view with the
+// legacy columns, so existing queries keep working. In `partitioned` mode
+// rows are kept in one database file per month (see partitioned storage
+// below), and `usage` is a view over them on the read connections.
+const STORAGE_MODES = ['legacy', 'normalized', 'partitioned'];
+const STORAGE_MODE = STORAGE_MODES.includes(process.env.USAGE_STORAGE_MODE) ? process.env.USAGE_STORAGE_MODE : 'legacy';
+const normalizedStorage = STORAGE_MODE === 'normalized';
+const partitionedStorage = STORAGE_MODE === 'partitioned';
+
+// Dictionary-encoded columns and their position in usageRowParams()
+const dimensionColumns = [
+    { column: 'app_name', param: 0 },
+    { column: 'fqdn', param: 1 },
+    { column: 'os_release', param: 3 },
+    { column: 'cpu_arch', param: 4 },
+    { column: 'app_version', param: 5 },
+    { column: 'username', param: 7 }
+];
+// Per-column map from string to surrogate id. Dimension rows are never
+// deleted, so cached ids stay valid for the life of the process.
+const dimensionCache = new Map(dimensionColumns.map(({ column }) => [column, new Map()]));
+const DIMENSION_LOOKUP_CHUNK = 500;
+
+// Prepared once (after the schema exists) and reused for every insert
+const insertUsageQuery = normalizedStorage ? `
+    INSERT INTO usage_facts (app_name_id, fqdn_id, local_ip, os_release_id, cpu_arch_id, app_version_id, username_id, ts, weight)
+    VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)
+` : `
+    INSERT INTO usage (app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username, ts, weight)
+    VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
+`;
+let insertUsageStmt;
+// Set once the schema is ready; events queued before that wait
+let ingestReady = false;
+
+// Daily rollups behind the chart endpoints, one per charted usage column.
+// They are maintained by triggers, so every writer of `usage` keeps them
+// current in the same transaction as its insert. A row counts `weight`
+// invocations (see aggregated events below).
+const rollups = [
+    { table: 'usage_daily_app', column: 'app_name' },
+    { table: 'usage_daily_os', column: 'os_release' },
+    { table: 'usage_daily_cpu', column: 'cpu_arch' },
+    { table: 'usage_daily_host', column: 'fqdn' }
+];
+
+// Statements for the rollup triggers: add a new row's weight to each rollup,
+// or take a deleted row's weight away. `normalized` rows hold dimension ids
+// and ts instead of the strings and timestamp.
+function rollupTriggerBodies(normalized) {
+    const dayOf = (row) => normalized ? `DATE(${row}.ts / 1000, 'unixepoch')` : `DATE(${row}.timestamp)`;
+    const valueOf = (row, column) => normalized
+        ? `(SELECT value FROM dim_${column} WHERE id = ${row}.${column}_id)`
+        : `${row}.${column}`;
+
+    const onInsert = rollups.map(({ table, column }) => `
+            INSERT INTO ${table} (day, ${column}, usage_count)
+            VALUES (${dayOf('NEW')}, ${valueOf('NEW', column)}, NEW.weight)
+            ON CONFLICT (day, ${column}) DO UPDATE SET usage_count = usage_count + excluded.usage_count;`).join('');
+    const onDelete = rollups.map(({ table, column }) => `
+            UPDATE ${table} SET usage_count = usage_count - OLD.weight
+            WHERE day = ${dayOf('OLD')} AND ${column} = ${valueOf('OLD', column)};`).join('');
+    return { onInsert, onDelete };
+}
+
+function initRollups() {
+    db.run(`
+        CREATE TABLE IF NOT EXISTS schema_meta (
+            key TEXT PRIMARY KEY,
+            value TEXT NOT NULL
+        )
+    `);
+    for (const { table, column } of rollups) {
+        db.run(`
+            CREATE TABLE IF NOT EXISTS ${table} (
+                day TEXT NOT NULL,
+                ${column} TEXT NOT NULL,
+                usage_count INTEGER NOT NULL,
+                PRIMARY KEY (day, ${column})
+            ) WITHOUT ROWID
+        `);
+    }
+
+    // In normalized storage the triggers sit on usage_facts and resolve the
+    // grouped strings through the dimension tables. Partitions get their own
+    // triggers when they are attached (attachPartition()).
+    const triggerTable = normalizedStorage ? 'usage_facts' : 'usage';
+    const { onInsert, onDelete } = rollupTriggerBodies(normalizedStorage);
+
+    // One-time backfill from existing rows. Runs in the startup queue, ahead of
+    // any ingestion, and in the same transaction that creates the triggers.
+    // The triggers are recreated on every start so that databases from before
+    // weighted rows pick up the current definition.
+    db.run('BEGIN IMMEDIATE');
+    db.run(`DROP TRIGGER IF EXISTS ${triggerTable}_rollup_insert`);
+    db.run(`DROP TRIGGER IF EXISTS ${triggerTable}_rollup_delete`);
+    db.run(`CREATE TRIGGER ${triggerTable}_rollup_insert AFTER INSERT ON ${triggerTable} BEGIN${onInsert}
+        END`);
+    db.run(`CREATE TRIGGER ${triggerTable}_rollup_delete AFTER DELETE ON ${triggerTable} BEGIN${onDelete}
+        END`);
+    for (const { table, column } of rollups) {
+        db.run(`
+            INSERT INTO ${table} (day, ${column}, usage_count)
+            SELECT DATE(timestamp), ${column}, SUM(weight)
+            FROM usage
+            WHERE NOT EXISTS (SELECT 1 FROM schema_meta WHERE key = 'rollups_backfilled')
+            GROUP BY 1, 2
+        `);
+    }
+    db.run(`INSERT OR IGNORE INTO schema_meta (key, value) VALUES ('rollups_backfilled', DATETIME('now'))`);
+    db.run('COMMIT', (err) => {
+        if (err) {
+            console.error('Error initializing rollup tables:', err);
+            return db.run('ROLLBACK');
+        }
+        console.log('Rollup tables initialized/verified.');
+    });
+}
+
+// --- Distinct users and hosts ---
+// HyperLogLog sketches (hll.js) of the usernames and FQDNs seen per app and
+// day, kept in usage_daily_distinct next to the rollups. /api/distinct
+// merges them into approximate distinct counts for any range of days
+// without reading `usage`. The rollup triggers are plain SQL and cannot
+// build sketches, so a background pass folds new rows in by id, from every
+// writer of `usage`, within DISTINCT_POLL_MS of their commit. schema_meta's
+// distinct_through holds the last id folded in. Ids become visible in
+// order, and adding a row to a sketch twice leaves it as it was, so a pass
+// that fails is simply repeated.
+const DISTINCT_CHUNK_ROWS = 5000;
+const DISTINCT_PAUSE_MS = 20;
+const DISTINCT_POLL_MS = 1000;
+const DISTINCT_DEFAULT_DAYS = 30;
+
+let distinctThroughId = null;
+const distinctMetrics = { rowsFolded: 0, sketchesWritten: 0 };
+
+function initDistinctSketches() {
+    db.run(`
+        CREATE TABLE IF NOT EXISTS usage_daily_distinct (
+            day TEXT NOT NULL,
+            app_name TEXT NOT NULL,
+            users BLOB NOT NULL,
+            hosts BLOB NOT NULL,
+            PRIMARY KEY (day, app_name)
+        )
+    `);
+}
+
+// Fold the next DISTINCT_CHUNK_ROWS rows into their sketches in one
+// transaction, then schedule the next pass
+function updateDistinctSketches() {
+    if (shuttingDown) {
+        return;
+    }
+    const next = (delay) => setTimeout(updateDistinctSketches, delay);
+    if (tsMigrationPending) {
+        return next(DISTINCT_POLL_MS);
+    }
+    if (distinctThroughId === null) {
+        return readDb.get(`SELECT CAST(value AS INTEGER) AS id FROM schema_meta WHERE key = 'distinct_through'`, (err, row) => {
+            if (err) {
+                console.error('Error reading distinct sketch state, will retry:', err);
+                return next(DISTINCT_POLL_MS);
+            }
+            distinctThroughId = row ? row.id : 0;
+            updateDistinctSketches();
+        });
+    }
+    readDb.all(`
+        SELECT id, app_name, username, fqdn, COALESCE(ts, ${tsFromTimestamp('timestamp')}) AS ts
+        FROM usage WHERE id > ? ORDER BY id LIMIT ?
+    `, [distinctThroughId, DISTINCT_CHUNK_ROWS], (err, rows) => {
+        if (err) {
+            console.error('Error reading rows for distinct sketches, will retry:', err);
+            return next(DISTINCT_POLL_MS);
+        }
+        if (rows.length === 0) {
+            return next(DISTINCT_POLL_MS);
+        }
+        const lastId = rows[rows.length - 1].id;
+        const groups = new Map(); // `${day}\0${app_name}` -> { day, app_name, users, hosts }
+        for (const row of rows) {
+            const day = new Date(row.ts).toISOString().slice(0, 10);
+            const key = `${day}\0${row.app_name}`;
+            let group = groups.get(key);
+            if (!group) {
+                group = { day, app_name: row.app_name, users: new Set(), hosts: new Set() };
+                groups.set(key, group);
+            }
+            // Events without a username count for hosts only
+            if (row.username) {
+                group.users.add(row.username);
+            }
+            group.hosts.add(row.fqdn);
+        }
+        const days = [...groups.values()].map(group => group.day).sort();
+
+        withIngestPaused((release) => {
+            const finish = (err) => {
+                if (err) {
+                    console.error('Error updating distinct sketches, will retry:', err);
+                    return db.run('ROLLBACK', () => {
+                        release();
+                        next(DISTINCT_POLL_MS);
+                    });
+                }
+                distinctThroughId = lastId;
+                distinctMetrics.rowsFolded += rows.length;
+                ingestGeneration++;
+                release();
+                next(rows.length === DISTINCT_CHUNK_ROWS ? DISTINCT_PAUSE_MS : DISTINCT_POLL_MS);
+            };
+            db.run('BEGIN', (err) => {
+                if (err) {
+                    return finish(err);
+                }
+                db.all(`
+                    SELECT day, app_name, users, hosts FROM usage_daily_distinct WHERE day BETWEEN ? AND ?
+                `, [days[0], days[days.length - 1]], (err, stored) => {
+                    if (err) {
+                        return finish(err);
+                    }
+                    const storedSketches = new Map(stored.map(row => [`${row.day}\0${row.app_name}`, row]));
+                    const writes = [];
+                    for (const [key, group] of groups) {
+                        const row = storedSketches.get(key);
+                        const users = row ? decodeSketch(row.users) : createSketch();
+                        const hosts = row ? decodeSketch(row.hosts) : createSketch();
+                        let changed = !row;
+                        for (const username of group.users) {
+                            changed = addToSketch(users, username) || changed;
+                        }
+                        for (const fqdn of group.hosts) {
+                            changed = addToSketch(hosts, fqdn) || changed;
+                        }
+                        if (changed) {
+                            writes.push([group.day, group.app_name, encodeSketch(users), encodeSketch(hosts)]);
+                        }
+                    }
+                    let pending = writes.length + 1;
+                    let writeError = null;
+                    const written = (err) => {
+                        writeError = writeError || err;
+                        if (--pending > 0) {
+                            return;
+                        }
+                        if (writeError) {
+                            return finish(writeError);
+                        }
+                        distinctMetrics.sketchesWritten += writes.length;
+                        db.run('COMMIT', finish);
+                    };
+                    for (const params of writes) {
+                        db.run(`
+                            INSERT INTO usage_daily_distinct (day, app_name, users, hosts) VALUES (?, ?, ?, ?)
+                            ON CONFLICT (day, app_name) DO UPDATE SET users = excluded.users, hosts = excluded.hosts
+                        `, params, written);
+                    }
+                    db.run(`
+                        INSERT INTO schema_meta (key, value) VALUES ('distinct_through', ?)
+                        ON CONFLICT (key) DO UPDATE SET value = excluded.value
+                    `, [String(lastId)], written);
+                });
+            });
+        });
+    });
+}
+
+// --- Schema v2 migration ---
+// v2 adds `ts`, the event time as integer epoch milliseconds, plus indexes
+// on it so day and range queries no longer need DATE(timestamp) scans.
+// Existing rows are converted in small chunks in the background so that
+// ingestion keeps running; until that finishes, day queries also match
+// rows whose ts is still NULL.
+const SCHEMA_VERSION = 2;
+const TS_MIGRATION_CHUNK_ROWS = 5000;
+const TS_MIGRATION_PAUSE_MS = 20;
+let tsMigrationPending = true;
+
+// Adds the column to databases created before v2 (no-op error otherwise)
+function addTsColumn() {
+    db.run('ALTER TABLE usage ADD COLUMN ts INTEGER', (err) => {
+        if (err && !/duplicate column/i.test(err.message)) {
+            console.error('Error adding ts column:', err);
+        }
+    });
+}
+
+function migrateSchemaV2() {
+    addTsColumn();
+    db.run('CREATE INDEX IF NOT EXISTS idx_usage_ts ON usage (ts)');
+    db.run('CREATE INDEX IF NOT EXISTS idx_usage_app_ts ON usage (app_name, ts)');
+    db.run('CREATE INDEX IF NOT EXISTS idx_usage_fqdn_ts ON usage (fqdn, ts)');
+    db.get('PRAGMA user_version', (err, row) => {
+        if (!err && row && row.user_version >= SCHEMA_VERSION) {
+            tsMigrationPending = false;
+            return;
+        }
+        console.log('Migrating usage timestamps to schema v2 in the background...');
+        migrateTimestampsChunk();
+    });
+}
+
+function migrateTimestampsChunk() {
+    db.run(`
+        UPDATE usage
+        SET ts = CAST(ROUND((julianday(timestamp) - 2440587.5) * 86400000) AS INTEGER)
+        WHERE id IN (SELECT id FROM usage WHERE ts IS NULL LIMIT ?)
+    `, [TS_MIGRATION_CHUNK_ROWS], function (err) {
+        if (err) {
+            console.error('Error migrating usage timestamps, will retry:', err);
+            return setTimeout(migrateTimestampsChunk, 1000);
+        }
+        if (this.changes > 0) {
+            return setTimeout(migrateTimestampsChunk, TS_MIGRATION_PAUSE_MS);
+        }
+        db.run(`PRAGMA user_version = ${SCHEMA_VERSION}`, () => {
+            tsMigrationPending = false;
+            console.log('Schema v2 migration complete.');
+        });
+    });
+}
+
+// --- Weighted rows ---
+// `weight` is the number of invocations a row stands for: 1 for a plain
+// event, the count for an aggregated one. Adding a column with a constant
+// default does not rewrite existing rows.
+function addWeightColumn(table) {
+    db.run(`ALTER TABLE ${table} ADD COLUMN weight INTEGER NOT NULL DEFAULT 1`, (err) => {
+        if (err && !/duplicate column/i.test(err.message)) {
+            console.error(`Error adding weight column to ${table}:`, err);
+        }
+    });
+}
+
+// --- Normalized storage ---
+const tsFromTimestamp = (column) => `CAST(ROUND((julianday(${column}) - 2440587.5) * 86400000) AS INTEGER)`;
+
+function createNormalizedTables() {
+    for (const { column } of dimensionColumns) {
+        db.run(`
+            CREATE TABLE IF NOT EXISTS dim_${column} (
+                id INTEGER PRIMARY KEY,
+                value TEXT NOT NULL UNIQUE
+            )
+        `);
+    }
+    db.run(`
+        CREATE TABLE IF NOT EXISTS usage_facts (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            app_name_id INTEGER NOT NULL,
+            fqdn_id INTEGER NOT NULL,
+            local_ip TEXT NOT NULL,
+            os_release_id INTEGER NOT NULL,
+            cpu_arch_id INTEGER NOT NULL,
+            app_version_id INTEGER NOT NULL,
+            username_id INTEGER NOT NULL,
+            ts INTEGER NOT NULL,
+            weight INTEGER NOT NULL DEFAULT 1
+        )
+    `);
+    addWeightColumn('usage_facts');
+    db.run('CREATE INDEX IF NOT EXISTS idx_usage_facts_ts ON usage_facts (ts)');
+    db.run('CREATE INDEX IF NOT EXISTS idx_usage_facts_app_ts ON usage_facts (app_name_id, ts)');
+    db.run('CREATE INDEX IF NOT EXISTS idx_usage_facts_fqdn_ts ON usage_facts (fqdn_id, ts)');
+}
+
+// `usage` as a view with the legacy columns. timestamp is derived from ts
+// (millisecond precision round-trips exactly). Inserts and deletes through
+// the view are redirected to usage_facts, so other writers keep working.
+// Returns the statements that (re)create the view and its triggers.
+function usageViewStatements() {
+    const joins = dimensionColumns.map(({ column }) =>
+        `JOIN dim_${column} ON dim_${column}.id = f.${column}_id`).join('\n            ');
+    const addValues = dimensionColumns.map(({ column }) => `
+            INSERT OR IGNORE INTO dim_${column} (value) VALUES (NEW.${column});`).join('');
+    const idOf = (column) => `(SELECT id FROM dim_${column} WHERE value = NEW.${column})`;
+    // Recreated on every start so its columns follow usage_facts; dropping
+    // the view also drops its INSTEAD OF triggers.
+    return [
+        'DROP VIEW IF EXISTS usage',
+        `
+        CREATE VIEW usage AS
+        SELECT f.id AS id,
+               dim_app_name.value AS app_name,
+               dim_fqdn.value AS fqdn,
+               f.local_ip AS local_ip,
+               dim_os_release.value AS os_release,
+               dim_cpu_arch.value AS cpu_arch,
+               dim_app_version.value AS app_version,
+               strftime('%Y-%m-%dT%H:%M:%fZ', f.ts / 1000.0, 'unixepoch') AS timestamp,
+               dim_username.value AS username,
+               f.ts AS ts,
+               f.weight AS weight
+        FROM usage_facts f
+            ${joins}
+        `,
+        `CREATE TRIGGER usage_view_insert INSTEAD OF INSERT ON usage BEGIN${addValues}
+            INSERT INTO usage_facts (app_name_id, fqdn_id, local_ip, os_release_id, cpu_arch_id, app_version_id, username_id, ts, weight)
+            VALUES (${idOf('app_name')}, ${idOf('fqdn')}, NEW.local_ip, ${idOf('os_release')}, ${idOf('cpu_arch')},
+                    ${idOf('app_version')}, ${idOf('username')}, COALESCE(NEW.ts, ${tsFromTimestamp('NEW.timestamp')}),
+                    COALESCE(NEW.weight, 1));
+        END`,
+        `CREATE TRIGGER usage_view_delete INSTEAD OF DELETE ON usage BEGIN
+            DELETE FROM usage_facts WHERE id = OLD.id;
+        END`
+    ];
+}
+
+function createUsageView() {
+    for (const sql of usageViewStatements()) {
+        db.run(sql);
+    }
+}
+
+// One-time conversion of a legacy `usage` table. Rows keep their ids, and
+// rows not yet migrated to v2 get ts from their timestamp. Dropping the table
+// also drops its indexes and rollup triggers; the rollup tables themselves
+// are already correct and are kept. VACUUM then returns the freed pages.
+function convertToNormalizedStorage() {
+    console.log('Converting usage table to normalized storage...');
+    const joins = dimensionColumns.map(({ column }) =>
+        `JOIN dim_${column} ON dim_${column}.value = u.${column}`).join('\n            ');
+
+    addTsColumn();
+    addWeightColumn('usage');
+    // One script, so that a failed step stops it before the table is dropped
+    const statements = [
+        'BEGIN IMMEDIATE',
+        ...dimensionColumns.map(({ column }) =>
+            `INSERT OR IGNORE INTO dim_${column} (value) SELECT DISTINCT ${column} FROM usage`),
+        `
+        INSERT INTO usage_facts (id, app_name_id, fqdn_id, local_ip, os_release_id, cpu_arch_id, app_version_id, username_id, ts, weight)
+        SELECT u.id, dim_app_name.id, dim_fqdn.id, u.local_ip, dim_os_release.id, dim_cpu_arch.id,
+               dim_app_version.id, dim_username.id, COALESCE(u.ts, ${tsFromTimestamp('u.timestamp')}), u.weight
+        FROM usage u
+            ${joins}
+        `,
+        'DROP TABLE usage',
+        ...usageViewStatements(),
+        `PRAGMA user_version = ${SCHEMA_VERSION}`,
+        'COMMIT'
+    ];
+    db.exec(statements.join(';\n'), (err) => {
+        if (err) {
+            console.error('Error converting to normalized storage, usage table kept:', err);
+            db.run('ROLLBACK', () => process.exit(1));
+            return;
+        }
+        console.log('Converted usage table to normalized storage.');
+    });
+    db.run('VACUUM', (err) => {
+        if (err) {
+            console.error('Error compacting database after conversion:', err);
+        }
+    });
+}
+
+// Fill the string-to-id cache so steady-state inserts need no lookups
+function loadDimensionCache() {
+    for (const { column } of dimensionColumns) {
+        const cache = dimensionCache.get(column);
+        db.each(`SELECT id, value FROM dim_${column}`, (err, row) => {
+            if (!err) {
+                cache.set(row.value, row.id);
+            }
+        });
+    }
+}
+
+// Make sure every dimension value in a group has an id, adding new values
+// to the dim_* tables. Runs before the group's transaction, so a failed
+// group may leave unused dimension rows behind; they are harmless.
+function resolveDimensions(entries, done) {
+    const lookups = [];
+    for (const { column, param } of dimensionColumns) {
+        const cache = dimensionCache.get(column);
+        const missing = new Set();
+        for (const entry of entries) {
+            for (const params of entry.rows) {
+                if (!cache.has(params[param])) {
+                    missing.add(params[param]);
+                }
+            }
+        }
+        const values = [...missing];
+        for (let i = 0; i < values.length; i += DIMENSION_LOOKUP_CHUNK) {
+            lookups.push({ column, values: values.slice(i, i + DIMENSION_LOOKUP_CHUNK) });
+        }
+    }
+    if (lookups.length === 0) {
+        return done(null);
+    }
+
+    let pending = lookups.length;
+    let lookupError = null;
+    const finish = (err) => {
+        lookupError = lookupError || err;
+        if (--pending === 0) {
+            done(lookupError);
+        }
+    };
+    for (const { column, values } of lookups) {
+        const cache = dimensionCache.get(column);
+        db.run(`INSERT OR IGNORE INTO dim_${column} (value) VALUES ${values.map(() => '(?)').join(', ')}`, values, (err) => {
+            if (err) {
+                return finish(err);
+            }
+            db.all(`SELECT id, value FROM dim_${column} WHERE value IN (${values.map(() => '?').join(', ')})`, values, (err, rows) => {
+                if (!err) {
+                    for (const row of rows) {
+                        cache.set(row.value, row.id);
+                    }
+                }
+                finish(err);
+            });
+        });
+    }
+}
+
+// Map usageRowParams() output to the usage_facts insert's parameters
+function factRowParams(params) {
+    const id = (column, index) => dimensionCache.get(column).get(params[index]);
+    return [
+        id('app_name', 0),
+        id('fqdn', 1),
+        params[2],
+        id('os_release', 3),
+        id('cpu_arch', 4),
+        id('app_version', 5),
+        id('username', 7),
+        params[8],
+        params[9]
+    ];
+}
+
+// Epoch-millisecond bounds of a UTC day given as YYYY-MM-DD, or null
+function dayRange(day) {
+    if (!/^\d{4}-\d{2}-\d{2}$/.test(day)) {
+        return null;
+    }
+    const start = Date.parse(`${day}T00:00:00.000Z`);
+    if (isNaN(start)) {
+        return null;
+    }
+    return [start, start + 24 * 60 * 60 * 1000];
+}
+
+function initLegacyStorage() {
     db.run(`
         CREATE TABLE IF NOT EXISTS usage (
             id INTEGER PRIMARY KEY AUTOINCREMENT,
@@ -69,10 +652,665 @@ db.serialize(() => {
             cpu_arch TEXT NOT NULL,
             app_version TEXT NOT NULL,
             timestamp TEXT NOT NULL,
-            username TEXT NOT NULL
+            username TEXT NOT NULL,
+            ts INTEGER,
+            weight INTEGER NOT NULL DEFAULT 1
         )
     `);
-    console.log('Database schema initialized/verified.');
+    migrateSchemaV2();
+    addWeightColumn('usage');
+}
+
+function initNormalizedStorage(usageType) {
+    createNormalizedTables();
+    if (usageType === 'table') {
+        convertToNormalizedStorage();
+    } else {
+        createUsageView();
+        db.run(`PRAGMA user_version = ${SCHEMA_VERSION}`);
+    }
+    // usage_facts.ts is always set
+    tsMigrationPending = false;
+    loadDimensionCache();
+}
+
+// --- Partitioned storage ---
+// Each month (UTC) of rows lives in its own file in PARTITION_DIR,
+// usage_YYYY_MM.db, attached to every connection as p_YYYY_MM. The main
+// database keeps the rollups and metadata. The server writes each row
+// straight into its month's partition. Other writers (the native
+// collector, older servers) still insert into main.usage, which serves as
+// an inbox; the rows there are moved to their partitions in the background
+// and are visible through the view meanwhile. An existing legacy database
+// is converted the same way.
+//
+// Rows keep one id sequence across all partitions: ids come from main's
+// sqlite_sequence entry for `usage`, which main.usage's AUTOINCREMENT
+// shares, so inbox rows keep their ids when moved.
+//
+// SQLite attaches at most 10 databases per connection, so only a window of
+// the newest months has partitions: PARTITION_WINDOW_MONTHS, or with
+// USAGE_RETENTION_MONTHS=N below that, the N months kept plus the one that
+// waits to expire. The other two slots are for the month that leaves the
+// window at a rollover and one being folded. A month that leaves the window
+// and is still kept is folded back into main.usage in chunks, where its rows
+// stay visible with the rest of the history through main's ts index.
+//
+// Without USAGE_RETENTION_MONTHS every row is kept. With it, the current
+// month and the N-1 before it are kept, and an older month is expired once
+// the weekly archive (archiveClosedWeeks()) has exported all of it: its
+// partition file is deleted, or its rows are deleted from main.usage if it
+// was folded, and its days go from the rollups and distinct sketches, so
+// the charts keep matching the stored rows. Converting a database whose
+// rows go back past retention is refused rather than expiring them
+// unarchived.
+//
+// A month whose partition cannot be attached has its rows written to the
+// inbox instead, where they stay visible, and the rest of the group is
+// unaffected.
+const PARTITION_WINDOW_MONTHS = 8;
+const PARTITION_DIR = process.env.USAGE_PARTITION_DIR || path.join(__dirname, 'partitions');
+const PARTITION_RETENTION_MONTHS = process.env.USAGE_RETENTION_MONTHS ? Number(process.env.USAGE_RETENTION_MONTHS) : null;
+const PARTITION_MOVE_CHUNK_ROWS = 5000;
+const PARTITION_MOVE_PAUSE_MS = 20;
+const PARTITION_INBOX_POLL_MS = 5000;
+const PARTITION_MAINTENANCE_MS = 60 * 60 * 1000;
+
+const partitions = new Map(); // month -> { month, schema, file, insertStmt, leaving }
+let inboxInsertStmt; // main.usage, for rows whose partition is not attached
+const inboxStuckMonths = new Set(); // months the inbox mover could not attach
+let partitionMaintenanceRunning = false;
+
+const partitionMetrics = {
+    unattached: 0,
+    attachFailures: 0,
+    inboxRows: 0,
+    rowsMoved: 0,
+    rowsFolded: 0,
+    rowsExpired: 0,
+    expired: 0
+};
+
+// [{ schema, file }] of the attached partitions, newest first
+function partitionList() {
+    return [...partitions.values()]
+        .sort((a, b) => (a.month < b.month ? 1 : a.month > b.month ? -1 : 0))
+        .map(({ schema, file }) => ({ schema, file }));
+}
+
+// The month `count` months before the current one
+function monthsBack(count) {
+    const now = new Date();
+    return partitionMonth(Date.UTC(now.getUTCFullYear(), now.getUTCMonth() - count, 1));
+}
+
+// First millisecond of a YYYY_MM month
+function monthStart(month) {
+    const [year, monthNumber] = month.split('_').map(Number);
+    return Date.UTC(year, monthNumber - 1, 1);
+}
+
+function windowMonths() {
+    return PARTITION_RETENTION_MONTHS === null ? PARTITION_WINDOW_MONTHS
+        : Math.min(PARTITION_RETENTION_MONTHS + 1, PARTITION_WINDOW_MONTHS);
+}
+
+// Oldest month with a partition; older rows live in main.usage
+function windowFloor() {
+    return monthsBack(windowMonths() - 1);
+}
+
+// Oldest month kept under USAGE_RETENTION_MONTHS, null when all are kept
+function retentionFloor() {
+    return PARTITION_RETENTION_MONTHS === null ? null : monthsBack(PARTITION_RETENTION_MONTHS - 1);
+}
+
+// Months before the returned one may be expired: they are past retention
+// and the archive has exported all of them. null while none may be.
+function expiryFloor(archivedThrough) {
+    const floor = retentionFloor();
+    if (floor === null || archivedThrough === null) {
+        return null;
+    }
+    const archived = partitionMonth(archivedThrough);
+    return archived < floor ? archived : floor;
+}
+
+function partitionFiles() {
+    return fs.readdirSync(PARTITION_DIR).map(partitionFileMonth).filter(month => month !== null);
+}
+
+function removePartitionFiles(file) {
+    for (const suffix of ['', '-wal', '-shm']) {
+        fs.rm(file + suffix, { force: true }, () => {});
+    }
+}
+
+// Attach (creating if needed) a month's partition to the write connection,
+// with the rollup triggers and the insert statement for it
+function attachPartition(month, callback) {
+    const schema = partitionSchema(month);
+    const file = path.join(PARTITION_DIR, partitionFileName(month));
+    const { onInsert, onDelete } = rollupTriggerBodies(false);
+    // Temp triggers may watch attached tables and write to main's rollups
+    db.exec(`
+        ATTACH DATABASE ${quoteLiteral(file)} AS ${schema};
+        PRAGMA ${schema}.journal_mode = WAL;
+        PRAGMA ${schema}.synchronous = NORMAL;
+        CREATE TABLE IF NOT EXISTS ${schema}.usage (
+            id INTEGER PRIMARY KEY,
+            app_name TEXT NOT NULL,
+            fqdn TEXT NOT NULL,
+            local_ip TEXT NOT NULL,
+            os_release TEXT NOT NULL,
+            cpu_arch TEXT NOT NULL,
+            app_version TEXT NOT NULL,
+            timestamp TEXT NOT NULL,
+            username TEXT NOT NULL,
+            ts INTEGER NOT NULL,
+            weight INTEGER NOT NULL DEFAULT 1
+        );
+        CREATE INDEX IF NOT EXISTS ${schema}.idx_usage_ts ON usage (ts);
+        CREATE INDEX IF NOT EXISTS ${schema}.idx_usage_app_ts ON usage (app_name, ts);
+        CREATE INDEX IF NOT EXISTS ${schema}.idx_usage_fqdn_ts ON usage (fqdn, ts);
+        DROP TRIGGER IF EXISTS temp.${schema}_rollup_insert;
+        DROP TRIGGER IF EXISTS temp.${schema}_rollup_delete;
+        CREATE TEMP TRIGGER ${schema}_rollup_insert AFTER INSERT ON ${schema}.usage BEGIN${onInsert}
+        END;
+        CREATE TEMP TRIGGER ${schema}_rollup_delete AFTER DELETE ON ${schema}.usage BEGIN${onDelete}
+        END;
+        UPDATE main.sqlite_sequence SET seq = MAX(seq, COALESCE((SELECT MAX(id) FROM ${schema}.usage), 0))
+        WHERE name = 'usage';
+    `, (err) => {
+        if (err) {
+            // Undo the attach if that much succeeded
+            return db.run(`DETACH DATABASE ${schema}`, () => callback(err));
+        }
+        const insertStmt = db.prepare(`
+            INSERT INTO ${schema}.usage (${usageColumns.join(', ')})
+            VALUES (${usageColumns.map(() => '?').join(', ')})
+        `, (err) => {
+            if (err) {
+                return callback(err);
+            }
+            partitions.set(month, { month, schema, file, insertStmt, leaving: month < windowFloor() });
+            callback(null);
+        });
+    });
+}
+
+// Detach a month's partition from every connection, then delete its files.
+// Runs between ingest groups.
+function detachPartition(month, callback) {
+    const { schema, file, insertStmt } = partitions.get(month);
+    insertStmt.finalize(() => {
+        db.exec(`
+            DROP TRIGGER IF EXISTS temp.${schema}_rollup_insert;
+            DROP TRIGGER IF EXISTS temp.${schema}_rollup_delete;
+            DETACH DATABASE ${schema};
+        `, (err) => {
+            if (err) {
+                return callback(err);
+            }
+            partitions.delete(month);
+            ingestGeneration++;
+            // The files go once the read connection has let go of them
+            syncReadPartitions(() => removePartitionFiles(file));
+            callback(null);
+        });
+    });
+}
+
+// Attach the partitions of `months` that are not attached yet, and pass on
+// the months that could not be attached. Months before the window are left
+// out; their rows go to main.usage. A failed month does not stop the others.
+// Runs between ingest groups (see withIngestPaused()).
+function ensurePartitions(months, done) {
+    const floor = windowFloor();
+    const missing = [...new Set(months)].filter(month => month >= floor && !partitions.has(month)).sort();
+    const failed = new Set();
+    if (missing.length === 0) {
+        return done(failed);
+    }
+    const attachNext = (i) => {
+        if (i === missing.length) {
+            syncReadPartitions();
+            // A new month may have pushed the oldest one out of the window
+            setImmediate(maintainPartitions);
+            return done(failed);
+        }
+        attachPartition(missing[i], (err) => {
+            if (err) {
+                partitionMetrics.attachFailures++;
+                failed.add(missing[i]);
+                console.error(`Error attaching partition ${missing[i]}, its rows stay in the inbox:`, err.message);
+            } else {
+                console.log(`Partition ${missing[i]} attached.`);
+            }
+            attachNext(i + 1);
+        });
+    };
+    attachNext(0);
+}
+
+// Take the months that have left the window out of the partitions, oldest
+// first, then expire what retention and the archive allow. Runs at startup,
+// after a new month is attached and every PARTITION_MAINTENANCE_MS.
+function maintainPartitions(done) {
+    done = done || (() => {});
+    if (partitionMaintenanceRunning || shuttingDown) {
+        return done();
+    }
+    partitionMaintenanceRunning = true;
+    const finish = () => {
+        partitionMaintenanceRunning = false;
+        done();
+    };
+    const floor = windowFloor();
+    for (const partition of partitions.values()) {
+        partition.leaving = partition.month < floor;
+    }
+    const retireAll = (months, expiry, next) => {
+        const retireNext = (i) => (i === months.length ? next() : retirePartition(months[i], expiry, () => retireNext(i + 1)));
+        retireNext(0);
+    };
+    // Nothing is expired before the archive has it
+    const archive = PARTITION_RETENTION_MONTHS === null ? (callback) => callback(null) : archiveClosedWeeks;
+    readArchivedThrough((before) => {
+        // The export only sees attached months, so files left from before a
+        // restart are folded first, and may only expire by what was archived
+        // while they were still attached
+        const unattached = partitionFiles().filter(month => month < floor && !partitions.has(month)).sort();
+        retireAll(unattached, expiryFloor(before), () => archive(() => readArchivedThrough((after) => {
+            const expiry = expiryFloor(after);
+            const leaving = [...partitions.keys()].filter(month => month < floor).sort();
+            retireAll(leaving, expiry, () => expireHistory(expiry, finish));
+        })));
+    });
+}
+
+// schema_meta's archived_through, null if unset or unreadable
+function readArchivedThrough(callback) {
+    db.get(`SELECT CAST(value AS INTEGER) AS archived_through FROM schema_meta WHERE key = 'archived_through'`, (err, row) => {
+        if (err) {
+            console.error('Error reading archive state, nothing expires this time:', err);
+        }
+        callback(err || !row ? null : row.archived_through);
+    });
+}
+
+// Expire a month that has left the window if it may be, else fold its rows
+// into main.usage. Either way its partition file goes.
+function retirePartition(month, expiry, done) {
+    if (shuttingDown) {
+        return done();
+    }
+    const file = path.join(PARTITION_DIR, partitionFileName(month));
+    if (expiry !== null && month < expiry) {
+        if (!partitions.has(month)) {
+            removePartitionFiles(file);
+            partitionMetrics.expired++;
+            console.log(`Partition ${month} expired and deleted.`);
+            return done();
+        }
+        return withIngestPaused((release) => detachPartition(month, (err) => {
+            release();
+            if (err) {
+                console.error(`Error detaching expired partition ${month}:`, err);
+            } else {
+                partitionMetrics.expired++;
+                console.log(`Partition ${month} expired and deleted.`);
+            }
+            done();
+        }));
+    }
+    if (partitions.has(month)) {
+        return foldPartition(month, done);
+    }
+    withIngestPaused((release) => attachPartition(month, (err) => {
+        release();
+        if (err) {
+            partitionMetrics.unattached++;
+            console.error(`Partition ${month} not attached, its rows are not visible:`, err.message);
+            return done();
+        }
+        syncReadPartitions();
+        foldPartition(month, done);
+    }));
+}
+
+// Move a leaving partition's rows into main.usage, PARTITION_MOVE_CHUNK_ROWS
+// at a time with their ids, then drop the empty partition. The partition's
+// delete trigger and main.usage's insert trigger leave the rollups as they
+// were, and every transaction leaves each row in exactly one of the two.
+function foldPartition(month, done) {
+    if (shuttingDown) {
+        return done();
+    }
+    withIngestPaused((release) => {
+        const { schema } = partitions.get(month);
+        const failed = (err) => {
+            console.error(`Error folding partition ${month} into the main database, will retry:`, err);
+            release();
+            done();
+        };
+        db.get(`SELECT COUNT(*) AS n FROM (SELECT 1 FROM ${schema}.usage LIMIT ?)`, [PARTITION_MOVE_CHUNK_ROWS], (err, row) => {
+            if (err) {
+                return failed(err);
+            }
+            if (row.n === 0) {
+                return detachPartition(month, (err) => {
+                    if (err) {
+                        return failed(err);
+                    }
+                    release();
+                    console.log(`Partition ${month} folded into the main database.`);
+                    done();
+                });
+            }
+            const columns = usageColumns.join(', ');
+            const chunk = `SELECT id FROM ${schema}.usage ORDER BY id LIMIT ${PARTITION_MOVE_CHUNK_ROWS}`;
+            db.exec(`
+                BEGIN IMMEDIATE;
+                INSERT INTO main.usage (${columns}) SELECT ${columns} FROM ${schema}.usage WHERE id IN (${chunk});
+                DELETE FROM ${schema}.usage WHERE id IN (${chunk});
+                COMMIT;
+            `, (err) => {
+                if (err) {
+                    return db.run('ROLLBACK', () => failed(err));
+                }
+                partitionMetrics.rowsFolded += row.n;
+                ingestGeneration++;
+                release();
+                setTimeout(() => foldPartition(month, done), PARTITION_MOVE_PAUSE_MS);
+            });
+        });
+    });
+}
+
+// Delete the rows of main.usage from before `expiry` in chunks, then the
+// days before it from the rollups and sketches. Rows without a timestamp
+// are never expired.
+function expireHistory(expiry, done) {
+    if (expiry === null || shuttingDown) {
+        return done();
+    }
+    const expiryTs = monthStart(expiry);
+    withIngestPaused((release) => {
+        db.run(`
+            DELETE FROM main.usage WHERE id IN (SELECT id FROM main.usage WHERE ts < ? LIMIT ?)
+        `, [expiryTs, PARTITION_MOVE_CHUNK_ROWS], function (err) {
+            if (err) {
+                release();
+                console.error('Error expiring rows from the main database, will retry:', err);
+                return done();
+            }
+            partitionMetrics.rowsExpired += this.changes;
+            if (this.changes > 0) {
+                ingestGeneration++;
+            }
+            if (this.changes === PARTITION_MOVE_CHUNK_ROWS) {
+                release();
+                return setTimeout(() => expireHistory(expiry, done), PARTITION_MOVE_PAUSE_MS);
+            }
+            const expiryDay = `${expiry.replace('_', '-')}-01`;
+            const dailyTables = [...rollups.map(({ table }) => table), 'usage_daily_distinct'];
+            let pending = dailyTables.length;
+            for (const table of dailyTables) {
+                db.run(`DELETE FROM ${table} WHERE day < ?`, [expiryDay], (err) => {
+                    if (err) {
+                        console.error(`Error expiring daily rows from ${table}:`, err);
+                    }
+                    if (--pending === 0) {
+                        release();
+                        done();
+                    }
+                });
+            }
+        });
+    });
+}
+
+// Bring the read connection and the query workers up to date with the
+// attached partitions. Runs one at a time on readDb; `callback` is called
+// once readDb has the current set.
+let readSyncRunning = false;
+let readSyncAgain = false;
+const readSyncWaiters = [];
+
+function syncReadPartitions(callback) {
+    if (callback) {
+        readSyncWaiters.push(callback);
+    }
+    const list = partitionList();
+    for (const entry of queryWorkers) {
+        if (entry) {
+            entry.worker.postMessage({ type: 'partitions', partitions: list });
+        }
+    }
+    if (readSyncRunning) {
+        readSyncAgain = true;
+        return;
+    }
+    readSyncRunning = true;
+    readSyncAgain = false;
+    const waiters = readSyncWaiters.splice(0);
+    syncReadConnection(readDb, list, (err) => {
+        readSyncRunning = false;
+        if (err) {
+            // A raw stream may still be reading a partition being detached
+            console.error('Error attaching partitions to the read connection, will retry:', err.message);
+            readSyncWaiters.push(...waiters);
+            return setTimeout(() => syncReadPartitions(), 1000);
+        }
+        for (const waiter of waiters) {
+            waiter();
+        }
+        if (readSyncAgain) {
+            syncReadPartitions();
+        }
+    });
+}
+
+// Move up to PARTITION_MOVE_CHUNK_ROWS rows of main.usage from the window's
+// months into their partitions in one transaction, keeping their ids.
+// main.usage's delete trigger and the partitions' insert triggers leave the
+// rollups as they were. Only the rows moved are deleted: rows from before
+// the window are history and stay, as do rows without a ts yet (the schema
+// v2 migration fills it in) and rows of months that could not be attached,
+// which are skipped until the inbox has no other rows left.
+function movePartitionInbox() {
+    if (shuttingDown) {
+        return;
+    }
+    const monthOf = `strftime('%Y_%m', ts / 1000, 'unixepoch')`;
+    withIngestPaused((release) => {
+        const retry = (delay) => {
+            release();
+            setTimeout(movePartitionInbox, delay);
+        };
+        const stuck = [...inboxStuckMonths].map(quoteLiteral).join(', ');
+        db.exec(`
+            DELETE FROM temp.partition_move;
+            INSERT INTO temp.partition_move (id)
+            SELECT id FROM main.usage WHERE ts >= ${monthStart(windowFloor())}${stuck ? ` AND ${monthOf} NOT IN (${stuck})` : ''}
+            ORDER BY ts LIMIT ${PARTITION_MOVE_CHUNK_ROWS};
+        `, (err) => {
+            if (err) {
+                console.error('Error reading the partition inbox, will retry:', err);
+                return retry(PARTITION_INBOX_POLL_MS);
+            }
+            db.all(`
+                SELECT ${monthOf} AS month, COUNT(*) AS row_count
+                FROM main.usage WHERE id IN (SELECT id FROM temp.partition_move)
+                GROUP BY 1
+            `, (err, rows) => {
+                if (err) {
+                    console.error('Error reading the partition inbox, will retry:', err);
+                    return retry(PARTITION_INBOX_POLL_MS);
+                }
+                if (rows.length === 0) {
+                    // Try the skipped months again on the next poll
+                    inboxStuckMonths.clear();
+                    return retry(PARTITION_INBOX_POLL_MS);
+                }
+                const rowCount = rows.reduce((sum, row) => sum + row.row_count, 0);
+
+                ensurePartitions(rows.map(row => row.month), (failed) => {
+                    for (const month of failed) {
+                        inboxStuckMonths.add(month);
+                    }
+                    const moved = rows.filter(row => partitions.has(row.month) && !partitions.get(row.month).leaving);
+                    if (moved.length === 0) {
+                        return retry(PARTITION_MOVE_PAUSE_MS);
+                    }
+                    const columns = usageColumns.join(', ');
+                    const chunk = 'SELECT id FROM temp.partition_move';
+                    const movedMonths = moved.map(row => quoteLiteral(row.month)).join(', ');
+                    const moves = moved.map(({ month }) => `
+                        INSERT INTO ${partitions.get(month).schema}.usage (${columns})
+                        SELECT ${columns} FROM main.usage WHERE id IN (${chunk}) AND ${monthOf} = '${month}';`).join('');
+                    db.exec(`
+                        BEGIN IMMEDIATE;${moves}
+                        DELETE FROM main.usage WHERE id IN (${chunk}) AND ${monthOf} IN (${movedMonths});
+                        COMMIT;
+                    `, (err) => {
+                        if (err) {
+                            console.error('Error moving rows into partitions, will retry:', err);
+                            return db.run('ROLLBACK', () => retry(PARTITION_INBOX_POLL_MS));
+                        }
+                        partitionMetrics.rowsMoved += moved.reduce((sum, row) => sum + row.row_count, 0);
+                        ingestGeneration++;
+                        retry(rowCount === PARTITION_MOVE_CHUNK_ROWS ? PARTITION_MOVE_PAUSE_MS : PARTITION_INBOX_POLL_MS);
+                    });
+                });
+            });
+        });
+    });
+}
+
+function initPartitionedStorage() {
+    // main.usage is the inbox for other writers
+    initLegacyStorage();
+    db.run(`
+        INSERT INTO sqlite_sequence (name, seq)
+        SELECT 'usage', 0 WHERE NOT EXISTS (SELECT 1 FROM sqlite_sequence WHERE name = 'usage')
+    `);
+    db.run('CREATE TEMP TABLE IF NOT EXISTS partition_move (id INTEGER PRIMARY KEY)');
+}
+
+// Converting with retention set would expire the rows from before it, some
+// of which may be in no archive yet: refuse, and say what to do instead.
+function checkConversionRetention(done) {
+    const floor = retentionFloor();
+    if (floor === null || partitionFiles().length > 0) {
+        return done();
+    }
+    db.get(`
+        SELECT COUNT(*) AS n FROM main.usage WHERE COALESCE(ts, ${tsFromTimestamp('timestamp')}) < ?
+    `, [monthStart(floor)], (err, row) => {
+        if (err) {
+            console.error('Error reading database for conversion:', err);
+            process.exit(1);
+        }
+        if (row.n > 0) {
+            console.error(`Converting to partitioned storage would expire ${row.n} rows from before ${floor.replace('_', '-')} ` +
+                `(USAGE_RETENTION_MONTHS=${PARTITION_RETENTION_MONTHS}). Convert without USAGE_RETENTION_MONTHS, which keeps ` +
+                'every row, and set it afterwards; months are then expired only once the weekly archive has exported them.');
+            process.exit(1);
+        }
+        done();
+    });
+}
+
+// Attach the existing partitions of the window, newest first, and start the
+// inbox mover and maintenance, which folds or expires the files of months
+// that left the window while the server was down.
+function openPartitions(done) {
+    fs.mkdirSync(PARTITION_DIR, { recursive: true });
+    checkConversionRetention(() => {
+        const floor = windowFloor();
+        const keep = partitionFiles().filter(month => month >= floor).sort().reverse();
+        const current = partitionMonth(Date.now());
+        if (!keep.includes(current)) {
+            keep.unshift(current);
+        }
+
+        const attachNext = (i) => {
+            if (i < keep.length) {
+                return attachPartition(keep[i], (err) => {
+                    if (err) {
+                        partitionMetrics.unattached++;
+                        console.error(`Partition ${keep[i]} not attached, its rows are not visible:`, err.message);
+                    }
+                    attachNext(i + 1);
+                });
+            }
+            syncReadPartitions();
+            console.log(`Partitioned storage: ${partitions.size} partitions in ${PARTITION_DIR}.`);
+            setInterval(() => maintainPartitions(), PARTITION_MAINTENANCE_MS).unref();
+            inboxInsertStmt = db.prepare(`
+                INSERT INTO main.usage (${usageColumns.join(', ')})
+                VALUES (${usageColumns.map(() => '?').join(', ')})
+            `, () => {
+                done();
+                movePartitionInbox();
+                maintainPartitions();
+            });
+        };
+        attachNext(0);
+    });
+}
+
+// Create or migrate the database schema. What `usage` currently is decides
+// the path, so look it up first and queue the rest behind it.
+db.serialize(() => {
+    db.run('PRAGMA journal_mode = WAL');
+    db.run('PRAGMA synchronous = NORMAL');
+    db.get(`SELECT type FROM sqlite_master WHERE name = 'usage'`, (err, row) => {
+        if (err) {
+            console.error('Error reading database schema:', err);
+            process.exit(1);
+        }
+        const usageType = row ? row.type : null;
+        if (!normalizedStorage && usageType === 'view') {
+            console.error('Database uses normalized storage; start with USAGE_STORAGE_MODE=normalized.');
+            process.exit(1);
+        }
+        if (partitionedStorage && PARTITION_RETENTION_MONTHS !== null &&
+            !(Number.isInteger(PARTITION_RETENTION_MONTHS) && PARTITION_RETENTION_MONTHS >= 1)) {
+            console.error('USAGE_RETENTION_MONTHS must be a whole number of months, 1 or more; leave it unset to keep every row.');
+            process.exit(1);
+        }
+        if (!partitionedStorage && fs.existsSync(PARTITION_DIR) && partitionFiles().length > 0) {
+            console.error(`Database has partitions in ${PARTITION_DIR}; start with USAGE_STORAGE_MODE=partitioned.`);
+            process.exit(1);
+        }
+
+        // Events that arrived during startup are waiting in the queue
+        const startIngest = () => {
+            ingestReady = true;
+            flushIngestQueue();
+            updateDistinctSketches();
+        };
+        db.serialize(() => {
+            if (normalizedStorage) {
+                initNormalizedStorage(usageType);
+            } else if (partitionedStorage) {
+                initPartitionedStorage();
+            } else {
+                initLegacyStorage();
+            }
+            console.log(`Database schema initialized/verified (${STORAGE_MODE} storage).`);
+            initRollups();
+            initDistinctSketches();
+            if (partitionedStorage) {
+                openPartitions(startIngest);
+            } else {
+                insertUsageStmt = db.prepare(insertUsageQuery, startIngest);
+            }
+        });
+    });
 });
 
 // --- OAuth 2.0 Strategy Configuration ---
@@ -160,54 +1398,596 @@ app.use((req, res, next) => {
         const httpsUrl = 'https://' + req.headers.host + req.url;
         res.redirect(httpsUrl); // Redirect to HTTPS for all other routes
     }
-});
+});
+
+
+// --- Query worker pool ---
+// Custom queries run in worker threads (queryWorker.js), each with its own
+// read-only connection, so an expensive query never holds up ingestion on
+// `db` or the dashboard on `readDb`. Each query gets a time limit and a row
+// limit, and is cancelled when the client goes away. Queries wait in
+// queryQueue while every worker is busy.
+const QUERY_TIMEOUT_MS = Number(process.env.QUERY_TIMEOUT_MS) || 30000;
+const QUERY_MAX_ROWS = Number(process.env.QUERY_MAX_ROWS) || 100000;
+const QUERY_CHUNK_ROWS = 500;
+const QUERY_QUEUE_MAX = 32;
+// A worker that does not answer this long after its time limit is replaced
+const QUERY_KILL_GRACE_MS = 5000;
+
+const queryWorkers = []; // { worker, job }
+const queryQueue = [];   // jobs waiting for a worker
+let nextQueryId = 1;
+
+const queryMetrics = {
+    completed: 0,
+    failed: 0,
+    timedOut: 0,
+    cancelled: 0,
+    rejected: 0,
+    totalMs: 0,
+    maxMs: 0
+};
+
+function startQueryWorker(slot) {
+    const worker = new Worker(path.join(__dirname, 'queryWorker.js'), {
+        workerData: { dbFilePath, partitions: partitionedStorage ? partitionList() : null }
+    });
+    const entry = { worker, job: null };
+    queryWorkers[slot] = entry;
+
+    worker.on('message', (msg) => {
+        const job = entry.job;
+        if (!job || job.id !== msg.id) {
+            return;
+        }
+        if (msg.type === 'rows') {
+            job.handlers.onRows(msg.rows, () => worker.postMessage({ type: 'ack', id: job.id }));
+            return;
+        }
+        const err = msg.type === 'error' ? Object.assign(new Error(msg.message), { code: msg.code }) : null;
+        finishQueryJob(entry, err, msg);
+    });
+    worker.on('error', (err) => {
+        console.error('Query worker failed:', err);
+    });
+    worker.on('exit', () => {
+        if (entry.job) {
+            finishQueryJob(entry, Object.assign(new Error('Query worker exited.'), { code: 'worker' }));
+        }
+        if (queryWorkers[slot] === entry && !shuttingDown) {
+            startQueryWorker(slot);
+            dispatchQueries();
+        }
+    });
+}
+
+function finishQueryJob(entry, err, result) {
+    const job = entry.job;
+    entry.job = null;
+    clearTimeout(job.killTimer);
+
+    const elapsedMs = Date.now() - job.startedAt;
+    queryMetrics.totalMs += elapsedMs;
+    queryMetrics.maxMs = Math.max(queryMetrics.maxMs, elapsedMs);
+    if (!err) {
+        queryMetrics.completed++;
+    } else if (err.code === 'timeout') {
+        queryMetrics.timedOut++;
+    } else if (err.code === 'cancelled') {
+        queryMetrics.cancelled++;
+    } else {
+        queryMetrics.failed++;
+    }
+
+    if (!job.cancelled) {
+        if (err) {
+            job.handlers.onError(err);
+        } else {
+            job.handlers.onDone(result);
+        }
+    }
+    dispatchQueries();
+}
+
+function dispatchQueries() {
+    for (const entry of queryWorkers) {
+        if (queryQueue.length === 0) {
+            return;
+        }
+        if (entry && !entry.job) {
+            const job = queryQueue.shift();
+            entry.job = job;
+            job.startedAt = Date.now();
+            job.entry = entry;
+            entry.worker.postMessage({
+                type: 'query',
+                id: job.id,
+                sql: job.sql,
+                maxRows: QUERY_MAX_ROWS,
+                timeoutMs: QUERY_TIMEOUT_MS,
+                chunkRows: QUERY_CHUNK_ROWS
+            });
+            job.killTimer = setTimeout(() => {
+                console.error(`Query worker did not stop query ${job.id} after its time limit, restarting it.`);
+                entry.worker.terminate();
+            }, QUERY_TIMEOUT_MS + QUERY_KILL_GRACE_MS);
+        }
+    }
+}
+
+// Queue `sql` for the pool. handlers: onRows(rows, ack) for each chunk (call
+// ack() to receive the next one), onDone({ rows, truncated }), onError(err).
+// Returns a job whose cancel() stops the query, or null if the queue is full.
+function submitQuery(sql, handlers) {
+    if (queryQueue.length >= QUERY_QUEUE_MAX) {
+        queryMetrics.rejected++;
+        return null;
+    }
+    const job = { id: nextQueryId++, sql, handlers, entry: null, cancelled: false };
+    job.cancel = () => {
+        if (job.cancelled) {
+            return;
+        }
+        job.cancelled = true;
+        if (job.entry) {
+            if (job.entry.job === job) {
+                job.entry.worker.postMessage({ type: 'cancel', id: job.id });
+            }
+        } else {
+            queryQueue.splice(queryQueue.indexOf(job), 1);
+        }
+    };
+    queryQueue.push(job);
+    dispatchQueries();
+    return job;
+}
+
+for (let i = 0; i < QUERY_WORKERS; i++) {
+    startQueryWorker(i);
+}
+
+app.get('/usage/custom-query', ensureAuthenticated, (req, res) => {
+    const sql = req.query.sql;
+
+    if (!sql) {
+        return res.status(400).json({ error: 'SQL query parameter is missing.' });
+    }
+
+    // Results are cut off after QUERY_MAX_ROWS rows
+    res.setHeader('X-Max-Rows', String(QUERY_MAX_ROWS));
+    const writer = createRowWriter(res, rawFormat(req));
+    const job = submitQuery(sql, {
+        onRows(rows, ack) {
+            let drained = true;
+            for (const row of rows) {
+                drained = writer.write(row);
+            }
+            if (drained) {
+                ack();
+            } else {
+                res.once('drain', ack);
+            }
+        },
+        onDone(result) {
+            if (result.truncated) {
+                console.warn(`Custom query truncated at ${result.rows} rows.`);
+            }
+            writer.end();
+        },
+        onError(err) {
+            console.error('Database error executing custom query:', err);
+            const status = err.code === 'timeout' ? 504 : 500;
+            writer.fail(err, { error: 'Failed to execute custom query.', details: err.message }, status);
+        }
+    });
+
+    if (!job) {
+        return res.status(503).json({ error: 'Too many queries are running; try again shortly.' });
+    }
+    res.on('close', () => {
+        if (!res.writableEnded) {
+            job.cancel();
+        }
+    });
+});
+
+
+// --- Backups ---
+// Backups go through SQLite's online backup API on the write connection,
+// BACKUP_STEP_PAGES pages per step with the event loop free in between.
+// Writes made through `db` while a backup runs are carried into the copy, so
+// each backup is a consistent snapshot (a write from another process makes
+// SQLite restart the copy instead). The copy is written to a temporary file
+// and renamed into place, so an interrupted backup never replaces a good one.
+// Backups run one at a time. In partitioned storage a backup also copies
+// every attached partition into <destination>.partitions/, all under one
+// ingest pause, so the partition copies and main's rollups show the same
+// rows and no partition is detached halfway.
+const BACKUP_STEP_PAGES = 100;
+
+const backupQueue = []; // { destination, source, callback(err) }
+let activeBackup = null;
+
+const backupMetrics = {
+    completed: 0,
+    failed: 0,
+    last: null
+};
+
+// Back up one schema of the write connection (main or a partition)
+function backupSchema(source, destination, callback) {
+    backupQueue.push({ destination, source, callback: callback || (() => {}) });
+    if (!activeBackup) {
+        runNextBackup();
+    }
+}
+
+function backupDatabase(destination, callback) {
+    callback = callback || (() => {});
+    if (!partitionedStorage) {
+        return backupSchema('main', destination, callback);
+    }
+    const partitionDir = `${destination}.partitions`;
+    // After an uncaught exception the pause may never come
+    const paused = crashing ? (work) => work(() => {}) : withIngestPaused;
+    paused((release) => {
+        const list = partitionList();
+        let pending = list.length + 1;
+        let firstError = null;
+        const finish = (err) => {
+            firstError = firstError || err;
+            if (--pending === 0) {
+                release();
+                callback(firstError);
+            }
+        };
+        fs.mkdir(partitionDir, { recursive: true }, (err) => {
+            if (err) {
+                release();
+                return callback(err);
+            }
+            // Copies of expired partitions from earlier backups go
+            const current = new Set(list.map(({ file }) => path.basename(file)));
+            for (const name of fs.readdirSync(partitionDir)) {
+                if (partitionFileMonth(name) && !current.has(name)) {
+                    fs.rm(path.join(partitionDir, name), { force: true }, () => {});
+                }
+            }
+            backupSchema('main', destination, finish);
+            for (const { schema, file } of list) {
+                backupSchema(schema, path.join(partitionDir, path.basename(file)), finish);
+            }
+        });
+    });
+}
+
+function runNextBackup() {
+    const job = backupQueue.shift();
+    if (!job) {
+        activeBackup = null;
+        return;
+    }
+    const tmpPath = `${job.destination}.tmp`;
+    const start = process.hrtime.bigint();
+    activeBackup = { destination: job.destination, startedAt: new Date(), pageCount: 0, remaining: 0, steps: 0 };
+
+    const finishJob = (err) => {
+        const durationMs = Number(process.hrtime.bigint() - start) / 1e6;
+        if (err) {
+            backupMetrics.failed++;
+            fs.rm(tmpPath, { force: true }, () => {});
+        } else {
+            backupMetrics.completed++;
+        }
+        backupMetrics.last = {
+            destination: job.destination,
+            started_at: activeBackup.startedAt.toISOString(),
+            duration_ms: durationMs,
+            pages: activeBackup.pageCount,
+            steps: activeBackup.steps,
+            error: err ? err.message : null
+        };
+        runNextBackup();
+        job.callback(err);
+    };
+
+    fs.rm(tmpPath, { force: true }, () => {
+        const backup = db.backup(tmpPath, 'main', job.source, true, (err) => {
+            if (err) {
+                return finishJob(err);
+            }
+            step();
+        });
+
+        const step = () => {
+            backup.step(BACKUP_STEP_PAGES, (err) => {
+                activeBackup.steps++;
+                activeBackup.pageCount = backup.pageCount;
+                activeBackup.remaining = backup.remaining;
+                if (err || backup.failed) {
+                    return backup.finish(() => finishJob(err || new Error('Backup failed.')));
+                }
+                if (!backup.completed) {
+                    return setImmediate(step);
+                }
+                backup.finish(() => {
+                    fs.rename(tmpPath, job.destination, finishJob);
+                });
+            });
+        };
+    });
+}
+
+// Create a regular backup of the SQLite database (on server events)
+function backupDatabaseOnEvent(callback) {
+    const start = Date.now();
+    backupDatabase(backupFilePath, (err) => {
+        if (err) {
+            console.error('Error creating regular database backup:', err);
+        } else {
+            console.log(`Regular database backup created at: ${backupFilePath} (${Date.now() - start} ms)`);
+        }
+        if (callback) {
+            callback(err);
+        }
+    });
+}
+
+// Create a timestamped weekly backup of the SQLite database
+function backupDatabaseWeekly() {
+    const now = new Date();
+    const timestamp = now.toISOString().split('T')[0]; // YYYY-MM-DD format
+    const timestampedBackupFilePath = path.join(weeklyBackupDir, `usage_data_backup_${timestamp}.db.bak`);
+    const start = Date.now();
+    backupDatabase(timestampedBackupFilePath, (err) => {
+        if (err) {
+            console.error('Error creating weekly database backup:', err);
+        } else {
+            console.log(`Weekly database backup created at: ${timestampedBackupFilePath} (${Date.now() - start} ms)`);
+            pruneWeeklyBackups();
+        }
+        archiveClosedWeeks();
+    });
+}
+
+// --- Cold data archive ---
+// Closed weeks of usage rows are exported once into compressed columnar
+// files in ARCHIVE_DIR, which tools/zusage-archive reads and runs the chart
+// aggregations on without a database. A week (Monday to Monday, UTC) is
+// closed once no event can still be dated into it, i.e. a day
+// (AGGREGATE_MAX_AGE_MS) after it ended. schema_meta's archived_through
+// records the end of the last exported week. Weeks without rows get no file.
+//
+// Layout (little-endian), described in full in tools/zusage_archive.c:
+//   "ZUAR", u32 version, u32 row count, u32 column count,
+//   i64 range start ms, i64 range end ms
+//   per column: u8 name length, name, u8 encoding, u32 raw size,
+//               u32 compressed size, zlib-compressed block
+// Rows are sorted by ts. ts is stored as varint deltas from the range
+// start, weight as varints, and the string columns as a dictionary plus
+// one fixed-width code per row. Row ids and the timestamp text (derived
+// from ts) are not kept.
+const ARCHIVE_DIR = process.env.USAGE_ARCHIVE_DIR || path.join(__dirname, 'archives');
+const ARCHIVE_VERSION = 1;
+const ARCHIVE_WEEK_MS = 7 * 24 * 60 * 60 * 1000;
+const ARCHIVE_ENCODING = { dictionary: 1, deltaVarint: 2, varint: 3 };
+const archiveStringColumns = ['app_name', 'fqdn', 'local_ip', 'os_release', 'cpu_arch', 'app_version', 'username'];
+// Weekly backups to keep, newest first (USAGE_WEEKLY_BACKUPS_KEEP); 0 keeps all
+const WEEKLY_BACKUPS_KEEP = Number(process.env.USAGE_WEEKLY_BACKUPS_KEEP) || 0;
+
+// Start (Monday 00:00 UTC) of the week holding `ts`
+function archiveWeekStart(ts) {
+    const day = Math.floor(ts / 86400000);
+    // 1970-01-01 was a Thursday
+    return (day - ((day + 3) % 7)) * 86400000;
+}
+
+// Unsigned LEB128
+function pushVarint(bytes, value) {
+    while (value >= 0x80) {
+        bytes.push((value % 0x80) | 0x80);
+        value = Math.floor(value / 0x80);
+    }
+    bytes.push(value);
+}
 
+function encodeDictionaryColumn(values) {
+    const codes = new Map();
+    const entries = [];
+    const rowCodes = new Uint32Array(values.length);
+    values.forEach((value, i) => {
+        let code = codes.get(value);
+        if (code === undefined) {
+            code = entries.length;
+            codes.set(value, code);
+            entries.push(Buffer.from(value, 'utf8'));
+        }
+        rowCodes[i] = code;
+    });
+    const header = [];
+    pushVarint(header, entries.length);
+    const parts = [Buffer.from(header)];
+    for (const entry of entries) {
+        const length = [];
+        pushVarint(length, entry.length);
+        parts.push(Buffer.from(length), entry);
+    }
+    const width = entries.length <= 0x100 ? 1 : entries.length <= 0x10000 ? 2 : 4;
+    const codeBytes = Buffer.alloc(1 + values.length * width);
+    codeBytes[0] = width;
+    rowCodes.forEach((code, i) => codeBytes.writeUIntLE(code, 1 + i * width, width));
+    parts.push(codeBytes);
+    return Buffer.concat(parts);
+}
 
-app.get('/usage/custom-query', ensureAuthenticated, (req, res) => {
-    const sql = req.query.sql;
+// Build the archive file for `rows` (sorted by ts) of [rangeStart, rangeEnd)
+function encodeArchive(rows, rangeStart, rangeEnd, callback) {
+    const tsBytes = [];
+    const weightBytes = [];
+    let previous = rangeStart;
+    for (const row of rows) {
+        pushVarint(tsBytes, row.ts - previous);
+        previous = row.ts;
+        pushVarint(weightBytes, row.weight);
+    }
+    const columns = [
+        { name: 'ts', encoding: ARCHIVE_ENCODING.deltaVarint, raw: Buffer.from(tsBytes) },
+        { name: 'weight', encoding: ARCHIVE_ENCODING.varint, raw: Buffer.from(weightBytes) },
+        ...archiveStringColumns.map(name => ({
+            name,
+            encoding: ARCHIVE_ENCODING.dictionary,
+            raw: encodeDictionaryColumn(rows.map(row => row[name]))
+        }))
+    ];
 
-    if (!sql) {
-        return res.status(400).json({ error: 'SQL query parameter is missing.' });
+    let pending = columns.length;
+    let failed = false;
+    for (const column of columns) {
+        zlib.deflate(column.raw, (err, compressed) => {
+            if (failed) {
+                return;
+            }
+            if (err) {
+                failed = true;
+                return callback(err);
+            }
+            column.compressed = compressed;
+            if (--pending > 0) {
+                return;
+            }
+            const header = Buffer.alloc(32);
+            header.write('ZUAR', 0, 'latin1');
+            header.writeUInt32LE(ARCHIVE_VERSION, 4);
+            header.writeUInt32LE(rows.length, 8);
+            header.writeUInt32LE(columns.length, 12);
+            header.writeBigInt64LE(BigInt(rangeStart), 16);
+            header.writeBigInt64LE(BigInt(rangeEnd), 24);
+            const parts = [header];
+            for (const { name, encoding, raw, compressed } of columns) {
+                const columnHeader = Buffer.alloc(10 + name.length);
+                columnHeader.writeUInt8(name.length, 0);
+                columnHeader.write(name, 1, 'latin1');
+                columnHeader.writeUInt8(encoding, 1 + name.length);
+                columnHeader.writeUInt32LE(raw.length, 2 + name.length);
+                columnHeader.writeUInt32LE(compressed.length, 6 + name.length);
+                parts.push(columnHeader, compressed);
+            }
+            callback(null, Buffer.concat(parts));
+        });
     }
+}
 
-    db.all(sql, [], (err, rows) => {
-        if (err) {
-            console.error('Database error executing custom query:', err);
-            return res.status(500).json({ error: 'Failed to execute custom query.', details: err.message });
+// Export one week to ARCHIVE_DIR/usage_<monday>.zua. Calls back with the
+// number of rows archived.
+function archiveWeek(weekStart, callback) {
+    const weekEnd = weekStart + ARCHIVE_WEEK_MS;
+    const file = path.join(ARCHIVE_DIR, `usage_${new Date(weekStart).toISOString().slice(0, 10)}.zua`);
+    readDb.all(`
+        SELECT ${archiveStringColumns.join(', ')}, ts, weight
+        FROM usage WHERE ts >= ? AND ts < ? ORDER BY ts
+    `, [weekStart, weekEnd], (err, rows) => {
+        if (err || rows.length === 0) {
+            return callback(err, 0);
         }
-        res.json(rows);
+        encodeArchive(rows, weekStart, weekEnd, (err, data) => {
+            if (err) {
+                return callback(err);
+            }
+            // Renamed into place, like backups, so a file is never partial
+            fs.writeFile(`${file}.tmp`, data, (err) => {
+                if (err) {
+                    return callback(err);
+                }
+                fs.rename(`${file}.tmp`, file, (err) => callback(err, rows.length));
+            });
+        });
     });
-});
+}
 
+// Export every closed week after archived_through, oldest first. Both the
+// weekly backup and partition maintenance call this; a call made while an
+// export runs waits for that one.
+let archiveWaiters = null;
 
-// Function to create a regular backup of the SQLite database (on server events)
-function backupDatabaseOnEvent() {
-    try {
-        if (fs.existsSync(dbFilePath)) {
-            fs.copyFileSync(dbFilePath, backupFilePath);
-            console.log(`Regular database backup created at: ${backupFilePath}`);
-        } else {
-            console.warn('No database file found to back up (regular event backup).');
-        }
-    } catch (error) {
-        console.error('Error creating regular database backup:', error);
+function archiveClosedWeeks(callback) {
+    callback = callback || (() => {});
+    if (archiveWaiters) {
+        archiveWaiters.push(callback);
+        return;
     }
+    archiveWaiters = [callback];
+    exportClosedWeeks((err) => {
+        const waiters = archiveWaiters;
+        archiveWaiters = null;
+        for (const waiter of waiters) {
+            waiter(err);
+        }
+    });
 }
 
-// Function to create a timestamped weekly backup of the SQLite database
-function backupDatabaseWeekly() {
-    try {
-        if (fs.existsSync(dbFilePath)) {
-            const now = new Date();
-            const timestamp = now.toISOString().split('T')[0]; // CHART-MM-DD format
-            const timestampedBackupFilePath = path.join(weeklyBackupDir, `usage_data_backup_${timestamp}.db.bak`);
-            fs.copyFileSync(dbFilePath, timestampedBackupFilePath);
-            console.log(`Weekly database backup created at: ${timestampedBackupFilePath}`);
-        } else {
-            console.warn('No database file found to back up (weekly backup).');
+function exportClosedWeeks(callback) {
+    if (tsMigrationPending) {
+        console.log('Archive export postponed until the schema v2 migration has finished.');
+        return callback(null);
+    }
+    const closedEnd = archiveWeekStart(Date.now() - AGGREGATE_MAX_AGE_MS);
+    // The oldest row is only looked up before the first export
+    readDb.get(`
+        SELECT archived_through,
+               CASE WHEN archived_through IS NULL THEN (SELECT MIN(ts) FROM usage) END AS first_ts
+        FROM (SELECT (SELECT CAST(value AS INTEGER) FROM schema_meta WHERE key = 'archived_through') AS archived_through)
+    `, (err, row) => {
+        if (err) {
+            console.error('Error reading archive state:', err);
+            return callback(err);
+        }
+        if (row.archived_through === null && row.first_ts === null) {
+            return callback(null);
         }
-    } catch (error) {
-        console.error('Error creating weekly database backup:', error);
+        fs.mkdirSync(ARCHIVE_DIR, { recursive: true });
+        const exportFrom = (weekStart) => {
+            if (weekStart >= closedEnd) {
+                return callback(null);
+            }
+            const start = Date.now();
+            archiveWeek(weekStart, (err, rowCount) => {
+                if (err) {
+                    console.error('Error exporting archive:', err);
+                    return callback(err);
+                }
+                if (rowCount > 0) {
+                    console.log(`Archived ${rowCount} rows of the week of ${new Date(weekStart).toISOString().slice(0, 10)} (${Date.now() - start} ms)`);
+                }
+                const next = weekStart + ARCHIVE_WEEK_MS;
+                db.run(`
+                    INSERT INTO schema_meta (key, value) VALUES ('archived_through', ?)
+                    ON CONFLICT (key) DO UPDATE SET value = excluded.value
+                `, [String(next)], (err) => {
+                    if (err) {
+                        console.error('Error recording archive state:', err);
+                        return callback(err);
+                    }
+                    exportFrom(next);
+                });
+            });
+        };
+        exportFrom(row.archived_through !== null ? row.archived_through : archiveWeekStart(row.first_ts));
+    });
+}
+
+// Keep the newest WEEKLY_BACKUPS_KEEP weekly backups (names sort by date)
+function pruneWeeklyBackups() {
+    if (!WEEKLY_BACKUPS_KEEP) {
+        return;
+    }
+    const backups = fs.readdirSync(weeklyBackupDir)
+        .filter(name => /^usage_data_backup_\d{4}-\d{2}-\d{2}\.db\.bak$/.test(name))
+        .sort()
+        .reverse();
+    for (const name of backups.slice(WEEKLY_BACKUPS_KEEP)) {
+        fs.rm(path.join(weeklyBackupDir, name), { force: true }, () => {});
+        fs.rm(path.join(weeklyBackupDir, `${name}.partitions`), { recursive: true, force: true }, () => {});
+        console.log(`Weekly backup ${name} removed (USAGE_WEEKLY_BACKUPS_KEEP=${WEEKLY_BACKUPS_KEEP}).`);
     }
 }
 
@@ -227,11 +2007,247 @@ function validateData(data) {
             return false;
         }
     }
+    if (data.count !== undefined &&
+        (!Number.isSafeInteger(data.count) || data.count < 1 || data.count > MAX_EVENT_COUNT)) {
+        return false;
+    }
     return true;
 }
 
+// --- Aggregated events ---
+// Clients running with ZUSAGE_AGGREGATE send one event per app and version
+// with `count` invocations and the first/last time they were seen (epoch
+// ms). Such an event is stored as one row with weight = count, dated at
+// last_seen so late flushes land on the right day. last_seen is only trusted
+// within AGGREGATE_MAX_AGE_MS of the server clock. A count is at most
+// MAX_EVENT_COUNT, the library's limit for one 5-minute flush
+// (COUNTER_MAX_EVENT_COUNT); anything larger is a bogus or hostile client.
+const MAX_EVENT_COUNT = 100000;
+const AGGREGATE_MAX_AGE_MS = 24 * 60 * 60 * 1000;
+
+function eventTime(data, now) {
+    const lastSeen = data.last_seen;
+    if (data.count === undefined || !Number.isSafeInteger(lastSeen) ||
+        lastSeen > now.getTime() || lastSeen < now.getTime() - AGGREGATE_MAX_AGE_MS) {
+        return now;
+    }
+    return new Date(lastSeen);
+}
+
+// Map a validated usage event to the insert statement's parameters
+function usageRowParams(data, now) {
+    const time = eventTime(data, now);
+    return [
+        data.app_name,
+        data.fqdn.toLowerCase(),
+        data.local_ip,
+        data.os_release,
+        data.cpu_arch,
+        data.app_version,
+        time.toISOString(),
+        data.username || 'unknown',
+        time.getTime(),
+        data.count === undefined ? 1 : data.count
+    ];
+}
+
+// --- Ingest queue (group commit) ---
+// Events from /usage and /usage/batch are queued and written by a single
+// flusher, many requests per transaction. A group is committed once it holds
+// INGEST_FLUSH_ROWS rows or INGEST_FLUSH_INTERVAL_MS after its first event,
+// and each request is answered when its group has committed.
+const INGEST_FLUSH_ROWS = 500;
+const INGEST_FLUSH_INTERVAL_MS = 5;
+
+const ingestQueue = []; // { rows: [params], callback(err, ids) }
+let ingestQueuedRows = 0;
+let ingestFlushTimer = null;
+let ingestFlushing = false;
+// Bumped after every commit; cached aggregates from older generations are stale
+let ingestGeneration = 0;
+
+const ingestMetrics = {
+    commits: 0,
+    rowsCommitted: 0,
+    failedCommits: 0,
+    lastCommitMs: 0,
+    maxCommitMs: 0,
+    totalCommitMs: 0,
+    lastRowsPerCommit: 0,
+    maxRowsPerCommit: 0,
+    maxQueueDepth: 0
+};
+
+function enqueueUsageRows(rows, callback) {
+    ingestQueue.push({ rows, callback });
+    ingestQueuedRows += rows.length;
+    ingestMetrics.maxQueueDepth = Math.max(ingestMetrics.maxQueueDepth, ingestQueuedRows);
+
+    if (ingestQueuedRows >= INGEST_FLUSH_ROWS) {
+        flushIngestQueue();
+    } else if (!ingestFlushTimer) {
+        ingestFlushTimer = setTimeout(flushIngestQueue, INGEST_FLUSH_INTERVAL_MS);
+    }
+}
+
+// In partitioned storage, take `count` ids from the shared sequence inside
+// the group's transaction and pass the first one on; other storage modes
+// let SQLite assign ids.
+function reserveUsageIds(count, callback) {
+    if (!partitionedStorage) {
+        return callback(null, null);
+    }
+    db.get(`UPDATE main.sqlite_sequence SET seq = seq + ? WHERE name = 'usage' RETURNING seq`, [count], (err, row) => {
+        callback(err, row ? row.seq - count + 1 : null);
+    });
+}
+
+// The prepared statement and parameters that insert one usageRowParams() row
+function usageInsert(params, id) {
+    if (normalizedStorage) {
+        return [insertUsageStmt, factRowParams(params)];
+    }
+    if (partitionedStorage) {
+        // A month leaving the window takes no new rows, so its fold can finish
+        let partition = partitions.get(partitionMonth(params[8]));
+        if (partition && partition.leaving) {
+            partition = null;
+        }
+        if (!partition) {
+            partitionMetrics.inboxRows++;
+        }
+        return [partition ? partition.insertStmt : inboxInsertStmt, [id, ...params]];
+    }
+    return [insertUsageStmt, params];
+}
+
+// Write one group in a single transaction with the shared prepared statement
+// (one per partition in partitioned storage). Rows are counted as they
+// complete, and the group commits once every row has been written.
+// Partitioned storage takes the write lock up front, so that no other
+// writer can take ids from the sequence while the group holds some.
+function commitIngestGroup(entries, rowCount, done) {
+    let completed = 0;
+    let insertError = null;
+    db.run(partitionedStorage ? 'BEGIN IMMEDIATE' : 'BEGIN', (beginErr) => {
+        if (beginErr) {
+            return done(beginErr);
+        }
+        reserveUsageIds(rowCount, (idErr, firstId) => {
+            if (idErr) {
+                return db.run('ROLLBACK', () => done(idErr));
+            }
+            let nextId = firstId;
+            for (const entry of entries) {
+                entry.ids = [];
+                for (const params of entry.rows) {
+                    const id = nextId === null ? null : nextId++;
+                    const [stmt, args] = usageInsert(params, id);
+                    const index = entry.ids.push(id) - 1;
+                    stmt.run(args, function (err) {
+                        if (err && !insertError) {
+                            insertError = err;
+                        }
+                        entry.ids[index] = this.lastID;
+                        if (++completed < rowCount) {
+                            return;
+                        }
+                        if (insertError) {
+                            return db.run('ROLLBACK', () => done(insertError));
+                        }
+                        db.run('COMMIT', (commitErr) => {
+                            if (commitErr) {
+                                return db.run('ROLLBACK', () => done(commitErr));
+                            }
+                            done(null);
+                        });
+                    });
+                }
+            }
+        });
+    });
+}
+
+function flushIngestQueue() {
+    if (ingestFlushTimer) {
+        clearTimeout(ingestFlushTimer);
+        ingestFlushTimer = null;
+    }
+    if (ingestFlushing || ingestQueue.length === 0 || !ingestReady) {
+        return;
+    }
+
+    ingestFlushing = true;
+    const entries = ingestQueue.splice(0, ingestQueue.length);
+    const rowCount = ingestQueuedRows;
+    ingestQueuedRows = 0;
+    const start = process.hrtime.bigint();
+
+    const writeGroup = (done) => {
+        if (partitionedStorage) {
+            const months = entries.flatMap(entry => entry.rows.map(params => partitionMonth(params[8])));
+            // Rows of a month that cannot be attached go to the inbox
+            return ensurePartitions(months, () => commitIngestGroup(entries, rowCount, done));
+        }
+        if (!normalizedStorage) {
+            return commitIngestGroup(entries, rowCount, done);
+        }
+        resolveDimensions(entries, (err) => {
+            if (err) {
+                return done(err);
+            }
+            commitIngestGroup(entries, rowCount, done);
+        });
+    };
+
+    writeGroup((err) => {
+        const elapsedMs = Number(process.hrtime.bigint() - start) / 1e6;
+        if (err) {
+            ingestMetrics.failedCommits++;
+        } else {
+            ingestGeneration++;
+            ingestMetrics.commits++;
+            ingestMetrics.rowsCommitted += rowCount;
+            ingestMetrics.lastCommitMs = elapsedMs;
+            ingestMetrics.maxCommitMs = Math.max(ingestMetrics.maxCommitMs, elapsedMs);
+            ingestMetrics.totalCommitMs += elapsedMs;
+            ingestMetrics.lastRowsPerCommit = rowCount;
+            ingestMetrics.maxRowsPerCommit = Math.max(ingestMetrics.maxRowsPerCommit, rowCount);
+        }
+        for (const entry of entries) {
+            entry.callback(err, entry.ids);
+        }
+
+        ingestFlushing = false;
+        scheduleIngestFlush();
+    });
+}
+
+// Flush now if a full group is waiting, otherwise after the flush interval
+function scheduleIngestFlush() {
+    if (ingestQueuedRows >= INGEST_FLUSH_ROWS) {
+        flushIngestQueue();
+    } else if (ingestQueue.length > 0 && !ingestFlushTimer) {
+        ingestFlushTimer = setTimeout(flushIngestQueue, INGEST_FLUSH_INTERVAL_MS);
+    }
+}
+
+// Run work(release) on `db` between ingest groups, for other writes that
+// need transactions of their own; `db` carries one transaction at a time.
+// Ingestion waits until release() is called.
+function withIngestPaused(work) {
+    if (ingestFlushing || !ingestReady) {
+        return setTimeout(() => withIngestPaused(work), INGEST_FLUSH_INTERVAL_MS);
+    }
+    ingestFlushing = true;
+    work(() => {
+        ingestFlushing = false;
+        scheduleIngestFlush();
+    });
+}
+
 // Endpoint to receive usage data
-httpApp.post('/usage', (req, res) => {
+ingestRouter.post('/usage', (req, res) => {
     const data = req.body;
 
     if (!validateData(data)) {
@@ -239,52 +2255,358 @@ httpApp.post('/usage', (req, res) => {
     }
 
 	    const now = new Date();
-    const timestamp = now.toISOString();
 
 
-    // Insert the data into the database, including server-generated timestamp and username (if provided)
-    const query = `
-        INSERT INTO usage (app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username)
-        VALUES (?, ?, ?, ?, ?, ?, ?, ?)
-    `;
-
-	db.run(
-    query,
-    [
-        data.app_name,
-        data.fqdn.toLowerCase(),
-        data.local_ip,
-        data.os_release,
-        data.cpu_arch,
-        data.app_version,
-        timestamp,
-        data.username || 'unknown'
-    ],
-    function (err) {
+    // Queue the data for the next group commit, including server-generated timestamp and username (if provided)
+	enqueueUsageRows(
+    [usageRowParams(data, now)],
+    function (err, ids) {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to save data.' });
         }
 
-        console.log('Data inserted with ID:', this.lastID);
-        res.status(201).json({ success: true, id: this.lastID });
+        console.log('Data inserted with ID:', ids[0]);
+        res.status(201).json({ success: true, id: ids[0] });
     }
 );
 });
 
-// Endpoint to view all stored data (raw table data - may be used for debugging)
-app.get('/usage/raw', (req, res) => {
-    db.all('SELECT * FROM usage', [], (err, rows) => {
+const MAX_BATCH_EVENTS = 10000;
+
+// --- UDP ingest (ZUSAGE_TRANSPORT=udp) ---
+// Clients may send each event as one binary datagram instead of an HTTP
+// request. The layout is defined in src/zusage_wire.h: "ZU", a version byte,
+// a field count, then each field as a 2-byte big-endian length and UTF-8
+// bytes. Fields a later version appends are ignored.
+const WIRE_VERSION = 1;
+const WIRE_FIELDS = ['app_name', 'fqdn', 'local_ip', 'os_release', 'cpu_arch', 'app_version', 'username'];
+
+function decodeUsageDatagram(buf) {
+    if (buf.length < 4 || buf[0] !== 0x5a || buf[1] !== 0x55 || buf[2] !== WIRE_VERSION || buf[3] < WIRE_FIELDS.length) {
+        return null;
+    }
+    const data = {};
+    let pos = 4;
+    for (const field of WIRE_FIELDS) {
+        if (pos + 2 > buf.length) {
+            return null;
+        }
+        const len = buf.readUInt16BE(pos);
+        pos += 2;
+        if (pos + len > buf.length) {
+            return null;
+        }
+        data[field] = buf.toString('utf8', pos, pos + len);
+        pos += len;
+    }
+    return data;
+}
+
+const udpMetrics = {
+    datagrams: 0,
+    rejected: 0,
+    failed: 0
+};
+
+// Datagrams get no answer, so each one is queued and forgotten
+function handleUsageDatagram(msg) {
+    udpMetrics.datagrams++;
+    const data = decodeUsageDatagram(msg);
+    if (!data || !validateData(data)) {
+        udpMetrics.rejected++;
+        return;
+    }
+    enqueueUsageRows([usageRowParams(data, new Date())], (err) => {
+        if (err) {
+            udpMetrics.failed++;
+        }
+    });
+}
+
+// Parse a batch body: either a JSON array or NDJSON (one event per line)
+function parseUsageBatch(body) {
+    if (Array.isArray(body)) {
+        return body;
+    }
+    if (typeof body !== 'string') {
+        return null;
+    }
+    const events = [];
+    for (const line of body.split('\n')) {
+        if (line.trim() === '') {
+            continue;
+        }
+        try {
+            events.push(JSON.parse(line));
+        } catch (err) {
+            return null;
+        }
+    }
+    return events;
+}
+
+// Endpoint to receive several usage events in one request
+ingestRouter.post('/usage/batch', (req, res) => {
+    const events = parseUsageBatch(req.body);
+
+    if (!events) {
+        return res.status(400).json({ error: 'Expected a JSON array or NDJSON body.' });
+    }
+    if (events.length > MAX_BATCH_EVENTS) {
+        return res.status(413).json({ error: `Batch exceeds ${MAX_BATCH_EVENTS} events.` });
+    }
+
+    const now = new Date();
+    const rows = [];
+    let rejected = 0;
+    for (const data of events) {
+        if (data && typeof data === 'object' && validateData(data)) {
+            rows.push(usageRowParams(data, now));
+        } else {
+            rejected++;
+        }
+    }
+
+    if (rows.length === 0) {
+        return res.status(400).json({ error: 'Invalid data format.', rejected: rejected });
+    }
+
+    enqueueUsageRows(rows, (err) => {
         if (err) {
             console.error('Database error:', err);
-            return res.status(500).json({ error: 'Failed to retrieve data.' });
+            return res.status(500).json({ error: 'Failed to save data.' });
         }
-        res.json(rows);
+
+        console.log(`Batch inserted: ${rows.length} rows, ${rejected} rejected`);
+        res.status(201).json({ success: true, inserted: rows.length, rejected: rejected });
+    });
+});
+
+// --- Raw data streaming ---
+// Raw endpoints never load a whole result set. Without ?limit= the full result
+// is streamed as a JSON array (or NDJSON with ?format=ndjson), fetched in
+// keyset pages of RAW_PAGE_ROWS rows; the next page is only read once the
+// socket has drained. With ?limit= a single page is returned together with
+// the cursor for the next one (?after_id=).
+const RAW_PAGE_ROWS = 1000;
+const RAW_MAX_PAGE_LIMIT = 10000;
+
+function rawFormat(req) {
+    const accept = req.get('Accept') || '';
+    return req.query.format === 'ndjson' || accept.includes('application/x-ndjson') ? 'ndjson' : 'json';
+}
+
+// Parse ?after_id= and ?limit=. Returns null if either is malformed.
+function parseRawPaging(req) {
+    const paging = { afterId: null, limit: null };
+    for (const [key, name] of [['afterId', 'after_id'], ['limit', 'limit']]) {
+        if (req.query[name] === undefined) {
+            continue;
+        }
+        if (!/^\d+$/.test(req.query[name])) {
+            return null;
+        }
+        paging[key] = Number(req.query[name]);
+    }
+    if (paging.limit !== null && (paging.limit < 1 || paging.limit > RAW_MAX_PAGE_LIMIT)) {
+        return null;
+    }
+    return paging;
+}
+
+// Writes rows to a response as they arrive, as a JSON array or NDJSON.
+// Headers go out with the first row, so an error before that still gets a
+// proper 500; after it the only option is to cut the response short.
+function createRowWriter(res, format) {
+    let started = false;
+    let count = 0;
+    const start = () => {
+        if (!started) {
+            started = true;
+            res.status(200);
+            res.setHeader('Content-Type', format === 'ndjson' ? 'application/x-ndjson' : 'application/json');
+            if (format === 'json') {
+                res.write('[');
+            }
+        }
+    };
+    return {
+        write(row) {
+            start();
+            const text = JSON.stringify(row);
+            return res.write(format === 'ndjson' ? text + '\n' : (count++ ? ',' : '') + text);
+        },
+        end() {
+            start();
+            res.end(format === 'json' ? ']' : '');
+        },
+        fail(err, body, status) {
+            if (started) {
+                return res.destroy(err);
+            }
+            res.status(status || 500).json(body);
+        }
+    };
+}
+
+// Stream the rows of `pageQuery(cursor, limit)` page after page, where
+// cursor is the last row written (or the starting cursor). Stops after
+// maxRows rows when given.
+function streamRawPages(res, writer, pageQuery, cursor, maxRows, errorMessage) {
+    let closed = false;
+    let remaining = maxRows === null ? Infinity : maxRows;
+    res.on('close', () => { closed = true; });
+
+    const nextPage = () => {
+        const limit = Math.min(RAW_PAGE_ROWS, remaining);
+        const { sql, params } = pageQuery(cursor, limit);
+        let count = 0;
+        let blocked = false;
+        let failed = false;
+        readDb.each(sql, params, (err, row) => {
+            if (err) {
+                failed = true;
+                console.error('Database error:', err);
+                return writer.fail(err, { error: errorMessage });
+            }
+            count++;
+            cursor = row;
+            if (!closed && !writer.write(row)) {
+                blocked = true;
+            }
+        }, (err) => {
+            if (failed || closed) {
+                return;
+            }
+            if (err) {
+                console.error('Database error:', err);
+                return writer.fail(err, { error: errorMessage });
+            }
+            remaining -= count;
+            if (count < limit || remaining === 0) {
+                return writer.end();
+            }
+            if (blocked) {
+                res.once('drain', nextPage);
+            } else {
+                setImmediate(nextPage);
+            }
+        });
+    };
+    nextPage();
+}
+
+// Answer a raw request: one page with its next cursor (?limit= as JSON), or
+// a stream of everything after the starting cursor.
+function sendRawRows(req, res, pageQuery, cursor, errorMessage) {
+    const paging = parseRawPaging(req);
+    const format = rawFormat(req);
+
+    if (paging.limit !== null && format === 'json') {
+        const { sql, params } = pageQuery(cursor, paging.limit);
+        return readDb.all(sql, params, (err, rows) => {
+            if (err) {
+                console.error('Database error:', err);
+                return res.status(500).json({ error: errorMessage });
+            }
+            const next = rows.length === paging.limit ? rows[rows.length - 1].id : null;
+            res.json({ rows: rows, next_after_id: next });
+        });
+    }
+    streamRawPages(res, createRowWriter(res, format), pageQuery, cursor, paging.limit, errorMessage);
+}
+
+// Endpoint to view all stored data (raw table data - may be used for debugging)
+app.get('/usage/raw', (req, res) => {
+    const paging = parseRawPaging(req);
+    if (!paging) {
+        return res.status(400).json({ error: `after_id and limit must be integers, limit at most ${RAW_MAX_PAGE_LIMIT}.` });
+    }
+
+    const pageQuery = (cursor, limit) => ({
+        sql: 'SELECT * FROM usage WHERE id > ? ORDER BY id LIMIT ?',
+        params: [cursor ? cursor.id : 0, limit]
     });
+    sendRawRows(req, res, pageQuery, paging.afterId !== null ? { id: paging.afterId } : null,
+        'Failed to retrieve data.');
 });
 
 // --- API Endpoints for Charts (Aggregated Data) ---
 
+// --- Aggregate response cache ---
+// Chart responses are cached per URL and stamped with the ingest generation
+// they were computed at. Any commit bumps the generation, so a cached body is
+// reused only while no data has changed since. Responses carry a strong ETag
+// (a hash of the body) and must be revalidated, so repeat loads get a 304.
+// Commits made outside this process (other writers of the database file) are
+// picked up by polling PRAGMA data_version on the read connection.
+const AGGREGATE_CACHE_MAX_ENTRIES = 64;
+const DATA_VERSION_POLL_MS = 1000;
+
+const aggregateCache = new Map(); // url -> { generation, etag, body }
+const aggregateCacheMetrics = { hits: 0, misses: 0, notModified: 0 };
+let lastDataVersion = null;
+
+setInterval(() => {
+    readDb.get('PRAGMA data_version', (err, row) => {
+        if (err || !row) {
+            return;
+        }
+        if (lastDataVersion !== null && row.data_version !== lastDataVersion) {
+            ingestGeneration++;
+        }
+        lastDataVersion = row.data_version;
+    });
+}, DATA_VERSION_POLL_MS).unref();
+
+function sendCachedAggregate(req, res, entry) {
+    res.setHeader('ETag', entry.etag);
+    res.setHeader('Cache-Control', 'private, no-cache');
+    const ifNoneMatch = req.headers['if-none-match'];
+    if (ifNoneMatch && ifNoneMatch.split(',').some(tag => tag.trim() === entry.etag || tag.trim() === '*')) {
+        aggregateCacheMetrics.notModified++;
+        return res.status(304).end();
+    }
+    res.setHeader('Content-Type', 'application/json; charset=utf-8');
+    res.send(entry.body);
+}
+
+// Middleware for the aggregate endpoints: answer from the cache when the
+// entry is current, otherwise let the handler run and cache what it sends.
+function cacheAggregate(req, res, next) {
+    const key = req.originalUrl;
+    const cached = aggregateCache.get(key);
+    if (cached && cached.generation === ingestGeneration) {
+        aggregateCacheMetrics.hits++;
+        return sendCachedAggregate(req, res, cached);
+    }
+    aggregateCacheMetrics.misses++;
+
+    // Stamp with the generation seen before reading, so a commit that lands
+    // while the handler runs leaves the entry stale rather than wrong.
+    const generation = ingestGeneration;
+    const json = res.json.bind(res);
+    res.json = (data) => {
+        if (res.statusCode !== 200) {
+            return json(data);
+        }
+        const body = JSON.stringify(data);
+        const entry = {
+            generation,
+            etag: `"${crypto.createHash('sha1').update(body).digest('base64url')}"`,
+            body
+        };
+        aggregateCache.delete(key);
+        aggregateCache.set(key, entry);
+        if (aggregateCache.size > AGGREGATE_CACHE_MAX_ENTRIES) {
+            aggregateCache.delete(aggregateCache.keys().next().value);
+        }
+        sendCachedAggregate(req, res, entry);
+    };
+    next();
+}
+
 // OS Release Mapping
 const osReleaseMap = {
     "26.00": "v2r3",
@@ -315,14 +2637,14 @@ const cpuArchMap = {
 };
 
 // Endpoint for Usage Over Time chart
-app.get('/api/usage-over-time', ensureAuthenticated, (req, res) => {
+app.get('/api/usage-over-time', ensureAuthenticated, cacheAggregate, (req, res) => {
     const query = `
-        SELECT DATE(timestamp) AS usage_date, COUNT(*) AS usage_count
-        FROM usage
+        SELECT day AS usage_date, SUM(usage_count) AS usage_count
+        FROM usage_daily_app
         GROUP BY usage_date
         ORDER BY usage_date
     `;
-    db.all(query, [], (err, rows) => {
+    readDb.all(query, [], (err, rows) => {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to retrieve usage over time data.' });
@@ -332,14 +2654,14 @@ app.get('/api/usage-over-time', ensureAuthenticated, (req, res) => {
 });
 
 // Endpoint for Application Popularity chart
-app.get('/api/app-popularity', ensureAuthenticated, (req, res) => {
+app.get('/api/app-popularity', ensureAuthenticated, cacheAggregate, (req, res) => {
     const query = `
-        SELECT app_name, COUNT(*) AS usage_count
-        FROM usage
+        SELECT app_name, SUM(usage_count) AS usage_count
+        FROM usage_daily_app
         GROUP BY app_name
         ORDER BY usage_count DESC
     `;
-    db.all(query, [], (err, rows) => {
+    readDb.all(query, [], (err, rows) => {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to retrieve app popularity data.' });
@@ -349,14 +2671,14 @@ app.get('/api/app-popularity', ensureAuthenticated, (req, res) => {
 });
 
 // Endpoint for OS Distribution chart with friendly names
-app.get('/api/os-distribution', ensureAuthenticated, (req, res) => {
+app.get('/api/os-distribution', ensureAuthenticated, cacheAggregate, (req, res) => {
     const query = `
-        SELECT os_release, COUNT(*) AS usage_count
-        FROM usage
+        SELECT os_release, SUM(usage_count) AS usage_count
+        FROM usage_daily_os
         GROUP BY os_release
         ORDER BY usage_count DESC
     `;
-    db.all(query, [], (err, rows) => {
+    readDb.all(query, [], (err, rows) => {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to retrieve OS distribution data.' });
@@ -371,14 +2693,14 @@ app.get('/api/os-distribution', ensureAuthenticated, (req, res) => {
 });
 
 // Endpoint for CPU Architecture Distribution chart
-app.get('/api/cpu-distribution', ensureAuthenticated, (req, res) => {
+app.get('/api/cpu-distribution', ensureAuthenticated, cacheAggregate, (req, res) => {
     const query = `
-        SELECT cpu_arch, COUNT(*) AS usage_count
-        FROM usage
+        SELECT cpu_arch, SUM(usage_count) AS usage_count
+        FROM usage_daily_cpu
         GROUP BY cpu_arch
         ORDER BY usage_count DESC
     `;
-    db.all(query, [], (err, rows) => {
+    readDb.all(query, [], (err, rows) => {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to retrieve CPU architecture distribution data.' });
@@ -393,14 +2715,14 @@ app.get('/api/cpu-distribution', ensureAuthenticated, (req, res) => {
 });
 
 // --- NEW API Endpoint for Hostname Usage Chart ---
-app.get('/api/hostname-usage', ensureAuthenticated, (req, res) => {
+app.get('/api/hostname-usage', ensureAuthenticated, cacheAggregate, (req, res) => {
     const query = `
-        SELECT fqdn, COUNT(*) AS usage_count
-        FROM usage
+        SELECT fqdn, SUM(usage_count) AS usage_count
+        FROM usage_daily_host
         GROUP BY fqdn
         ORDER BY usage_count DESC
     `;
-    db.all(query, [], (err, rows) => {
+    readDb.all(query, [], (err, rows) => {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to retrieve hostname usage data.' });
@@ -409,7 +2731,189 @@ app.get('/api/hostname-usage', ensureAuthenticated, (req, res) => {
     });
 });
 
-// Endpoint to view raw data for a specific day
+// Endpoint with every dashboard chart in one response. A single statement
+// reads all rollups, so the charts come from one consistent snapshot and the
+// page needs one round trip instead of five.
+app.get('/api/dashboard', ensureAuthenticated, cacheAggregate, (req, res) => {
+    const query = `
+        SELECT 'usage_over_time' AS chart, day AS label, SUM(usage_count) AS usage_count
+        FROM usage_daily_app GROUP BY day
+        UNION ALL
+        SELECT 'app_popularity', app_name, SUM(usage_count) FROM usage_daily_app GROUP BY app_name
+        UNION ALL
+        SELECT 'os_distribution', os_release, SUM(usage_count) FROM usage_daily_os GROUP BY os_release
+        UNION ALL
+        SELECT 'cpu_distribution', cpu_arch, SUM(usage_count) FROM usage_daily_cpu GROUP BY cpu_arch
+        UNION ALL
+        SELECT 'hostname_usage', fqdn, SUM(usage_count) FROM usage_daily_host GROUP BY fqdn
+    `;
+    readDb.all(query, [], (err, rows) => {
+        if (err) {
+            console.error('Database error:', err);
+            return res.status(500).json({ error: 'Failed to retrieve dashboard data.' });
+        }
+
+        // Sum per chart and display label; mapped labels may merge several raw values
+        const charts = {
+            usage_over_time: { field: 'usage_date', counts: new Map() },
+            app_popularity: { field: 'app_name', counts: new Map() },
+            os_distribution: { field: 'os_release', counts: new Map(), labels: osReleaseMap },
+            cpu_distribution: { field: 'cpu_arch', counts: new Map(), labels: cpuArchMap },
+            hostname_usage: { field: 'fqdn', counts: new Map() }
+        };
+        for (const row of rows) {
+            const chart = charts[row.chart];
+            const label = (chart.labels && chart.labels[row.label]) || row.label;
+            chart.counts.set(label, (chart.counts.get(label) || 0) + row.usage_count);
+        }
+
+        const result = {};
+        for (const [name, chart] of Object.entries(charts)) {
+            const entries = [...chart.counts];
+            if (name === 'usage_over_time') {
+                entries.sort((a, b) => (a[0] < b[0] ? -1 : a[0] > b[0] ? 1 : 0));
+            } else {
+                entries.sort((a, b) => b[1] - a[1]);
+            }
+            result[name] = entries.map(([label, count]) => ({ [chart.field]: label, usage_count: count }));
+        }
+        res.json(result);
+    });
+});
+
+// Endpoint for approximate distinct users and hosts per app over the days
+// from..to (YYYY-MM-DD, UTC, inclusive; by default the last
+// DISTINCT_DEFAULT_DAYS days), merged from the daily sketches. `app` limits
+// it to one app. Totals count each user or host once across all apps.
+app.get('/api/distinct', ensureAuthenticated, cacheAggregate, (req, res) => {
+    const today = new Date().toISOString().slice(0, 10);
+    const to = req.query.to || today;
+    const from = req.query.from ||
+        new Date(Date.now() - (DISTINCT_DEFAULT_DAYS - 1) * 24 * 60 * 60 * 1000).toISOString().slice(0, 10);
+    if (!dayRange(from) || !dayRange(to)) {
+        return res.status(400).json({ error: 'from and to must be in YYYY-MM-DD format.' });
+    }
+    const params = [from, to];
+    let query = 'SELECT app_name, users, hosts FROM usage_daily_distinct WHERE day BETWEEN ? AND ?';
+    if (req.query.app) {
+        query += ' AND app_name = ?';
+        params.push(String(req.query.app));
+    }
+    readDb.all(query, params, (err, rows) => {
+        if (err) {
+            console.error('Database error:', err);
+            return res.status(500).json({ error: 'Failed to retrieve distinct counts.' });
+        }
+        const apps = new Map(); // app_name -> { users, hosts }
+        for (const row of rows) {
+            let sketches = apps.get(row.app_name);
+            if (!sketches) {
+                sketches = { users: createSketch(), hosts: createSketch() };
+                apps.set(row.app_name, sketches);
+            }
+            decodeSketch(row.users, sketches.users);
+            decodeSketch(row.hosts, sketches.hosts);
+        }
+        const users = createSketch();
+        const hosts = createSketch();
+        const result = [];
+        for (const [appName, sketches] of apps) {
+            mergeSketch(users, sketches.users);
+            mergeSketch(hosts, sketches.hosts);
+            result.push({
+                app_name: appName,
+                users: estimateSketch(sketches.users),
+                hosts: estimateSketch(sketches.hosts)
+            });
+        }
+        result.sort((a, b) => b.users - a.users || b.hosts - a.hosts || (a.app_name < b.app_name ? -1 : 1));
+        res.json({
+            from,
+            to,
+            users: estimateSketch(users),
+            hosts: estimateSketch(hosts),
+            apps: result
+        });
+    });
+});
+
+// Endpoint for collector health metrics
+app.get('/api/metrics', ensureAuthenticated, (req, res) => {
+    const commits = ingestMetrics.commits;
+    const queriesFinished = queryMetrics.completed + queryMetrics.failed + queryMetrics.timedOut + queryMetrics.cancelled;
+    const partitionNames = partitionList().map(({ schema }) => schema);
+    res.json({
+        ingest: {
+            queue_depth: ingestQueuedRows,
+            max_queue_depth: ingestMetrics.maxQueueDepth,
+            commits: commits,
+            failed_commits: ingestMetrics.failedCommits,
+            rows_committed: ingestMetrics.rowsCommitted,
+            rows_per_commit_last: ingestMetrics.lastRowsPerCommit,
+            rows_per_commit_avg: commits ? ingestMetrics.rowsCommitted / commits : 0,
+            rows_per_commit_max: ingestMetrics.maxRowsPerCommit,
+            commit_latency_ms_last: ingestMetrics.lastCommitMs,
+            commit_latency_ms_avg: commits ? ingestMetrics.totalCommitMs / commits : 0,
+            commit_latency_ms_max: ingestMetrics.maxCommitMs,
+            udp_datagrams: udpMetrics.datagrams,
+            udp_rejected: udpMetrics.rejected,
+            udp_failed: udpMetrics.failed
+        },
+        queries: {
+            workers: queryWorkers.length,
+            busy: queryWorkers.filter(entry => entry && entry.job).length,
+            queued: queryQueue.length,
+            completed: queryMetrics.completed,
+            failed: queryMetrics.failed,
+            timed_out: queryMetrics.timedOut,
+            cancelled: queryMetrics.cancelled,
+            rejected: queryMetrics.rejected,
+            latency_ms_max: queryMetrics.maxMs,
+            latency_ms_avg: queriesFinished ? queryMetrics.totalMs / queriesFinished : 0
+        },
+        aggregate_cache: {
+            generation: ingestGeneration,
+            entries: aggregateCache.size,
+            hits: aggregateCacheMetrics.hits,
+            misses: aggregateCacheMetrics.misses,
+            not_modified: aggregateCacheMetrics.notModified
+        },
+        distinct: {
+            through_id: distinctThroughId,
+            rows_folded: distinctMetrics.rowsFolded,
+            sketches_written: distinctMetrics.sketchesWritten
+        },
+        partitions: partitionedStorage ? {
+            attached: partitions.size,
+            unattached: partitionMetrics.unattached,
+            attach_failures: partitionMetrics.attachFailures,
+            inbox_rows: partitionMetrics.inboxRows,
+            newest: partitionNames[0] || null,
+            oldest: partitionNames[partitionNames.length - 1] || null,
+            window_months: windowMonths(),
+            retention_months: PARTITION_RETENTION_MONTHS,
+            expired: partitionMetrics.expired,
+            rows_moved: partitionMetrics.rowsMoved,
+            rows_folded: partitionMetrics.rowsFolded,
+            rows_expired: partitionMetrics.rowsExpired
+        } : null,
+        backup: {
+            running: activeBackup ? {
+                destination: activeBackup.destination,
+                started_at: activeBackup.startedAt.toISOString(),
+                pages_total: activeBackup.pageCount,
+                pages_remaining: activeBackup.remaining,
+                progress: activeBackup.pageCount ? 1 - activeBackup.remaining / activeBackup.pageCount : 0
+            } : null,
+            queued: backupQueue.length,
+            completed: backupMetrics.completed,
+            failed: backupMetrics.failed,
+            last: backupMetrics.last
+        }
+    });
+});
+
+// Endpoint to view raw data for a specific day, newest first
 app.get('/usage/daily-raw/:date', ensureAuthenticated, (req, res) => {
     const selectedDate = req.params.date; // Date from URL parameter (YYYY-MM-DD)
 
@@ -417,18 +2921,59 @@ app.get('/usage/daily-raw/:date', ensureAuthenticated, (req, res) => {
         return res.status(400).json({ error: 'Date parameter is required.' });
     }
 
-    const query = `
-        SELECT * FROM usage
-        WHERE DATE(timestamp) = ?
-        ORDER BY timestamp DESC
-    `;
+    const range = dayRange(selectedDate);
+    if (!range) {
+        return res.status(400).json({ error: 'Date must be in YYYY-MM-DD format.' });
+    }
+    const paging = parseRawPaging(req);
+    if (!paging) {
+        return res.status(400).json({ error: `after_id and limit must be integers, limit at most ${RAW_MAX_PAGE_LIMIT}.` });
+    }
 
-    db.all(query, [selectedDate], (err, rows) => {
+    // Pages walk idx_usage_ts backwards. The cursor's ts is passed as the
+    // upper bound so each page starts right where the previous one ended.
+    const pageQuery = (cursor, limit) => {
+        if (tsMigrationPending) {
+            // Rows not yet converted by the v2 migration have no ts
+            return {
+                sql: `
+                    SELECT * FROM usage
+                    WHERE ((ts >= ? AND ts < ?) OR (ts IS NULL AND DATE(timestamp) = ?)) AND id < ?
+                    ORDER BY id DESC
+                    LIMIT ?
+                `,
+                params: [range[0], range[1], selectedDate, cursor ? cursor.id : Number.MAX_SAFE_INTEGER, limit]
+            };
+        }
+        if (!cursor) {
+            return {
+                sql: 'SELECT * FROM usage WHERE ts >= ? AND ts < ? ORDER BY ts DESC, id DESC LIMIT ?',
+                params: [range[0], range[1], limit]
+            };
+        }
+        return {
+            sql: `
+                SELECT * FROM usage
+                WHERE ts >= ? AND ts <= ? AND (ts < ? OR id < ?)
+                ORDER BY ts DESC, id DESC
+                LIMIT ?
+            `,
+            params: [range[0], Math.min(cursor.ts, range[1] - 1), cursor.ts, cursor.id, limit]
+        };
+    };
+
+    if (paging.afterId === null) {
+        return sendRawRows(req, res, pageQuery, null, 'Failed to retrieve daily data.');
+    }
+    readDb.get('SELECT id, ts FROM usage WHERE id = ?', [paging.afterId], (err, cursor) => {
         if (err) {
             console.error('Database error:', err);
             return res.status(500).json({ error: 'Failed to retrieve daily data.' });
         }
-        res.json(rows);
+        if (!cursor) {
+            return res.status(400).json({ error: 'after_id does not match a stored row.' });
+        }
+        sendRawRows(req, res, pageQuery, cursor, 'Failed to retrieve daily data.');
     });
 });
 
@@ -446,24 +2991,31 @@ function getLocalIpAddress() {
 }
 
 app.get('/download-db', ensureAuthenticated, (req, res) => {
-    const dbFilePath = path.join(__dirname, 'usage_data.db');
+    // Serve a snapshot taken for this download, never the live file
+    const snapshotPath = `${dbFilePath}.download-${process.pid}-${Date.now()}`;
 
-    // Check if the database file exists
-    if (!fs.existsSync(dbFilePath)) {
-        return res.status(404).send('Database file not found.');
-    }
+    // In partitioned storage this is the main database: rollups and metadata
+    backupSchema('main', snapshotPath, (err) => {
+        if (err) {
+            console.error('Error creating database snapshot for download:', err);
+            return res.status(500).send('Error creating database snapshot.');
+        }
 
-    // Set headers to force download
-    res.setHeader('Content-Disposition', 'attachment; filename=usage_data.db');
-    res.setHeader('Content-Type', 'application/octet-stream'); // Or 'application/x-sqlite3'
+        // Set headers to force download
+        res.setHeader('Content-Disposition', 'attachment; filename=usage_data.db');
+        res.setHeader('Content-Type', 'application/octet-stream'); // Or 'application/x-sqlite3'
 
-    // Stream the database file to the response
-    const fileStream = fs.createReadStream(dbFilePath);
-    fileStream.pipe(res);
+        // Stream the snapshot to the response and remove it afterwards
+        const fileStream = fs.createReadStream(snapshotPath);
+        fileStream.pipe(res);
 
-    fileStream.on('error', (err) => {
-        console.error('Error streaming database file for download:', err);
-        res.status(500).send('Error serving database file.');
+        const cleanup = () => fs.rm(snapshotPath, { force: true }, () => {});
+        res.on('close', cleanup);
+
+        fileStream.on('error', (err) => {
+            console.error('Error streaming database snapshot for download:', err);
+            res.destroy(err);
+        });
     });
 });
 
@@ -475,6 +3027,9 @@ function scheduleWeeklyBackup() {
     const nextSundayMidnight = new Date(now);
     nextSundayMidnight.setDate(now.getDate() + daysUntilSunday);
     nextSundayMidnight.setHours(0, 0, 0, 0); // Set to midnight
+    if (nextSundayMidnight <= now) {
+        nextSundayMidnight.setDate(nextSundayMidnight.getDate() + 7); // Today's has passed
+    }
 
     const timeUntilNextBackup = nextSundayMidnight.getTime() - now.getTime();
 
@@ -488,6 +3043,9 @@ function scheduleWeeklyBackup() {
     }, timeUntilNextBackup);
 }
 
+// Weekly backups also export closed weeks to the archive
+scheduleWeeklyBackup();
+
 const httpsServer = https.createServer(credentials, app); // Use 'app' (HTTPS-secured Express app)
 const HTTPS_PORT = 3443; // Standard HTTPS port
 httpsServer.listen(HTTPS_PORT, () => {
@@ -501,23 +3059,100 @@ httpsServer.listen(HTTPS_PORT, () => {
 // --- HTTP Server Setup (ONLY for /usage route) ---
 const httpServer = http.createServer(httpApp); // Use 'httpApp' (HTTP-only Express app)
 const HTTP_PORT = 3000; // Choose a different port for HTTP, e.g., 3000
-httpServer.listen(HTTP_PORT, () => {
-    const ipAddress = getLocalIpAddress();
-    console.log(`HTTP Server is running! ONLY /usage route accessible via HTTP at:`);
-    console.log(`- Local:   http://localhost:${HTTP_PORT}/usage`); // Note: http and port 3000, /usage path
-    console.log(`- Network: http://${ipAddress}:${HTTP_PORT}/usage`); // Note: http and port 3000, /usage path
+const UDP_PORT = 3001; // USAGE_ANALYTICS_UDP_PORT in the C client
+const udpServer = dgram.createSocket('udp4');
+udpServer.on('message', handleUsageDatagram);
+udpServer.on('error', (err) => {
+    console.error('UDP listener error:', err);
 });
+// USAGE_HTTP_LISTENER=off leaves ports 3000 and 3001 to the native collector
+const ingestListeners = process.env.USAGE_HTTP_LISTENER !== 'off';
+if (ingestListeners) {
+    httpServer.listen(HTTP_PORT, () => {
+        const ipAddress = getLocalIpAddress();
+        console.log(`HTTP Server is running! ONLY /usage route accessible via HTTP at:`);
+        console.log(`- Local:   http://localhost:${HTTP_PORT}/usage`); // Note: http and port 3000, /usage path
+        console.log(`- Network: http://${ipAddress}:${HTTP_PORT}/usage`); // Note: http and port 3000, /usage path
+    });
+    udpServer.bind(UDP_PORT, () => {
+        console.log(`UDP ingest listening on port ${UDP_PORT}`);
+    });
+} else {
+    console.log('HTTP and UDP ingest listeners disabled (USAGE_HTTP_LISTENER=off).');
+}
 
 
-// Backup database on process exit or errors (using regular backup function)
-process.on('exit', backupDatabaseOnEvent);
-process.on('SIGINT', () => {
-    console.log('\nGracefully shutting down...');
-    backupDatabaseOnEvent();
-    process.exit();
-});
+// --- Bench listener ---
+// USAGE_BENCH_PORT opens a plain HTTP listener on 127.0.0.1 with only the
+// ingest routes, so load tests (bench/zusage_loadgen) can drive this server
+// while the public HTTP listener is off or taken by the native collector.
+// It serves nothing that needs a login; load-test readers go through the
+// HTTPS UI with a session like any other user.
+const BENCH_PORT = Number(process.env.USAGE_BENCH_PORT) || 0;
+const benchApp = express();
+benchApp.use(ingestRouter);
+const benchServer = http.createServer(benchApp);
+if (BENCH_PORT) {
+    benchServer.listen(BENCH_PORT, '127.0.0.1', () => {
+        console.log(`Bench ingest listener on http://127.0.0.1:${BENCH_PORT}/usage`);
+    });
+}
+
+// Wait until every queued event has been committed
+function drainIngestQueue(callback) {
+    if (!ingestFlushing && ingestQueue.length === 0) {
+        return callback();
+    }
+    flushIngestQueue();
+    setTimeout(() => drainIngestQueue(callback), INGEST_FLUSH_INTERVAL_MS);
+}
+
+// Graceful shutdown: stop accepting requests, commit queued events, take a
+// backup and close the database. A second signal exits immediately.
+let shuttingDown = false;
+let crashing = false;
+function shutdown(signal) {
+    if (shuttingDown) {
+        console.log(`\n${signal} received again, exiting without waiting.`);
+        process.exit(1);
+    }
+    shuttingDown = true;
+    console.log(`\n${signal} received, gracefully shutting down...`);
+    httpServer.close();
+    httpsServer.close();
+    if (BENCH_PORT) {
+        benchServer.close();
+    }
+    if (ingestListeners) {
+        udpServer.close();
+    }
+    drainIngestQueue(() => {
+        backupDatabaseOnEvent(() => {
+            // Every prepared statement must be finalized before the close
+            const statements = [...partitions.values()].map(({ insertStmt }) => insertStmt);
+            for (const stmt of [insertUsageStmt, inboxInsertStmt]) {
+                if (stmt) {
+                    statements.push(stmt);
+                }
+            }
+            let pending = statements.length + 1;
+            const closeDb = () => {
+                if (--pending === 0) {
+                    db.close(() => process.exit());
+                }
+            };
+            for (const stmt of statements) {
+                stmt.finalize(closeDb);
+            }
+            closeDb();
+        });
+    });
+}
+
+process.on('SIGINT', () => shutdown('SIGINT'));
+process.on('SIGTERM', () => shutdown('SIGTERM'));
 process.on('uncaughtException', (err) => {
     console.error('Uncaught exception:', err);
-    backupDatabaseOnEvent();
-    process.exit(1);
+    crashing = true;
+    backupDatabaseOnEvent(() => process.exit(1));
 });
@@ -0,0 +1,85 @@
+// Helpers for partitioned storage (USAGE_STORAGE_MODE=partitioned), shared by
+// app.js and queryWorker.js. Each calendar month (UTC) of usage rows lives in
+// its own database file, usage_YYYY_MM.db, with a `usage` table of the legacy
+// columns. Connections attach the files as schemas p_YYYY_MM, and read
+// connections get a TEMP view `usage` over all of them plus main.usage, so
+// queries written against `usage` keep working. A view in main cannot refer
+// to attached databases, hence TEMP: it exists per connection.
+const PARTITION_FILE_PATTERN = /^usage_(\d{4})_(\d{2})\.db$/;
+
+const usageColumns = ['id', 'app_name', 'fqdn', 'local_ip', 'os_release', 'cpu_arch', 'app_version',
+    'timestamp', 'username', 'ts', 'weight'];
+
+// 'YYYY_MM' of an epoch-millisecond time
+function partitionMonth(ts) {
+    return new Date(ts).toISOString().slice(0, 7).replace('-', '_');
+}
+
+function partitionSchema(month) {
+    return `p_${month}`;
+}
+
+function partitionFileName(month) {
+    return `usage_${month}.db`;
+}
+
+// Month of a partition file name, or null for any other file
+function partitionFileMonth(name) {
+    const match = PARTITION_FILE_PATTERN.exec(name);
+    return match ? `${match[1]}_${match[2]}` : null;
+}
+
+function quoteLiteral(text) {
+    return `'${text.replace(/'/g, "''")}'`;
+}
+
+// The merged view. With the WHERE and ORDER BY of a query pushed into every
+// arm, SQLite answers id and ts range queries with an index search per
+// partition and merges the sorted results, so a query reads only the rows
+// in its range.
+function usageViewSql(partitions) {
+    const columns = usageColumns.join(', ');
+    const arms = partitions.map(({ schema }) => `SELECT ${columns} FROM ${schema}.usage`);
+    arms.push(`SELECT ${columns} FROM main.usage`);
+    return `CREATE TEMP VIEW usage AS\n${arms.join('\nUNION ALL\n')}`;
+}
+
+// Bring a read connection's attached partitions in line with `partitions`
+// ([{ schema, file }]) and recreate its `usage` view. Detaching fails while
+// a statement on that connection still reads the partition; the connection
+// is then left as it was and the caller may try again later.
+function syncReadConnection(conn, partitions, callback) {
+    conn.all('PRAGMA database_list', (err, rows) => {
+        if (err) {
+            return callback(err);
+        }
+        const wanted = new Set(partitions.map(({ schema }) => schema));
+        const attached = new Set(rows.map(row => row.name));
+        const statements = [];
+        for (const name of attached) {
+            if (name.startsWith('p_') && !wanted.has(name)) {
+                statements.push(`DETACH DATABASE ${name}`);
+            }
+        }
+        for (const { schema, file } of partitions) {
+            if (!attached.has(schema)) {
+                statements.push(`ATTACH DATABASE ${quoteLiteral(file)} AS ${schema}`);
+            }
+        }
+        // query_only also covers the temp schema
+        statements.push('PRAGMA query_only = OFF', 'DROP VIEW IF EXISTS temp.usage', usageViewSql(partitions));
+        conn.exec(statements.join(';\n'), (err) => {
+            conn.run('PRAGMA query_only = ON', () => callback(err));
+        });
+    });
+}
+
+module.exports = {
+    usageColumns,
+    partitionMonth,
+    partitionSchema,
+    partitionFileName,
+    partitionFileMonth,
+    quoteLiteral,
+    syncReadConnection
+};
@@ -9,60 +9,58 @@ document.addEventListener('DOMContentLoaded', function() {
     dailyDateInput.value = currentDate;
 
     // --- Fetch data and create charts ---
-    createUsageOverTimeChart();
-    createAppPopularityChart();
-    createOSDistributionChart();
-    createCPUDistributionChart();
-    createHostnameUsageChart();
+    // All charts come from one /api/dashboard response
+    fetch('/api/dashboard')
+    .then(response => response.json())
+    .then(data => {
+        createUsageOverTimeChart(data.usage_over_time);
+        createAppPopularityChart(data.app_popularity);
+        createOSDistributionChart(data.os_distribution);
+        createCPUDistributionChart(data.cpu_distribution);
+        createHostnameUsageChart(data.hostname_usage);
+    })
+    .catch(error => console.error('Error fetching dashboard data:', error));
 
     // --- Chart Creation Functions ---
-    function createUsageOverTimeChart() {
-        fetch('/api/usage-over-time')
-        .then(response => response.json())
-        .then(data => {
-            const labels = data.map(item => item.usage_date);
-            const usageCounts = data.map(item => item.usage_count);
+    function createUsageOverTimeChart(data) {
+        const labels = data.map(item => item.usage_date);
+        const usageCounts = data.map(item => item.usage_count);
 
-            const ctx = document.getElementById('usageOverTimeChart').getContext('2d');
-            new Chart(ctx, {
-                type: 'line',
-                data: {
-                    labels: labels,
-                    datasets: [{
-                        label: 'Usage Count',
-                        data: usageCounts,
-                        borderColor: 'rgb(75, 192, 192)',
-                        tension: 0.1
-                    }]
-                },
-                options: {
-                    responsive: true,
-                    maintainAspectRatio: false,
-                    scales: {
-                        y: {
-                            beginAtZero: true,
-                            title: {
-                                display: true,
-                                text: 'Usage Count'
-                            }
-                        },
-                        x: {
-                            title: {
-                                display: true,
-                                text: 'Date'
-                            }
+        const ctx = document.getElementById('usageOverTimeChart').getContext('2d');
+        new Chart(ctx, {
+            type: 'line',
+            data: {
+                labels: labels,
+                datasets: [{
+                    label: 'Usage Count',
+                    data: usageCounts,
+                    borderColor: 'rgb(75, 192, 192)',
+                    tension: 0.1
+                }]
+            },
+            options: {
+                responsive: true,
+                maintainAspectRatio: false,
+                scales: {
+                    y: {
+                        beginAtZero: true,
+                        title: {
+                            display: true,
+                            text: 'Usage Count'
+                        }
+                    },
+                    x: {
+                        title: {
+                            display: true,
+                            text: 'Date'
                         }
                     }
                 }
-            });
-        })
-        .catch(error => console.error('Error fetching usage over time data:', error));
+            }
+        });
     }
 
-    function createAppPopularityChart() {
-    fetch('/api/app-popularity')
-    .then(response => response.json())
-    .then(data => {
+    function createAppPopularityChart(data) {
         const labels = data.map(item => item.app_name);
         const usageCounts = data.map(item => item.usage_count);
 
@@ -99,138 +97,198 @@ document.addEventListener('DOMContentLoaded', function() {
                 }
             }
         });
-    })
-    .catch(error => console.error('Error fetching app popularity data:', error));
 }
 
-    function createOSDistributionChart() {
-        fetch('/api/os-distribution')
-        .then(response => response.json())
-        .then(data => {
-            // OS Release Mapping (same as server-side)
-            const osReleaseMap = {
-                "26.00": "v2r3",
-                "27.00": "v2r4",
-                "28.00": "v2r5",
-                "29.00": "v3r1",
-                "30.00":  "v3r2"
-            };
+    function createOSDistributionChart(data) {
+        // OS Release Mapping (same as server-side)
+        const osReleaseMap = {
+            "26.00": "v2r3",
+            "27.00": "v2r4",
+            "28.00": "v2r5",
+            "29.00": "v3r1",
+            "30.00":  "v3r2"
+        };
 
-            const labels = data.map(item => osReleaseMap[item.os_release] || item.os_release);
-            const usageCounts = data.map(item => item.usage_count);
+        const labels = data.map(item => osReleaseMap[item.os_release] || item.os_release);
+        const usageCounts = data.map(item => item.usage_count);
 
-            const ctx = document.getElementById('osDistributionChart').getContext('2d');
-            new Chart(ctx, {
-                type: 'pie',
-                data: {
-                    labels: labels,
-                    datasets: [{
-                        label: 'OS Distribution',
-                        data: usageCounts,
-                        backgroundColor: [
-                            'rgba(255, 99, 132, 0.7)',
-                            'rgba(54, 162, 235, 0.7)',
-                            'rgba(255, 206, 86, 0.7)',
-                            'rgba(75, 192, 192, 0.7)',
-                            'rgba(153, 102, 255, 0.7)',
-                            'rgba(255, 159, 64, 0.7)',
-                            // Add more colors if needed
-                        ],
-                        borderColor: 'rgba(255, 255, 255, 1)',
-                        borderWidth: 1
-                    }]
-                },
-                options: {
-                    responsive: true,
-                    maintainAspectRatio: false,
-                }
-            });
-        })
-        .catch(error => console.error('Error fetching OS distribution data:', error));
+        const ctx = document.getElementById('osDistributionChart').getContext('2d');
+        new Chart(ctx, {
+            type: 'pie',
+            data: {
+                labels: labels,
+                datasets: [{
+                    label: 'OS Distribution',
+                    data: usageCounts,
+                    backgroundColor: [
+                        'rgba(255, 99, 132, 0.7)',
+                        'rgba(54, 162, 235, 0.7)',
+                        'rgba(255, 206, 86, 0.7)',
+                        'rgba(75, 192, 192, 0.7)',
+                        'rgba(153, 102, 255, 0.7)',
+                        'rgba(255, 159, 64, 0.7)',
+                        // Add more colors if needed
+                    ],
+                    borderColor: 'rgba(255, 255, 255, 1)',
+                    borderWidth: 1
+                }]
+            },
+            options: {
+                responsive: true,
+                maintainAspectRatio: false,
+            }
+        });
     }
 
-    function createCPUDistributionChart() {
-        fetch('/api/cpu-distribution')
-        .then(response => response.json())
-        .then(data => {
-            const labels = data.map(item => item.cpu_arch);
-            const usageCounts = data.map(item => item.usage_count);
+    function createCPUDistributionChart(data) {
+        const labels = data.map(item => item.cpu_arch);
+        const usageCounts = data.map(item => item.usage_count);
 
-            const ctx = document.getElementById('cpuDistributionChart').getContext('2d');
-            new Chart(ctx, {
-                type: 'pie',
-                data: {
-                    labels: labels,
-                    datasets: [{
-                        label: 'CPU Arch Distribution',
-                        data: usageCounts,
-                        backgroundColor: [
-                            'rgba(240, 80, 80, 0.7)',
-                            'rgba(80, 240, 80, 0.7)',
-                            'rgba(80, 80, 240, 0.7)',
-                            'rgba(240, 240, 80, 0.7)',
-                            'rgba(240, 80, 240, 0.7)',
-                            'rgba(80, 240, 240, 0.7)',
-                            // Add more colors if needed
-                        ],
-                        borderColor: 'rgba(255, 255, 255, 1)',
-                        borderWidth: 1
-                    }]
-                },
-                options: {
-                    responsive: true,
-                    maintainAspectRatio: false,
-                }
-            });
-        })
-        .catch(error => console.error('Error fetching CPU distribution data:', error));
+        const ctx = document.getElementById('cpuDistributionChart').getContext('2d');
+        new Chart(ctx, {
+            type: 'pie',
+            data: {
+                labels: labels,
+                datasets: [{
+                    label: 'CPU Arch Distribution',
+                    data: usageCounts,
+                    backgroundColor: [
+                        'rgba(240, 80, 80, 0.7)',
+                        'rgba(80, 240, 80, 0.7)',
+                        'rgba(80, 80, 240, 0.7)',
+                        'rgba(240, 240, 80, 0.7)',
+                        'rgba(240, 80, 240, 0.7)',
+                        'rgba(80, 240, 240, 0.7)',
+                        // Add more colors if needed
+                    ],
+                    borderColor: 'rgba(255, 255, 255, 1)',
+                    borderWidth: 1
+                }]
+            },
+            options: {
+                responsive: true,
+                maintainAspectRatio: false,
+            }
+        });
     }
 
     // --- NEW CHART CREATION FUNCTION for Hostname Usage ---
-    function createHostnameUsageChart() {
-        fetch('/api/hostname-usage') // Fetch data from the new hostname usage endpoint
-        .then(response => response.json())
-        .then(data => {
-            const labels = data.map(item => item.fqdn); // Use fqdn as labels
-            const usageCounts = data.map(item => item.usage_count);
+    function createHostnameUsageChart(data) {
+        const labels = data.map(item => item.fqdn); // Use fqdn as labels
+        const usageCounts = data.map(item => item.usage_count);
 
-            const ctx = document.getElementById('hostnameUsageChart').getContext('2d');
-            new Chart(ctx, {
-                type: 'bar', // Or 'pie' if you prefer a pie chart for hostnames
-                data: {
-                    labels: labels,
-                    datasets: [{
-                        label: 'Hostname Usage Count',
-                        data: usageCounts,
-                        backgroundColor: 'rgba(255, 159, 64, 0.7)', // Example color
-                        borderColor: 'rgba(255, 159, 64, 1)',
-                        borderWidth: 1
-                    }]
-                },
-                options: {
-                    responsive: true,
-                    maintainAspectRatio: false,
-                    scales: {
-                        y: {
-                            beginAtZero: true,
-                            title: {
-                                display: true,
-                                text: 'Usage Count'
-                            }
-                        },
-                        x: {
-                            title: {
-                                display: true,
-                                text: 'Hostname (FQDN)'
-                            }
+        const ctx = document.getElementById('hostnameUsageChart').getContext('2d');
+        new Chart(ctx, {
+            type: 'bar', // Or 'pie' if you prefer a pie chart for hostnames
+            data: {
+                labels: labels,
+                datasets: [{
+                    label: 'Hostname Usage Count',
+                    data: usageCounts,
+                    backgroundColor: 'rgba(255, 159, 64, 0.7)', // Example color
+                    borderColor: 'rgba(255, 159, 64, 1)',
+                    borderWidth: 1
+                }]
+            },
+            options: {
+                responsive: true,
+                maintainAspectRatio: false,
+                scales: {
+                    y: {
+                        beginAtZero: true,
+                        title: {
+                            display: true,
+                            text: 'Usage Count'
+                        }
+                    },
+                    x: {
+                        title: {
+                            display: true,
+                            text: 'Hostname (FQDN)'
                         }
                     }
                 }
+            }
+        });
+    }
+
+    // --- Distinct Users and Hosts ---
+    // Approximate counts from /api/distinct; days are UTC, like the server's
+    const DISTINCT_CHART_APPS = 20;
+    const distinctFromInput = document.getElementById('distinct-from');
+    const distinctToInput = document.getElementById('distinct-to');
+    const distinctSummary = document.getElementById('distinct-summary');
+    let distinctChart = null;
+    distinctToInput.value = new Date().toISOString().slice(0, 10);
+    distinctFromInput.value = new Date(Date.now() - 6 * 24 * 60 * 60 * 1000).toISOString().slice(0, 10);
+
+    function fetchDistinctCounts() {
+        const params = new URLSearchParams({ from: distinctFromInput.value, to: distinctToInput.value });
+        fetch(`/api/distinct?${params}`)
+            .then(response => response.json())
+            .then(data => {
+                if (data.error) {
+                    distinctSummary.textContent = data.error;
+                    return;
+                }
+                distinctSummary.textContent = `${data.from} to ${data.to}: about ${data.users} distinct users on ` +
+                    `${data.hosts} distinct hosts across all applications.`;
+                createDistinctChart(data.apps.slice(0, DISTINCT_CHART_APPS));
+            })
+            .catch(error => {
+                console.error('Error fetching distinct counts:', error);
+                distinctSummary.textContent = 'Failed to load distinct counts.';
             });
-        })
-        .catch(error => console.error('Error fetching hostname usage data:', error));
     }
 
+    function createDistinctChart(data) {
+        if (distinctChart) {
+            distinctChart.destroy();
+        }
+        const ctx = document.getElementById('distinctChart').getContext('2d');
+        distinctChart = new Chart(ctx, {
+            type: 'bar',
+            data: {
+                labels: data.map(item => item.app_name),
+                datasets: [{
+                    label: 'Distinct Users',
+                    data: data.map(item => item.users),
+                    backgroundColor: 'rgba(54, 162, 235, 0.7)',
+                    borderColor: 'rgba(54, 162, 235, 1)',
+                    borderWidth: 1
+                }, {
+                    label: 'Distinct Hosts',
+                    data: data.map(item => item.hosts),
+                    backgroundColor: 'rgba(255, 99, 132, 0.7)',
+                    borderColor: 'rgba(255, 99, 132, 1)',
+                    borderWidth: 1
+                }]
+            },
+            options: {
+                responsive: true,
+                maintainAspectRatio: false,
+                scales: {
+                    y: {
+                        beginAtZero: true,
+                        title: {
+                            display: true,
+                            text: 'Distinct Count (approximate)'
+                        }
+                    },
+                    x: {
+                        title: {
+                            display: true,
+                            text: 'Application Name'
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    document.getElementById('fetch-distinct').addEventListener('click', fetchDistinctCounts);
+    fetchDistinctCounts();
+
     // --- Daily Raw Data Fetching ---
     const fetchDailyDataButton = document.getElementById('fetch-daily-data');
     const dailyDataTableBody = document.querySelector('#daily-usage-table tbody');
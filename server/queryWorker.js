@@ -0,0 +1,156 @@
+// Worker thread for ad-hoc queries (/usage/custom-query). Each worker owns one
+// read-only connection and runs one query at a time for app.js. Rows are sent
+// back in chunks, and the next chunk is only read once app.js has acked the
+// previous one, so a slow client never makes the worker buffer a whole result.
+const { parentPort, workerData } = require('worker_threads');
+const sqlite3 = require('sqlite3');
+const { syncReadConnection } = require('./partitions');
+
+const db = new sqlite3.Database(workerData.dbFilePath, sqlite3.OPEN_READONLY);
+db.run('PRAGMA query_only = ON');
+
+let current = null;
+
+// In partitioned storage app.js sends the current partitions whenever they
+// change. They are attached before the next query runs, or right away when
+// the worker is idle, so the files of expired partitions are let go.
+let partitionUpdate = workerData.partitions || null;
+let partitionSyncing = false;
+const afterPartitionSync = [];
+
+function applyPartitions(done) {
+    if (partitionSyncing) {
+        return afterPartitionSync.push(done);
+    }
+    if (!partitionUpdate) {
+        return done();
+    }
+    const partitions = partitionUpdate;
+    partitionUpdate = null;
+    partitionSyncing = true;
+    syncReadConnection(db, partitions, (err) => {
+        if (err) {
+            console.error('Query worker could not attach partitions:', err.message);
+        }
+        partitionSyncing = false;
+        // An update that arrived meanwhile goes in before the waiting queries
+        const waiting = afterPartitionSync.splice(0);
+        waiting.push(done);
+        applyPartitions(() => waiting.forEach(callback => callback()));
+    });
+}
+
+parentPort.on('message', (msg) => {
+    if (msg.type === 'query') {
+        applyPartitions(() => runQuery(msg));
+    } else if (msg.type === 'partitions') {
+        partitionUpdate = msg.partitions;
+        if (!current) {
+            applyPartitions(() => {});
+        }
+    } else if (current && current.id === msg.id) {
+        if (msg.type === 'ack') {
+            current.waiting = false;
+            step(current);
+        } else if (msg.type === 'cancel') {
+            abort(current, 'cancelled');
+        }
+    }
+});
+
+function runQuery({ id, sql, maxRows, timeoutMs, chunkRows }) {
+    const query = {
+        id,
+        maxRows,
+        chunkRows,
+        rows: [],
+        count: 0,
+        waiting: false,
+        stepping: false,
+        aborted: null,
+        finished: false,
+        stmt: null
+    };
+    current = query;
+    // node-sqlite3 does not expose the progress handler; interrupting the
+    // connection stops the running statement the same way.
+    query.timer = setTimeout(() => abort(query, 'timeout'), timeoutMs);
+    query.stmt = db.prepare(sql, (err) => {
+        if (err) {
+            return finish(query, err);
+        }
+        step(query);
+    });
+}
+
+function step(query) {
+    if (query.aborted) {
+        return finish(query, null);
+    }
+    query.stepping = true;
+    query.stmt.get((err, row) => {
+        query.stepping = false;
+        if (query.aborted) {
+            return finish(query, null);
+        }
+        if (err) {
+            return finish(query, err);
+        }
+        if (!row) {
+            sendRows(query);
+            return finish(query, null);
+        }
+        query.rows.push(row);
+        query.count++;
+        if (query.count >= query.maxRows) {
+            sendRows(query);
+            return finish(query, null, true);
+        }
+        if (query.rows.length >= query.chunkRows) {
+            sendRows(query);
+            query.waiting = true;
+            return;
+        }
+        step(query);
+    });
+}
+
+function sendRows(query) {
+    if (query.rows.length > 0) {
+        parentPort.postMessage({ type: 'rows', id: query.id, rows: query.rows });
+        query.rows = [];
+    }
+}
+
+function abort(query, reason) {
+    if (query.finished || query.aborted) {
+        return;
+    }
+    query.aborted = reason;
+    if (query.stepping) {
+        db.interrupt(); // the pending step returns SQLITE_INTERRUPT
+    } else {
+        finish(query, null);
+    }
+}
+
+function finish(query, err, truncated) {
+    if (query.finished) {
+        return;
+    }
+    query.finished = true;
+    clearTimeout(query.timer);
+    if (query.stmt) {
+        query.stmt.finalize();
+    }
+    if (current === query) {
+        current = null;
+    }
+    if (query.aborted) {
+        parentPort.postMessage({ type: 'error', id: query.id, code: query.aborted, message: `Query ${query.aborted === 'timeout' ? 'exceeded its time limit' : 'was cancelled'}.` });
+    } else if (err) {
+        parentPort.postMessage({ type: 'error', id: query.id, code: 'sqlite', message: err.message });
+    } else {
+        parentPort.postMessage({ type: 'done', id: query.id, rows: query.count, truncated: !!truncated });
+    }
+}
@@ -0,0 +1,266 @@
+// Preloaded into app.js by server.test.js (node -r ./harness.js app.js).
+// The HTTP layer is replaced by stand-ins that only record the routes, so
+// the server runs without ports, certificates or OAuth, and with a real
+// sqlite3. SERVER_TEST_SCENARIO holds an async function's source; it is
+// called with the helpers below once app.js has loaded, and what it returns
+// is printed as the SERVER_TEST_RESULT line for the test to check. The
+// server is then shut down with SIGTERM.
+const Module = require('module');
+const fs = require('fs');
+const { isMainThread } = require('worker_threads');
+
+const routes = []; // { method, path, handlers }
+
+// express() and express.Router(): record routes, ignore middleware
+function createApp() {
+    const app = () => {};
+    for (const method of ['get', 'post', 'put', 'delete', 'all']) {
+        app[method] = (route, ...handlers) => {
+            routes.push({ method, path: route, handlers });
+            return app;
+        };
+    }
+    app.use = () => app;
+    app.set = () => app;
+    return app;
+}
+const express = () => createApp();
+express.Router = () => createApp();
+express.static = () => (req, res, next) => next();
+
+const passThrough = () => (req, res, next) => next();
+const fakeServer = () => ({
+    listen() { return this; },
+    on() { return this; },
+    close(callback) {
+        if (callback) {
+            callback();
+        }
+    }
+});
+const stubs = {
+    express,
+    'body-parser': { json: passThrough, text: passThrough, urlencoded: passThrough },
+    'express-session': passThrough,
+    passport: {
+        use() {},
+        initialize: passThrough,
+        session: passThrough,
+        authenticate: passThrough,
+        serializeUser() {},
+        deserializeUser() {}
+    },
+    'passport-oauth2': function OAuth2Strategy() {},
+    dotenv: { config() {} },
+    http: { createServer: fakeServer },
+    https: { createServer: fakeServer }
+};
+
+if (isMainThread) {
+    const load = Module._load;
+    Module._load = function (request, parent, isMain) {
+        if (Object.prototype.hasOwnProperty.call(stubs, request)) {
+            return stubs[request];
+        }
+        return load.call(this, request, parent, isMain);
+    };
+    // There is no TLS certificate in a test copy
+    const readFileSync = fs.readFileSync;
+    fs.readFileSync = function (file, ...args) {
+        if (/\.(key|pem)$/.test(String(file))) {
+            return '';
+        }
+        return readFileSync.call(this, file, ...args);
+    };
+}
+
+// Call the handlers of a route as Express would, signed in. Resolves with
+// { status, headers, body } once the response has ended; a JSON body is
+// parsed.
+function invoke(method, route, { query = {}, params = {}, body, headers = {} } = {}) {
+    const match = routes.find(r => r.method === method && r.path === route);
+    if (!match) {
+        throw new Error(`No route ${method} ${route}`);
+    }
+    return new Promise((resolve) => {
+        const out = { status: 200, headers: {}, body: undefined };
+        const chunks = [];
+        const listeners = {};
+        const finish = () => {
+            if (res.writableEnded) {
+                return;
+            }
+            res.writableEnded = true;
+            if (out.body === undefined && chunks.length) {
+                out.body = chunks.join('');
+            }
+            if (typeof out.body === 'string' && /json/.test(out.headers['content-type'] || '')) {
+                try {
+                    out.body = JSON.parse(out.body);
+                } catch (err) {
+                    // left as text; NDJSON and cut-off streams are not one document
+                }
+            }
+            resolve(out);
+            setImmediate(() => res.emit('finish') && res.emit('close'));
+        };
+        const res = {
+            statusCode: 200,
+            headersSent: false,
+            writableEnded: false,
+            status(code) {
+                out.status = code;
+                this.statusCode = code;
+                return this;
+            },
+            setHeader(name, value) {
+                out.headers[name.toLowerCase()] = value;
+            },
+            getHeader(name) {
+                return out.headers[name.toLowerCase()];
+            },
+            set(name, value) {
+                if (typeof name === 'object') {
+                    for (const [key, v] of Object.entries(name)) {
+                        this.setHeader(key, v);
+                    }
+                } else {
+                    this.setHeader(name, value);
+                }
+                return this;
+            },
+            type(value) {
+                this.setHeader('Content-Type', value);
+                return this;
+            },
+            json(data) {
+                out.body = data;
+                finish();
+                return this;
+            },
+            send(data) {
+                out.body = data;
+                finish();
+                return this;
+            },
+            sendStatus(code) {
+                out.status = code;
+                finish();
+                return this;
+            },
+            redirect(url) {
+                out.status = 302;
+                out.headers.location = url;
+                finish();
+            },
+            render(view, data) {
+                out.body = { view, data };
+                finish();
+            },
+            write(chunk) {
+                this.headersSent = true;
+                chunks.push(String(chunk));
+                return true;
+            },
+            end(chunk) {
+                if (chunk !== undefined && typeof chunk !== 'function') {
+                    chunks.push(String(chunk));
+                }
+                finish();
+            },
+            destroy(err) {
+                out.destroyed = err ? err.message : true;
+                finish();
+            },
+            on(event, listener) {
+                (listeners[event] = listeners[event] || []).push(listener);
+                return this;
+            },
+            once(event, listener) {
+                const wrapper = (...args) => {
+                    this.removeListener(event, wrapper);
+                    listener(...args);
+                };
+                return this.on(event, wrapper);
+            },
+            removeListener(event, listener) {
+                listeners[event] = (listeners[event] || []).filter(l => l !== listener);
+                return this;
+            },
+            emit(event, ...args) {
+                (listeners[event] || []).slice().forEach(listener => listener(...args));
+                return true;
+            }
+        };
+        const lowerHeaders = Object.fromEntries(Object.entries(headers).map(([k, v]) => [k.toLowerCase(), v]));
+        const search = new URLSearchParams(query).toString();
+        const req = {
+            method: method.toUpperCase(),
+            url: route,
+            path: route,
+            originalUrl: search ? `${route}?${search}` : route,
+            query,
+            params,
+            body,
+            headers: lowerHeaders,
+            get: name => lowerHeaders[name.toLowerCase()],
+            isAuthenticated: () => true,
+            secure: true,
+            ip: '127.0.0.1',
+            socket: { remoteAddress: '127.0.0.1' },
+            on() {}
+        };
+        const handlers = match.handlers.slice();
+        const next = () => {
+            const handler = handlers.shift();
+            if (handler) {
+                handler(req, res, next);
+            }
+        };
+        next();
+    });
+}
+
+const sleep = ms => new Promise(resolve => setTimeout(resolve, ms));
+
+// Poll `check` until it returns something truthy
+async function until(check, timeoutMs = 20000) {
+    const deadline = Date.now() + timeoutMs;
+    for (;;) {
+        const value = await check();
+        if (value) {
+            return value;
+        }
+        if (Date.now() > deadline) {
+            throw new Error('Timed out waiting for the server.');
+        }
+        await sleep(50);
+    }
+}
+
+// Rows of a query run through /usage/custom-query
+async function query(sql) {
+    const res = await invoke('get', '/usage/custom-query', { query: { sql } });
+    if (res.status !== 200) {
+        throw new Error(`Query failed with ${res.status}: ${JSON.stringify(res.body)}`);
+    }
+    return res.body;
+}
+
+if (isMainThread && process.env.SERVER_TEST_SCENARIO) {
+    // app.js is loaded after this preload; start once it has run
+    setImmediate(async () => {
+        let result;
+        try {
+            const scenario = eval(`(${process.env.SERVER_TEST_SCENARIO})`);
+            result = { value: await scenario({ invoke, query, sleep, until, dir: process.cwd() }) };
+        } catch (err) {
+            result = { error: err.stack || String(err) };
+        }
+        process.stdout.write(`\nSERVER_TEST_RESULT ${JSON.stringify(result)}\n`);
+        // Shut down as on a real SIGTERM, which also takes a backup
+        process.kill(process.pid, 'SIGTERM');
+    });
+}
+
+module.exports = { invoke };
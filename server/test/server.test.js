@@ -0,0 +1,643 @@
+// Tests for the usage server: node --test server/test/server.test.js, or
+// npm test in server/ (tests/tests.sh runs them when node is installed). Each test runs app.js in a scratch copy of
+// server/ through harness.js, which stubs out the HTTP layer and calls the
+// routes directly. The server tests need the sqlite3 module (npm install in
+// server/) and are skipped without it.
+const { test } = require('node:test');
+const assert = require('node:assert');
+const { spawn } = require('child_process');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+
+const { createSketch, addToSketch, mergeSketch, estimateSketch, encodeSketch, decodeSketch } = require('../hll');
+const { partitionMonth, partitionFileMonth } = require('../partitions');
+
+const serverDir = path.join(__dirname, '..');
+const SERVER_FILES = ['app.js', 'hll.js', 'partitions.js', 'queryWorker.js'];
+const SERVER_TEST_TIMEOUT_MS = 60000;
+
+let sqlite3 = null;
+try {
+    sqlite3 = require(require.resolve('sqlite3', { paths: [serverDir] }));
+} catch (err) {
+    // skipped below
+}
+const needsSqlite = { skip: sqlite3 ? false : 'the sqlite3 module is not installed in server/' };
+
+// A scratch copy of the server's sources, with its own database
+function scratchServer() {
+    const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'zusage-server-test-'));
+    for (const file of SERVER_FILES) {
+        fs.copyFileSync(path.join(serverDir, file), path.join(dir, file));
+    }
+    fs.symlinkSync(path.join(serverDir, 'node_modules'), path.join(dir, 'node_modules'), 'dir');
+    return dir;
+}
+
+// Run SQL on a database file outside the server, e.g. to set up an old one
+function withDatabase(file, work) {
+    return new Promise((resolve, reject) => {
+        const db = new sqlite3.Database(file);
+        work(db, (err, value) => db.close(() => (err ? reject(err) : resolve(value))));
+    });
+}
+
+function execSql(file, sql) {
+    return withDatabase(file, (db, done) => db.exec(sql, done));
+}
+
+// Start app.js in `dir` and return what `scenario` returns. The scenario is
+// an async function that runs inside the server process (see harness.js),
+// so it can only use its arguments. Without a scenario the server is
+// expected to exit on its own, and its exit code and output are returned.
+function runServer(dir, scenario, env = {}) {
+    return new Promise((resolve, reject) => {
+        const child = spawn(process.execPath, ['-r', path.join(__dirname, 'harness.js'), 'app.js'], {
+            cwd: dir,
+            env: {
+                ...process.env,
+                USAGE_HTTP_LISTENER: 'off',
+                QUERY_WORKERS: '1',
+                ...env,
+                SERVER_TEST_SCENARIO: scenario ? scenario.toString() : ''
+            },
+            stdio: ['ignore', 'pipe', 'pipe']
+        });
+        let stdout = '';
+        let stderr = '';
+        child.stdout.on('data', chunk => { stdout += chunk; });
+        child.stderr.on('data', chunk => { stderr += chunk; });
+        const timer = setTimeout(() => child.kill('SIGKILL'), SERVER_TEST_TIMEOUT_MS);
+        child.on('close', (code) => {
+            clearTimeout(timer);
+            const line = stdout.split('\n').find(l => l.startsWith('SERVER_TEST_RESULT '));
+            if (!scenario) {
+                return resolve({ output: stdout + stderr, code });
+            }
+            if (!line) {
+                return reject(new Error(`Server exited with ${code} before the scenario finished:\n${stdout}\n${stderr}`));
+            }
+            const result = JSON.parse(line.slice('SERVER_TEST_RESULT '.length));
+            if (result.error) {
+                return reject(new Error(`${result.error}\n--- server output ---\n${stdout}\n${stderr}`));
+            }
+            resolve({ value: result.value, output: stdout + stderr, code });
+        });
+    });
+}
+
+// --- Group commit ---
+
+test('concurrent events are committed in groups and all acknowledged', needsSqlite, async () => {
+    const dir = scratchServer();
+    const { value } = await runServer(dir, async ({ invoke, query }) => {
+        const base = {
+            fqdn: 'host1.example.com', local_ip: '10.0.0.1', os_release: '29.00',
+            cpu_arch: '3931', app_version: '1.0', username: 'user1'
+        };
+        const singles = [];
+        for (let i = 0; i < 200; i++) {
+            singles.push(invoke('post', '/usage', { body: { app_name: `app${i % 5}`, ...base } }));
+        }
+        const batch = invoke('post', '/usage/batch', {
+            body: [{ app_name: 'batched', ...base }, { app_name: 'batched', ...base, count: 7, last_seen: Date.now() }]
+        });
+        const responses = await Promise.all([...singles, batch]);
+        const metrics = await invoke('get', '/api/metrics');
+        return {
+            statuses: [...new Set(responses.map(r => r.status))],
+            ids: responses.slice(0, 200).map(r => r.body.id),
+            batch: responses[200].body,
+            ingest: metrics.body.ingest,
+            rows: await query('SELECT COUNT(*) AS n, SUM(weight) AS w FROM usage')
+        };
+    });
+    assert.deepStrictEqual(value.statuses, [201]);
+    assert.strictEqual(new Set(value.ids).size, 200);
+    assert.strictEqual(value.batch.inserted, 2);
+    assert.deepStrictEqual(value.rows, [{ n: 202, w: 208 }]);
+    assert.strictEqual(value.ingest.rows_committed, 202);
+    assert.strictEqual(value.ingest.failed_commits, 0);
+    // Requests that arrive together share a transaction
+    assert.ok(value.ingest.commits < 202, `${value.ingest.commits} commits for 202 rows`);
+    assert.ok(value.ingest.rows_per_commit_max > 1);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+test('invalid events are rejected and nothing is written', needsSqlite, async () => {
+    const dir = scratchServer();
+    const { value } = await runServer(dir, async ({ invoke }) => {
+        const missing = await invoke('post', '/usage', { body: { app_name: 'x' } });
+        const tooMany = await invoke('post', '/usage', {
+            body: {
+                app_name: 'x', fqdn: 'h', local_ip: '1', os_release: 'r', cpu_arch: 'c', app_version: 'v',
+                count: 100001, last_seen: Date.now()
+            }
+        });
+        const metrics = await invoke('get', '/api/metrics');
+        return { missing: missing.status, tooMany: tooMany.status, committed: metrics.body.ingest.rows_committed };
+    });
+    assert.deepStrictEqual(value, { missing: 400, tooMany: 400, committed: 0 });
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Schema migration ---
+
+test('a database from before schema v2 is migrated in place', needsSqlite, async () => {
+    const dir = scratchServer();
+    // The original schema: no ts, no weight, no rollups
+    await execSql(path.join(dir, 'usage_data.db'), `
+        CREATE TABLE usage (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            app_name TEXT NOT NULL,
+            fqdn TEXT NOT NULL,
+            local_ip TEXT NOT NULL,
+            os_release TEXT NOT NULL,
+            cpu_arch TEXT NOT NULL,
+            app_version TEXT NOT NULL,
+            timestamp TEXT NOT NULL,
+            username TEXT NOT NULL
+        );
+        INSERT INTO usage (app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username) VALUES
+            ('vim', 'host1', '10.0.0.1', '29.00', '3931', '9.0', '2026-09-14T10:00:00.000Z', 'u1'),
+            ('vim', 'host2', '10.0.0.2', '29.00', '3931', '9.0', '2026-09-14T23:59:59.999Z', 'u2'),
+            ('git', 'host1', '10.0.0.1', '29.00', '3931', '2.4', '2026-09-15T00:00:00.000Z', 'u1');
+    `);
+    const { value } = await runServer(dir, async ({ invoke, query, until }) => {
+        await until(async () => (await query('PRAGMA user_version'))[0].user_version === 2);
+        const posted = await invoke('post', '/usage', {
+            body: {
+                app_name: 'git', fqdn: 'host3', local_ip: '10.0.0.3', os_release: '29.00',
+                cpu_arch: '3931', app_version: '2.4'
+            }
+        });
+        const day = await invoke('get', '/usage/daily-raw/:date', { params: { date: '2026-09-14' } });
+        return {
+            posted: posted.status,
+            rows: await query('SELECT id, timestamp, ts, weight FROM usage ORDER BY id'),
+            rollup: await query(`SELECT day, app_name, usage_count FROM usage_daily_app
+                                 WHERE day < '2026-10-01' ORDER BY day, app_name`),
+            day: day.body.map(row => row.id)
+        };
+    });
+    assert.strictEqual(value.posted, 201);
+    assert.strictEqual(value.rows.length, 4);
+    for (const row of value.rows) {
+        assert.strictEqual(row.ts, Date.parse(row.timestamp), `row ${row.id}`);
+        assert.strictEqual(row.weight, 1);
+    }
+    // The existing rows are counted into the rollups once
+    assert.deepStrictEqual(value.rollup, [
+        { day: '2026-09-14', app_name: 'vim', usage_count: 2 },
+        { day: '2026-09-15', app_name: 'git', usage_count: 1 }
+    ]);
+    // Day queries go by ts, newest first; the last millisecond still
+    // belongs to its day
+    assert.deepStrictEqual(value.day, [2, 1]);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Normalized storage ---
+
+test('normalized storage converts a legacy table and keeps the usage view writable', needsSqlite, async () => {
+    const dir = scratchServer();
+    const dbFile = path.join(dir, 'usage_data.db');
+    await execSql(dbFile, legacyDatabaseSql(['2026-09-14T10:00:00.000Z', '2026-09-14T11:00:00.000Z']));
+    const { value } = await runServer(dir, async ({ invoke, query }) => {
+        const posted = await invoke('post', '/usage', {
+            body: {
+                app_name: 'app1', fqdn: 'HOST2', local_ip: '10.0.0.2', os_release: '29.00',
+                cpu_arch: '3931', app_version: '1.0', count: 4, last_seen: Date.now()
+            }
+        });
+        return {
+            posted: posted.status,
+            rows: await query('SELECT id, app_name, fqdn, timestamp, ts, weight FROM usage ORDER BY id')
+        };
+    }, { USAGE_STORAGE_MODE: 'normalized' });
+    assert.strictEqual(value.posted, 201);
+    assert.deepStrictEqual(value.rows.map(row => [row.id, row.app_name, row.fqdn, row.weight]),
+        [[1, 'app0', 'host1', 1], [2, 'app1', 'host1', 1], [3, 'app1', 'host2', 4]]);
+    for (const row of value.rows) {
+        assert.strictEqual(Date.parse(row.timestamp), row.ts);
+    }
+
+    // Another writer inserts and deletes through the view; the rollup
+    // triggers on usage_facts follow both
+    const after = await withDatabase(dbFile, (db, done) => db.exec(`
+        INSERT INTO usage (app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username)
+        VALUES ('app2', 'host1', '10.0.0.1', '29.00', '3931', '2.0', '2026-09-15T08:00:00.000Z', 'u9');
+        DELETE FROM usage WHERE id = 1;
+    `, (err) => {
+        if (err) {
+            return done(err);
+        }
+        db.all(`SELECT (SELECT COUNT(*) FROM usage_facts) AS facts,
+                       (SELECT COUNT(*) FROM dim_app_name) AS apps,
+                       (SELECT ts FROM usage WHERE app_name = 'app2') AS ts,
+                       (SELECT usage_count FROM usage_daily_app WHERE day = '2026-09-14' AND app_name = 'app0') AS app0,
+                       (SELECT usage_count FROM usage_daily_app WHERE day = '2026-09-15' AND app_name = 'app2') AS app2`, done);
+    }));
+    assert.deepStrictEqual(after, [{ facts: 3, apps: 3, ts: Date.parse('2026-09-15T08:00:00.000Z'), app0: 0, app2: 1 }]);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Keyset pagination ---
+
+test('raw endpoints page by keyset cursors', needsSqlite, async () => {
+    const dir = scratchServer();
+    // Ties on ts within the day, and neighbours on either side of it
+    await execSql(path.join(dir, 'usage_data.db'), legacyDatabaseSql([
+        '2026-09-14T10:00:00.000Z', '2026-09-14T12:00:00.000Z', '2026-09-14T10:00:00.000Z',
+        '2026-09-13T23:00:00.000Z', '2026-09-14T12:00:00.000Z', '2026-09-15T00:00:00.000Z',
+        '2026-09-14T10:00:00.000Z'
+    ]));
+    const { value } = await runServer(dir, async ({ invoke, query, until }) => {
+        await until(async () => (await query('PRAGMA user_version'))[0].user_version === 2);
+        // Follow next_after_id until it runs out
+        const walk = async (route, params, limit) => {
+            const pages = [];
+            let afterId;
+            do {
+                const res = await invoke('get', route, {
+                    params,
+                    query: afterId === undefined ? { limit } : { limit, after_id: String(afterId) }
+                });
+                pages.push(res.body.rows.map(row => row.id));
+                afterId = res.body.next_after_id;
+            } while (afterId !== null);
+            return pages;
+        };
+        const day = { date: '2026-09-14' };
+        const streamed = await invoke('get', '/usage/raw', { query: { after_id: '4' } });
+        return {
+            raw: await walk('/usage/raw', {}, '3'),
+            streamed: streamed.body.map(row => row.id),
+            daily: await walk('/usage/daily-raw/:date', day, '2'),
+            unknownCursor: (await invoke('get', '/usage/daily-raw/:date', { params: day, query: { after_id: '99' } })).status,
+            badLimit: (await invoke('get', '/usage/raw', { query: { limit: '0' } })).status
+        };
+    });
+    assert.deepStrictEqual(value.raw, [[1, 2, 3], [4, 5, 6], [7]]);
+    assert.deepStrictEqual(value.streamed, [5, 6, 7]);
+    // Newest first; rows sharing a ts are split across pages by id
+    assert.deepStrictEqual(value.daily, [[5, 2], [7, 3], [1]]);
+    assert.strictEqual(value.unknownCursor, 400);
+    assert.strictEqual(value.badLimit, 400);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Query worker pool ---
+
+test('custom queries time out, queue for the worker and are cut off at the row limit', needsSqlite, async () => {
+    const dir = scratchServer();
+    const { value } = await runServer(dir, async ({ invoke }) => {
+        const customQuery = async (sql) => {
+            const startedAt = Date.now();
+            const res = await invoke('get', '/usage/custom-query', { query: { sql } });
+            return { status: res.status, body: res.body, maxRows: res.headers['x-max-rows'], ms: Date.now() - startedAt };
+        };
+        // Far longer than the time limit unless interrupted; the second
+        // query waits for the only worker
+        const [slow, queued] = await Promise.all([
+            customQuery(`WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 1000000000)
+                         SELECT COUNT(*) AS n FROM c`),
+            customQuery('SELECT 1 AS one')
+        ]);
+        const truncated = await customQuery(`WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 100)
+                                             SELECT x FROM c`);
+        const metrics = await invoke('get', '/api/metrics');
+        return { slow, queued, truncated, queries: metrics.body.queries };
+    }, { QUERY_TIMEOUT_MS: '300', QUERY_MAX_ROWS: '5' });
+    assert.strictEqual(value.slow.status, 504);
+    // Stopped by the time limit, not by restarting the worker
+    assert.ok(value.slow.ms >= 300 && value.slow.ms < 5000, `slow query took ${value.slow.ms} ms`);
+    assert.strictEqual(value.queued.status, 200);
+    assert.deepStrictEqual(value.queued.body, [{ one: 1 }]);
+    assert.strictEqual(value.truncated.maxRows, '5');
+    assert.deepStrictEqual(value.truncated.body.map(row => row.x), [1, 2, 3, 4, 5]);
+    assert.strictEqual(value.queries.workers, 1);
+    assert.strictEqual(value.queries.timed_out, 1);
+    assert.strictEqual(value.queries.completed, 2);
+    assert.strictEqual(value.queries.failed, 0);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Aggregate cache ---
+
+test('chart responses carry an ETag and are revalidated against new data', needsSqlite, async () => {
+    const dir = scratchServer();
+    const { value } = await runServer(dir, async ({ invoke }) => {
+        const event = {
+            fqdn: 'host1', local_ip: '10.0.0.1', os_release: '29.00',
+            cpu_arch: '3931', app_version: '1.0'
+        };
+        const popularity = headers => invoke('get', '/api/app-popularity', { headers });
+        await invoke('post', '/usage', { body: { app_name: 'vim', ...event } });
+        const first = await popularity({});
+        const revalidated = await popularity({ 'If-None-Match': first.headers.etag });
+        const otherTag = await popularity({ 'If-None-Match': '"something-else"' });
+        await invoke('post', '/usage', { body: { app_name: 'git', ...event } });
+        const changed = await popularity({ 'If-None-Match': first.headers.etag });
+        const metrics = await invoke('get', '/api/metrics');
+        return { first, revalidated, otherTag, changed, cache: metrics.body.aggregate_cache };
+    });
+    const { first, revalidated, otherTag, changed, cache } = value;
+    assert.strictEqual(first.status, 200);
+    assert.match(first.headers.etag, /^"[^"]+"$/);
+    assert.strictEqual(first.headers['cache-control'], 'private, no-cache');
+    assert.deepStrictEqual(first.body, [{ app_name: 'vim', usage_count: 1 }]);
+    assert.strictEqual(revalidated.status, 304);
+    assert.strictEqual(revalidated.headers.etag, first.headers.etag);
+    assert.strictEqual(otherTag.status, 200);
+    // A commit invalidates the cached body and its tag
+    assert.strictEqual(changed.status, 200);
+    assert.notStrictEqual(changed.headers.etag, first.headers.etag);
+    assert.strictEqual(changed.body.length, 2);
+    // Hit and miss counts depend on when the data_version poll runs; the
+    // tag is a hash of the body either way
+    assert.strictEqual(cache.not_modified, 1);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Partitioned storage ---
+
+// The original usage table with one row per timestamp
+function legacyDatabaseSql(timestamps) {
+    const rows = timestamps.map((timestamp, i) =>
+        `('app${i % 2}', 'host1', '10.0.0.1', '29.00', '3931', '1.0', '${timestamp}', 'u1')`);
+    return `
+        CREATE TABLE usage (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            app_name TEXT NOT NULL,
+            fqdn TEXT NOT NULL,
+            local_ip TEXT NOT NULL,
+            os_release TEXT NOT NULL,
+            cpu_arch TEXT NOT NULL,
+            app_version TEXT NOT NULL,
+            timestamp TEXT NOT NULL,
+            username TEXT NOT NULL
+        );
+        INSERT INTO usage (app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username)
+        VALUES ${rows.join(', ')};
+    `;
+}
+
+// Noon UTC on the 10th, `monthsAgo` months back
+function monthsAgo(months) {
+    const now = new Date();
+    return new Date(Date.UTC(now.getUTCFullYear(), now.getUTCMonth() - months, 10, 12)).toISOString();
+}
+
+test('partition months follow UTC calendar months', () => {
+    assert.strictEqual(partitionMonth(Date.UTC(2026, 8, 30, 23, 59, 59, 999)), '2026_09');
+    assert.strictEqual(partitionMonth(Date.UTC(2026, 9, 1)), '2026_10');
+    assert.strictEqual(partitionMonth(Date.UTC(2026, 11, 31, 23, 59, 59, 999)), '2026_12');
+    assert.strictEqual(partitionMonth(Date.UTC(2027, 0, 1)), '2027_01');
+    assert.strictEqual(partitionFileMonth('usage_2026_10.db'), '2026_10');
+    assert.strictEqual(partitionFileMonth('usage_2026_10.db-wal'), null);
+    assert.strictEqual(partitionFileMonth('usage_data.db'), null);
+});
+
+// A partition file as the server writes it, with one row per timestamp
+function partitionFileSql(timestamps) {
+    const rows = timestamps.map((timestamp, i) =>
+        `(${i + 1}, 'app0', 'host1', '10.0.0.1', '29.00', '3931', '1.0', '${timestamp}', 'u1', ${Date.parse(timestamp)})`);
+    return `
+        CREATE TABLE usage (
+            id INTEGER PRIMARY KEY,
+            app_name TEXT NOT NULL,
+            fqdn TEXT NOT NULL,
+            local_ip TEXT NOT NULL,
+            os_release TEXT NOT NULL,
+            cpu_arch TEXT NOT NULL,
+            app_version TEXT NOT NULL,
+            timestamp TEXT NOT NULL,
+            username TEXT NOT NULL,
+            ts INTEGER NOT NULL,
+            weight INTEGER NOT NULL DEFAULT 1
+        );
+        INSERT INTO usage (id, app_name, fqdn, local_ip, os_release, cpu_arch, app_version, timestamp, username, ts)
+        VALUES ${rows.join(', ')};
+    `;
+}
+
+test('partitioned storage rejects a retention that is not a number of months', needsSqlite, async () => {
+    for (const retention of ['0', '-1', '1.5', 'six']) {
+        const dir = scratchServer();
+        const { code, output } = await runServer(dir, null, {
+            USAGE_STORAGE_MODE: 'partitioned',
+            USAGE_PARTITION_DIR: path.join(dir, 'partitions'),
+            USAGE_RETENTION_MONTHS: retention
+        });
+        assert.strictEqual(code, 1, `retention '${retention}'`);
+        assert.match(output, /USAGE_RETENTION_MONTHS must be a whole number of months/);
+        fs.rmSync(dir, { recursive: true, force: true });
+    }
+});
+
+test('converting with rows past retention is refused and deletes nothing', needsSqlite, async () => {
+    const dir = scratchServer();
+    const partitionDir = path.join(dir, 'partitions');
+    const database = path.join(dir, 'usage_data.db');
+    await execSql(database, legacyDatabaseSql([monthsAgo(0), monthsAgo(5)]));
+    const { code, output } = await runServer(dir, null, {
+        USAGE_STORAGE_MODE: 'partitioned',
+        USAGE_PARTITION_DIR: partitionDir,
+        USAGE_RETENTION_MONTHS: '3'
+    });
+    assert.strictEqual(code, 1);
+    assert.match(output, /would expire 1 rows/);
+    const rows = await withDatabase(database, (db, done) => db.all('SELECT id FROM usage ORDER BY id', done));
+    assert.deepStrictEqual(rows, [{ id: 1 }, { id: 2 }]);
+    assert.deepStrictEqual(fs.readdirSync(partitionDir).filter(partitionFileMonth), []);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+test('a legacy database is split into monthly partitions', needsSqlite, async () => {
+    const dir = scratchServer();
+    const partitionDir = path.join(dir, 'partitions');
+    const timestamps = [monthsAgo(1), monthsAgo(0), monthsAgo(1), monthsAgo(0), monthsAgo(10)];
+    await execSql(path.join(dir, 'usage_data.db'), legacyDatabaseSql(timestamps));
+    const { value } = await runServer(dir, async ({ invoke, query, until }) => {
+        await until(async () => (await query('SELECT COUNT(*) AS n FROM main.usage'))[0].n === 1);
+        const posted = await invoke('post', '/usage', {
+            body: {
+                app_name: 'app0', fqdn: 'host1', local_ip: '10.0.0.1', os_release: '29.00',
+                cpu_arch: '3931', app_version: '1.0'
+            }
+        });
+        const metrics = await invoke('get', '/api/metrics');
+        return {
+            posted: posted.body,
+            rows: await query('SELECT id, timestamp FROM usage ORDER BY id'),
+            history: await query('SELECT id FROM main.usage'),
+            attached: (await query('PRAGMA database_list')).map(db => db.name).filter(name => name.startsWith('p_')),
+            partitions: metrics.body.partitions,
+            rollup: await query('SELECT SUM(usage_count) AS n FROM usage_daily_app')
+        };
+    }, {
+        USAGE_STORAGE_MODE: 'partitioned',
+        USAGE_PARTITION_DIR: partitionDir
+    });
+    const current = partitionMonth(Date.parse(monthsAgo(0)));
+    const previous = partitionMonth(Date.parse(monthsAgo(1)));
+    // Rows keep their ids; the one from before the window stays in main
+    assert.deepStrictEqual(value.rows.map(row => row.id), [1, 2, 3, 4, 5, 6]);
+    assert.deepStrictEqual(value.history, [{ id: 5 }]);
+    assert.strictEqual(value.posted.id, 6);
+    assert.deepStrictEqual(value.attached.sort(), [`p_${previous}`, `p_${current}`].sort());
+    assert.strictEqual(value.partitions.rows_moved, 4);
+    assert.strictEqual(value.partitions.retention_months, null);
+    assert.deepStrictEqual(value.rollup, [{ n: 6 }]);
+    assert.deepStrictEqual(fs.readdirSync(partitionDir).filter(partitionFileMonth).sort(),
+        [`usage_${previous}.db`, `usage_${current}.db`].sort());
+    // The shutdown backup has the partitions next to main
+    assert.deepStrictEqual(fs.readdirSync(path.join(dir, 'usage_data.db.bak.partitions')).sort(),
+        [`usage_${previous}.db`, `usage_${current}.db`].sort());
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+test('a month that leaves the window is folded into the main database', needsSqlite, async () => {
+    const dir = scratchServer();
+    const partitionDir = path.join(dir, 'partitions');
+    const old = partitionMonth(Date.parse(monthsAgo(9)));
+    fs.mkdirSync(partitionDir);
+    await execSql(path.join(partitionDir, `usage_${old}.db`), partitionFileSql([monthsAgo(9), monthsAgo(9)]));
+    const { value } = await runServer(dir, async ({ invoke, query, until }) => {
+        await until(async () => (await invoke('get', '/api/metrics')).body.partitions.rows_folded === 2);
+        await until(async () => (await query('PRAGMA database_list')).length === 3);
+        return {
+            history: await query('SELECT id FROM main.usage ORDER BY id'),
+            visible: await query('SELECT COUNT(*) AS n FROM usage'),
+            attached: (await query('PRAGMA database_list')).map(db => db.name).filter(name => name.startsWith('p_'))
+        };
+    }, {
+        USAGE_STORAGE_MODE: 'partitioned',
+        USAGE_PARTITION_DIR: partitionDir
+    });
+    assert.deepStrictEqual(value.history, [{ id: 1 }, { id: 2 }]);
+    assert.deepStrictEqual(value.visible, [{ n: 2 }]);
+    assert.deepStrictEqual(value.attached, [`p_${partitionMonth(Date.now())}`]);
+    assert.deepStrictEqual(fs.readdirSync(partitionDir).filter(partitionFileMonth),
+        [`usage_${partitionMonth(Date.now())}.db`]);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+test('months past retention expire once they are archived', needsSqlite, async () => {
+    const dir = scratchServer();
+    const partitionDir = path.join(dir, 'partitions');
+    const old = partitionMonth(Date.parse(monthsAgo(3)));
+    fs.mkdirSync(partitionDir);
+    await execSql(path.join(partitionDir, `usage_${old}.db`), partitionFileSql([monthsAgo(3)]));
+    const { value } = await runServer(dir, async ({ invoke, query, until }) => {
+        await until(async () => (await invoke('get', '/api/metrics')).body.partitions.rows_expired === 1);
+        return {
+            visible: await query('SELECT COUNT(*) AS n FROM usage'),
+            partitions: (await invoke('get', '/api/metrics')).body.partitions
+        };
+    }, {
+        USAGE_STORAGE_MODE: 'partitioned',
+        USAGE_PARTITION_DIR: partitionDir,
+        USAGE_RETENTION_MONTHS: '1'
+    });
+    assert.deepStrictEqual(value.visible, [{ n: 0 }]);
+    assert.strictEqual(value.partitions.rows_folded, 1);
+    assert.strictEqual(value.partitions.window_months, 2);
+    // The row is in the archive before it is deleted
+    assert.strictEqual(fs.readdirSync(path.join(dir, 'archives')).filter(name => name.endsWith('.zua')).length, 1);
+    assert.ok(!fs.existsSync(path.join(partitionDir, `usage_${old}.db`)));
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+test('rows of a month that cannot be attached stay in the inbox', needsSqlite, async () => {
+    const dir = scratchServer();
+    const partitionDir = path.join(dir, 'partitions');
+    const previous = partitionMonth(Date.parse(monthsAgo(1)));
+    // A directory where the previous month's file should be
+    fs.mkdirSync(path.join(partitionDir, `usage_${previous}.db`), { recursive: true });
+    await execSql(path.join(dir, 'usage_data.db'), legacyDatabaseSql([monthsAgo(1), monthsAgo(0), monthsAgo(0)]));
+    const { value } = await runServer(dir, async ({ invoke, query, until }) => {
+        await until(async () => (await query('SELECT COUNT(*) AS n FROM main.usage'))[0].n === 1);
+        const posted = await invoke('post', '/usage', {
+            body: {
+                app_name: 'app0', fqdn: 'host1', local_ip: '10.0.0.1', os_release: '29.00',
+                cpu_arch: '3931', app_version: '1.0'
+            }
+        });
+        const metrics = await invoke('get', '/api/metrics');
+        return {
+            posted: posted.status,
+            inbox: await query('SELECT id FROM main.usage'),
+            visible: await query('SELECT COUNT(*) AS n FROM usage'),
+            partitions: metrics.body.partitions
+        };
+    }, {
+        USAGE_STORAGE_MODE: 'partitioned',
+        USAGE_PARTITION_DIR: partitionDir
+    });
+    assert.strictEqual(value.posted, 201);
+    assert.deepStrictEqual(value.inbox, [{ id: 1 }]);
+    assert.deepStrictEqual(value.visible, [{ n: 4 }]);
+    assert.strictEqual(value.partitions.rows_moved, 2);
+    assert.ok(value.partitions.attach_failures >= 1);
+    fs.rmSync(dir, { recursive: true, force: true });
+});
+
+// --- Distinct count sketches ---
+
+function sketchOf(values) {
+    const sketch = createSketch();
+    for (const value of values) {
+        addToSketch(sketch, value);
+    }
+    return sketch;
+}
+
+function users(from, to) {
+    const values = [];
+    for (let i = from; i < to; i++) {
+        values.push(`user${i}@host${i % 97}`);
+    }
+    return values;
+}
+
+test('sketch estimates stay within a few standard errors', () => {
+    for (const n of [0, 1, 10, 1000, 10000, 100000]) {
+        const estimate = estimateSketch(sketchOf(users(0, n)));
+        // 1.6% standard error, 5% allowed
+        assert.ok(Math.abs(estimate - n) <= Math.max(1, n * 0.05), `${estimate} for ${n} values`);
+    }
+});
+
+test('adding a value again leaves the sketch unchanged', () => {
+    const sketch = sketchOf(users(0, 500));
+    const before = Buffer.from(sketch);
+    for (const value of users(0, 500)) {
+        assert.strictEqual(addToSketch(sketch, value), false);
+    }
+    assert.deepStrictEqual(Buffer.from(sketch), before);
+});
+
+test('merged sketches equal the sketch of the union', () => {
+    // Overlapping sets, as on consecutive days
+    const merged = mergeSketch(sketchOf(users(0, 6000)), sketchOf(users(4000, 10000)));
+    assert.deepStrictEqual(merged, sketchOf(users(0, 10000)));
+    const estimate = estimateSketch(merged);
+    assert.ok(Math.abs(estimate - 10000) <= 500, `${estimate} for the union of 10000 values`);
+});
+
+test('sketches survive encoding, sparse and dense', () => {
+    for (const n of [0, 5, 100, 5000]) {
+        const sketch = sketchOf(users(0, n));
+        const blob = encodeSketch(sketch);
+        // A few users take a few bytes; many take every register
+        assert.strictEqual(blob[0], n < 1000 ? 0 : 1, `format for ${n} values`);
+        assert.deepStrictEqual(decodeSketch(blob), sketch);
+    }
+    // Decoding into a sketch merges
+    const into = sketchOf(users(0, 50));
+    decodeSketch(encodeSketch(sketchOf(users(50, 100))), into);
+    assert.deepStrictEqual(into, sketchOf(users(0, 100)));
+});
@@ -3,50 +3,36 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
-#include <sys/ps.h>
+#include <ctype.h>
 #include <arpa/inet.h>
 #include <limits.h>
 #include <stdarg.h>
+#ifdef __MVS__
 #include <_Nascii.h>
+#endif
 #include <pwd.h>
 
-// --- Macro Definitions ---
-
-#define USAGE_ANALYTICS_URL "zusage1.fyre.ibm.com"
-#define USAGE_ANALYTICS_PATH "/usage"
-#define USAGE_ANALYTICS_PORT 3000
-#define VERSION_FILE_RELATIVE_PATH "/../.version"
-#define PATH_MAX 1024*4
-
-#define MAX_HOSTNAME_LENGTH _POSIX_HOST_NAME_MAX
-#define MAX_IP_ADDRESS_LENGTH INET_ADDRSTRLEN
-#define MAX_TIMESTAMP_LENGTH 32
-#define MAX_POST_DATA_SIZE 4096
-#define MAX_APP_VERSION_LENGTH 100
-#define MAX_OS_RELEASE_LENGTH 32
-#define MAX_CPU_ARCH_LENGTH 16
-#define MAX_DEBUG_BUFFER_SIZE 8192
-#define MAX_USERNAME_LENGTH 64 
-#define MAX_FQDN_LENGTH MAX_HOSTNAME_LENGTH // Assuming FQDN won't exceed hostname length
+#include "zusage_internal.h"
+#include "zusage_wire.h"
+#include "zusage_trace.h"
 
-// --- Environment Variables ---
-#define DISABLE_ENV_VAR "ZUSAGE_DISABLE"
-#define DEBUG_ENV_VAR "ZUSAGE_DEBUG"
-
-#define IBM_CHECK_CACHE_EXPIRY (14 * 24 * 3600) // 2 weeks in seconds
-#define IBM_CHECK_CACHE_FILE_NAME "zusage_check.cache"
+extern char **environ;
 
 static int debug_fd = -1;
+static int debug_state = -1; // -1: not checked, 0: off, 1: on
 
 // --- Hostname Cache ---
 static char cached_hostname[MAX_HOSTNAME_LENGTH] = "";
@@ -81,8 +67,12 @@ char *generate_unique_filename() {
   return filename;
 }
 
+// ZUSAGE_DEBUG is read once per process, so a disabled call costs a branch.
 void print_debug(const char *format, ...) {
-  if (getenv(DEBUG_ENV_VAR) == NULL) {
+  if (debug_state < 0) {
+    debug_state = getenv(DEBUG_ENV_VAR) != NULL;
+  }
+  if (!debug_state) {
     return;
   }
 
@@ -103,12 +93,13 @@ void print_debug(const char *format, ...) {
   char timestamp[30];
   struct timeval tv;
   gettimeofday(&tv, NULL);
-  struct tm *tm_info = localtime(&tv.tv_sec);
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+  struct tm tm_info;
+  localtime_r(&tv.tv_sec, &tm_info);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
 
   char buffer[MAX_DEBUG_BUFFER_SIZE];
   int len = snprintf(buffer, sizeof(buffer), "%s.%06ld: ", timestamp, (long)tv.tv_usec);
-  if (len < 0 || len >= sizeof(buffer)) {
+  if (len < 0 || (size_t)len >= sizeof(buffer)) {
     va_end(args);
     return;
   }
@@ -122,24 +113,28 @@ void print_debug(const char *format, ...) {
   }
   len += msg_len;
 
-  if (len < sizeof(buffer) - 1) {
+  if ((size_t)len < sizeof(buffer) - 1) {
     buffer[len++] = '\n';
     buffer[len] = '\0';
   }
   write(debug_fd, buffer, len);
 }
 
-#ifdef ZUSAGE_TIMING
-#define START_TIMER clock_t start_time = clock();
-#define END_TIMER(label)                                                       \
-  do {                                                                         \
-    double duration = (double)(clock() - start_time) / CLOCKS_PER_SEC;         \
-    print_debug("%s: %.6f seconds", label, duration);                          \
-  } while (0)
-#else
-#define START_TIMER
-#define END_TIMER(label)
-#endif
+// Close every descriptor above stderr in a background process, so sockets and
+// locked files the host left open without FD_CLOEXEC do not stay open for as
+// long as it runs. The offline ring and the debug log are reopened on their
+// next use.
+void close_inherited_fds() {
+  ring_close();
+  debug_fd = -1; // a new log is opened, under this process's pid
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  if (max_fd < 0 || max_fd > MAX_INHERITED_FD) {
+    max_fd = MAX_INHERITED_FD;
+  }
+  for (int fd = STDERR_FILENO + 1; fd < max_fd; fd++) {
+    close(fd);
+  }
+}
 
 size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
   if (!ptr || !stream) {
@@ -299,111 +294,6 @@ void get_local_ip(char *local_ip, size_t size) {
   close(sock);
 }
 
-char* __tool_getprogramdir() {
-  char argv[PATH_MAX];
-  W_PSPROC buf;
-  int token = 0;
-  pid_t mypid = getpid();
-
-  memset(&buf, 0, sizeof(buf));
-  buf.ps_pathlen = PATH_MAX;
-  buf.ps_pathptr = &argv[0];
-
-  while ((token = w_getpsent(token, &buf, sizeof(buf))) > 0) {
-    if (buf.ps_pid == mypid) {
-      char* parent = (char*) malloc(PATH_MAX + 1);
-      if (parent == NULL) {
-        print_debug("__tool_getprogramdir: failed to resolve program directory");
-        return NULL;
-      }
-      parent = realpath(argv, parent);
-      if (parent == NULL) {
-        print_debug("__tool_getprogramdir: failed to resolve program directory");
-        return NULL;
-      }
-
-      dirname(parent);
-      return parent;
-    }
-  }
-
-  print_debug("__tool_getprogramdir: Failed to get program directory");
-  return NULL;
-}
-
-char* __tool_getprogname() {
-  char argv[PATH_MAX];
-  W_PSPROC buf;
-  int token = 0;
-  pid_t mypid = getpid();
-
-  memset(&buf, 0, sizeof(buf));
-  buf.ps_pathlen = PATH_MAX;
-  buf.ps_pathptr = &argv[0];
-
-  while ((token = w_getpsent(token, &buf, sizeof(buf))) > 0) {
-    if (buf.ps_pid == mypid) {
-        char* progname = strdup(basename(buf.ps_pathptr));
-        if (!progname) {
-          print_debug("__tool_getprogname: strdup failed");
-          return NULL;
-        }
-      return progname;
-    }
-  }
-    print_debug("__tool_getprogname: w_getpsent failed");
-  return NULL;
-}
-
-char *get_app_version() {
-  char *app_version = malloc(MAX_APP_VERSION_LENGTH);
-  if (!app_version) {
-    print_debug("get_app_version: Memory allocation failure");
-    return strdup("unknown");
-  }
-  char *program_dir = __tool_getprogramdir();
-  if (!program_dir)
-  {
-    print_debug("get_app_version: Failed to get program directory, returning unknown");
-    return strdup("unknown");
-  }
-
-  print_debug("get_app_version: program_dir: %s", program_dir);
-
-  char version_file_path[PATH_MAX];
-  int snprintf_result = snprintf(version_file_path, sizeof(version_file_path), "%s%s", program_dir, VERSION_FILE_RELATIVE_PATH);
-
-  if (snprintf_result < 0 || snprintf_result >= sizeof(version_file_path)) {
-    print_debug("get_app_version: Version file path too long or snprintf error.");
-    strncpy(app_version, "unknown", MAX_APP_VERSION_LENGTH - 1);
-    app_version[MAX_APP_VERSION_LENGTH-1] = '\0';
-    free(program_dir);
-    return app_version;
-  }
-
-  FILE *version_file = fopen(version_file_path, "r");
-  if (version_file) {
-    if (fgets(app_version, MAX_APP_VERSION_LENGTH, version_file)) {
-      size_t len = strlen(app_version);
-      if (len > 0 && app_version[len - 1] == '\n') {
-        app_version[len - 1] = '\0';
-      }
-       print_debug("get_app_version: Resolved app version: %s", app_version);
-    } else {
-      print_debug("get_app_version: fgets failed");
-      strncpy(app_version, "unknown", MAX_APP_VERSION_LENGTH - 1);
-      app_version[MAX_APP_VERSION_LENGTH-1] = '\0';
-    }
-    fclose(version_file);
-  } else {
-    print_debug("get_app_version: Failed to open version file: %s", version_file_path);
-    strncpy(app_version, "unknown", MAX_APP_VERSION_LENGTH - 1);
-    app_version[MAX_APP_VERSION_LENGTH - 1] = '\0';
-  }
-  free(program_dir);
-  return app_version;
-}
-
 int is_ibm_internal_ip(struct sockaddr_in *addr) {
   if (!addr)
   {
@@ -447,6 +337,9 @@ int resolve_and_check_ibm() {
 
 // Function to check if it's IBM domain and cache the result to file
 int check_and_cache_ibm_domain() {
+    if (collector_overridden()) {
+        return 1; // explicitly configured collector
+    }
     time_t current_time = time(NULL);
     if (current_time == (time_t)-1) {
         print_debug("check_and_cache_ibm_domain: time() failed, cannot check cache expiry. Proceeding with check.");
@@ -509,9 +402,67 @@ int check_and_cache_ibm_domain() {
 }
 
 
+// Parse a non-negative decimal number from [*p, end), advancing *p past it.
+static int parse_cache_number(const char **p, const char *end, long *value) {
+    const char *s = *p;
+    long v = 0;
+    if (s >= end || *s < '0' || *s > '9') {
+        return 0;
+    }
+    while (s < end && *s >= '0' && *s <= '9') {
+        v = v * 10 + (*s - '0');
+        s++;
+    }
+    *value = v;
+    *p = s;
+    return 1;
+}
+
+// Read the IBM check cache file through a read-only mapping. This is the only
+// cache access made by the fast constructor path: no stdio, no resolver.
+// Returns 1 and fills in result/timestamp if the file is well formed.
+int read_ibm_check_cache_mapped(const char *path, int *result, time_t *timestamp) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > IBM_CHECK_CACHE_MAX_SIZE) {
+        close(fd);
+        return 0;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    const char *p = map;
+    const char *end = map + st.st_size;
+    long cached_result, cached_timestamp;
+    int ok = parse_cache_number(&p, end, &cached_result);
+    if (ok && p < end && *p == '\n') {
+        p++;
+        ok = parse_cache_number(&p, end, &cached_timestamp);
+    } else {
+        ok = 0;
+    }
+    munmap(map, st.st_size);
+
+    if (!ok) {
+        return 0;
+    }
+    *result = cached_result ? 1 : 0;
+    *timestamp = (time_t)cached_timestamp;
+    return 1;
+}
+
+
 char* get_username() {
     if (username_cached) {
-        return cached_username_val;
+        return strdup(cached_username_val); // callers free the result
     }
 
     char *username = malloc(MAX_USERNAME_LENGTH);
@@ -539,258 +490,596 @@ char* get_username() {
 }
 
 
-void *send_usage_data() {
-  double duration;
-
-  START_TIMER;
-
-  END_TIMER("1. Initial setup");
-
-  char fqdn[MAX_HOSTNAME_LENGTH];
-  get_fqdn(fqdn, sizeof(fqdn)); // Will use cache if available
-
-  END_TIMER("2. After get_fqdn");
+// Look up the collector's IPv4 address (network byte order). Returns 1 on
+// success.
+int lookup_collector_address(unsigned int *addr) {
+  long long trace_start = trace_begin();
+  struct hostent *server = gethostbyname(USAGE_ANALYTICS_URL);
+  if (server == NULL || server->h_length != sizeof(*addr)) {
+    print_debug("ERROR, no such host: %s", USAGE_ANALYTICS_URL);
+    trace_end(ZUSAGE_TRACE_RESOLVE, trace_start, 0);
+    return 0;
+  }
+  memcpy(addr, server->h_addr_list[0], sizeof(*addr));
+  trace_end(ZUSAGE_TRACE_RESOLVE, trace_start, 1);
+  return 1;
+}
 
+// Returns 1 if ZUSAGE_COLLECTOR names the collector (ZUSAGE_TESTING builds)
+int collector_overridden() {
+#ifdef ZUSAGE_TESTING
+  return getenv(COLLECTOR_ENV_VAR) != NULL;
+#else
+  return 0;
+#endif
+}
 
-  char *app_name = __tool_getprogname();
-  if (!app_name) {
-    app_name = strdup("unknown");
-    if (!app_name) {
-      print_debug("send_usage_data: Memory allocation failed");
-      return NULL;
-    }
+// Parse ZUSAGE_COLLECTOR ("host:port"). Returns 1 and fills in the address
+// (network byte order) and port if it is set and valid. Always 0 outside
+// ZUSAGE_TESTING builds.
+int collector_override(unsigned int *addr, int *port) {
+#ifndef ZUSAGE_TESTING
+  (void)addr;
+  (void)port;
+  return 0;
+#else
+  const char *value = getenv(COLLECTOR_ENV_VAR);
+  if (value == NULL) {
+    return 0;
   }
-  END_TIMER("3. After getprogname");
-
-  char local_ip[MAX_IP_ADDRESS_LENGTH];
-  get_local_ip(local_ip, sizeof(local_ip));
-  END_TIMER("4. After get_local_ip");
+  const char *colon = strrchr(value, ':');
+  char host[MAX_HOSTNAME_LENGTH];
+  if (colon == NULL || colon == value || (size_t)(colon - value) >= sizeof(host)) {
+    print_debug("collector_override: %s must be host:port, ignoring '%s'", COLLECTOR_ENV_VAR, value);
+    return 0;
+  }
+  memcpy(host, value, colon - value);
+  host[colon - value] = '\0';
 
-  char *os_release = NULL;
-  char *cpu_arch = NULL;
-  get_system_info(&os_release, &cpu_arch);
-  if (!os_release || !cpu_arch) {
-    print_debug("send_usage_data: Memory allocation error in get_system_info");
-    free(app_name);
-    return NULL;
+  char *end;
+  long port_value = strtol(colon + 1, &end, 10);
+  if (*end != '\0' || port_value <= 0 || port_value > 65535) {
+    print_debug("collector_override: invalid port in '%s'", value);
+    return 0;
   }
-  END_TIMER("5. After get_system_info");
 
-  char *app_version = get_app_version();
-  if (!app_version) {
-    print_debug("send_usage_data: app_version is NULL");
-    app_version = strdup("unknown");
-    if (!app_version) {
-      print_debug("send_usage_data: memory alloc failed");
-      free(os_release);
-      free(cpu_arch);
-      free(app_name);
-      return NULL;
+  struct in_addr in;
+  if (inet_pton(AF_INET, host, &in) != 1) {
+    struct hostent *server = gethostbyname(host);
+    if (server == NULL || server->h_length != sizeof(in.s_addr)) {
+      print_debug("collector_override: no such host: %s", host);
+      return 0;
     }
+    memcpy(&in.s_addr, server->h_addr_list[0], sizeof(in.s_addr));
   }
+  *addr = in.s_addr;
+  *port = (int)port_value;
+  return 1;
+#endif
+}
 
-  END_TIMER("6. After get_app_version");
-
-    char *username = get_username(); // Will use cache if available
-    if (!username) {
-        print_debug("send_usage_data: username is NULL");
-        username = strdup("unknown"); // Fallback to "unknown" username
-        if (!username) {
-            print_debug("send_usage_data: memory alloc failed for username");
-            free(os_release);
-            free(cpu_arch);
-            free(app_version);
-            free(app_name);
-            return NULL;
-        }
+// Fill in the collector's address for the given port, from ZUSAGE_COLLECTOR
+// if set, else from the host profile when it holds one. Returns 1 on success.
+static int resolve_collector(struct sockaddr_in *serv_addr, int port) {
+  unsigned int addr;
+  if (!collector_override(&addr, &port)) {
+    addr = host_profile_get()->collector_addr;
+    if (addr == 0 && !lookup_collector_address(&addr)) {
+      return 0;
     }
-    END_TIMER("6.1. After get_username");
-
+  }
+  memset(serv_addr, 0, sizeof(*serv_addr));
+  serv_addr->sin_family = AF_INET;
+  serv_addr->sin_port = htons(port);
+  serv_addr->sin_addr.s_addr = addr;
+  return 1;
+}
 
+static int open_collector_socket() {
   const char *hostname = USAGE_ANALYTICS_URL;
   const int port = USAGE_ANALYTICS_PORT;
-  const char *path = USAGE_ANALYTICS_PATH;
 
-  struct hostent *server = gethostbyname(hostname);
-  if (server == NULL) {
-    print_debug("ERROR, no such host: %s", hostname);
-    free(os_release);
-    free(cpu_arch);
-    free(app_version);
-    free(app_name);
-    free(username); // Free username as well
-    return NULL;
+  struct sockaddr_in serv_addr;
+  if (!resolve_collector(&serv_addr, port)) {
+    return -1;
   }
-  END_TIMER("7. After gethostbyname");
 
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
     print_debug("ERROR opening socket");
-    free(os_release);
-    free(cpu_arch);
-    free(app_version);
-    free(app_name);
-    free(username); // Free username as well
-    return NULL;
+    return -1;
   }
 
-  struct sockaddr_in serv_addr;
-  memset(&serv_addr, 0, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(port);
-  memcpy(&serv_addr.sin_addr.s_addr, server->h_addr_list[0], server->h_length);
-
   struct timeval connect_timeout;
   connect_timeout.tv_sec = 2;
   connect_timeout.tv_usec = 0;
   if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &connect_timeout, sizeof(connect_timeout)) < 0) {
     print_debug("ERROR setting connect timeout");
     close(sockfd);
-    free(os_release);
-    free(cpu_arch);
-    free(app_version);
-    free(app_name);
-    free(username); // Free username as well
+    return -1;
   }
 
   if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
     print_debug("ERROR connecting to %s:%d", hostname, port);
     close(sockfd);
-    free(os_release);
-    free(cpu_arch);
-    free(app_version);
-    free(app_name);
-    free(username); // Free username as well
-    return NULL;
+    return -1;
   }
+  return sockfd;
+}
 
-  END_TIMER("8. After connect");
+// Resolve the collector and open a connected TCP socket to it.
+// Returns the socket, or -1 on failure.
+int connect_to_collector() {
+  long long trace_start = trace_begin();
+  int sockfd = open_collector_socket();
+  trace_end(ZUSAGE_TRACE_CONNECT, trace_start, sockfd >= 0);
+  return sockfd;
+}
 
-  char post_data[MAX_POST_DATA_SIZE];
-  int post_data_len = snprintf(post_data, sizeof(post_data),
-           "{\"app_name\": \"%s\", \"fqdn\": \"%s\", \"local_ip\": \"%s\", \"os_release\": \"%s\", \"cpu_arch\": \"%s\", \"app_version\": \"%s\", \"username\": \"%s\"}",
-           app_name, fqdn, local_ip, os_release, cpu_arch, app_version, username);
+// Send one event to the collector's UDP listener as a binary datagram
+// (zusage_wire.h). There is no acknowledgement, so a lost datagram is not
+// spooled to the offline ring. Returns 1 if the datagram was handed to the
+// network.
+static int send_usage_datagram(const char *const fields[ZUSAGE_WIRE_FIELD_COUNT]) {
+  unsigned char datagram[ZUSAGE_WIRE_MAX_DATAGRAM];
+  int datagram_len = zusage_wire_encode(datagram, sizeof(datagram), fields);
+  if (datagram_len < 0) {
+    print_debug("send_usage_datagram: event does not fit in one datagram");
+    return 0;
+  }
 
-  if (post_data_len < 0 || post_data_len >= sizeof(post_data)) {
-    print_debug("send_usage_data: post data creation failed");
-    close(sockfd);
-    free(os_release);
-    free(cpu_arch);
-    free(app_version);
-    free(app_name);
-    free(username); // Free username as well
-    return NULL;
+  struct sockaddr_in serv_addr;
+  if (!resolve_collector(&serv_addr, USAGE_ANALYTICS_UDP_PORT)) {
+    return 0;
+  }
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    print_debug("send_usage_datagram: socket failed, errno: %d", errno);
+    return 0;
+  }
+  ssize_t sent = sendto(sockfd, datagram, datagram_len, 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+  int saved_errno = errno;
+  close(sockfd);
+  if (sent != datagram_len) {
+    print_debug("send_usage_datagram: sendto failed, errno: %d", saved_errno);
+    return 0;
+  }
+  print_debug("send_usage_datagram: sent %d bytes", datagram_len);
+  return 1;
+}
+
+int send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    buf += n;
+    len -= n;
   }
+  return 1;
+}
 
-  char request[MAX_POST_DATA_SIZE * 2];
-  int request_len = snprintf(request, sizeof(request),
+// --- Batched requests ---
+// A usage_batch collects several JSON payloads into one POST to
+// USAGE_ANALYTICS_BATCH_PATH. The body is built after MAX_REQUEST_HEADER_SIZE
+// reserved bytes so the headers can be prepended without copying the body.
+
+int usage_batch_init(struct usage_batch *batch, size_t body_capacity) {
+  batch->capacity = MAX_REQUEST_HEADER_SIZE + body_capacity + 2;
+  batch->data = malloc(batch->capacity);
+  batch->len = 0;
+  batch->count = 0;
+  if (!batch->data) {
+    print_debug("usage_batch_init: Memory allocation failed");
+    return 0;
+  }
+  batch->data[MAX_REQUEST_HEADER_SIZE] = '[';
+  batch->len = 1;
+  return 1;
+}
+
+int usage_batch_add(struct usage_batch *batch, const char *payload, int payload_len) {
+  char *body = batch->data + MAX_REQUEST_HEADER_SIZE;
+  size_t body_capacity = batch->capacity - MAX_REQUEST_HEADER_SIZE;
+  if (payload_len <= 0 || batch->len + payload_len + 2 > body_capacity) {
+    return 0;
+  }
+  if (batch->count > 0) {
+    body[batch->len++] = ',';
+  }
+  memcpy(body + batch->len, payload, payload_len);
+  batch->len += payload_len;
+  batch->count++;
+  return 1;
+}
+
+void usage_batch_add_backlog(struct usage_batch *batch, const struct ring_claim *claim) {
+  for (int i = 0; i < claim->count; i++) {
+    int payload_len;
+    const char *payload = ring_claim_payload(claim, i, &payload_len);
+    if (!payload) {
+      continue;
+    }
+    if (!usage_batch_add(batch, payload, payload_len)) {
+      print_debug("usage_batch_add_backlog: batch full");
+      break;
+    }
+  }
+}
+
+// Close the JSON array and prepend the HTTP headers. Returns the start of the
+// request and stores its length, or returns NULL if the headers do not fit.
+const char *usage_batch_finish(struct usage_batch *batch, int keep_alive, size_t *request_len) {
+  char *body = batch->data + MAX_REQUEST_HEADER_SIZE;
+  body[batch->len++] = ']';
+
+  char header[MAX_REQUEST_HEADER_SIZE];
+  int header_len = snprintf(header, sizeof(header),
            "POST %s HTTP/1.1\r\n"
            "Host: %s\r\n"
            "Content-Type: application/json\r\n"
-           "Content-Length: %d\r\n"
-           "Connection: close\r\n"
-           "\r\n"
-           "%s",
-           path, hostname, post_data_len, post_data);
-
-  if (request_len < 0 || request_len >= sizeof(request)) {
-    print_debug("send_usage_data: snprintf failed for request");
-    close(sockfd);
-    free(os_release);
-    free(cpu_arch);
-    free(app_version);
-    free(app_name);
-    free(username); // Free username as well
+           "Content-Length: %lu\r\n"
+           "Connection: %s\r\n"
+           "\r\n",
+           USAGE_ANALYTICS_BATCH_PATH, USAGE_ANALYTICS_URL, (unsigned long)batch->len,
+           keep_alive ? "keep-alive" : "close");
+  if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+    print_debug("usage_batch_finish: header creation failed");
     return NULL;
   }
+  char *request = body - header_len;
+  memcpy(request, header, header_len);
+  *request_len = header_len + batch->len;
+  return request;
+}
 
-  ssize_t bytes_sent = send(sockfd, request, request_len, 0);
-  if (bytes_sent < 0) {
-    print_debug("ERROR writing to socket");
-  } else if (bytes_sent != request_len) {
-    print_debug("Incomplete data sent");
+void usage_batch_free(struct usage_batch *batch) {
+  free(batch->data);
+  batch->data = NULL;
+}
+
+// Returns 1 if the response waiting on sockfd has a 2xx status.
+int read_response_ok(int sockfd) {
+  struct timeval recv_timeout;
+  recv_timeout.tv_sec = 2;
+  recv_timeout.tv_usec = 0;
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+
+  char status[32];
+  size_t len = 0;
+  while (len < sizeof(status) - 1) {
+    ssize_t n = recv(sockfd, status + len, sizeof(status) - 1 - len, 0);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
   }
+  status[len] = '\0';
+  // "HTTP/1.1 201 Created"
+  return len >= 12 && strncmp(status, "HTTP/1.", 7) == 0 && status[9] == '2';
+}
 
-#if 0
-  char buffer[256];
-  ssize_t bytes_received;
-  do {
-    bytes_received = recv(sockfd, buffer, sizeof(buffer) -1, 0);
-    if (bytes_received > 0) {
-      buffer[bytes_received] = 0;
-      print_debug("recv: %s", buffer);
+// Deliver one payload over a fresh collector connection. If events are
+// waiting in the offline ring, they go out in the same POST to the batch
+// endpoint, and are only released once the collector has acknowledged them.
+// Returns 1 if the payload was delivered.
+static int send_with_backlog(int sockfd, const char *post_data, int post_data_len) {
+  struct ring_claim claim;
+  int backlog = ring_claim_backlog(&claim);
+
+  if (backlog == 0) {
+    char request[MAX_POST_DATA_SIZE * 2];
+    int request_len = build_usage_request(request, sizeof(request), post_data, post_data_len, 0);
+    ring_release_claim(&claim, 0);
+    if (request_len < 0) {
+      print_debug("send_usage_data: snprintf failed for request");
+      return 0;
+    }
+    if (!send_all(sockfd, request, request_len)) {
+      print_debug("ERROR writing to socket");
+      return 0;
     }
-  } while(bytes_received > 0);
+    return 1;
+  }
 
-  if (bytes_received < 0)
-  {
-    print_debug("send_usage_data: recv failed");
+  struct usage_batch batch;
+  if (!usage_batch_init(&batch, post_data_len + 1 + (size_t)backlog * (RING_SLOT_PAYLOAD_SIZE + 1))) {
+    ring_release_claim(&claim, 0);
+    return 0;
   }
-#endif
+  usage_batch_add(&batch, post_data, post_data_len);
+  usage_batch_add_backlog(&batch, &claim);
 
-  close(sockfd);
-  END_TIMER("9. After sending and receiving data");
+  size_t request_len;
+  const char *request = usage_batch_finish(&batch, 0, &request_len);
+  int delivered = request && send_all(sockfd, request, request_len) && read_response_ok(sockfd);
+  usage_batch_free(&batch);
+
+  if (!delivered) {
+    print_debug("send_with_backlog: batch of %d events not acknowledged", backlog + 1);
+  }
+  ring_release_claim(&claim, delivered);
+  return delivered;
+}
+
+// Build and deliver one event, for the given app name and version or, where
+// they are NULL, for this process. Each step is a trace phase.
+static void send_usage_event(const char *known_app_name, const char *known_app_version) {
+  // Host-wide fields come from the cached profile; only the app name and
+  // version are looked up per process.
+  long long trace_start = trace_begin();
+  const struct host_profile *host = host_profile_get();
+  trace_end(ZUSAGE_TRACE_HOST_PROFILE, trace_start, 1);
+
+  trace_start = trace_begin();
+  char *app_name = known_app_name ? strdup(known_app_name) : __tool_getprogname();
+  trace_end(ZUSAGE_TRACE_PROGRAM_INFO, trace_start, app_name != NULL);
+  if (!app_name) {
+    app_name = strdup("unknown");
+    if (!app_name) {
+      print_debug("send_usage_data: Memory allocation failed");
+      return;
+    }
+  }
+
+  trace_start = trace_begin();
+  char *app_version = known_app_version ? strdup(known_app_version) : get_app_version();
+  trace_end(ZUSAGE_TRACE_APP_VERSION, trace_start, app_version != NULL);
+  if (!app_version) {
+    print_debug("send_usage_data: app_version is NULL");
+    app_version = strdup("unknown");
+    if (!app_version) {
+      print_debug("send_usage_data: memory alloc failed");
+      free(app_name);
+      return;
+    }
+  }
+
+  const char *transport = getenv(TRANSPORT_ENV_VAR);
+  if (transport != NULL && strcmp(transport, "udp") == 0) {
+    const char *fields[ZUSAGE_WIRE_FIELD_COUNT];
+    fields[ZUSAGE_WIRE_APP_NAME] = app_name;
+    fields[ZUSAGE_WIRE_FQDN] = host->fqdn;
+    fields[ZUSAGE_WIRE_LOCAL_IP] = host->local_ip;
+    fields[ZUSAGE_WIRE_OS_RELEASE] = host->os_release;
+    fields[ZUSAGE_WIRE_CPU_ARCH] = host->cpu_arch;
+    fields[ZUSAGE_WIRE_APP_VERSION] = app_version;
+    fields[ZUSAGE_WIRE_USERNAME] = host->username;
+    trace_start = trace_begin();
+    int sent = send_usage_datagram(fields);
+    trace_end(ZUSAGE_TRACE_DATAGRAM, trace_start, sent);
+
+    free(app_version);
+    free(app_name);
+    return;
+  }
+
+  trace_start = trace_begin();
+  char post_data[MAX_POST_DATA_SIZE];
+  int post_data_len = build_usage_payload_from_prefix(post_data, sizeof(post_data), host->payload_prefix,
+                                                      host->payload_prefix_len, app_name, app_version);
+  trace_end(ZUSAGE_TRACE_PAYLOAD, trace_start, post_data_len >= 0);
 
-  free(os_release);
-  free(cpu_arch);
   free(app_version);
   free(app_name);
-    free(username); // Free username
-  return NULL;
-}
 
-__attribute__((constructor))
-void usage_analytics_init() {
-  int cvstate = __ae_autoconvert_state(_CVTSTATE_QUERY);
-  if (_CVTSTATE_OFF == cvstate) {
-    __ae_autoconvert_state(_CVTSTATE_ON);
+  if (post_data_len < 0) {
+    print_debug("send_usage_data: post data creation failed");
+    return;
   }
 
-  if (getenv(DISABLE_ENV_VAR) != NULL) {
+  if (ring_collector_down()) {
+    print_debug("send_usage_data: collector recently unreachable, spooling event");
+    ring_append(post_data, post_data_len);
+    return;
+  }
+
+  int sockfd = connect_to_collector();
+  if (sockfd < 0) {
+    ring_append(post_data, post_data_len);
+    ring_set_collector_down(1);
+    host_profile_invalidate(); // the collector may have moved
     return;
   }
 
-  // --- Initialize cache file path ---
+  trace_start = trace_begin();
+  int delivered = send_with_backlog(sockfd, post_data, post_data_len);
+  trace_end(ZUSAGE_TRACE_REQUEST, trace_start, delivered);
+  if (delivered) {
+    ring_set_collector_down(0);
+  } else {
+    ring_append(post_data, post_data_len);
+  }
+
+  close(sockfd);
+}
+
+void *send_usage_data() {
+  long long trace_start = trace_begin();
+  send_usage_event(NULL, NULL);
+  trace_end(ZUSAGE_TRACE_SEND, trace_start, 1);
+  return NULL;
+}
+
+// Build "$HOME/.cache/<file_name>". Returns 0 if HOME is unset or the path
+// does not fit.
+int build_cache_file_path(char *buf, size_t size, const char *file_name) {
   char *home_dir = getenv("HOME");
   if (home_dir == NULL) {
-      print_debug("usage_analytics_init: HOME environment variable not set, cannot initialize cache file path. Using in-memory cache only.");
-  } else {
-      snprintf(ibm_check_cache_path, sizeof(ibm_check_cache_path), "%s/.cache/%s", home_dir, IBM_CHECK_CACHE_FILE_NAME);
-
-      // Create cache directory if it doesn't exist
-      char cache_dir[PATH_MAX];
-      strncpy(cache_dir, ibm_check_cache_path, sizeof(cache_dir) - 1);
-      cache_dir[sizeof(cache_dir) - 1] = '\0';
-      char *dir_path = dirname(cache_dir); // modifies cache_dir
-      struct stat st;
-      if (stat(dir_path, &st) != 0) {
-          if (mkdir(dir_path, 0700) == -1) {
-              print_debug("usage_analytics_init: Failed to create cache directory: %s, errno: %d", dir_path, errno);
-              ibm_check_cache_path[0] = '\0'; // Invalidate cache path
-          } else {
-              print_debug("usage_analytics_init: Created cache directory: %s", dir_path);
-          }
-      } else if (!S_ISDIR(st.st_mode)) {
-          print_debug("usage_analytics_init: Cache directory path exists but is not a directory: %s", dir_path);
+    return 0;
+  }
+  int len = snprintf(buf, size, "%s/.cache/%s", home_dir, file_name);
+  if (len < 0 || (size_t)len >= size) {
+    buf[0] = '\0';
+    return 0;
+  }
+  return 1;
+}
+
+// --- Initialize cache file path (no filesystem access) ---
+void init_cache_path() {
+  if (!build_cache_file_path(ibm_check_cache_path, sizeof(ibm_check_cache_path), IBM_CHECK_CACHE_FILE_NAME)) {
+      print_debug("init_cache_path: HOME environment variable not set, cannot initialize cache file path. Using in-memory cache only.");
+  }
+}
+
+// --- Create cache directory if it doesn't exist ---
+void ensure_cache_dir() {
+  if (ibm_check_cache_path[0] == '\0') {
+      return;
+  }
+
+  char cache_dir[PATH_MAX];
+  strncpy(cache_dir, ibm_check_cache_path, sizeof(cache_dir) - 1);
+  cache_dir[sizeof(cache_dir) - 1] = '\0';
+  char *dir_path = dirname(cache_dir); // modifies cache_dir
+  struct stat st;
+  if (stat(dir_path, &st) != 0) {
+      if (mkdir(dir_path, 0700) == -1) {
+          print_debug("ensure_cache_dir: Failed to create cache directory: %s, errno: %d", dir_path, errno);
           ibm_check_cache_path[0] = '\0'; // Invalidate cache path
+      } else {
+          print_debug("ensure_cache_dir: Created cache directory: %s", dir_path);
       }
+  } else if (!S_ISDIR(st.st_mode)) {
+      print_debug("ensure_cache_dir: Cache directory path exists but is not a directory: %s", dir_path);
+      ibm_check_cache_path[0] = '\0'; // Invalidate cache path
   }
+}
 
+// The work of a background sender, in a forked child or in zusage-send.
+// With SENDER_VERIFY_IBM_DOMAIN it first runs the full (DNS-based) IBM domain
+// check and only sends if it passes. With SENDER_START_SPOOLER it also brings
+// up the per-user spooler so that later processes can hand their events to
+// it instead of forking. With SENDER_FLUSH_COUNTERS it sends the aggregated
+// counters instead of an event. The event is for app_name and app_version,
+// or for the running program where they are NULL.
+void run_usage_sender(int flags, const char *app_name, const char *app_version) {
+  if (flags & SENDER_VERIFY_IBM_DOMAIN) {
+    ensure_cache_dir();
+    long long trace_start = trace_begin();
+    int is_ibm = check_and_cache_ibm_domain();
+    trace_end(ZUSAGE_TRACE_IBM_CHECK, trace_start, is_ibm);
+    if (!is_ibm) {
+      print_debug("run_usage_sender: Not IBM domain or internal IP, not sending.");
+      return;
+    }
+  }
 
-  // --- Check and cache IBM domain status ---
-  if (!check_and_cache_ibm_domain()) {
-      print_debug("Skipping usage collection: Not IBM domain or internal IP (cached check).");
-      return; // Skip forking if not IBM domain after checking cache
+  if (flags & SENDER_FLUSH_COUNTERS) {
+    long long trace_start = trace_begin();
+    counter_flush();
+    trace_end(ZUSAGE_TRACE_COUNTER_FLUSH, trace_start, 1);
+    return;
+  }
+
+  long long trace_start = trace_begin();
+  send_usage_event(app_name, app_version);
+  trace_end(ZUSAGE_TRACE_SEND, trace_start, 1);
+  if (flags & SENDER_START_SPOOLER) {
+    start_spooler();
+  }
+}
+
+// Start the zusage-send helper with argv, which must include -d: the helper
+// forks once more and its first process exits at once, so reaping it here
+// leaves no zombie and the rest is inherited by init. helper is the helper's
+// path, or any other value to find it in PATH. The helper's stdio is
+// /dev/null and its signal mask and SIGPIPE/SIGCHLD handling are the
+// defaults, whatever the host set. Returns 0 if it could not be started.
+int spawn_helper(const char *helper, char *const argv[]) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDWR, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+  posix_spawnattr_init(&attr);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigaddset(&signals, SIGPIPE);
+  sigaddset(&signals, SIGCHLD);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  // A path names the helper; any other value finds it in PATH
+  pid_t pid;
+  int rc = strchr(helper, '/') ? posix_spawn(&pid, helper, &actions, &attr, argv, environ)
+                               : posix_spawnp(&pid, SPAWN_HELPER_NAME, &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (rc != 0) {
+    print_debug("spawn_helper: cannot start %s, error: %d", strchr(helper, '/') ? helper : SPAWN_HELPER_NAME, rc);
+    return 0;
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+  }
+  return 1;
+}
+
+// Start zusage-send (ZUSAGE_SPAWN) instead of forking. posix_spawn does not
+// copy the host's page tables, so the cost does not grow with the size of the
+// host process, and nothing runs in a copy of a possibly multithreaded host.
+// Returns 0 if the helper could not be started.
+static int spawn_usage_helper(int flags, const char *helper) {
+  // The helper cannot see which program started it. It is only told the
+  // executable's path and looks up the name and version itself.
+  char exe_path[PATH_MAX];
+  if (!(flags & SENDER_FLUSH_COUNTERS) && !get_executable_path(exe_path, sizeof(exe_path))) {
+    return 0;
+  }
+
+  char *argv[8];
+  int argc = 0;
+  argv[argc++] = SPAWN_HELPER_NAME;
+  argv[argc++] = "-d";
+  if (flags & SENDER_VERIFY_IBM_DOMAIN) {
+    argv[argc++] = "-i";
+  }
+  if (flags & SENDER_START_SPOOLER) {
+    argv[argc++] = "-s";
+  }
+  if (flags & SENDER_FLUSH_COUNTERS) {
+    argv[argc++] = "-c";
+  } else {
+    argv[argc++] = "-x";
+    argv[argc++] = exe_path;
+  }
+  argv[argc] = NULL;
+  return spawn_helper(helper, argv);
+}
+
+// Start the background sender, see run_usage_sender(). It is forked from the
+// host process unless ZUSAGE_SPAWN selects the zusage-send helper.
+void spawn_usage_sender(int flags) {
+  long long trace_start = trace_begin();
+  const char *helper = getenv(SPAWN_ENV_VAR);
+  if (helper != NULL) {
+    int spawned = spawn_usage_helper(flags, helper);
+    trace_end(ZUSAGE_TRACE_SPAWN, trace_start, spawned);
+    if (spawned) {
+      return;
+    }
+    trace_start = trace_begin();
   }
 
   pid_t pid = fork();
 
   if (pid == -1) {
+    trace_end(ZUSAGE_TRACE_FORK, trace_start, 0);
     print_debug("Failed to fork process for usage analytics\n");
     return;
   }
 
   if (pid == 0) {
+    trace_forked();
     int devnull = open("/dev/null", O_RDWR);
     if (devnull == -1) {
       print_debug("Failed to open /dev/null");
@@ -814,14 +1103,183 @@ void usage_analytics_init() {
     }
 
     close(devnull);
-    send_usage_data();
+
+    run_usage_sender(flags, NULL, NULL);
     exit(EXIT_SUCCESS);
   } else {
     // Parent process
    // signal(SIGCHLD, SIG_IGN);
+    trace_end(ZUSAGE_TRACE_FORK, trace_start, 1);
   }
 }
 
+// Read the IBM check cache through the mapped fast path. Returns 1 if the
+// cached result is present and unexpired, storing it in *is_ibm.
+static int fresh_ibm_check_from_cache(int *is_ibm) {
+  if (collector_overridden()) {
+    *is_ibm = 1; // explicitly configured collector
+    return 1;
+  }
+  int cached_result;
+  time_t cached_timestamp;
+  time_t current_time = time(NULL);
+
+  if (ibm_check_cache_path[0] == '\0' ||
+      !read_ibm_check_cache_mapped(ibm_check_cache_path, &cached_result, &cached_timestamp) ||
+      current_time == (time_t)-1 ||
+      difftime(current_time, cached_timestamp) >= IBM_CHECK_CACHE_EXPIRY) {
+    return 0;
+  }
+  is_ibm_cached = cached_result;
+  last_ibm_check_time = current_time;
+  *is_ibm = cached_result;
+  return 1;
+}
+
+// Fast constructor path: only an env check and a mapped read of the IBM check
+// cache happen in the host process. Anything that may block (DNS, mkdir,
+// writing the cache) is left to the forked child.
+void fast_usage_analytics_init() {
+  int is_ibm;
+  if (fresh_ibm_check_from_cache(&is_ibm)) {
+    if (!is_ibm) {
+      print_debug("fast_usage_analytics_init: Skipping usage collection: Not IBM domain (mapped cache).");
+      return;
+    }
+    spawn_usage_sender(0);
+    return;
+  }
+
+  print_debug("fast_usage_analytics_init: IBM check cache cold or expired, deferring check to sender.");
+  spawn_usage_sender(SENDER_VERIFY_IBM_DOMAIN);
+}
+
+// Spooler constructor path: hand one record to the per-user spooler and
+// return without forking. If no spooler is listening, fall back to a forked
+// sender which also starts one for the processes that follow.
+void spooler_usage_analytics_init() {
+  int is_ibm;
+  if (!fresh_ibm_check_from_cache(&is_ibm)) {
+    spawn_usage_sender(SENDER_VERIFY_IBM_DOMAIN | SENDER_START_SPOOLER);
+    return;
+  }
+  if (!is_ibm) {
+    print_debug("spooler_usage_analytics_init: Skipping usage collection: Not IBM domain (mapped cache).");
+    return;
+  }
+
+  // The spooler looks up the name and version from the path
+  char exe_path[PATH_MAX];
+  long long trace_start = trace_begin();
+  int submitted = get_executable_path(exe_path, sizeof(exe_path)) && spooler_submit(exe_path);
+  trace_end(ZUSAGE_TRACE_SPOOLER_SUBMIT, trace_start, submitted);
+
+  if (!submitted) {
+    spawn_usage_sender(SENDER_START_SPOOLER);
+  }
+}
+
+// Aggregating constructor path: count this invocation in the shared counter
+// table and only fork when the counters are due to be flushed. Falls back to
+// a normal sender when the table cannot be used.
+void aggregate_usage_analytics_init() {
+  int is_ibm;
+  if (!fresh_ibm_check_from_cache(&is_ibm)) {
+    spawn_usage_sender(SENDER_VERIFY_IBM_DOMAIN);
+    return;
+  }
+  if (!is_ibm) {
+    print_debug("aggregate_usage_analytics_init: Skipping usage collection: Not IBM domain (mapped cache).");
+    return;
+  }
+
+  const struct program_info *info = get_program_info();
+  char *app_version = get_app_version();
+  int flush_due;
+  long long trace_start = trace_begin();
+  int counted = counter_increment(info ? info->name : "unknown", app_version ? app_version : "unknown", &flush_due);
+  trace_end(ZUSAGE_TRACE_COUNTER_INCREMENT, trace_start, counted);
+  free(app_version);
+
+  if (!counted) {
+    spawn_usage_sender(0);
+  } else if (flush_due) {
+    spawn_usage_sender(SENDER_FLUSH_COUNTERS);
+  }
+}
+
+static void report_init_overhead(const struct timespec *start) {
+  struct timespec end;
+  if (clock_gettime(CLOCK_MONOTONIC, &end) != 0) {
+    return;
+  }
+  // start is on the trace clock; trace_begin() is only asked whether tracing is on
+  long long start_ns = (long long)start->tv_sec * 1000000000LL + start->tv_nsec;
+  trace_end(ZUSAGE_TRACE_INIT, trace_begin() ? start_ns : 0, 1);
+  long elapsed_us = (long)(end.tv_sec - start->tv_sec) * 1000000L +
+                    (end.tv_nsec - start->tv_nsec) / 1000L;
+  if (elapsed_us > INIT_OVERHEAD_BUDGET_US) {
+    print_debug("usage_analytics_init: slow constructor, overhead %ld us (reference %d us)", elapsed_us, INIT_OVERHEAD_BUDGET_US);
+  } else {
+    print_debug("usage_analytics_init: overhead %ld us", elapsed_us);
+  }
+}
+
+// zusage-send is built from the same sources without the constructor
+#ifndef ZUSAGE_NO_CONSTRUCTOR
+__attribute__((constructor))
+#endif
+void usage_analytics_init() {
+  struct timespec init_start;
+  clock_gettime(CLOCK_MONOTONIC, &init_start);
+
+#ifdef __MVS__
+  int cvstate = __ae_autoconvert_state(_CVTSTATE_QUERY);
+  if (_CVTSTATE_OFF == cvstate) {
+    __ae_autoconvert_state(_CVTSTATE_ON);
+  }
+#endif
+
+  if (getenv(DISABLE_ENV_VAR) != NULL) {
+    return;
+  }
+
+  init_cache_path();
+
+  if (getenv(AGGREGATE_ENV_VAR) != NULL) {
+    aggregate_usage_analytics_init();
+    report_init_overhead(&init_start);
+    return;
+  }
+
+  if (getenv(SPOOLER_ENV_VAR) != NULL) {
+    spooler_usage_analytics_init();
+    report_init_overhead(&init_start);
+    return;
+  }
+
+  if (getenv(FAST_INIT_ENV_VAR) != NULL) {
+    fast_usage_analytics_init();
+    report_init_overhead(&init_start);
+    return;
+  }
+
+  ensure_cache_dir();
+
+  // --- Check and cache IBM domain status ---
+  long long trace_start = trace_begin();
+  int is_ibm = check_and_cache_ibm_domain();
+  trace_end(ZUSAGE_TRACE_IBM_CHECK, trace_start, is_ibm);
+  if (!is_ibm) {
+      print_debug("Skipping usage collection: Not IBM domain or internal IP (cached check).");
+      report_init_overhead(&init_start);
+      return; // Skip forking if not IBM domain after checking cache
+  }
+
+  spawn_usage_sender(0);
+  report_init_overhead(&init_start);
+}
+
 #ifdef ZUSAGE_TEST_MAIN
 int main(int argc, char **argv) {
   sleep(2);
@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <limits.h>
+
+#include "zusage_internal.h"
+
+// Aggregated usage counters (ZUSAGE_AGGREGATE). Instead of sending one event
+// per process, each process bumps a counter for its (app name, app version)
+// in a shared table in ~/.cache and returns. The user is implicit: the table
+// lives in the user's home directory. Slots are claimed with a compare and
+// swap and counted with atomic adds, so the constructor takes no lock. Every
+// COUNTER_FLUSH_INTERVAL_SECONDS the process that wins the header's flush
+// timestamp forks a sender, which posts one event per counter with its count
+// and first/last seen times to the batch endpoint and subtracts what was
+// acknowledged.
+
+#define COUNTER_SLOT_EMPTY 0
+#define COUNTER_SLOT_CLAIMING 1
+#define COUNTER_SLOT_ACTIVE 2
+
+// Set in a slot's count while it is given back. An increment that lands on
+// it was too late for that slot and counts again in another.
+#define COUNTER_RELEASED (1ULL << 63)
+
+// Byte ranges of the table file used as fcntl locks.
+#define COUNTER_INIT_LOCK_BYTE 0
+#define COUNTER_FLUSH_LOCK_BYTE 1
+
+// Slots of apps not seen for this long are given back when flushing, so
+// retired versions do not fill the table.
+#define COUNTER_IDLE_SECONDS (7 * 24 * 3600)
+
+// Room for the per-counter fields after the host prefix in a flushed event.
+#define COUNTER_PAYLOAD_FIELDS_SIZE (SPOOLER_MAX_APP_NAME_LENGTH + MAX_APP_VERSION_LENGTH + 160)
+
+struct counter_header {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int slot_count;
+  unsigned int slot_size;
+  long long next_flush;            // epoch seconds
+  char reserved[40];
+};
+
+struct counter_slot {
+  unsigned int state;
+  unsigned int hash;
+  unsigned long long count;        // invocations since the last flush
+  long long first_seen_ms;         // epoch milliseconds
+  long long last_seen_ms;
+  char app_name[SPOOLER_MAX_APP_NAME_LENGTH];
+  char app_version[MAX_APP_VERSION_LENGTH];
+};
+
+static struct counter_header *counters = NULL;
+static struct counter_slot *counter_slots = NULL;
+static size_t counter_map_size = 0;
+static int counter_fd = -1;
+static int counter_failed = 0;
+
+static int counter_lock(int byte, int wait) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+  return fcntl(counter_fd, wait ? F_SETLKW : F_SETLK, &lock) == 0;
+}
+
+static void counter_unlock(int byte) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_UNLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+  fcntl(counter_fd, F_SETLK, &lock);
+}
+
+static long long now_ms() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+    return (long long)time(NULL) * 1000;
+  }
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Map the counter table, creating or resetting it if needed. Returns 1 on
+// success.
+static int counter_open() {
+  if (counters) {
+    return 1;
+  }
+  if (counter_failed) {
+    return 0;
+  }
+  counter_failed = 1;
+
+  char path[PATH_MAX];
+  if (!build_cache_file_path(path, sizeof(path), COUNTER_FILE_NAME)) {
+    return 0;
+  }
+  counter_fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (counter_fd == -1) {
+    print_debug("counter_open: Failed to open %s, errno: %d", path, errno);
+    return 0;
+  }
+
+  counter_map_size = sizeof(struct counter_header) + (size_t)COUNTER_SLOT_COUNT * sizeof(struct counter_slot);
+
+  // Only the first process of a new table has to wait here.
+  struct stat st;
+  int sized = fstat(counter_fd, &st) == 0 && st.st_size == (off_t)counter_map_size;
+  int locked = 0;
+  if (!sized) {
+    if (!counter_lock(COUNTER_INIT_LOCK_BYTE, 1)) {
+      print_debug("counter_open: Failed to lock %s, errno: %d", path, errno);
+      close(counter_fd);
+      counter_fd = -1;
+      return 0;
+    }
+    locked = 1;
+    sized = fstat(counter_fd, &st) == 0 && st.st_size == (off_t)counter_map_size;
+    if (!sized && ftruncate(counter_fd, counter_map_size) != 0) {
+      print_debug("counter_open: ftruncate failed, errno: %d", errno);
+      counter_unlock(COUNTER_INIT_LOCK_BYTE);
+      close(counter_fd);
+      counter_fd = -1;
+      return 0;
+    }
+  }
+
+  void *map = mmap(NULL, counter_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, counter_fd, 0);
+  if (map == MAP_FAILED) {
+    print_debug("counter_open: mmap failed, errno: %d", errno);
+    if (locked) {
+      counter_unlock(COUNTER_INIT_LOCK_BYTE);
+    }
+    close(counter_fd);
+    counter_fd = -1;
+    return 0;
+  }
+  struct counter_header *header = map;
+
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != COUNTER_MAGIC || header->version != COUNTER_VERSION ||
+      header->slot_count != COUNTER_SLOT_COUNT || header->slot_size != sizeof(struct counter_slot)) {
+    if (!locked && !counter_lock(COUNTER_INIT_LOCK_BYTE, 1)) {
+      munmap(map, counter_map_size);
+      close(counter_fd);
+      counter_fd = -1;
+      return 0;
+    }
+    locked = 1;
+    if (header->magic != COUNTER_MAGIC || header->version != COUNTER_VERSION ||
+        header->slot_count != COUNTER_SLOT_COUNT || header->slot_size != sizeof(struct counter_slot)) {
+      print_debug("counter_open: Initializing counter table %s", path);
+      memset(map, 0, counter_map_size);
+      header->version = COUNTER_VERSION;
+      header->slot_count = COUNTER_SLOT_COUNT;
+      header->slot_size = sizeof(struct counter_slot);
+      header->next_flush = (long long)time(NULL) + COUNTER_FLUSH_INTERVAL_SECONDS;
+      __atomic_store_n(&header->magic, COUNTER_MAGIC, __ATOMIC_RELEASE);
+    }
+  }
+  if (locked) {
+    counter_unlock(COUNTER_INIT_LOCK_BYTE);
+  }
+
+  counters = header;
+  counter_slots = (struct counter_slot *)(header + 1);
+  counter_failed = 0;
+  return 1;
+}
+
+static unsigned int counter_key_hash(const char *app_name, const char *app_version) {
+  // FNV-1a over "name\0version"
+  unsigned int hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)app_name; *p; p++) {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  hash *= 16777619u;
+  for (const unsigned char *p = (const unsigned char *)app_version; *p; p++) {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+static int counter_slot_matches(const struct counter_slot *slot, unsigned int hash,
+                                const char *app_name, const char *app_version) {
+  return slot->hash == hash &&
+         strncmp(slot->app_name, app_name, sizeof(slot->app_name) - 1) == 0 &&
+         strncmp(slot->app_version, app_version, sizeof(slot->app_version) - 1) == 0;
+}
+
+// Find the slot for a key, claiming an empty one if the key is new. Returns
+// NULL when the table is full.
+static struct counter_slot *counter_find_slot(const char *app_name, const char *app_version) {
+  unsigned int hash = counter_key_hash(app_name, app_version);
+  for (unsigned int probe = 0; probe < COUNTER_SLOT_COUNT; probe++) {
+    struct counter_slot *slot = &counter_slots[(hash + probe) % COUNTER_SLOT_COUNT];
+    unsigned int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == COUNTER_SLOT_ACTIVE) {
+      if (counter_slot_matches(slot, hash, app_name, app_version)) {
+        return slot;
+      }
+      continue;
+    }
+    // A slot being claimed right now may be for this key; counting into the
+    // next slot instead is harmless, both are flushed.
+    if (state != COUNTER_SLOT_EMPTY ||
+        !__atomic_compare_exchange_n(&slot->state, &state, COUNTER_SLOT_CLAIMING, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    __atomic_store_n(&slot->count, 0, __ATOMIC_RELEASE);
+    slot->hash = hash;
+    strncpy(slot->app_name, app_name, sizeof(slot->app_name) - 1);
+    slot->app_name[sizeof(slot->app_name) - 1] = '\0';
+    strncpy(slot->app_version, app_version, sizeof(slot->app_version) - 1);
+    slot->app_version[sizeof(slot->app_version) - 1] = '\0';
+    __atomic_store_n(&slot->state, COUNTER_SLOT_ACTIVE, __ATOMIC_RELEASE);
+    return slot;
+  }
+  return NULL;
+}
+
+// Count one invocation. Returns 0 if it could not be counted (no table, or
+// the table is full), in which case the caller sends the event itself. Sets
+// *flush_due if this process should fork the flushing sender.
+int counter_increment(const char *app_name, const char *app_version, int *flush_due) {
+  *flush_due = 0;
+  if (!counter_open()) {
+    return 0;
+  }
+  long long now = now_ms();
+  struct counter_slot *slot = NULL;
+  unsigned long long before = COUNTER_RELEASED;
+  // A second attempt finds or claims a live slot for the key
+  for (int attempt = 0; attempt < 2 && (before & COUNTER_RELEASED); attempt++) {
+    slot = counter_find_slot(app_name, app_version);
+    if (!slot) {
+      print_debug("counter_increment: counter table full");
+      return 0;
+    }
+    before = __atomic_fetch_add(&slot->count, 1, __ATOMIC_ACQ_REL);
+  }
+  if (before & COUNTER_RELEASED) {
+    return 0;
+  }
+  if (before == 0) {
+    __atomic_store_n(&slot->first_seen_ms, now, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&slot->last_seen_ms, now, __ATOMIC_RELEASE);
+
+  long long next_flush = __atomic_load_n(&counters->next_flush, __ATOMIC_ACQUIRE);
+  if (now / 1000 >= next_flush &&
+      __atomic_compare_exchange_n(&counters->next_flush, &next_flush, now / 1000 + COUNTER_FLUSH_INTERVAL_SECONDS, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    *flush_due = 1;
+  }
+  return 1;
+}
+
+static void counter_release_idle(struct counter_slot *slot, long long now) {
+  unsigned int state = COUNTER_SLOT_ACTIVE;
+  if (now - __atomic_load_n(&slot->last_seen_ms, __ATOMIC_ACQUIRE) < (long long)COUNTER_IDLE_SECONDS * 1000 ||
+      !__atomic_compare_exchange_n(&slot->state, &state, COUNTER_SLOT_CLAIMING, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  // Only a count of zero is given back, in the same step that marks it
+  // released, so an increment racing with this one is never dropped
+  unsigned long long count = 0;
+  if (!__atomic_compare_exchange_n(&slot->count, &count, COUNTER_RELEASED, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&slot->state, COUNTER_SLOT_ACTIVE, __ATOMIC_RELEASE); // in use again
+    return;
+  }
+  print_debug("counter_flush: releasing idle counter for %s", slot->app_name);
+  slot->hash = 0;
+  slot->app_name[0] = '\0';
+  slot->app_version[0] = '\0';
+  __atomic_store_n(&slot->state, COUNTER_SLOT_EMPTY, __ATOMIC_RELEASE);
+}
+
+struct counter_taken {
+  unsigned int slot;
+  unsigned long long count;
+  long long first_seen_ms;
+};
+
+// Send every non-zero counter to the collector as one batch. Counts are
+// taken out of the table before sending and added back if the collector does
+// not acknowledge them, so increments made during the flush are kept.
+void counter_flush() {
+  if (!counter_open()) {
+    return;
+  }
+  if (!counter_lock(COUNTER_FLUSH_LOCK_BYTE, 0)) {
+    return; // someone else is flushing
+  }
+
+  const struct host_profile *host = host_profile_get();
+  static struct counter_taken taken[COUNTER_SLOT_COUNT];
+  int taken_count = 0;
+
+  struct usage_batch batch;
+  if (!usage_batch_init(&batch, (size_t)COUNTER_SLOT_COUNT *
+                                    (host->payload_prefix_len + COUNTER_PAYLOAD_FIELDS_SIZE + 1))) {
+    counter_unlock(COUNTER_FLUSH_LOCK_BYTE);
+    return;
+  }
+
+  long long now = now_ms();
+  for (unsigned int i = 0; i < COUNTER_SLOT_COUNT; i++) {
+    struct counter_slot *slot = &counter_slots[i];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != COUNTER_SLOT_ACTIVE) {
+      continue;
+    }
+    if (__atomic_load_n(&slot->count, __ATOMIC_ACQUIRE) == 0) {
+      counter_release_idle(slot, now);
+      continue;
+    }
+    long long first_seen = __atomic_load_n(&slot->first_seen_ms, __ATOMIC_ACQUIRE);
+    long long last_seen = __atomic_load_n(&slot->last_seen_ms, __ATOMIC_ACQUIRE);
+    unsigned long long count = __atomic_exchange_n(&slot->count, 0, __ATOMIC_ACQ_REL);
+    if (count == 0) {
+      continue;
+    }
+    if (count > COUNTER_MAX_EVENT_COUNT) {
+      // The collector refuses larger counts; the rest waits for the next flush
+      __atomic_fetch_add(&slot->count, count - COUNTER_MAX_EVENT_COUNT, __ATOMIC_ACQ_REL);
+      count = COUNTER_MAX_EVENT_COUNT;
+    }
+
+    char payload[PROFILE_PAYLOAD_PREFIX_SIZE + COUNTER_PAYLOAD_FIELDS_SIZE];
+    memcpy(payload, host->payload_prefix, host->payload_prefix_len);
+    int len = snprintf(payload + host->payload_prefix_len, sizeof(payload) - host->payload_prefix_len,
+             "\"app_name\": \"%s\", \"app_version\": \"%s\", \"count\": %llu, \"first_seen\": %lld, \"last_seen\": %lld}",
+             slot->app_name, slot->app_version, count, first_seen, last_seen);
+    if (len < 0 || (size_t)len >= sizeof(payload) - host->payload_prefix_len ||
+        !usage_batch_add(&batch, payload, host->payload_prefix_len + len)) {
+      print_debug("counter_flush: payload for %s does not fit", slot->app_name);
+      __atomic_fetch_add(&slot->count, count, __ATOMIC_ACQ_REL);
+      continue;
+    }
+    taken[taken_count].slot = i;
+    taken[taken_count].count = count;
+    taken[taken_count].first_seen_ms = first_seen;
+    taken_count++;
+  }
+
+  int delivered = 0;
+  if (batch.count > 0) {
+    int sockfd = connect_to_collector();
+    if (sockfd >= 0) {
+      size_t request_len;
+      const char *request = usage_batch_finish(&batch, 0, &request_len);
+      delivered = request && send_all(sockfd, request, request_len) && read_response_ok(sockfd);
+      close(sockfd);
+    } else {
+      host_profile_invalidate(); // the collector may have moved
+    }
+  }
+  usage_batch_free(&batch);
+
+  if (delivered) {
+    print_debug("counter_flush: flushed %d counters", taken_count);
+  } else if (taken_count > 0) {
+    print_debug("counter_flush: %d counters not acknowledged, keeping them", taken_count);
+    for (int i = 0; i < taken_count; i++) {
+      struct counter_slot *slot = &counter_slots[taken[i].slot];
+      __atomic_fetch_add(&slot->count, taken[i].count, __ATOMIC_ACQ_REL);
+      __atomic_store_n(&slot->first_seen_ms, taken[i].first_seen_ms, __ATOMIC_RELEASE);
+    }
+    // Try again sooner than a full interval
+    __atomic_store_n(&counters->next_flush, (long long)time(NULL) + RING_RETRY_BACKOFF_SECONDS, __ATOMIC_RELEASE);
+  }
+  counter_unlock(COUNTER_FLUSH_LOCK_BYTE);
+}
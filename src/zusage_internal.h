@@ -0,0 +1,241 @@
+#ifndef ZUSAGE_INTERNAL_H
+#define ZUSAGE_INTERNAL_H
+
+#include <stddef.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+// Shared between the zusage translation units. Not installed.
+
+// --- Macro Definitions ---
+
+#define USAGE_ANALYTICS_URL "zusage1.fyre.ibm.com"
+#define USAGE_ANALYTICS_PATH "/usage"
+#define USAGE_ANALYTICS_BATCH_PATH "/usage/batch"
+#define USAGE_ANALYTICS_PORT 3000
+#define USAGE_ANALYTICS_UDP_PORT 3001
+#define VERSION_FILE_RELATIVE_PATH "/../.version"
+#undef PATH_MAX
+#define PATH_MAX 1024*4
+
+#define MAX_HOSTNAME_LENGTH _POSIX_HOST_NAME_MAX
+#define MAX_IP_ADDRESS_LENGTH INET_ADDRSTRLEN
+#define MAX_TIMESTAMP_LENGTH 32
+#define MAX_POST_DATA_SIZE 4096
+#define MAX_APP_VERSION_LENGTH 100
+#define MAX_OS_RELEASE_LENGTH 32
+#define MAX_CPU_ARCH_LENGTH 16
+#define MAX_DEBUG_BUFFER_SIZE 8192
+#define MAX_USERNAME_LENGTH 64 
+#define MAX_FQDN_LENGTH MAX_HOSTNAME_LENGTH // Assuming FQDN won't exceed hostname length
+#define MAX_INHERITED_FD 4096 // highest descriptor close_inherited_fds() closes
+
+// --- Environment Variables ---
+#define DISABLE_ENV_VAR "ZUSAGE_DISABLE"
+#define DEBUG_ENV_VAR "ZUSAGE_DEBUG"
+#define FAST_INIT_ENV_VAR "ZUSAGE_FAST_INIT"
+#define TRANSPORT_ENV_VAR "ZUSAGE_TRANSPORT" // "udp": one datagram per event
+#ifdef ZUSAGE_TESTING
+// "host:port" of a collector to use instead of USAGE_ANALYTICS_URL, for
+// tests and benchmarks against a local collector. Skips the IBM domain check.
+// Only the ZUSAGE_TESTING builds used by bench/ and tests/ read it; the
+// installed library and zusage-send always report to the IBM collector.
+#define COLLECTOR_ENV_VAR "ZUSAGE_COLLECTOR"
+#endif
+// Record phase timings, see zusage_trace.h. The value may name the directory
+// for the trace files; they go to /tmp otherwise.
+#define TRACE_ENV_VAR "ZUSAGE_TRACE"
+// Start senders with posix_spawn of the zusage-send helper instead of fork().
+// The value is the helper's path, or any other value to find it in PATH.
+#define SPAWN_ENV_VAR "ZUSAGE_SPAWN"
+#define SPAWN_HELPER_NAME "zusage-send"
+
+#define IBM_CHECK_CACHE_EXPIRY (14 * 24 * 3600) // 2 weeks in seconds
+#define IBM_CHECK_CACHE_FILE_NAME "zusage_check.cache"
+#define IBM_CHECK_CACHE_MAX_SIZE 64 // "<0|1>\n<epoch seconds>\n" always fits
+
+// Reference wall-clock cost of usage_analytics_init() in the host process.
+// Only used to flag slow constructors in the print_debug output; nothing is
+// skipped when it is exceeded.
+#define INIT_OVERHEAD_BUDGET_US 1000
+
+// Events kept per process before the oldest are overwritten
+#define TRACE_RING_EVENTS 512
+
+// --- Spooler ---
+#define SPOOLER_ENV_VAR "ZUSAGE_SPOOLER"
+#define SPOOLER_SOCKET_FILE_NAME "zusage_spool.sock"
+#define SPOOLER_LOCK_FILE_NAME "zusage_spool.lock"
+#define SPOOLER_RECORD_MAGIC 0x5a555332 // "ZUS2"
+#define SPOOLER_MAX_APP_NAME_LENGTH 256
+#define SPOOLER_BATCH_MAX 64
+#define SPOOLER_FLUSH_INTERVAL_MS 1000
+#define SPOOLER_IDLE_EXIT_SECONDS 600
+
+// --- Offline event ring ---
+#define RING_FILE_NAME "zusage_events.ring"
+#define RING_MAGIC 0x5a555247 // "ZURG"
+#define RING_VERSION 2
+#define RING_SLOT_COUNT 1024
+#define RING_SLOT_PAYLOAD_SIZE 1024
+#define RING_DRAIN_MAX 256 // events delivered per connection
+#define RING_RETRY_BACKOFF_SECONDS 60
+#define RING_STALE_WRITE_SECONDS 60
+
+// --- Aggregated counters ---
+#define AGGREGATE_ENV_VAR "ZUSAGE_AGGREGATE"
+#define COUNTER_FILE_NAME "zusage_counters.table"
+#define COUNTER_MAGIC 0x5a554354 // "ZUCT"
+#define COUNTER_VERSION 1
+#define COUNTER_SLOT_COUNT 256
+#define COUNTER_FLUSH_INTERVAL_SECONDS 300
+// Largest count in one event, about 330 starts a second for a whole flush
+// interval; the collector and server reject more. Counts above it are sent
+// over the following flushes.
+#define COUNTER_MAX_EVENT_COUNT 100000
+
+// --- Host profile ---
+// Host-wide fields, the collector's address and the host part of the JSON
+// payload, discovered once and kept in ~/.cache for the senders that follow.
+#define PROFILE_FILE_NAME "zusage_profile.cache"
+#define PROFILE_MAGIC 0x5a554850 // "ZUHP"
+#define PROFILE_VERSION 1
+#define PROFILE_TTL_SECONDS 3600 // DHCP may hand out a new address
+#define PROFILE_BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define PROFILE_BOOT_ID_LENGTH 40
+#define PROFILE_SYSTEM_FIELD_LENGTH 65 // size of a struct utsname field
+#define PROFILE_PAYLOAD_PREFIX_SIZE 1024
+
+struct host_profile {
+  unsigned int magic;
+  unsigned int version;
+  long long written_at;            // epoch seconds
+  char boot_id[PROFILE_BOOT_ID_LENGTH]; // empty where the system has none
+  char fqdn[MAX_FQDN_LENGTH];
+  char local_ip[MAX_IP_ADDRESS_LENGTH];
+  char os_release[PROFILE_SYSTEM_FIELD_LENGTH];
+  char cpu_arch[PROFILE_SYSTEM_FIELD_LENGTH];
+  char username[MAX_USERNAME_LENGTH];
+  unsigned int collector_addr;     // IPv4, network byte order; 0 if unresolved
+  unsigned int payload_prefix_len;
+  char payload_prefix[PROFILE_PAYLOAD_PREFIX_SIZE]; // see build_usage_payload_prefix()
+};
+
+// --- Program introspection ---
+#define VERSION_CACHE_FILE_NAME "zusage_versions.cache"
+#define VERSION_CACHE_MAGIC 0x5a555643 // "ZUVC"
+#define VERSION_CACHE_VERSION 1
+#define VERSION_CACHE_SLOTS 256
+
+struct program_info {
+  char path[PATH_MAX];        // resolved path of the executable
+  char name[PATH_MAX];        // file name it was started as
+  int identified;             // dev/ino/mtime are set
+  unsigned long long dev;
+  unsigned long long ino;
+  long long mtime;
+};
+
+// Room for the HTTP request line and headers around one payload.
+#define MAX_REQUEST_HEADER_SIZE 256
+
+struct ring_claim {
+  unsigned int slots[RING_DRAIN_MAX];
+  int count;
+  int locked;
+};
+
+struct usage_batch {
+  char *data;
+  size_t len;       // bytes of JSON body written so far
+  size_t capacity;
+  int count;
+};
+
+// --- spawn_usage_sender() flags ---
+#define SENDER_VERIFY_IBM_DOMAIN 0x1
+#define SENDER_START_SPOOLER 0x2
+#define SENDER_FLUSH_COUNTERS 0x4
+
+// One datagram on the spooler socket: the executable of the process that ran.
+// The spooler, which runs as the same user, resolves its name and version and
+// fills in the host-wide fields (fqdn, ip, os, cpu, username).
+struct spool_record {
+  unsigned int magic;
+  char exe_path[PATH_MAX];
+};
+
+// --- zusage.c ---
+void print_debug(const char *format, ...);
+void get_fqdn(char *fqdn, size_t size);
+void get_local_ip(char *local_ip, size_t size);
+void get_system_info(char **os_release, char **cpu_arch);
+char *get_username();
+int build_cache_file_path(char *buf, size_t size, const char *file_name);
+int lookup_collector_address(unsigned int *addr);
+int collector_overridden();
+int collector_override(unsigned int *addr, int *port);
+int connect_to_collector();
+int send_all(int fd, const char *buf, size_t len);
+int read_response_ok(int sockfd);
+int usage_batch_init(struct usage_batch *batch, size_t body_capacity);
+int usage_batch_add(struct usage_batch *batch, const char *payload, int payload_len);
+void usage_batch_add_backlog(struct usage_batch *batch, const struct ring_claim *claim);
+const char *usage_batch_finish(struct usage_batch *batch, int keep_alive, size_t *request_len);
+void usage_batch_free(struct usage_batch *batch);
+void init_cache_path();
+void close_inherited_fds();
+int spawn_helper(const char *helper, char *const argv[]);
+void spawn_usage_sender(int flags);
+void run_usage_sender(int flags, const char *app_name, const char *app_version);
+
+// --- zusage_payload.c ---
+int build_usage_payload_prefix(char *buf, size_t size, const char *fqdn, const char *local_ip,
+                               const char *os_release, const char *cpu_arch, const char *username);
+int build_usage_payload_from_prefix(char *buf, size_t size, const char *prefix, int prefix_len,
+                                    const char *app_name, const char *app_version);
+int build_usage_payload(char *buf, size_t size, const char *app_name, const char *fqdn,
+                        const char *local_ip, const char *os_release, const char *cpu_arch,
+                        const char *app_version, const char *username);
+int build_usage_request(char *buf, size_t size, const char *payload, int payload_len, int keep_alive);
+
+// --- zusage_ring.c ---
+int ring_append(const char *payload, int payload_len);
+int ring_collector_down();
+void ring_set_collector_down(int down);
+void ring_close();
+int ring_claim_backlog(struct ring_claim *claim);
+const char *ring_claim_payload(const struct ring_claim *claim, int index, int *payload_len);
+void ring_release_claim(struct ring_claim *claim, int delivered);
+
+// --- zusage_program.c ---
+int get_executable_path(char *raw_path, size_t size);
+void program_info_from_path(const char *raw_path, struct program_info *info);
+const struct program_info *get_program_info();
+char *app_version_of(const struct program_info *info);
+char *__tool_getprogname();
+char *get_app_version();
+
+// --- zusage_profile.c ---
+const struct host_profile *host_profile_get();
+void host_profile_invalidate();
+void host_profile_release();
+
+// --- zusage_counters.c ---
+int counter_increment(const char *app_name, const char *app_version, int *flush_due);
+void counter_flush();
+
+// --- zusage_trace.c ---
+long long trace_begin();
+void trace_end(int phase, long long start, int value);
+void trace_forked();
+void trace_dump();
+void trace_maybe_dump();
+
+// --- zusage_spooler.c ---
+int spooler_submit(const char *exe_path);
+void start_spooler();
+void run_spooler_process();
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <limits.h>
+
+#include "zusage_internal.h"
+
+// Usage event payloads and requests, exactly as the sender puts them on the
+// wire. Kept apart from zusage.c (and its constructor) so that tools such as
+// bench/zusage_loadgen can build the same bytes without linking the library.
+
+// Format the host part of a usage event's JSON body: everything up to the
+// per-process fields. Returns its length, or -1 if it does not fit.
+int build_usage_payload_prefix(char *buf, size_t size, const char *fqdn, const char *local_ip,
+                               const char *os_release, const char *cpu_arch, const char *username) {
+  int len = snprintf(buf, size,
+           "{\"fqdn\": \"%s\", \"local_ip\": \"%s\", \"os_release\": \"%s\", \"cpu_arch\": \"%s\", \"username\": \"%s\", ",
+           fqdn, local_ip, os_release, cpu_arch, username);
+  if (len < 0 || (size_t)len >= size) {
+    return -1;
+  }
+  return len;
+}
+
+// Complete a JSON body from a prefix built by build_usage_payload_prefix().
+// Returns its length, or -1 if it does not fit.
+int build_usage_payload_from_prefix(char *buf, size_t size, const char *prefix, int prefix_len,
+                                    const char *app_name, const char *app_version) {
+  if (prefix_len <= 0 || (size_t)prefix_len >= size) {
+    return -1;
+  }
+  memcpy(buf, prefix, prefix_len);
+  int len = snprintf(buf + prefix_len, size - prefix_len,
+           "\"app_name\": \"%s\", \"app_version\": \"%s\"}", app_name, app_version);
+  if (len < 0 || (size_t)len >= size - prefix_len) {
+    return -1;
+  }
+  return prefix_len + len;
+}
+
+// Format the JSON body of one usage event. Returns its length, or -1 if it
+// does not fit.
+int build_usage_payload(char *buf, size_t size, const char *app_name, const char *fqdn,
+                        const char *local_ip, const char *os_release, const char *cpu_arch,
+                        const char *app_version, const char *username) {
+  char prefix[PROFILE_PAYLOAD_PREFIX_SIZE];
+  int prefix_len = build_usage_payload_prefix(prefix, sizeof(prefix), fqdn, local_ip, os_release,
+                                              cpu_arch, username);
+  return build_usage_payload_from_prefix(buf, size, prefix, prefix_len, app_name, app_version);
+}
+
+// Wrap a JSON payload in an HTTP POST to the collector. Returns the request
+// length, or -1 if it does not fit.
+int build_usage_request(char *buf, size_t size, const char *payload, int payload_len, int keep_alive) {
+  int len = snprintf(buf, size,
+           "POST %s HTTP/1.1\r\n"
+           "Host: %s\r\n"
+           "Content-Type: application/json\r\n"
+           "Content-Length: %d\r\n"
+           "Connection: %s\r\n"
+           "\r\n"
+           "%s",
+           USAGE_ANALYTICS_PATH, USAGE_ANALYTICS_URL, payload_len,
+           keep_alive ? "keep-alive" : "close", payload);
+  if (len < 0 || (size_t)len >= size) {
+    return -1;
+  }
+  return len;
+}
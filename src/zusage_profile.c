@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <limits.h>
+
+#include "zusage_internal.h"
+
+// Host profile cache. Everything a sender needs that is the same for every
+// process of this user on this host (fqdn, local IP, uname fields, username,
+// the collector's address and the JSON payload built from them) is kept in
+// one fixed-layout file in ~/.cache. A warm sender maps the file read-only
+// and only fills in the app name and version. The file is rebuilt after
+// PROFILE_TTL_SECONDS, after a reboot (boot id change), or when the collector
+// could not be reached at the cached address. It is replaced with rename()
+// so readers never see a partial profile.
+
+static const struct host_profile *profile = NULL;
+static struct host_profile built_profile; // used when the file cannot be
+
+// Read the kernel's boot id. Leaves buf empty where the system has none.
+static void read_boot_id(char *buf, size_t size) {
+  buf[0] = '\0';
+  int fd = open(PROFILE_BOOT_ID_PATH, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n <= 0) {
+    buf[0] = '\0';
+    return;
+  }
+  buf[n] = '\0';
+  char *newline = strchr(buf, '\n');
+  if (newline) {
+    *newline = '\0';
+  }
+}
+
+static int field_terminated(const char *field, size_t size) {
+  return memchr(field, '\0', size) != NULL;
+}
+
+static int profile_valid(const struct host_profile *p, const char *boot_id) {
+  time_t now = time(NULL);
+  return p->magic == PROFILE_MAGIC && p->version == PROFILE_VERSION &&
+         now != (time_t)-1 && p->written_at <= now && now - p->written_at < PROFILE_TTL_SECONDS &&
+         field_terminated(p->boot_id, sizeof(p->boot_id)) && strcmp(p->boot_id, boot_id) == 0 &&
+         field_terminated(p->fqdn, sizeof(p->fqdn)) &&
+         field_terminated(p->local_ip, sizeof(p->local_ip)) &&
+         field_terminated(p->os_release, sizeof(p->os_release)) &&
+         field_terminated(p->cpu_arch, sizeof(p->cpu_arch)) &&
+         field_terminated(p->username, sizeof(p->username)) &&
+         p->payload_prefix_len > 0 && p->payload_prefix_len < sizeof(p->payload_prefix);
+}
+
+// Map the profile file. Returns the mapping if it is current, else NULL.
+static const struct host_profile *map_profile(const char *path, const char *boot_id) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size != sizeof(struct host_profile)) {
+    close(fd);
+    return NULL;
+  }
+  struct host_profile *map = mmap(NULL, sizeof(struct host_profile), PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  if (!profile_valid(map, boot_id)) {
+    print_debug("map_profile: host profile stale or invalid, rebuilding");
+    munmap(map, sizeof(struct host_profile));
+    return NULL;
+  }
+  return map;
+}
+
+static void copy_field(char *dest, size_t size, const char *value) {
+  snprintf(dest, size, "%s", value ? value : "unknown");
+}
+
+// Run the discovery calls once and fill in a profile.
+static void build_profile(struct host_profile *p, const char *boot_id) {
+  memset(p, 0, sizeof(*p));
+  p->magic = PROFILE_MAGIC;
+  p->version = PROFILE_VERSION;
+  p->written_at = (long long)time(NULL);
+  copy_field(p->boot_id, sizeof(p->boot_id), boot_id);
+
+  get_fqdn(p->fqdn, sizeof(p->fqdn));
+  get_local_ip(p->local_ip, sizeof(p->local_ip));
+
+  char *os_release = NULL;
+  char *cpu_arch = NULL;
+  get_system_info(&os_release, &cpu_arch);
+  copy_field(p->os_release, sizeof(p->os_release), os_release);
+  copy_field(p->cpu_arch, sizeof(p->cpu_arch), cpu_arch);
+  free(os_release);
+  free(cpu_arch);
+
+  char *username = get_username();
+  copy_field(p->username, sizeof(p->username), username);
+  free(username);
+
+  // With ZUSAGE_COLLECTOR set the default collector is not used, so do not
+  // spend a DNS lookup on it
+  if (collector_overridden() || !lookup_collector_address(&p->collector_addr)) {
+    p->collector_addr = 0;
+  }
+
+  int prefix_len = build_usage_payload_prefix(p->payload_prefix, sizeof(p->payload_prefix), p->fqdn,
+                                              p->local_ip, p->os_release, p->cpu_arch, p->username);
+  p->payload_prefix_len = prefix_len > 0 ? prefix_len : 0;
+}
+
+// Write the profile next to its final path and rename it into place.
+static void write_profile(const char *path, const struct host_profile *p) {
+  char tmp_path[PATH_MAX];
+  int len = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+  if (len < 0 || (size_t)len >= sizeof(tmp_path)) {
+    return;
+  }
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    print_debug("write_profile: Failed to open %s, errno: %d", tmp_path, errno);
+    return;
+  }
+  ssize_t written = write(fd, p, sizeof(*p));
+  close(fd);
+  if (written != sizeof(*p) || rename(tmp_path, path) == -1) {
+    print_debug("write_profile: Failed to write %s, errno: %d", path, errno);
+    unlink(tmp_path);
+    return;
+  }
+  print_debug("write_profile: Host profile written to %s", path);
+}
+
+// Return the host profile, from the cache file when it is current, otherwise
+// from a fresh discovery (which is then saved for the next sender).
+const struct host_profile *host_profile_get() {
+  if (profile) {
+    return profile;
+  }
+
+  char boot_id[PROFILE_BOOT_ID_LENGTH];
+  read_boot_id(boot_id, sizeof(boot_id));
+
+  char path[PATH_MAX];
+  int have_path = build_cache_file_path(path, sizeof(path), PROFILE_FILE_NAME);
+  if (have_path) {
+    profile = map_profile(path, boot_id);
+    if (profile) {
+      print_debug("host_profile_get: Using cached host profile");
+      return profile;
+    }
+  }
+
+  build_profile(&built_profile, boot_id);
+  if (have_path && built_profile.payload_prefix_len > 0) {
+    write_profile(path, &built_profile);
+  }
+  profile = &built_profile;
+  return profile;
+}
+
+// Forget this process's profile so the next host_profile_get() reads the
+// cache file again. For the spooler, which would otherwise keep one profile
+// for as long as it runs.
+void host_profile_release() {
+  if (profile && profile != &built_profile) {
+    munmap((void *)profile, sizeof(struct host_profile));
+  }
+  profile = NULL;
+}
+
+// Drop the cache file, e.g. when the cached collector address stopped
+// answering. This process keeps its profile; the next sender rebuilds it.
+void host_profile_invalidate() {
+  char path[PATH_MAX];
+  if (build_cache_file_path(path, sizeof(path), PROFILE_FILE_NAME)) {
+    unlink(path);
+  }
+}
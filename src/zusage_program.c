@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libgen.h>
+#ifdef __MVS__
+#include <sys/ps.h>
+#endif
+#include <arpa/inet.h>
+#include <limits.h>
+
+#include "zusage_internal.h"
+
+// Process introspection: which executable is this process running, and what
+// version is it. The executable is looked up once per process and shared by
+// __tool_getprogname() and get_app_version(). On z/OS that takes a walk of
+// the process table with w_getpsent, which is the costliest step of a send on
+// systems with many address spaces; on Linux it is a readlink of
+// /proc/self/exe. App versions are cached in ~/.cache per binary (device,
+// inode, mtime), so the .version file is only read the first time a binary
+// is seen. The spooler and zusage-send are handed only the executable's path
+// and resolve name and version with program_info_from_path() and
+// app_version_of(), so that work stays out of the host process.
+
+#define VERSION_CACHE_HEADER_SIZE sizeof(struct version_cache_header)
+
+struct version_cache_header {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int slot_count;
+  unsigned int slot_size;
+};
+
+// One cached version. check covers the other fields, so a slot that is
+// being rewritten by another process reads as a miss.
+struct version_cache_entry {
+  unsigned long long dev;
+  unsigned long long ino;
+  long long mtime;
+  char app_version[MAX_APP_VERSION_LENGTH];
+  unsigned int check;
+};
+
+static struct program_info program;
+static int program_state = 0; // 0: not looked up, 1: found, -1: failed
+
+#ifdef __MVS__
+// One pass over the process table for our own entry.
+int get_executable_path(char *raw_path, size_t size) {
+  W_PSPROC buf;
+  int token = 0;
+  pid_t mypid = getpid();
+
+  memset(&buf, 0, sizeof(buf));
+  buf.ps_pathlen = size;
+  buf.ps_pathptr = raw_path;
+
+  while ((token = w_getpsent(token, &buf, sizeof(buf))) > 0) {
+    if (buf.ps_pid == mypid) {
+      raw_path[size - 1] = '\0';
+      return 1;
+    }
+  }
+  print_debug("get_executable_path: w_getpsent failed");
+  return 0;
+}
+#else
+int get_executable_path(char *raw_path, size_t size) {
+  ssize_t len = readlink("/proc/self/exe", raw_path, size - 1);
+  if (len <= 0) {
+    print_debug("get_executable_path: readlink of /proc/self/exe failed, errno: %d", errno);
+    return 0;
+  }
+  raw_path[len] = '\0';
+  // The kernel marks a replaced or removed binary
+  static const char deleted[] = " (deleted)";
+  size_t suffix_len = sizeof(deleted) - 1;
+  if ((size_t)len > suffix_len && strcmp(raw_path + len - suffix_len, deleted) == 0) {
+    raw_path[len - suffix_len] = '\0';
+  }
+  return 1;
+}
+#endif
+
+// Fill in info for the executable at raw_path. The name is always set; where
+// the file cannot be resolved or identified (a deleted binary), identified
+// stays 0 and only the version cache is skipped.
+void program_info_from_path(const char *raw_path, struct program_info *info) {
+  memset(info, 0, sizeof(*info));
+
+  // The name is taken before resolving links, so on z/OS a tool started
+  // through a symlink reports the name it was started as. /proc/self/exe is
+  // already resolved.
+  char name_buf[PATH_MAX];
+  strncpy(name_buf, raw_path, sizeof(name_buf) - 1);
+  name_buf[sizeof(name_buf) - 1] = '\0';
+  strncpy(info->name, basename(name_buf), sizeof(info->name) - 1);
+
+  if (realpath(raw_path, info->path) == NULL) {
+    // The .version file is still looked for next to the unresolved path
+    print_debug("program_info_from_path: failed to resolve %s, errno: %d", raw_path, errno);
+    strncpy(info->path, raw_path, sizeof(info->path) - 1);
+    return;
+  }
+
+  struct stat st;
+  if (stat(info->path, &st) == 0) {
+    info->dev = (unsigned long long)st.st_dev;
+    info->ino = (unsigned long long)st.st_ino;
+    info->mtime = (long long)st.st_mtime;
+    info->identified = 1;
+  }
+}
+
+// Look up the running executable. Returns NULL if it cannot be found.
+const struct program_info *get_program_info() {
+  if (program_state != 0) {
+    return program_state > 0 ? &program : NULL;
+  }
+  program_state = -1;
+
+  char raw_path[PATH_MAX];
+  if (!get_executable_path(raw_path, sizeof(raw_path))) {
+    return NULL;
+  }
+  program_info_from_path(raw_path, &program);
+  program_state = 1;
+  return &program;
+}
+
+char* __tool_getprogname() {
+  const struct program_info *info = get_program_info();
+  if (!info) {
+    return NULL;
+  }
+  char *progname = strdup(info->name);
+  if (!progname) {
+    print_debug("__tool_getprogname: strdup failed");
+  }
+  return progname;
+}
+
+// --- Version cache ---
+
+static unsigned int version_entry_check(const struct version_cache_entry *entry) {
+  // FNV-1a over everything before the check field
+  const unsigned char *p = (const unsigned char *)entry;
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(struct version_cache_entry, check); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static off_t version_slot_offset(const struct program_info *info) {
+  unsigned long long key = info->dev * 31 + info->ino;
+  return VERSION_CACHE_HEADER_SIZE + (off_t)(key % VERSION_CACHE_SLOTS) * sizeof(struct version_cache_entry);
+}
+
+static int open_version_cache(int create) {
+  char path[PATH_MAX];
+  if (!build_cache_file_path(path, sizeof(path), VERSION_CACHE_FILE_NAME)) {
+    return -1;
+  }
+  int fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct version_cache_header header;
+  ssize_t n = pread(fd, &header, sizeof(header), 0);
+  if (n == sizeof(header) && header.magic == VERSION_CACHE_MAGIC && header.version == VERSION_CACHE_VERSION &&
+      header.slot_count == VERSION_CACHE_SLOTS && header.slot_size == sizeof(struct version_cache_entry)) {
+    return fd;
+  }
+  if (!create) {
+    close(fd);
+    return -1;
+  }
+
+  // New or from another layout: start over
+  header.magic = VERSION_CACHE_MAGIC;
+  header.version = VERSION_CACHE_VERSION;
+  header.slot_count = VERSION_CACHE_SLOTS;
+  header.slot_size = sizeof(struct version_cache_entry);
+  if (ftruncate(fd, 0) == -1 ||
+      ftruncate(fd, VERSION_CACHE_HEADER_SIZE + VERSION_CACHE_SLOTS * sizeof(struct version_cache_entry)) == -1 ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    print_debug("open_version_cache: Failed to initialize %s, errno: %d", path, errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int lookup_cached_version(const struct program_info *info, char *app_version, size_t size) {
+  int fd = open_version_cache(0);
+  if (fd == -1) {
+    return 0;
+  }
+  struct version_cache_entry entry;
+  ssize_t n = pread(fd, &entry, sizeof(entry), version_slot_offset(info));
+  close(fd);
+  if (n != sizeof(entry) || entry.check != version_entry_check(&entry) || entry.dev != info->dev ||
+      entry.ino != info->ino || entry.mtime != info->mtime ||
+      memchr(entry.app_version, '\0', sizeof(entry.app_version)) == NULL) {
+    return 0;
+  }
+  strncpy(app_version, entry.app_version, size - 1);
+  app_version[size - 1] = '\0';
+  return 1;
+}
+
+static void store_cached_version(const struct program_info *info, const char *app_version) {
+  int fd = open_version_cache(1);
+  if (fd == -1) {
+    return;
+  }
+  struct version_cache_entry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.dev = info->dev;
+  entry.ino = info->ino;
+  entry.mtime = info->mtime;
+  strncpy(entry.app_version, app_version, sizeof(entry.app_version) - 1);
+  entry.check = version_entry_check(&entry);
+  if (pwrite(fd, &entry, sizeof(entry), version_slot_offset(info)) != sizeof(entry)) {
+    print_debug("store_cached_version: pwrite failed, errno: %d", errno);
+  }
+  close(fd);
+}
+
+// Read the first line of <program dir>/../.version into app_version.
+static void read_version_file(const struct program_info *info, char *app_version, size_t size) {
+  char program_dir[PATH_MAX];
+  strncpy(program_dir, info->path, sizeof(program_dir) - 1);
+  program_dir[sizeof(program_dir) - 1] = '\0';
+
+  char version_file_path[PATH_MAX];
+  int snprintf_result = snprintf(version_file_path, sizeof(version_file_path), "%s%s",
+                                 dirname(program_dir), VERSION_FILE_RELATIVE_PATH);
+  if (snprintf_result < 0 || (size_t)snprintf_result >= sizeof(version_file_path)) {
+    print_debug("get_app_version: Version file path too long or snprintf error.");
+    strncpy(app_version, "unknown", size - 1);
+    app_version[size - 1] = '\0';
+    return;
+  }
+
+  FILE *version_file = fopen(version_file_path, "r");
+  if (version_file) {
+    if (fgets(app_version, size, version_file)) {
+      size_t len = strlen(app_version);
+      if (len > 0 && app_version[len - 1] == '\n') {
+        app_version[len - 1] = '\0';
+      }
+      print_debug("get_app_version: Resolved app version: %s", app_version);
+    } else {
+      print_debug("get_app_version: fgets failed");
+      strncpy(app_version, "unknown", size - 1);
+    }
+    fclose(version_file);
+  } else {
+    print_debug("get_app_version: Failed to open version file: %s", version_file_path);
+    strncpy(app_version, "unknown", size - 1);
+  }
+  app_version[size - 1] = '\0';
+}
+
+// The version of the program described by info, from the version cache or
+// its .version file. The caller frees the result.
+char *app_version_of(const struct program_info *info) {
+  char *app_version = malloc(MAX_APP_VERSION_LENGTH);
+  if (!app_version) {
+    print_debug("get_app_version: Memory allocation failure");
+    return strdup("unknown");
+  }
+
+  if (info->identified && lookup_cached_version(info, app_version, MAX_APP_VERSION_LENGTH)) {
+    print_debug("get_app_version: Using cached app version: %s", app_version);
+    return app_version;
+  }
+
+  read_version_file(info, app_version, MAX_APP_VERSION_LENGTH);
+  if (info->identified) {
+    store_cached_version(info, app_version);
+  }
+  return app_version;
+}
+
+char *get_app_version() {
+  const struct program_info *info = get_program_info();
+  if (!info) {
+    print_debug("get_app_version: Failed to get program directory, returning unknown");
+    return strdup("unknown");
+  }
+  return app_version_of(info);
+}
@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <limits.h>
+
+#include "zusage_internal.h"
+#include "zusage_trace.h"
+
+// Offline event ring. A fixed-size file in ~/.cache that holds usage payloads
+// which could not be delivered. Writers reserve a slot with an atomic
+// increment of the header's sequence counter and publish it by flipping the
+// slot state to RING_SLOT_READY, so appends need no lock. Draining is done by
+// one sender at a time (fcntl lock on RING_DRAIN_LOCK_BYTE) after it has
+// reached the collector. When the ring is full the oldest undelivered events
+// are overwritten.
+
+#define RING_SLOT_EMPTY 0
+#define RING_SLOT_WRITING 1
+#define RING_SLOT_READY 2
+#define RING_SLOT_DRAINING 3
+
+// A slot's state and the epoch second it entered that state share one word,
+// so whoever reads the state also sees when it was set; a reclaimer cannot
+// pair a fresh RING_SLOT_WRITING with the previous writer's timestamp.
+#define RING_SLOT_WORD(state, since) (((unsigned long long)(since) << 8) | (state))
+#define RING_SLOT_STATE(word) ((unsigned int)((word) & 0xff))
+#define RING_SLOT_SINCE(word) ((long long)((word) >> 8))
+
+// Byte ranges of the ring file used as fcntl locks.
+#define RING_INIT_LOCK_BYTE 0
+#define RING_DRAIN_LOCK_BYTE 1
+
+struct ring_header {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int slot_count;
+  unsigned int slot_size;
+  unsigned long long head;         // next sequence number to reserve
+  long long collector_down_until;  // epoch seconds, 0 if collector is up
+  char reserved[32];
+};
+
+struct ring_slot {
+  unsigned long long state;        // RING_SLOT_WORD(state, since)
+  unsigned int length;
+  unsigned int reserved;
+  char payload[RING_SLOT_PAYLOAD_SIZE];
+};
+
+static struct ring_header *ring = NULL;
+static struct ring_slot *ring_slots = NULL;
+static size_t ring_map_size = 0;
+static int ring_fd = -1;
+static int ring_failed = 0;
+
+static int ring_lock(int byte, int wait) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+  return fcntl(ring_fd, wait ? F_SETLKW : F_SETLK, &lock) == 0;
+}
+
+static void ring_unlock(int byte) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_UNLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+  fcntl(ring_fd, F_SETLK, &lock);
+}
+
+static int ring_header_valid(const struct ring_header *header) {
+  return __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == RING_MAGIC && header->version == RING_VERSION &&
+         header->slot_count == RING_SLOT_COUNT && header->slot_size == sizeof(struct ring_slot);
+}
+
+// Map the ring file. Only writers create it (or reset it if needed); readers
+// find nothing to do without one. Returns 1 on success.
+static int ring_open(int create) {
+  if (ring) {
+    return 1;
+  }
+  if (ring_failed) {
+    return 0;
+  }
+
+  char path[PATH_MAX];
+  if (!build_cache_file_path(path, sizeof(path), RING_FILE_NAME)) {
+    ring_failed = 1;
+    return 0;
+  }
+  ring_fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+  if (ring_fd == -1) {
+    if (create || errno != ENOENT) {
+      print_debug("ring_open: Failed to open %s, errno: %d", path, errno);
+      ring_failed = 1;
+    }
+    return 0;
+  }
+  ring_failed = 1;
+
+  ring_map_size = sizeof(struct ring_header) + (size_t)RING_SLOT_COUNT * sizeof(struct ring_slot);
+
+  // Only the process that creates or resets the ring has to wait here.
+  struct stat st;
+  int sized = fstat(ring_fd, &st) == 0 && st.st_size == (off_t)ring_map_size;
+  int locked = 0;
+  if (!sized) {
+    if (!create) {
+      close(ring_fd);
+      ring_fd = -1;
+      ring_failed = 0;
+      return 0;
+    }
+    if (!ring_lock(RING_INIT_LOCK_BYTE, 1)) {
+      print_debug("ring_open: Failed to lock %s, errno: %d", path, errno);
+      close(ring_fd);
+      ring_fd = -1;
+      return 0;
+    }
+    locked = 1;
+    sized = fstat(ring_fd, &st) == 0 && st.st_size == (off_t)ring_map_size;
+    if (!sized && ftruncate(ring_fd, ring_map_size) != 0) {
+      print_debug("ring_open: ftruncate failed, errno: %d", errno);
+      ring_unlock(RING_INIT_LOCK_BYTE);
+      close(ring_fd);
+      ring_fd = -1;
+      return 0;
+    }
+  }
+
+  void *map = mmap(NULL, ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+  if (map == MAP_FAILED) {
+    print_debug("ring_open: mmap failed, errno: %d", errno);
+    if (locked) {
+      ring_unlock(RING_INIT_LOCK_BYTE);
+    }
+    close(ring_fd);
+    ring_fd = -1;
+    return 0;
+  }
+  struct ring_header *header = map;
+
+  if (!ring_header_valid(header)) {
+    if (!locked && !ring_lock(RING_INIT_LOCK_BYTE, 1)) {
+      munmap(map, ring_map_size);
+      close(ring_fd);
+      ring_fd = -1;
+      return 0;
+    }
+    locked = 1;
+    if (!ring_header_valid(header)) {
+      print_debug("ring_open: Initializing event ring %s", path);
+      memset(map, 0, ring_map_size);
+      header->version = RING_VERSION;
+      header->slot_count = RING_SLOT_COUNT;
+      header->slot_size = sizeof(struct ring_slot);
+      __atomic_store_n(&header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    }
+  }
+  if (locked) {
+    ring_unlock(RING_INIT_LOCK_BYTE);
+  }
+
+  ring = header;
+  ring_slots = (struct ring_slot *)(header + 1);
+  ring_failed = 0;
+  return 1;
+}
+
+// Store one payload for later delivery. Returns 1 if it was stored.
+static int ring_store(const char *payload, int payload_len) {
+  if (payload_len <= 0 || payload_len > RING_SLOT_PAYLOAD_SIZE) {
+    print_debug("ring_append: payload of %d bytes does not fit a ring slot", payload_len);
+    return 0;
+  }
+  if (!ring_open(1)) {
+    return 0;
+  }
+
+  unsigned long long seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_ACQ_REL);
+  struct ring_slot *slot = &ring_slots[seq % RING_SLOT_COUNT];
+
+  // Take the slot unless another writer or a drainer is using it right now.
+  long long now = (long long)time(NULL);
+  unsigned long long word = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  unsigned int state = RING_SLOT_STATE(word);
+  if ((state != RING_SLOT_EMPTY && state != RING_SLOT_READY) ||
+      !__atomic_compare_exchange_n(&slot->state, &word, RING_SLOT_WORD(RING_SLOT_WRITING, now), 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    print_debug("ring_append: slot %llu busy, dropping event", seq % RING_SLOT_COUNT);
+    return 0;
+  }
+
+  memcpy(slot->payload, payload, payload_len);
+  slot->length = payload_len;
+  __atomic_store_n(&slot->state, RING_SLOT_WORD(RING_SLOT_READY, now), __ATOMIC_RELEASE);
+  print_debug("ring_append: spooled event in slot %llu", seq % RING_SLOT_COUNT);
+  return 1;
+}
+
+int ring_append(const char *payload, int payload_len) {
+  long long trace_start = trace_begin();
+  int stored = ring_store(payload, payload_len);
+  trace_end(ZUSAGE_TRACE_RING_APPEND, trace_start, stored);
+  return stored;
+}
+
+// Returns 1 if a recent sender failed to reach the collector, in which case
+// new events should go straight to the ring. Asked before every send, so
+// unless the ring is already mapped this only reads the header: no ring is
+// created, mapped or locked on the way to a healthy collector.
+int ring_collector_down() {
+  long long until;
+  if (ring) {
+    until = __atomic_load_n(&ring->collector_down_until, __ATOMIC_ACQUIRE);
+  } else {
+    char path[PATH_MAX];
+    if (!build_cache_file_path(path, sizeof(path), RING_FILE_NAME)) {
+      return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      return 0; // no sender has ever failed here
+    }
+    struct ring_header header;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+    if (n != sizeof(header) || header.magic != RING_MAGIC || header.version != RING_VERSION) {
+      return 0;
+    }
+    until = header.collector_down_until;
+  }
+  return until != 0 && (long long)time(NULL) < until;
+}
+
+void ring_set_collector_down(int down) {
+  // Clearing a flag that is not set needs no ring
+  if (!down && !ring && !ring_collector_down()) {
+    return;
+  }
+  if (!ring_open(down)) {
+    return;
+  }
+  long long until = down ? (long long)time(NULL) + RING_RETRY_BACKOFF_SECONDS : 0;
+  __atomic_store_n(&ring->collector_down_until, until, __ATOMIC_RELEASE);
+}
+
+// Unmap the ring and close its file; the next use maps it again.
+void ring_close() {
+  if (ring) {
+    munmap(ring, ring_map_size);
+  }
+  if (ring_fd != -1) {
+    close(ring_fd);
+  }
+  ring = NULL;
+  ring_slots = NULL;
+  ring_fd = -1;
+  ring_failed = 0;
+}
+
+// Claim up to RING_DRAIN_MAX ready events for delivery. Returns the number
+// claimed; the caller must hand the claim back to ring_release_claim().
+// Senders and the spooler are single-threaded and hold at most one claim, so
+// whoever gets the drain lock knows that no other drainer is alive: slots
+// still marked RING_SLOT_DRAINING were left by one that died before releasing
+// its claim, and are made ready again.
+int ring_claim_backlog(struct ring_claim *claim) {
+  claim->count = 0;
+  claim->locked = 0;
+  if (!ring_open(0)) {
+    return 0; // no ring, no backlog
+  }
+  if (!ring_lock(RING_DRAIN_LOCK_BYTE, 0)) {
+    return 0; // someone else is draining
+  }
+  claim->locked = 1;
+
+  long long now = (long long)time(NULL);
+  for (unsigned int i = 0; i < RING_SLOT_COUNT && claim->count < RING_DRAIN_MAX; i++) {
+    struct ring_slot *slot = &ring_slots[i];
+    unsigned long long word = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    unsigned int state = RING_SLOT_STATE(word);
+    if (state == RING_SLOT_WRITING && now - RING_SLOT_SINCE(word) > RING_STALE_WRITE_SECONDS) {
+      // The writer died mid-append; the slot contents are not trustworthy.
+      // The CAS fails if a new writer has taken the slot since.
+      __atomic_compare_exchange_n(&slot->state, &word, RING_SLOT_WORD(RING_SLOT_EMPTY, now), 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      continue;
+    }
+    if (state == RING_SLOT_DRAINING) {
+      // Delivery is at least once: the dead drainer may have been answered
+      if (__atomic_compare_exchange_n(&slot->state, &word, RING_SLOT_WORD(RING_SLOT_READY, now), 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        print_debug("ring_claim_backlog: slot %u was left claimed, making it ready again", i);
+        state = RING_SLOT_READY;
+        word = RING_SLOT_WORD(RING_SLOT_READY, now);
+      }
+    }
+    if (state != RING_SLOT_READY ||
+        !__atomic_compare_exchange_n(&slot->state, &word, RING_SLOT_WORD(RING_SLOT_DRAINING, now), 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    claim->slots[claim->count++] = i;
+  }
+  return claim->count;
+}
+
+// The payload of a claimed event, or NULL if the slot's length is out of
+// range (a corrupted ring file); such an event is not sent.
+const char *ring_claim_payload(const struct ring_claim *claim, int index, int *payload_len) {
+  struct ring_slot *slot = &ring_slots[claim->slots[index]];
+  unsigned int length = slot->length;
+  if (length == 0 || length > RING_SLOT_PAYLOAD_SIZE) {
+    print_debug("ring_claim_payload: slot %u has a length of %u, skipping it", claim->slots[index], length);
+    *payload_len = 0;
+    return NULL;
+  }
+  *payload_len = (int)length;
+  return slot->payload;
+}
+
+// Finish a claim: delivered events are freed, undelivered ones go back to
+// the ready state for the next sender.
+void ring_release_claim(struct ring_claim *claim, int delivered) {
+  long long now = (long long)time(NULL);
+  for (int i = 0; i < claim->count; i++) {
+    struct ring_slot *slot = &ring_slots[claim->slots[i]];
+    __atomic_store_n(&slot->state, RING_SLOT_WORD(delivered ? RING_SLOT_EMPTY : RING_SLOT_READY, now),
+                     __ATOMIC_RELEASE);
+  }
+  if (claim->count > 0) {
+    print_debug("ring_release_claim: %s %d spooled events", delivered ? "delivered" : "returned", claim->count);
+  }
+  if (claim->locked) {
+    ring_unlock(RING_DRAIN_LOCK_BYTE);
+  }
+  claim->count = 0;
+  claim->locked = 0;
+}
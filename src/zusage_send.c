@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zusage_internal.h"
+
+// zusage-send: the background sender as a program of its own, started by the
+// library with posix_spawn when ZUSAGE_SPAWN is set (spawn_usage_helper() in
+// zusage.c). Built from the library sources with ZUSAGE_NO_CONSTRUCTOR, so it
+// does not report itself.
+//
+//   zusage-send [-d] [-i] [-s] -c
+//   zusage-send [-d] [-i] [-s] -x exe_path
+//   zusage-send [-d] [-i] [-s] [--] app_name app_version
+//   zusage-send [-d] -S
+//       -d  detach: fork, and let the first process exit at once so the
+//           caller can reap it without waiting for the send
+//       -i  run the full IBM domain check first (SENDER_VERIFY_IBM_DOMAIN)
+//       -s  start the per-user spooler after sending (SENDER_START_SPOOLER)
+//       -c  flush the aggregated counters instead (SENDER_FLUSH_COUNTERS)
+//       -x  report the program at exe_path, looking up its name and version
+//           here rather than in the process that started the helper
+//       -S  run the per-user spooler instead of sending (start_spooler() in
+//           zusage_spooler.c)
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-d] [-i] [-s] (-c | -x exe_path | [--] app_name app_version)\n", argv0);
+  fprintf(stderr, "       %s [-d] -S\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int flags = 0;
+  int detach = 0;
+  int spooler = 0;
+  const char *exe_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "discx:S")) != -1) {
+    switch (opt) {
+      case 'd': detach = 1; break;
+      case 'i': flags |= SENDER_VERIFY_IBM_DOMAIN; break;
+      case 's': flags |= SENDER_START_SPOOLER; break;
+      case 'c': flags |= SENDER_FLUSH_COUNTERS; break;
+      case 'x': exe_path = optarg; break;
+      case 'S': spooler = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  int operands = (flags & SENDER_FLUSH_COUNTERS) || exe_path || spooler ? 0 : 2;
+  if (((flags & SENDER_FLUSH_COUNTERS) && exe_path) || (spooler && (flags || exe_path)) ||
+      optind + operands != argc) {
+    usage(argv[0]);
+  }
+
+  if (detach) {
+    // The child waits for EOF on the pipe, i.e. until the first process has
+    // exited, so on a busy or single CPU the caller is not kept waiting
+    // while the child already works.
+    int exited[2];
+    if (pipe(exited) != 0) {
+      print_debug("zusage-send: pipe failed");
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+      print_debug("zusage-send: fork failed");
+      return 1;
+    }
+    if (pid > 0) {
+      _exit(0);
+    }
+    close(exited[1]);
+    char byte;
+    while (read(exited[0], &byte, 1) > 0) {
+    }
+    close(exited[0]);
+    trace_forked();
+    setsid();
+  }
+
+  if (spooler) {
+    run_spooler_process();
+    return 0;
+  }
+
+  close_inherited_fds();
+
+  init_cache_path();
+  if (flags & SENDER_FLUSH_COUNTERS) {
+    run_usage_sender(flags, NULL, NULL);
+  } else if (exe_path) {
+    struct program_info info;
+    program_info_from_path(exe_path, &info);
+    char *app_version = app_version_of(&info);
+    run_usage_sender(flags, info.name[0] ? info.name : "unknown", app_version ? app_version : "unknown");
+    free(app_version);
+  } else {
+    run_usage_sender(flags, argv[optind], argv[optind + 1]);
+  }
+  return 0;
+}
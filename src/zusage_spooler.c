@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <limits.h>
+
+#include "zusage_internal.h"
+#include "zusage_trace.h"
+
+// Per-user spooler. Short-lived processes hand one spool_record to it over an
+// AF_UNIX datagram socket in ~/.cache; the spooler looks up the app name and
+// version from the executable's path, takes the host-wide fields from the
+// host profile and forwards batches of events to the collector's batch
+// endpoint over a single keep-alive connection. It is started on demand by a
+// sender, as zusage-send -S, and exits after SPOOLER_IDLE_EXIT_SECONDS without
+// traffic.
+
+static int build_spooler_address(struct sockaddr_un *addr) {
+  char path[PATH_MAX];
+  if (!build_cache_file_path(path, sizeof(path), SPOOLER_SOCKET_FILE_NAME)) {
+    return 0;
+  }
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    print_debug("build_spooler_address: socket path too long: %s", path);
+    return 0;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct spool_event {
+  char app_name[SPOOLER_MAX_APP_NAME_LENGTH];
+  char app_version[MAX_APP_VERSION_LENGTH];
+};
+
+// Send one record to the spooler without blocking. Returns 1 if the spooler
+// accepted it, 0 if the caller should fall back to sending it itself.
+int spooler_submit(const char *exe_path) {
+  struct sockaddr_un addr;
+  if (!build_spooler_address(&addr)) {
+    return 0;
+  }
+
+  struct spool_record record;
+  memset(&record, 0, sizeof(record));
+  record.magic = SPOOLER_RECORD_MAGIC;
+  strncpy(record.exe_path, exe_path, sizeof(record.exe_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    print_debug("spooler_submit: socket failed, errno: %d", errno);
+    return 0;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  ssize_t sent = sendto(fd, &record, sizeof(record), 0, (struct sockaddr *)&addr, sizeof(addr));
+  int saved_errno = errno;
+  close(fd);
+
+  if (sent != sizeof(record)) {
+    print_debug("spooler_submit: sendto failed, errno: %d", saved_errno);
+    return 0;
+  }
+  print_debug("spooler_submit: handed %s to spooler", record.exe_path);
+  return 1;
+}
+
+// Read one whole response off the keep-alive connection (status line,
+// headers and a Content-Length body) so the next request starts clean.
+// Returns 1 for a 2xx status, 0 for any other status and -1 if no response
+// arrived. *reusable is cleared when the connection cannot carry another
+// request.
+static int read_batch_response(int fd, int *reusable) {
+  struct timeval recv_timeout;
+  recv_timeout.tv_sec = 2;
+  recv_timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+  *reusable = 0;
+
+  char response[4096];
+  size_t len = 0;
+  char *header_end = NULL;
+  while (header_end == NULL && len < sizeof(response) - 1) {
+    ssize_t n = recv(fd, response + len, sizeof(response) - 1 - len, 0);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+    response[len] = '\0';
+    header_end = strstr(response, "\r\n\r\n");
+  }
+  if (len < 12 || strncmp(response, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
+  int ok = response[9] == '2';
+  if (header_end == NULL) {
+    return ok;
+  }
+  *header_end = '\0';
+
+  long content_length = -1;
+  int keep_alive = 1;
+  for (char *line = strstr(response, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      content_length = strtol(line + 15, NULL, 10);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      const char *value = line + 11;
+      while (*value == ' ') {
+        value++;
+      }
+      keep_alive = strncasecmp(value, "close", 5) != 0;
+    }
+  }
+  if (content_length < 0 || !keep_alive) {
+    return ok;
+  }
+
+  size_t body_read = len - (size_t)(header_end + 4 - response);
+  while (body_read < (size_t)content_length) {
+    char discard[1024];
+    size_t want = (size_t)content_length - body_read;
+    ssize_t n = recv(fd, discard, want < sizeof(discard) ? want : sizeof(discard), 0);
+    if (n <= 0) {
+      return ok;
+    }
+    body_read += n;
+  }
+  *reusable = body_read == (size_t)content_length;
+  return ok;
+}
+
+// Forward pending records, plus any backlog from the offline ring, as one
+// keep-alive POST to the batch endpoint. Claims on the backlog are only
+// released once the collector has answered with a 2xx status. Reconnects
+// once if the collector has dropped the idle connection; if it stays
+// unreachable or refuses the batch the records are moved to the offline
+// ring.
+static void flush_records(int *upstream, const struct spool_event *records, int count,
+                          const struct host_profile *host) {
+  char payloads[SPOOLER_BATCH_MAX][MAX_POST_DATA_SIZE];
+  int payload_lens[SPOOLER_BATCH_MAX];
+  size_t payload_total = 0;
+  for (int i = 0; i < count; i++) {
+    payload_lens[i] = build_usage_payload_from_prefix(payloads[i], sizeof(payloads[i]), host->payload_prefix,
+                                                      host->payload_prefix_len, records[i].app_name,
+                                                      records[i].app_version);
+    if (payload_lens[i] < 0) {
+      print_debug("flush_records: post data creation failed for %s", records[i].app_name);
+      continue;
+    }
+    payload_total += payload_lens[i] + 1;
+  }
+
+  struct ring_claim claim;
+  claim.count = 0;
+  claim.locked = 0;
+  int delivered = 0;
+
+  for (int attempt = 0; attempt < 2 && !delivered; attempt++) {
+    if (*upstream < 0) {
+      if (ring_collector_down()) {
+        break;
+      }
+      *upstream = connect_to_collector();
+      if (*upstream < 0) {
+        ring_set_collector_down(1);
+        host_profile_invalidate(); // the collector may have moved
+        break;
+      }
+      if (claim.count == 0) {
+        ring_claim_backlog(&claim);
+      }
+    }
+
+    struct usage_batch batch;
+    if (!usage_batch_init(&batch, payload_total + (size_t)claim.count * (RING_SLOT_PAYLOAD_SIZE + 1))) {
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (payload_lens[i] > 0) {
+        usage_batch_add(&batch, payloads[i], payload_lens[i]);
+      }
+    }
+    usage_batch_add_backlog(&batch, &claim);
+
+    size_t request_len;
+    const char *request = usage_batch_finish(&batch, 1, &request_len);
+    int sent = request && send_all(*upstream, request, request_len);
+    usage_batch_free(&batch);
+    int reusable = 0;
+    int status = sent ? read_batch_response(*upstream, &reusable) : -1;
+    delivered = status > 0;
+    if (!reusable) {
+      close(*upstream);
+      *upstream = -1;
+    }
+    if (status == 0) {
+      // The collector answered; sending the same batch again will not help
+      print_debug("flush_records: batch of %d records not acknowledged", count + claim.count);
+      break;
+    }
+    if (status < 0) {
+      print_debug("flush_records: no response from collector, errno: %d", errno);
+    }
+  }
+
+  ring_release_claim(&claim, delivered);
+  if (delivered) {
+    print_debug("flush_records: forwarded %d records", count);
+    ring_set_collector_down(0);
+    return;
+  }
+
+  print_debug("flush_records: collector unreachable, spooling %d records", count);
+  for (int i = 0; i < count; i++) {
+    if (payload_lens[i] > 0) {
+      ring_append(payloads[i], payload_lens[i]);
+    }
+  }
+}
+
+// Set by SIGUSR1: write out the trace ring now (ZUSAGE_TRACE)
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+static void request_trace_dump(int signo) {
+  (void)signo;
+  trace_dump_requested = 1;
+}
+
+// Copy src into dest, cut to size - 1 bytes
+static void copy_truncated(char *dest, size_t size, const char *src) {
+  size_t len = strnlen(src, size - 1);
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+// Name and version of the program behind a record, looked up here rather
+// than in the short-lived process that sent it
+static void resolve_event(const char *exe_path, struct spool_event *event) {
+  struct program_info info;
+  program_info_from_path(exe_path, &info);
+  char *app_version = app_version_of(&info);
+  copy_truncated(event->app_name, sizeof(event->app_name), info.name[0] ? info.name : "unknown");
+  copy_truncated(event->app_version, sizeof(event->app_version), app_version ? app_version : "unknown");
+  free(app_version);
+}
+
+static void run_spooler() {
+  char lock_path[PATH_MAX];
+  struct sockaddr_un addr;
+  if (!build_cache_file_path(lock_path, sizeof(lock_path), SPOOLER_LOCK_FILE_NAME) ||
+      !build_spooler_address(&addr)) {
+    return;
+  }
+
+  // Only one spooler per user: whoever holds the lock owns the socket.
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+  if (lock_fd == -1) {
+    print_debug("run_spooler: Failed to open lock file: %s, errno: %d", lock_path, errno);
+    return;
+  }
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(lock_fd, F_SETLK, &lock) == -1) {
+    print_debug("run_spooler: spooler already running");
+    close(lock_fd);
+    return;
+  }
+
+  unlink(addr.sun_path);
+  int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    print_debug("run_spooler: socket failed, errno: %d", errno);
+    close(lock_fd);
+    return;
+  }
+  mode_t old_umask = umask(077);
+  int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (bound == -1) {
+    print_debug("run_spooler: bind failed, errno: %d", errno);
+    close(sock);
+    close(lock_fd);
+    return;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR1, request_trace_dump);
+
+  print_debug("run_spooler: listening on %s", addr.sun_path);
+
+  struct spool_event records[SPOOLER_BATCH_MAX];
+  int pending = 0;
+  int upstream = -1;
+  long long first_pending = 0;
+  long long last_activity = now_ms();
+  int stopping = 0;
+
+  for (;;) {
+    struct pollfd fds[2];
+    int nfds = 1;
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if (upstream >= 0) {
+      fds[1].fd = upstream;
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+      nfds = 2;
+    }
+
+    long long now = now_ms();
+    int timeout = 1000;
+    if (pending > 0) {
+      long long due = first_pending + SPOOLER_FLUSH_INTERVAL_MS - now;
+      timeout = due > 0 ? (int)due : 0;
+    }
+    if (!stopping && poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+      print_debug("run_spooler: poll failed, errno: %d", errno);
+      break;
+    }
+
+    // Each response is read by flush_records(), so an idle connection only
+    // becomes readable when the collector closes it (or sends something
+    // unexpected). Either way it is reopened on demand.
+    if (nfds == 2 && fds[1].revents) {
+      close(upstream);
+      upstream = -1;
+    }
+
+    while (pending < SPOOLER_BATCH_MAX) {
+      struct spool_record record;
+      ssize_t n = recv(sock, &record, sizeof(record), 0);
+      if (n < 0) {
+        break;
+      }
+      if (n != sizeof(record) || record.magic != SPOOLER_RECORD_MAGIC) {
+        print_debug("run_spooler: ignoring malformed record of %ld bytes", (long)n);
+        continue;
+      }
+      record.exe_path[sizeof(record.exe_path) - 1] = '\0';
+      resolve_event(record.exe_path, &records[pending]);
+      if (pending == 0) {
+        first_pending = now_ms();
+      }
+      pending++;
+      last_activity = now_ms();
+    }
+
+    now = now_ms();
+    if (pending > 0 && (stopping || pending == SPOOLER_BATCH_MAX ||
+                        now - first_pending >= SPOOLER_FLUSH_INTERVAL_MS)) {
+      // The profile is looked up again for every batch, so a spooler that
+      // runs for days picks up a new address, a rebuilt profile after
+      // PROFILE_TTL_SECONDS or one dropped because the collector moved.
+      host_profile_release();
+      long long trace_start = trace_begin();
+      flush_records(&upstream, records, pending, host_profile_get());
+      trace_end(ZUSAGE_TRACE_SPOOLER_FLUSH, trace_start, pending);
+      trace_maybe_dump();
+      pending = 0;
+      continue;
+    }
+
+    if (trace_dump_requested) {
+      trace_dump_requested = 0;
+      trace_dump();
+    }
+
+    if (stopping) {
+      break;
+    }
+    if (pending == 0 && now - last_activity >= SPOOLER_IDLE_EXIT_SECONDS * 1000LL) {
+      // Stop accepting new records, then make one last pass over the queue.
+      unlink(addr.sun_path);
+      stopping = 1;
+    }
+  }
+
+  print_debug("run_spooler: exiting");
+  if (upstream >= 0) {
+    close(upstream);
+  }
+  close(sock);
+  close(lock_fd);
+}
+
+// The spooler's process, in zusage-send -S or a forked child: let go of
+// everything inherited from the process that started it (descriptors, the
+// terminal and the working directory), then serve until idle.
+void run_spooler_process() {
+  close_inherited_fds();
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd != -1) {
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO) {
+      close(null_fd);
+    }
+  }
+  if (chdir("/") != 0) {
+    print_debug("run_spooler_process: chdir failed, errno: %d", errno);
+  }
+  run_spooler();
+}
+
+// Start the spooler as "zusage-send -d -S", detached, so the caller (itself a
+// sender) can exit immediately. The spooler runs for minutes; exec'd, it
+// holds a fresh image rather than a copy-on-write copy of the host's whole
+// address space, and it does not run in a forked copy of a possibly
+// multithreaded host. The helper is this program when the sender is
+// zusage-send, else the one ZUSAGE_SPAWN names or zusage-send from PATH.
+// Test builds do not look in PATH, where an installed helper would send
+// to the real collector. Only if no helper can be started is the spooler
+// forked from the sender.
+void start_spooler() {
+  char helper[PATH_MAX];
+#ifdef ZUSAGE_NO_CONSTRUCTOR
+  int have_helper = get_executable_path(helper, sizeof(helper));
+#else
+  const char *env_helper = getenv(SPAWN_ENV_VAR);
+#ifdef ZUSAGE_TESTING
+  int have_helper = env_helper != NULL;
+#else
+  int have_helper = 1;
+#endif
+  snprintf(helper, sizeof(helper), "%s", env_helper ? env_helper : SPAWN_HELPER_NAME);
+#endif
+  if (have_helper) {
+    char *argv[] = { SPAWN_HELPER_NAME, "-d", "-S", NULL };
+    if (spawn_helper(helper, argv)) {
+      return;
+    }
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    print_debug("start_spooler: fork failed");
+    return;
+  }
+  if (pid == 0) {
+    trace_forked();
+    setsid();
+    run_spooler_process();
+    exit(EXIT_SUCCESS);
+  }
+}
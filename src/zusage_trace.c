@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zusage_internal.h"
+#include "zusage_trace.h"
+
+// Phase tracing (ZUSAGE_TRACE). Spans are recorded as fixed-size binary
+// events into a ring in this process's memory: a clock_gettime and a few
+// stores each, no formatting and no syscalls, so tracing can stay on in
+// production. The ring is appended to a file at exit, when trace_dump() is
+// called, and by long-running processes through trace_maybe_dump(). With
+// tracing off, trace_begin() returns 0 and trace_end() ignores it.
+//
+// zusage-trace turns the files into per-phase latency histograms.
+
+static struct zusage_trace_event ring[TRACE_RING_EVENTS];
+static unsigned long long recorded = 0; // events ever recorded, ring index = recorded % size
+static unsigned long long dumped = 0;   // value of recorded at the last dump
+static int trace_state = -1;            // -1: not checked, 0: off, 1: on
+
+static long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int trace_enabled() {
+  if (trace_state < 0) {
+    trace_state = getenv(TRACE_ENV_VAR) != NULL;
+    if (trace_state) {
+      atexit(trace_dump);
+    }
+  }
+  return trace_state;
+}
+
+long long trace_begin() {
+  if (!trace_enabled()) {
+    return 0;
+  }
+  return monotonic_ns();
+}
+
+void trace_end(int phase, long long start, int value) {
+  if (start == 0) {
+    return;
+  }
+  long long now = monotonic_ns();
+  unsigned long long index = __atomic_fetch_add(&recorded, 1, __ATOMIC_RELAXED);
+  struct zusage_trace_event *event = &ring[index % TRACE_RING_EVENTS];
+  event->start_ns = start;
+  event->duration_ns = now - start;
+  event->phase = (unsigned int)phase;
+  event->value = value;
+}
+
+// In a forked child: the ring holds the parent's events, which the parent
+// dumps itself.
+void trace_forked() {
+  recorded = 0;
+  dumped = 0;
+}
+
+// "$ZUSAGE_TRACE/zusagetrace-<pid>.bin" if the variable names a directory,
+// otherwise the file goes to /tmp.
+static int build_trace_file_path(char *buf, size_t size) {
+  const char *dir = getenv(TRACE_ENV_VAR);
+  if (dir == NULL || dir[0] != '/') {
+    dir = "/tmp";
+  }
+  int len = snprintf(buf, size, "%s/%s%d.bin", dir, ZUSAGE_TRACE_FILE_PREFIX, (int)getpid());
+  return len > 0 && (size_t)len < size;
+}
+
+void trace_dump() {
+  if (trace_state != 1 || recorded == dumped) {
+    return;
+  }
+  unsigned long long end = recorded;
+  unsigned long long begin = dumped;
+  unsigned int dropped = 0;
+  if (end - begin > TRACE_RING_EVENTS) {
+    dropped = (unsigned int)(end - begin - TRACE_RING_EVENTS);
+    begin = end - TRACE_RING_EVENTS;
+  }
+  dumped = end;
+
+  struct zusage_trace_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = ZUSAGE_TRACE_MAGIC;
+  header.version = ZUSAGE_TRACE_VERSION;
+  header.event_size = sizeof(struct zusage_trace_event);
+  header.event_count = (unsigned int)(end - begin);
+  header.dropped = dropped;
+  header.pid = (int)getpid();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  header.realtime_ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  header.monotonic_ns = monotonic_ns();
+
+  char path[PATH_MAX];
+  if (!build_trace_file_path(path, sizeof(path))) {
+    return;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd == -1) {
+    print_debug("trace_dump: Failed to open %s, errno: %d", path, errno);
+    return;
+  }
+
+  // The header and the ring in order, unwrapped, in one write so that
+  // O_APPEND keeps the chunk whole
+  struct iovec iov[3];
+  size_t first = begin % TRACE_RING_EVENTS;
+  size_t count = header.event_count;
+  size_t tail = count < TRACE_RING_EVENTS - first ? count : TRACE_RING_EVENTS - first;
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = &ring[first];
+  iov[1].iov_len = tail * sizeof(struct zusage_trace_event);
+  iov[2].iov_base = &ring[0];
+  iov[2].iov_len = (count - tail) * sizeof(struct zusage_trace_event);
+  ssize_t len = sizeof(header) + count * sizeof(struct zusage_trace_event);
+  if (writev(fd, iov, 3) != len) {
+    print_debug("trace_dump: write to %s failed, errno: %d", path, errno);
+  }
+  close(fd);
+}
+
+// For processes that run for a long time (the spooler): dump once half the
+// ring is new, before it starts to overwrite events.
+void trace_maybe_dump() {
+  if (trace_state == 1 && recorded - dumped >= TRACE_RING_EVENTS / 2) {
+    trace_dump();
+  }
+}
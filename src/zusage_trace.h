@@ -0,0 +1,65 @@
+#ifndef ZUSAGE_TRACE_H
+#define ZUSAGE_TRACE_H
+
+// Binary trace files written by the client library when ZUSAGE_TRACE is set,
+// and read by zusage-trace (tools/zusage_trace.c). Each process records the
+// phases it goes through into a fixed ring in memory and appends it to
+// <dir>/zusagetrace-<pid>.bin when it exits, or earlier when asked to. A
+// file is a sequence of chunks, each a header followed by its events:
+//
+//   struct zusage_trace_header
+//   struct zusage_trace_event[event_count]   oldest first
+//
+// Everything is in the byte order of the writer; a reader recognizes a file
+// from the other byte order by its swapped magic. Times are nanoseconds of
+// CLOCK_MONOTONIC, so waits in connect() or DNS count in full. realtime_ns
+// and monotonic_ns are read together at dump time to place events on the
+// wall clock.
+
+#define ZUSAGE_TRACE_MAGIC 0x5a555452 // "ZUTR"
+#define ZUSAGE_TRACE_VERSION 1
+#define ZUSAGE_TRACE_FILE_PREFIX "zusagetrace-"
+
+struct zusage_trace_header {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int event_size;   // sizeof(struct zusage_trace_event)
+  unsigned int event_count;  // events in this chunk
+  unsigned int dropped;      // overwritten before this dump
+  int pid;
+  long long realtime_ns;
+  long long monotonic_ns;
+};
+
+struct zusage_trace_event {
+  long long start_ns;
+  long long duration_ns;
+  unsigned int phase;        // enum zusage_trace_phase
+  int value;                 // phase specific: 1/0 for success, or a count
+};
+
+// Append new phases at the end, and their names to phase_names in
+// tools/zusage_trace.c; the decoder shows unknown phases by number.
+enum zusage_trace_phase {
+  ZUSAGE_TRACE_INIT,              // constructor, as seen by the host process
+  ZUSAGE_TRACE_IBM_CHECK,         // cached or DNS-based IBM domain check
+  ZUSAGE_TRACE_FORK,              // spawn_usage_sender() forking, in the parent
+  ZUSAGE_TRACE_HOST_PROFILE,
+  ZUSAGE_TRACE_PROGRAM_INFO,
+  ZUSAGE_TRACE_APP_VERSION,
+  ZUSAGE_TRACE_PAYLOAD,
+  ZUSAGE_TRACE_RESOLVE,           // DNS lookup of the collector
+  ZUSAGE_TRACE_CONNECT,
+  ZUSAGE_TRACE_REQUEST,           // request sent and response read
+  ZUSAGE_TRACE_DATAGRAM,
+  ZUSAGE_TRACE_SEND,              // send_usage_data() as a whole
+  ZUSAGE_TRACE_RING_APPEND,
+  ZUSAGE_TRACE_SPOOLER_SUBMIT,
+  ZUSAGE_TRACE_SPOOLER_FLUSH,     // value: records forwarded
+  ZUSAGE_TRACE_COUNTER_INCREMENT,
+  ZUSAGE_TRACE_COUNTER_FLUSH,
+  ZUSAGE_TRACE_SPAWN,             // zusage-send started and reaped (ZUSAGE_SPAWN)
+  ZUSAGE_TRACE_PHASE_COUNT
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef ZUSAGE_WIRE_H
+#define ZUSAGE_WIRE_H
+
+#include <stddef.h>
+#include <string.h>
+
+// Binary encoding of one usage event, sent as a single UDP datagram
+// (ZUSAGE_TRANSPORT=udp). Shared by the client and the native collector; the
+// Node server has its own decoder (decodeUsageDatagram in app.js) and must be
+// kept in step with this file.
+//
+//   offset 0  'Z' 'U'            magic
+//          2  version            ZUSAGE_WIRE_VERSION
+//          3  field count        fields in the order of enum zusage_wire_field
+//          4  fields             each a 2-byte big-endian length and the bytes
+//
+// Strings are UTF-8 without a terminating NUL. Decoders read the fields they
+// know and ignore any that a later version appends.
+
+#define ZUSAGE_WIRE_MAGIC_0 'Z'
+#define ZUSAGE_WIRE_MAGIC_1 'U'
+#define ZUSAGE_WIRE_VERSION 1
+#define ZUSAGE_WIRE_HEADER_SIZE 4
+// Stays below the usual path MTU, so a datagram is never fragmented
+#define ZUSAGE_WIRE_MAX_DATAGRAM 1400
+
+enum zusage_wire_field {
+  ZUSAGE_WIRE_APP_NAME,
+  ZUSAGE_WIRE_FQDN,
+  ZUSAGE_WIRE_LOCAL_IP,
+  ZUSAGE_WIRE_OS_RELEASE,
+  ZUSAGE_WIRE_CPU_ARCH,
+  ZUSAGE_WIRE_APP_VERSION,
+  ZUSAGE_WIRE_USERNAME,
+  ZUSAGE_WIRE_FIELD_COUNT
+};
+
+// Encode the fields (NUL-terminated strings, in enum order) into buf.
+// Returns the datagram length, or -1 if it does not fit.
+static inline int zusage_wire_encode(unsigned char *buf, size_t size,
+                                     const char *const fields[ZUSAGE_WIRE_FIELD_COUNT]) {
+  if (size < ZUSAGE_WIRE_HEADER_SIZE) {
+    return -1;
+  }
+  buf[0] = ZUSAGE_WIRE_MAGIC_0;
+  buf[1] = ZUSAGE_WIRE_MAGIC_1;
+  buf[2] = ZUSAGE_WIRE_VERSION;
+  buf[3] = ZUSAGE_WIRE_FIELD_COUNT;
+  size_t len = ZUSAGE_WIRE_HEADER_SIZE;
+  for (int i = 0; i < ZUSAGE_WIRE_FIELD_COUNT; i++) {
+    size_t field_len = strlen(fields[i]);
+    if (field_len > 0xffff || len + 2 + field_len > size) {
+      return -1;
+    }
+    buf[len] = (unsigned char)(field_len >> 8);
+    buf[len + 1] = (unsigned char)(field_len & 0xff);
+    memcpy(buf + len + 2, fields[i], field_len);
+    len += 2 + field_len;
+  }
+  return (int)len;
+}
+
+// Decode a datagram in place: fields[i] points into buf and lens[i] holds its
+// length. Returns 1 on success, 0 if the datagram is malformed or from an
+// unknown major version.
+static inline int zusage_wire_decode(const unsigned char *buf, size_t len,
+                                     const char *fields[ZUSAGE_WIRE_FIELD_COUNT],
+                                     int lens[ZUSAGE_WIRE_FIELD_COUNT]) {
+  if (len < ZUSAGE_WIRE_HEADER_SIZE || buf[0] != ZUSAGE_WIRE_MAGIC_0 || buf[1] != ZUSAGE_WIRE_MAGIC_1 ||
+      buf[2] != ZUSAGE_WIRE_VERSION || buf[3] < ZUSAGE_WIRE_FIELD_COUNT) {
+    return 0;
+  }
+  size_t pos = ZUSAGE_WIRE_HEADER_SIZE;
+  for (int i = 0; i < ZUSAGE_WIRE_FIELD_COUNT; i++) {
+    if (pos + 2 > len) {
+      return 0;
+    }
+    size_t field_len = ((size_t)buf[pos] << 8) | buf[pos + 1];
+    pos += 2;
+    if (pos + field_len > len) {
+      return 0;
+    }
+    fields[i] = (const char *)buf + pos;
+    lens[i] = (int)field_len;
+    pos += field_len;
+  }
+  return 1;
+}
+
+#endif
@@ -5,15 +5,19 @@ PASSED=0
 TOTAL=0
 
 test_passed() {
-	PASSED=$[ $PASSED +1 ]
+	PASSED=$(( PASSED + 1 ))
 }
 
 test_failed() {
-	FAILED=$[ $FAILED +1 ]
+	FAILED=$(( FAILED + 1 ))
 }
 
 test_version()
 {
+	if [ ! -x ./getVersion ]; then
+		echo "Skipping version test"
+		return
+	fi
 	VERSION=$(./getVersion)
 	EXPECTED_VERSION="1.2.11"
 
@@ -24,16 +28,199 @@ test_version()
 	fi
 }
 
+# Post one event and one NDJSON batch to the native collector, one event
+# through the zusage-send helper (its ZUSAGE_TESTING build), then a second of load from zusage_loadgen,
+# and check that every row reaches the database. Skipped where it is not
+# built.
+test_collector()
+{
+	COLLECTOR=../collector/zusage-collector
+	if [ ! -x "$COLLECTOR" ] || ! command -v curl >/dev/null || ! command -v sqlite3 >/dev/null; then
+		echo "Skipping collector test"
+		return
+	fi
+
+	DB=$(mktemp -d)/usage.db
+	PORT=$(( 20000 + $$ % 10000 ))
+	$COLLECTOR -p $PORT -b 127.0.0.1 -d "$DB" 2>/dev/null &
+	PID=$!
+	sleep 1
+
+	EVENT='{"app_name":"test","fqdn":"host","local_ip":"127.0.0.1","os_release":"1","cpu_arch":"x","app_version":"1.0","username":"u"}'
+	SINGLE=$(curl -s -o /dev/null -w '%{http_code}' -H 'Content-Type: application/json' -d "$EVENT" http://127.0.0.1:$PORT/usage)
+	BATCH=$(printf '%s\n%s\n' "$EVENT" "$EVENT" | curl -s -o /dev/null -w '%{http_code}' -H 'Content-Type: application/x-ndjson' --data-binary @- http://127.0.0.1:$PORT/usage/batch)
+	mkdir "$(dirname "$DB")/home"
+	HOME="$(dirname "$DB")/home" ZUSAGE_COLLECTOR=127.0.0.1:$PORT ../src/zusage-send-testing spawn-test 1.0
+	LOADGEN=$(../bench/zusage_loadgen -p $PORT -r 100 -c 2 -d 1 2>/dev/null)
+	kill $PID
+	wait $PID
+	ROWS=$(sqlite3 "$DB" 'SELECT COUNT(*) FROM usage')
+	HELPER_ROWS=$(sqlite3 "$DB" "SELECT COUNT(*) FROM usage WHERE app_name = 'spawn-test'")
+	rm -rf "$(dirname "$DB")"
+
+	if [ "$SINGLE" = "201" ] && [ "$BATCH" = "201" ] && [ "$ROWS" = "104" ] && [ "$HELPER_ROWS" = "1" ] &&
+	   echo "$LOADGEN" | grep -q '"ok": 100,'; then
+		test_passed
+	else
+		test_failed
+	fi
+}
+
+# Spool events in the offline ring while the collector is down, let a sender
+# claim them and die before the collector answers, then check that the next
+# sender replays them. Clearing collector_down_until (8 bytes at offset 24 of
+# the ring header) stands in for the retry backoff running out.
+test_ring()
+{
+	COLLECTOR=../collector/zusage-collector
+	SENDER=../src/zusage-send-testing
+	if [ ! -x "$COLLECTOR" ] || [ ! -x "$SENDER" ] || ! command -v sqlite3 >/dev/null; then
+		echo "Skipping ring test"
+		return
+	fi
+
+	DIR=$(mktemp -d)
+	mkdir -p "$DIR/home/.cache"
+	RING="$DIR/home/.cache/zusage_events.ring"
+	PORT=$(( 30000 + $$ % 10000 ))
+	CLEAR_BACKOFF="dd if=/dev/zero of=$RING bs=1 seek=24 count=8 conv=notrunc"
+
+	# Nothing listens yet: the first sender spools and marks the collector
+	# down, the others spool straight away
+	for i in 1 2 3; do
+		HOME="$DIR/home" ZUSAGE_COLLECTOR=127.0.0.1:$PORT $SENDER ring-spooled 1.0
+	done
+
+	# A stopped collector: connections are accepted by the kernel, but
+	# nothing is read or answered
+	$COLLECTOR -p $PORT -u 0 -b 127.0.0.1 -d "$DIR/usage.db" 2>/dev/null &
+	PID=$!
+	sleep 1
+	kill -STOP $PID
+	$CLEAR_BACKOFF 2>/dev/null
+	HOME="$DIR/home" ZUSAGE_COLLECTOR=127.0.0.1:$PORT $SENDER ring-killed 1.0 &
+	DRAINER=$!
+	sleep 1
+	kill -KILL $DRAINER
+	wait $DRAINER 2>/dev/null
+	kill -KILL $PID
+	wait $PID 2>/dev/null
+
+	$COLLECTOR -p $PORT -u 0 -b 127.0.0.1 -d "$DIR/usage.db" 2>/dev/null &
+	PID=$!
+	sleep 1
+	$CLEAR_BACKOFF 2>/dev/null
+	HOME="$DIR/home" ZUSAGE_COLLECTOR=127.0.0.1:$PORT $SENDER ring-final 1.0
+	kill $PID
+	wait $PID
+	SPOOLED=$(sqlite3 "$DIR/usage.db" "SELECT COUNT(*) FROM usage WHERE app_name = 'ring-spooled'")
+	FINAL=$(sqlite3 "$DIR/usage.db" "SELECT COUNT(*) FROM usage WHERE app_name = 'ring-final'")
+	rm -rf "$DIR"
+
+	if [ "$SPOOLED" = "3" ] && [ "$FINAL" = "1" ]; then
+		test_passed
+	else
+		test_failed
+	fi
+}
+
+# Run the startup benchmark with a few samples: the library must reach the
+# stand-in collector from every scenario and the report must be complete.
+test_bench()
+{
+	BENCH=../bench/zusage_bench
+	if [ ! -x "$BENCH" ]; then
+		echo "Skipping benchmark test"
+		return
+	fi
+
+	OUTPUT=$($BENCH -n 3 -r 0)
+	if [ $? -eq 0 ] && echo "$OUTPUT" | grep -q '"name": "send_total", "variant": "warm"'; then
+		test_passed
+	else
+		test_failed
+	fi
+}
+
+# Run a program linked with the library with ZUSAGE_TRACE set and decode the
+# trace files its processes leave behind. The collector port is closed, so
+# the sender traces a failed connect.
+test_trace()
+{
+	APP=../bench/zusage_bench_app
+	DECODER=../tools/zusage-trace
+	if [ ! -x "$APP" ] || [ ! -x "$DECODER" ]; then
+		echo "Skipping trace test"
+		return
+	fi
+
+	DIR=$(mktemp -d)
+	mkdir "$DIR/home" "$DIR/traces"
+	HOME="$DIR/home" ZUSAGE_TRACE="$DIR/traces" ZUSAGE_COLLECTOR=127.0.0.1:1 $APP
+	sleep 1
+	OUTPUT=$($DECODER -s "$DIR"/traces/zusagetrace-*.bin)
+	STATUS=$?
+	rm -rf "$DIR"
+
+	if [ $STATUS -eq 0 ] && echo "$OUTPUT" | grep -q '^init ' && echo "$OUTPUT" | grep -q '^connect .* 1 '; then
+		test_passed
+	else
+		test_failed
+	fi
+}
+
+# Run the chart aggregations on a sample archive, one week exported by the
+# server (archiveClosedWeeks() in server/app.js), limited to two of its days.
+test_archive()
+{
+	READER=../tools/zusage-archive
+	if [ ! -x "$READER" ]; then
+		echo "Skipping archive test"
+		return
+	fi
+
+	OUTPUT=$($READER -f 2026-09-14 -t 2026-09-15 "$(dirname "$0")/usage_sample.zua")
+	if [ $? -eq 0 ] && echo "$OUTPUT" | grep -q '"usage_over_time":\[{"usage_date":"2026-09-14","usage_count":18},{"usage_date":"2026-09-15","usage_count":21}\]' &&
+	   echo "$OUTPUT" | grep -q '"app_popularity":\[{"app_name":"curl","usage_count":12},{"app_name":"vim","usage_count":12},' &&
+	   echo "$OUTPUT" | grep -q '{"fqdn":"host2.example.com","usage_count":21}'; then
+		test_passed
+	else
+		test_failed
+	fi
+}
+
+# Run the server's tests (server/test/server.test.js). They need node 18 or
+# later; without the server's node modules they skip themselves.
+test_server()
+{
+	TESTS="$(dirname "$0")/../server/test/server.test.js"
+	if ! command -v node >/dev/null || ! node -e 'process.exit(Number(process.versions.node.split(".")[0]) >= 18 ? 0 : 1)'; then
+		echo "Skipping server test"
+		return
+	fi
+
+	if node --test "$TESTS"; then
+		test_passed
+	else
+		test_failed
+	fi
+}
 
 #################################################
 # RUN TESTS                                       #
 #################################################
 test_version
+test_collector
+test_ring
+test_bench
+test_trace
+test_archive
+test_server
 
 #################################################
 # RESULTS                                       #
 #################################################
-TOTAL=$[ $FAILED + $PASSED ]
+TOTAL=$(( FAILED + PASSED ))
 echo "================================================"
 echo "=                 RESULTS                      ="
 echo "================================================"
@@ -41,3 +228,6 @@ echo "Total tests:  $TOTAL"
 echo "Passed:       $PASSED"
 echo "Failed:       $FAILED"
 
+if [ $FAILED -ne 0 ]; then
+	exit 1
+fi
@@ -0,0 +1,543 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// zusage-archive: read the cold data archives the server exports for closed
+// weeks (archiveClosedWeeks() in server/app.js) and compute the dashboard's
+// chart aggregations from them, with no database. Only the columns the
+// charts need are decompressed.
+//
+//   zusage-archive [-f YYYY-MM-DD] [-t YYYY-MM-DD] file...
+//       charts as JSON, in the shape of /api/dashboard (raw OS release and
+//       CPU labels); -f and -t limit the rows to these days (UTC, inclusive)
+//   zusage-archive -i file...
+//       rows, time range and per-column sizes of each file
+//
+// File layout, all integers little-endian:
+//
+//   char magic[4]            "ZUAR"
+//   u32  version             1
+//   u32  row_count
+//   u32  column_count
+//   i64  range_start         epoch ms, inclusive
+//   i64  range_end           epoch ms, exclusive
+//   column_count times:
+//     u8   name_length, then the name
+//     u8   encoding          ARCHIVE_DICTIONARY, ARCHIVE_DELTA_VARINT, ARCHIVE_VARINT
+//     u32  raw_size
+//     u32  compressed_size
+//     the block, zlib-compressed (compress()/deflate)
+//
+// Rows are sorted by ts. Varints are unsigned LEB128. Blocks, uncompressed:
+//
+//   ARCHIVE_DELTA_VARINT (ts)   per row: ts minus the previous row's ts, the
+//                               first row's minus range_start
+//   ARCHIVE_VARINT (weight)     per row: the value
+//   ARCHIVE_DICTIONARY          varint entry count, each entry as a varint
+//                               length and UTF-8 bytes, then u8 code width
+//                               (1, 2 or 4) and per row the entry's index
+
+#define ARCHIVE_MAGIC "ZUAR"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 32
+#define ARCHIVE_DICTIONARY 1
+#define ARCHIVE_DELTA_VARINT 2
+#define ARCHIVE_VARINT 3
+#define MS_PER_DAY 86400000LL
+
+// --- Labels ---
+// Sums per label for one chart, in an open-addressing hash table
+
+struct label_count {
+  char *label;
+  size_t length;
+  long long count;
+};
+
+struct label_table {
+  struct label_count *slots;
+  size_t capacity; // power of two
+  size_t size;
+};
+
+static void *xmalloc(size_t size) {
+  void *p = calloc(1, size > 0 ? size : 1);
+  if (!p) {
+    fprintf(stderr, "zusage-archive: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static size_t hash_label(const char *label, size_t length) {
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)label[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void label_add(struct label_table *table, const char *label, size_t length, long long count);
+
+static void label_grow(struct label_table *table) {
+  struct label_table grown = { xmalloc(table->capacity * 2 * sizeof(struct label_count)), table->capacity * 2, 0 };
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct label_count *slot = &table->slots[i];
+    if (slot->label) {
+      label_add(&grown, slot->label, slot->length, slot->count);
+      free(slot->label);
+    }
+  }
+  free(table->slots);
+  *table = grown;
+}
+
+static void label_add(struct label_table *table, const char *label, size_t length, long long count) {
+  if (table->capacity == 0) {
+    table->capacity = 64;
+    table->slots = xmalloc(table->capacity * sizeof(struct label_count));
+  } else if (table->size * 2 >= table->capacity) {
+    label_grow(table);
+  }
+  size_t i = hash_label(label, length) & (table->capacity - 1);
+  while (table->slots[i].label) {
+    struct label_count *slot = &table->slots[i];
+    if (slot->length == length && memcmp(slot->label, label, length) == 0) {
+      slot->count += count;
+      return;
+    }
+    i = (i + 1) & (table->capacity - 1);
+  }
+  struct label_count *slot = &table->slots[i];
+  slot->label = xmalloc(length + 1);
+  memcpy(slot->label, label, length);
+  slot->length = length;
+  slot->count = count;
+  table->size++;
+}
+
+// --- Reading ---
+
+struct column {
+  char name[256];
+  int encoding;
+  unsigned int raw_size;
+  unsigned int compressed_size;
+  unsigned char *raw; // NULL unless loaded
+};
+
+struct archive {
+  const char *path;
+  unsigned int row_count;
+  unsigned int column_count;
+  long long range_start;
+  long long range_end;
+  struct column *columns;
+};
+
+static unsigned int get_u32(const unsigned char *p) {
+  return (unsigned int)p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static long long get_i64(const unsigned char *p) {
+  return (long long)((unsigned long long)get_u32(p) | (unsigned long long)get_u32(p + 4) << 32);
+}
+
+// Decode a varint at *pos; 0 if the block ends first
+static int get_varint(const unsigned char *block, size_t size, size_t *pos, unsigned long long *value) {
+  unsigned long long result = 0;
+  for (int shift = 0; shift < 64 && *pos < size; shift += 7) {
+    unsigned char byte = block[(*pos)++];
+    result |= (unsigned long long)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int archive_error(const struct archive *archive, const char *what) {
+  fprintf(stderr, "zusage-archive: %s: %s\n", archive->path, what);
+  return 0;
+}
+
+// Read the header and column directory, decompressing the columns named in
+// `wanted` (NULL-terminated; NULL loads none)
+static int read_archive(FILE *f, struct archive *archive, const char *const *wanted) {
+  unsigned char header[ARCHIVE_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, f) != 1 || memcmp(header, ARCHIVE_MAGIC, 4) != 0) {
+    return archive_error(archive, "not an archive file");
+  }
+  if (get_u32(header + 4) != ARCHIVE_VERSION) {
+    return archive_error(archive, "archive from another version");
+  }
+  archive->row_count = get_u32(header + 8);
+  archive->column_count = get_u32(header + 12);
+  archive->range_start = get_i64(header + 16);
+  archive->range_end = get_i64(header + 24);
+  if (archive->column_count > 255) {
+    return archive_error(archive, "corrupt header");
+  }
+  archive->columns = xmalloc(archive->column_count * sizeof(struct column));
+
+  for (unsigned int i = 0; i < archive->column_count; i++) {
+    struct column *column = &archive->columns[i];
+    unsigned char meta[9];
+    int name_length = fgetc(f);
+    if (name_length == EOF || fread(column->name, 1, name_length, f) != (size_t)name_length ||
+        fread(meta, sizeof(meta), 1, f) != 1) {
+      return archive_error(archive, "truncated column header");
+    }
+    column->name[name_length] = '\0';
+    column->encoding = meta[0];
+    column->raw_size = get_u32(meta + 1);
+    column->compressed_size = get_u32(meta + 5);
+
+    int load = 0;
+    for (const char *const *name = wanted; name && *name; name++) {
+      load |= strcmp(*name, column->name) == 0;
+    }
+    if (!load) {
+      if (fseek(f, column->compressed_size, SEEK_CUR) != 0) {
+        return archive_error(archive, "truncated column");
+      }
+      continue;
+    }
+    unsigned char *compressed = xmalloc(column->compressed_size);
+    column->raw = xmalloc(column->raw_size);
+    uLongf raw_size = column->raw_size;
+    int ok = fread(compressed, 1, column->compressed_size, f) == column->compressed_size &&
+             uncompress(column->raw, &raw_size, compressed, column->compressed_size) == Z_OK &&
+             raw_size == column->raw_size;
+    free(compressed);
+    if (!ok) {
+      return archive_error(archive, "corrupt column");
+    }
+  }
+  return 1;
+}
+
+static void free_archive(struct archive *archive) {
+  for (unsigned int i = 0; archive->columns && i < archive->column_count; i++) {
+    free(archive->columns[i].raw);
+  }
+  free(archive->columns);
+}
+
+static struct column *find_column(struct archive *archive, const char *name, int encoding) {
+  for (unsigned int i = 0; i < archive->column_count; i++) {
+    struct column *column = &archive->columns[i];
+    if (strcmp(column->name, name) == 0 && column->raw && column->encoding == encoding) {
+      return column;
+    }
+  }
+  return NULL;
+}
+
+// Decode a varint column into values[row_count]; delta columns are summed
+// up from `base`
+static int decode_varints(struct archive *archive, struct column *column, long long base, long long *values) {
+  size_t pos = 0;
+  long long value = base;
+  for (unsigned int row = 0; row < archive->row_count; row++) {
+    unsigned long long v;
+    if (!get_varint(column->raw, column->raw_size, &pos, &v)) {
+      return archive_error(archive, "truncated varint column");
+    }
+    value = column->encoding == ARCHIVE_DELTA_VARINT ? value + (long long)v : (long long)v;
+    values[row] = value;
+  }
+  return 1;
+}
+
+// Add the weights of rows [first, last) to `table` under their dictionary
+// entries
+static int sum_dictionary(struct archive *archive, const char *name, const long long *weights, unsigned int first,
+                          unsigned int last, struct label_table *table) {
+  struct column *column = find_column(archive, name, ARCHIVE_DICTIONARY);
+  if (!column) {
+    return archive_error(archive, "missing a chart column");
+  }
+  const unsigned char *block = column->raw;
+  size_t size = column->raw_size;
+  size_t pos = 0;
+  unsigned long long entry_count;
+  if (!get_varint(block, size, &pos, &entry_count) || entry_count > size) {
+    return archive_error(archive, "corrupt dictionary");
+  }
+  const unsigned char **entries = xmalloc(entry_count * sizeof(*entries));
+  size_t *lengths = xmalloc(entry_count * sizeof(*lengths));
+  long long *sums = xmalloc(entry_count * sizeof(*sums));
+  int ok = 1;
+  for (unsigned long long i = 0; ok && i < entry_count; i++) {
+    unsigned long long length;
+    ok = get_varint(block, size, &pos, &length) && length <= size - pos;
+    if (ok) {
+      entries[i] = block + pos;
+      lengths[i] = length;
+      pos += length;
+    }
+  }
+  unsigned int width = ok && pos < size ? block[pos++] : 0;
+  ok = ok && (width == 1 || width == 2 || width == 4) && (size - pos) / width >= archive->row_count;
+  for (unsigned int row = first; ok && row < last; row++) {
+    const unsigned char *p = block + pos + (size_t)row * width;
+    unsigned int code = width == 1 ? p[0] : width == 2 ? (unsigned int)(p[0] | p[1] << 8) : get_u32(p);
+    ok = code < entry_count;
+    if (ok) {
+      sums[code] += weights[row];
+    }
+  }
+  for (unsigned long long i = 0; ok && i < entry_count; i++) {
+    if (sums[i] != 0) {
+      label_add(table, (const char *)entries[i], lengths[i], sums[i]);
+    }
+  }
+  free(entries);
+  free(lengths);
+  free(sums);
+  return ok ? 1 : archive_error(archive, "corrupt dictionary column");
+}
+
+// --- Charts ---
+
+struct chart {
+  const char *name;   // key in the output, as in /api/dashboard
+  const char *field;  // label field of each item
+  const char *column; // archive column, NULL for the day
+  struct label_table labels;
+};
+
+static struct chart charts[] = {
+  { "usage_over_time", "usage_date", NULL, { 0 } },
+  { "app_popularity", "app_name", "app_name", { 0 } },
+  { "os_distribution", "os_release", "os_release", { 0 } },
+  { "cpu_distribution", "cpu_arch", "cpu_arch", { 0 } },
+  { "hostname_usage", "fqdn", "fqdn", { 0 } },
+};
+#define CHART_COUNT (sizeof(charts) / sizeof(charts[0]))
+
+static const char *const chart_columns[] = { "ts", "weight", "app_name", "os_release", "cpu_arch", "fqdn", NULL };
+
+static void add_day(long long day, long long count) {
+  time_t seconds = (time_t)(day * (MS_PER_DAY / 1000));
+  struct tm tm_info;
+  char label[16];
+  gmtime_r(&seconds, &tm_info);
+  size_t length = strftime(label, sizeof(label), "%Y-%m-%d", &tm_info);
+  label_add(&charts[0].labels, label, length, count);
+}
+
+static int aggregate_archive(struct archive *archive, long long from, long long to) {
+  struct column *ts_column = find_column(archive, "ts", ARCHIVE_DELTA_VARINT);
+  struct column *weight_column = find_column(archive, "weight", ARCHIVE_VARINT);
+  if (!ts_column || !weight_column) {
+    return archive_error(archive, "missing the ts or weight column");
+  }
+  long long *ts = xmalloc(archive->row_count * sizeof(long long));
+  long long *weights = xmalloc(archive->row_count * sizeof(long long));
+  int ok = decode_varints(archive, ts_column, archive->range_start, ts) &&
+           decode_varints(archive, weight_column, 0, weights);
+
+  // Rows are sorted by ts, so the rows in [from, to) are one run
+  unsigned int first = 0;
+  unsigned int last = archive->row_count;
+  while (ok && first < last && ts[first] < from) {
+    first++;
+  }
+  while (ok && last > first && ts[last - 1] >= to) {
+    last--;
+  }
+
+  long long day = -1;
+  long long day_count = 0;
+  for (unsigned int row = first; ok && row < last; row++) {
+    long long row_day = ts[row] / MS_PER_DAY;
+    if (row_day != day) {
+      if (day_count) {
+        add_day(day, day_count);
+      }
+      day = row_day;
+      day_count = 0;
+    }
+    day_count += weights[row];
+  }
+  if (ok && day_count) {
+    add_day(day, day_count);
+  }
+  for (size_t i = 1; ok && i < CHART_COUNT; i++) {
+    ok = sum_dictionary(archive, charts[i].column, weights, first, last, &charts[i].labels);
+  }
+  free(ts);
+  free(weights);
+  return ok;
+}
+
+static int by_count(const void *a, const void *b) {
+  const struct label_count *x = a;
+  const struct label_count *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return strcmp(x->label, y->label);
+}
+
+static int by_label(const void *a, const void *b) {
+  return strcmp(((const struct label_count *)a)->label, ((const struct label_count *)b)->label);
+}
+
+static void print_json_string(const char *s, size_t length) {
+  putchar('"');
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)s[i];
+    if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c < 0x20) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+static void print_charts() {
+  printf("{");
+  for (size_t i = 0; i < CHART_COUNT; i++) {
+    struct label_table *table = &charts[i].labels;
+    struct label_count *items = xmalloc(table->size * sizeof(struct label_count));
+    size_t count = 0;
+    for (size_t j = 0; j < table->capacity; j++) {
+      if (table->slots[j].label) {
+        items[count++] = table->slots[j];
+      }
+    }
+    qsort(items, count, sizeof(*items), i == 0 ? by_label : by_count);
+    printf("%s\"%s\":[", i ? "," : "", charts[i].name);
+    for (size_t j = 0; j < count; j++) {
+      printf("%s{\"%s\":", j ? "," : "", charts[i].field);
+      print_json_string(items[j].label, items[j].length);
+      printf(",\"usage_count\":%lld}", items[j].count);
+    }
+    printf("]");
+    free(items);
+  }
+  printf("}\n");
+}
+
+static void print_info(struct archive *archive, long long file_size) {
+  char from[32];
+  char to[32];
+  time_t seconds = (time_t)(archive->range_start / 1000);
+  struct tm tm_info;
+  strftime(from, sizeof(from), "%Y-%m-%d %H:%M:%S", gmtime_r(&seconds, &tm_info));
+  seconds = (time_t)(archive->range_end / 1000);
+  strftime(to, sizeof(to), "%Y-%m-%d %H:%M:%S", gmtime_r(&seconds, &tm_info));
+  printf("%s: %u rows, %s to %s UTC, %lld bytes\n", archive->path, archive->row_count, from, to, file_size);
+  unsigned long long raw_total = 0;
+  for (unsigned int i = 0; i < archive->column_count; i++) {
+    struct column *column = &archive->columns[i];
+    raw_total += column->raw_size;
+    printf("  %-12s %-10s %10u raw %10u compressed\n", column->name,
+           column->encoding == ARCHIVE_DICTIONARY     ? "dictionary"
+           : column->encoding == ARCHIVE_DELTA_VARINT ? "delta"
+                                                      : "varint",
+           column->raw_size, column->compressed_size);
+  }
+  printf("  %.1f bytes per row, %.1fx smaller than the raw columns\n",
+         archive->row_count ? (double)file_size / archive->row_count : 0.0,
+         file_size ? (double)raw_total / file_size : 0.0);
+}
+
+// YYYY-MM-DD as epoch ms at 00:00 UTC, or -1
+static long long parse_day(const char *text) {
+  int year;
+  int month;
+  int day;
+  char extra;
+  if (sscanf(text, "%4d-%2d-%2d%c", &year, &month, &day, &extra) != 3 || month < 1 || month > 12 || day < 1 ||
+      day > 31) {
+    return -1;
+  }
+  // Days from civil (proleptic Gregorian)
+  year -= month <= 2;
+  long long era = (year >= 0 ? year : year - 399) / 400;
+  long long year_of_era = year - era * 400;
+  long long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return (era * 146097 + day_of_era - 719468) * MS_PER_DAY;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-i] [-f YYYY-MM-DD] [-t YYYY-MM-DD] file...\n", argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int info = 0;
+  long long from = LLONG_MIN;
+  long long to = LLONG_MAX;
+  int opt;
+  while ((opt = getopt(argc, argv, "if:t:")) != -1) {
+    switch (opt) {
+      case 'i': info = 1; break;
+      case 'f':
+        if ((from = parse_day(optarg)) == -1) {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        if ((to = parse_day(optarg)) == -1) {
+          usage(argv[0]);
+        }
+        to += MS_PER_DAY;
+        break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+  }
+
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    struct archive archive = { .path = argv[i] };
+    FILE *f = fopen(argv[i], "rb");
+    if (!f) {
+      fprintf(stderr, "zusage-archive: cannot open %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+    int ok;
+    if (info) {
+      ok = read_archive(f, &archive, NULL);
+      if (ok) {
+        print_info(&archive, ftell(f));
+      }
+    } else {
+      // Files outside the range are not decompressed at all
+      ok = read_archive(f, &archive, NULL);
+      if (ok && archive.range_end > from && archive.range_start < to) {
+        free_archive(&archive);
+        archive = (struct archive){ .path = argv[i] };
+        rewind(f);
+        ok = read_archive(f, &archive, chart_columns) && aggregate_archive(&archive, from, to);
+      }
+    }
+    if (!ok) {
+      status = 1;
+    }
+    free_archive(&archive);
+    fclose(f);
+  }
+  if (!info) {
+    print_charts();
+  }
+  return status;
+}
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zusage_trace.h"
+
+// zusage-trace: decode the trace files the client library writes with
+// ZUSAGE_TRACE set (see src/zusage_trace.h) into per-phase wall-clock
+// latency percentiles and log2 histograms, over all the files given.
+//
+//   zusage-trace [-e] [-s] file...
+//       -e  also list every event, with its wall-clock time and process
+//       -s  percentiles only, no histograms
+
+#define HISTOGRAM_BUCKETS 40 // log2 microseconds, 1 us .. beyond an hour
+#define HISTOGRAM_WIDTH 40
+
+static const char *const phase_names[ZUSAGE_TRACE_PHASE_COUNT] = {
+  "init",
+  "ibm_check",
+  "fork",
+  "host_profile",
+  "program_info",
+  "app_version",
+  "payload",
+  "resolve",
+  "connect",
+  "request",
+  "datagram",
+  "send",
+  "ring_append",
+  "spooler_submit",
+  "spooler_flush",
+  "counter_increment",
+  "counter_flush",
+  "spawn",
+};
+
+struct phase_stats {
+  long long *durations; // ns
+  size_t count;
+  size_t capacity;
+  unsigned long long failed; // value 0 where 1 means success
+};
+
+#define MAX_PHASES 256
+
+static struct phase_stats phases[MAX_PHASES];
+static unsigned long long total_events = 0;
+static unsigned long long total_dropped = 0;
+static unsigned long long total_chunks = 0;
+
+static const char *phase_name(unsigned int phase, char *buf, size_t size) {
+  if (phase < ZUSAGE_TRACE_PHASE_COUNT) {
+    return phase_names[phase];
+  }
+  snprintf(buf, size, "phase_%u", phase);
+  return buf;
+}
+
+static unsigned int swap32(unsigned int v) {
+  return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+static long long swap64(long long v) {
+  unsigned long long u = (unsigned long long)v;
+  return (long long)(((unsigned long long)swap32((unsigned int)u) << 32) | swap32((unsigned int)(u >> 32)));
+}
+
+static void add_duration(unsigned int phase, long long duration_ns, int value) {
+  if (phase >= MAX_PHASES) {
+    return;
+  }
+  struct phase_stats *stats = &phases[phase];
+  if (stats->count == stats->capacity) {
+    size_t capacity = stats->capacity ? stats->capacity * 2 : 256;
+    long long *grown = realloc(stats->durations, capacity * sizeof(*grown));
+    if (!grown) {
+      fprintf(stderr, "zusage-trace: out of memory\n");
+      exit(1);
+    }
+    stats->durations = grown;
+    stats->capacity = capacity;
+  }
+  stats->durations[stats->count++] = duration_ns;
+  if (value == 0) {
+    stats->failed++;
+  }
+}
+
+static void print_event(const struct zusage_trace_header *header, const struct zusage_trace_event *event) {
+  long long wall_ns = header->realtime_ns - (header->monotonic_ns - event->start_ns);
+  time_t seconds = (time_t)(wall_ns / 1000000000LL);
+  struct tm tm_info;
+  char timestamp[32];
+  localtime_r(&seconds, &tm_info);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+  char buf[32];
+  printf("%s.%06lld %8d %-18s %12.1f us  %d\n", timestamp, (wall_ns % 1000000000LL) / 1000, header->pid,
+         phase_name(event->phase, buf, sizeof(buf)), event->duration_ns / 1000.0, event->value);
+}
+
+static int read_file(const char *path, int list_events) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "zusage-trace: cannot open %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+
+  struct zusage_trace_header header;
+  while (fread(&header, sizeof(header), 1, f) == 1) {
+    int swapped = 0;
+    if (header.magic == swap32(ZUSAGE_TRACE_MAGIC)) {
+      swapped = 1;
+      header.magic = swap32(header.magic);
+      header.version = swap32(header.version);
+      header.event_size = swap32(header.event_size);
+      header.event_count = swap32(header.event_count);
+      header.dropped = swap32(header.dropped);
+      header.pid = (int)swap32((unsigned int)header.pid);
+      header.realtime_ns = swap64(header.realtime_ns);
+      header.monotonic_ns = swap64(header.monotonic_ns);
+    }
+    if (header.magic != ZUSAGE_TRACE_MAGIC || header.version != ZUSAGE_TRACE_VERSION ||
+        header.event_size != sizeof(struct zusage_trace_event)) {
+      fprintf(stderr, "zusage-trace: %s: not a trace file, or from another version\n", path);
+      fclose(f);
+      return 0;
+    }
+
+    total_chunks++;
+    total_dropped += header.dropped;
+    for (unsigned int i = 0; i < header.event_count; i++) {
+      struct zusage_trace_event event;
+      if (fread(&event, sizeof(event), 1, f) != 1) {
+        fprintf(stderr, "zusage-trace: %s: truncated chunk\n", path);
+        fclose(f);
+        return 0;
+      }
+      if (swapped) {
+        event.start_ns = swap64(event.start_ns);
+        event.duration_ns = swap64(event.duration_ns);
+        event.phase = swap32(event.phase);
+        event.value = (int)swap32((unsigned int)event.value);
+      }
+      total_events++;
+      add_duration(event.phase, event.duration_ns, event.value);
+      if (list_events) {
+        print_event(&header, &event);
+      }
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct phase_stats *stats, double p) {
+  size_t rank = (size_t)(p / 100.0 * stats->count + 0.999999);
+  return stats->durations[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+static void print_histogram(const struct phase_stats *stats) {
+  unsigned long long buckets[HISTOGRAM_BUCKETS];
+  memset(buckets, 0, sizeof(buckets));
+  int first = HISTOGRAM_BUCKETS;
+  int last = 0;
+  unsigned long long largest = 0;
+  for (size_t i = 0; i < stats->count; i++) {
+    long long us = stats->durations[i] / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+      us >>= 1;
+      bucket++;
+    }
+    buckets[bucket]++;
+    if (bucket < first) {
+      first = bucket;
+    }
+    if (bucket > last) {
+      last = bucket;
+    }
+  }
+  for (int b = first; b <= last; b++) {
+    if (buckets[b] > largest) {
+      largest = buckets[b];
+    }
+  }
+  // Bucket b holds durations below 2^b microseconds
+  for (int b = first; b <= last; b++) {
+    int width = (int)(buckets[b] * HISTOGRAM_WIDTH / largest);
+    if (width == 0 && buckets[b] > 0) {
+      width = 1;
+    }
+    printf("    < %10lld us %8llu ", 1LL << b, buckets[b]);
+    for (int i = 0; i < width; i++) {
+      putchar('#');
+    }
+    putchar('\n');
+  }
+}
+
+int main(int argc, char **argv) {
+  int list_events = 0;
+  int histograms = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "es")) != -1) {
+    switch (opt) {
+      case 'e': list_events = 1; break;
+      case 's': histograms = 0; break;
+      default:
+        fprintf(stderr, "usage: %s [-e] [-s] file...\n", argv[0]);
+        return 2;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-e] [-s] file...\n", argv[0]);
+    return 2;
+  }
+
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    if (!read_file(argv[i], list_events)) {
+      status = 1;
+    }
+  }
+  if (list_events) {
+    putchar('\n');
+  }
+
+  printf("%llu events in %llu dumps from %d files", total_events, total_chunks, argc - optind);
+  if (total_dropped > 0) {
+    printf(", %llu overwritten before a dump", total_dropped);
+  }
+  printf("\n\n%-18s %8s %8s %12s %12s %12s %12s\n", "phase (us)", "count", "failed", "p50", "p90", "p99", "max");
+  for (int p = 0; p < MAX_PHASES; p++) {
+    struct phase_stats *stats = &phases[p];
+    if (stats->count == 0) {
+      continue;
+    }
+    qsort(stats->durations, stats->count, sizeof(*stats->durations), compare_ll);
+    char buf[32];
+    printf("%-18s %8lu %8llu %12.1f %12.1f %12.1f %12.1f\n", phase_name(p, buf, sizeof(buf)),
+           (unsigned long)stats->count, stats->failed, percentile_us(stats, 50), percentile_us(stats, 90),
+           percentile_us(stats, 99), stats->durations[stats->count - 1] / 1000.0);
+  }
+
+  if (histograms) {
+    for (int p = 0; p < MAX_PHASES; p++) {
+      if (phases[p].count == 0) {
+        continue;
+      }
+      char buf[32];
+      printf("\n%s\n", phase_name(p, buf, sizeof(buf)));
+      print_histogram(&phases[p]);
+    }
+  }
+  return status;
+}